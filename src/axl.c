@@ -1,3 +1,8 @@
+/* syncfs */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,8 +19,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
-/* opendir */
-#include <dirent.h>
+/* open, syncfs */
+#include <fcntl.h>
+#include <unistd.h>
 
 /* axl_xfer_t */
 #include "axl.h"
@@ -31,9 +37,14 @@
 #include "axl_sync.h"
 
 #ifdef HAVE_PTHREADS
+#include <pthread.h>
 #include "axl_pthread.h"
 #endif /* HAVE_PTHREAD */
 
+#ifdef HAVE_LIBURING
+#include "axl_uring.h"
+#endif /* HAVE_LIBURING */
+
 #ifdef HAVE_BBAPI
 #include "axl_async_bbapi.h"
 #endif /* HAVE_BBAPI */
@@ -75,6 +86,44 @@ int axl_copy_metadata;
 /* global rank of calling process, used for BBAPI */
 int axl_rank = -1;
 
+/* default engine used to copy file data */
+int axl_copy_engine;
+
+/* whether to copy file data with O_DIRECT */
+int axl_direct_io;
+
+/* order in which the pthread transfer copies files, one of the axl_schedule_t values */
+int axl_schedule;
+
+/* checksum to compute for each file while copying it, one of the axl_crc_t values */
+int axl_crc;
+
+/* size of the blocks whose checksums are recorded in each file's manifest,
+ * 0 for no manifest */
+unsigned long axl_manifest_size;
+
+/* whether to compress or decompress files while copying them, one of the
+ * axl_compress_t values */
+int axl_compress;
+
+/* size of the blocks compared to update existing destination files in
+ * place, 0 to always copy whole files */
+unsigned long axl_delta_size;
+
+/* files smaller than this are packed into a container in their destination
+ * directory, 0 to copy every file to its own destination */
+unsigned long axl_pack_size;
+
+/* when files copied are synced to disk, one of the axl_sync_t values */
+int axl_sync_policy;
+
+/* bytes of copied data a file may leave dirty in the page cache before
+ * the copy writes it back, 0 to leave writeback to the kernel */
+unsigned long axl_write_behind_size;
+
+/* format of the state file, one of the axl_state_format_t values */
+int axl_state_format;
+
 /* reference count for number of times AXL_Init has been called */
 static unsigned int axl_init_count = 0;
 
@@ -91,6 +140,134 @@ static unsigned int axl_kvtrees_count = 0;
 static int bbapi_is_loaded = 0;
 #endif
 
+/* The state file is a snapshot of a transfer's kvtree, written with
+ * kvtree_write_file() or in the binary format of axl_state.c, and a journal
+ * of the changes made to it since, in a file of the same name with this
+ * extension added.  Each record in the journal is a header followed by the
+ * source file's name, the key of the subtree the record replaces (empty for
+ * the whole element), the key of the subtree of that one it replaces
+ * (empty for all of it), and the subtree packed with kvtree_pack().
+ *
+ * Appends to the journal aren't synced, to keep recording a manifest block
+ * down to one write.  A crash can lose the last records, which only makes
+ * a resumed transfer redo that work: every record describes data that was
+ * synced before it was recorded, or work that is safe to do again. */
+#define AXL_JOURNAL_EXTENSION ".journal"
+#define AXL_JOURNAL_MAGIC     "AXJ2"
+
+/* Record header: the magic, then the CRC32C of the rest of the header and
+ * the len bytes that follow it, the record's sequence number, and len, all
+ * little-endian, as in the binary state file.  Records before the
+ * snapshot's AXL_KEY_STATE_JOURNAL value are already in the snapshot. */
+#define AXL_JOURNAL_HEADER_SIZE (4 + 4 + 8 + 8)
+
+/* Returns the name of the journal of state_file, which the caller frees */
+static char* axl_journal_name(const char* state_file)
+{
+    char* journal = NULL;
+    asprintf(&journal, "%s%s", state_file, AXL_JOURNAL_EXTENSION);
+    return journal;
+}
+
+/* Apply the records in the journal of state_file that the snapshot in
+ * file_list doesn't have yet.  Stops at the first record that's torn or
+ * corrupt, since it and everything after it may not have been written. */
+static void axl_journal_replay(const char* state_file, kvtree* file_list)
+{
+    char* journal = axl_journal_name(state_file);
+    int fd = open(journal, O_RDONLY);
+    if (fd < 0) {
+        axl_free(&journal);
+        return;
+    }
+
+    struct stat statbuf;
+    char* buf = NULL;
+    if (fstat(fd, &statbuf) == 0 && statbuf.st_size > 0) {
+        buf = malloc((size_t) statbuf.st_size);
+    }
+    if (buf && axl_pread_all(journal, fd, buf, (size_t) statbuf.st_size, 0) != AXL_SUCCESS) {
+        axl_free(&buf);
+    }
+    close(fd);
+
+    unsigned long next = 0;
+    kvtree_util_get_unsigned_long(file_list, AXL_KEY_STATE_JOURNAL, &next);
+
+    size_t size = buf ? (size_t) statbuf.st_size : 0;
+    size_t pos = 0;
+    unsigned long count = 0;
+    while (size - pos >= AXL_JOURNAL_HEADER_SIZE) {
+        const unsigned char* hdr = (const unsigned char*) buf + pos;
+        uint32_t crc = axl_get_le32(hdr + 4);
+        uint64_t seq = axl_get_le64(hdr + 8);
+        uint64_t len = axl_get_le64(hdr + 16);
+        pos += AXL_JOURNAL_HEADER_SIZE;
+
+        const char* body = buf + pos;
+        if (memcmp(hdr, AXL_JOURNAL_MAGIC, 4) != 0 ||
+            len > size - pos ||
+            axl_hash(AXL_CRC_CRC32C, axl_hash(AXL_CRC_CRC32C, 0, hdr + 8, 16),
+                body, (size_t) len) != crc)
+        {
+            AXL_DBG(1, "Ignoring the end of journal %s from offset %lu",
+                journal, (unsigned long) (pos - AXL_JOURNAL_HEADER_SIZE)
+            );
+            break;
+        }
+        pos += (size_t) len;
+
+        if (seq < next) {
+            /* the snapshot was written after this record */
+            continue;
+        }
+
+        /* the crc covers the body, so the strings are terminated */
+        const char* src = body;
+        const char* key = src + strlen(src) + 1;
+        const char* subkey = key + strlen(key) + 1;
+        const char* packed = subkey + strlen(subkey) + 1;
+
+        kvtree* files = kvtree_get(file_list, AXL_KEY_FILES);
+        if (! files) {
+            files = kvtree_set(file_list, AXL_KEY_FILES, kvtree_new());
+        }
+        kvtree* hash;
+        if (*key == '\0') {
+            kvtree_unset(files, src);
+            hash = kvtree_set(files, src, kvtree_new());
+        } else {
+            kvtree* elem_hash = kvtree_get(files, src);
+            if (! elem_hash) {
+                elem_hash = kvtree_set(files, src, kvtree_new());
+            }
+            if (*subkey == '\0') {
+                kvtree_unset(elem_hash, key);
+                hash = kvtree_set(elem_hash, key, kvtree_new());
+            } else {
+                kvtree* key_hash = kvtree_get(elem_hash, key);
+                if (! key_hash) {
+                    key_hash = kvtree_set(elem_hash, key, kvtree_new());
+                }
+                kvtree_unset(key_hash, subkey);
+                hash = kvtree_set(key_hash, subkey, kvtree_new());
+            }
+        }
+        kvtree_unpack(packed, hash);
+
+        next = (unsigned long) seq + 1;
+        count++;
+    }
+
+    if (count > 0) {
+        AXL_DBG(2, "Replayed %lu records from journal %s", count, journal);
+    }
+    kvtree_util_set_unsigned_long(file_list, AXL_KEY_STATE_JOURNAL, next);
+
+    axl_free(&buf);
+    axl_free(&journal);
+}
+
 /* Allocate a new kvtree and return the AXL ID for it.  If state_file is
  * specified, then populate the kvtree with it's data. */
 static int axl_alloc_id(const char* state_file)
@@ -100,12 +277,15 @@ static int axl_alloc_id(const char* state_file)
     /* initialize kvtree values from state_file if we have one */
     if (state_file) {
         if (access(state_file, F_OK) == 0 &&
-            kvtree_read_file(state_file, new) != KVTREE_SUCCESS)
+            axl_state_read_file(state_file, new) != AXL_SUCCESS)
         {
             AXL_ERR("Couldn't read state file correctly");
             return -1;
         }
 
+        /* and catch up with the changes made since it was written */
+        axl_journal_replay(state_file, new);
+
         /* record name of state file */
         kvtree_util_set_str(new, AXL_KEY_STATE_FILE, state_file);
     }
@@ -127,6 +307,10 @@ static void axl_remove_state_file(int id)
     if (kvtree_util_get_str(file_list, AXL_KEY_STATE_FILE,
         &state_file) == KVTREE_SUCCESS)
     {
+        char* journal = axl_journal_name(state_file);
+        unlink(journal);
+        axl_free(&journal);
+
         axl_file_unlink(state_file);
     }
 }
@@ -140,6 +324,30 @@ static void axl_free_id(int id)
     kvtree_delete(&axl_kvtrees[id]);
 }
 
+#ifdef HAVE_PTHREADS
+/* pthread workers save the state file as they record manifest blocks,
+ * which may be while the main thread is saving it */
+static pthread_mutex_t axl_state_file_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Write file_list to state_file in full, and drop the journal, whose
+ * records are all in the snapshot now.  The snapshot records the sequence
+ * number of the next record, so if we die before the journal is gone, its
+ * old records are skipped. */
+static void axl_write_state_snapshot(const char* state_file, const kvtree* file_list)
+{
+    int format = AXL_STATE_FORMAT_KVTREE;
+    kvtree_util_get_int(file_list, AXL_KEY_CONFIG_STATE_FORMAT, &format);
+    if (axl_state_write_file(state_file, file_list, format) != AXL_SUCCESS) {
+        /* keep the journal, it has changes the state file doesn't */
+        return;
+    }
+
+    char* journal = axl_journal_name(state_file);
+    unlink(journal);
+    axl_free(&journal);
+}
+
 /* If the user specified a state_file then write our kvtree to it. If not, then
  * do nothing. */
 void axl_write_state_file(int id)
@@ -149,10 +357,108 @@ void axl_write_state_file(int id)
     if (kvtree_util_get_str(file_list, AXL_KEY_STATE_FILE,
         &state_file) == KVTREE_SUCCESS)
     {
-        kvtree_write_file(state_file, file_list);
+#ifdef HAVE_PTHREADS
+        pthread_mutex_lock(&axl_state_file_lock);
+#endif
+        axl_write_state_snapshot(state_file, file_list);
+#ifdef HAVE_PTHREADS
+        pthread_mutex_unlock(&axl_state_file_lock);
+#endif
     }
 }
 
+/* Record the element of src in the file list of id, or just its key
+ * subtree if key is set, or just the subkey subtree of that if subkey is
+ * set, in the journal of the state file.  Adding N files would write
+ * O(N^2) bytes if we wrote the whole state file every time, as would
+ * recording the whole manifest of a file after each of its N blocks.  The
+ * journal is folded into the state file the next time it's written in
+ * full, which AXL_Dispatch() and AXL_Wait() do. */
+void axl_write_state_record(int id, const char* src, const char* key,
+    const char* subkey)
+{
+    kvtree* file_list = axl_kvtrees[id];
+    char* state_file = NULL;
+    if (kvtree_util_get_str(file_list, AXL_KEY_STATE_FILE,
+        &state_file) != KVTREE_SUCCESS)
+    {
+        return;
+    }
+
+    kvtree* hash = kvtree_get(kvtree_get(file_list, AXL_KEY_FILES), src);
+    if (key) {
+        hash = kvtree_get(hash, key);
+    } else {
+        key = "";
+    }
+    if (subkey && *key != '\0') {
+        hash = kvtree_get(hash, subkey);
+    } else {
+        subkey = "";
+    }
+    if (! hash) {
+        return;
+    }
+
+#ifdef HAVE_PTHREADS
+    pthread_mutex_lock(&axl_state_file_lock);
+#endif
+
+    unsigned long seq = 0;
+    kvtree_util_get_unsigned_long(file_list, AXL_KEY_STATE_JOURNAL, &seq);
+
+    size_t src_len    = strlen(src) + 1;
+    size_t key_len    = strlen(key) + 1;
+    size_t subkey_len = strlen(subkey) + 1;
+    size_t len = src_len + key_len + subkey_len + kvtree_pack_size(hash);
+    char* buf = malloc(AXL_JOURNAL_HEADER_SIZE + len);
+
+    int rc = AXL_FAILURE;
+    char* journal = axl_journal_name(state_file);
+    if (buf) {
+        char* body = buf + AXL_JOURNAL_HEADER_SIZE;
+        memcpy(body, src, src_len);
+        memcpy(body + src_len, key, key_len);
+        memcpy(body + src_len + key_len, subkey, subkey_len);
+        kvtree_pack(body + src_len + key_len + subkey_len, hash);
+
+        unsigned char* hdr = (unsigned char*) buf;
+        memcpy(hdr, AXL_JOURNAL_MAGIC, 4);
+        axl_put_le64(hdr + 8,  (uint64_t) seq);
+        axl_put_le64(hdr + 16, (uint64_t) len);
+        axl_put_le32(hdr + 4, axl_hash(AXL_CRC_CRC32C,
+            axl_hash(AXL_CRC_CRC32C, 0, hdr + 8, 16), body, len));
+
+        /* a single write, so a crash leaves at most one torn record at the
+         * end of the journal */
+        int fd = open(journal, O_WRONLY | O_CREAT | O_APPEND, axl_getmode(1, 1, 0));
+        if (fd >= 0) {
+            if (axl_write_attempt(journal, fd, buf, AXL_JOURNAL_HEADER_SIZE + len) ==
+                (ssize_t) (AXL_JOURNAL_HEADER_SIZE + len))
+            {
+                rc = AXL_SUCCESS;
+            }
+            close(fd);
+        }
+    }
+
+    if (rc == AXL_SUCCESS) {
+        kvtree_util_set_unsigned_long(file_list, AXL_KEY_STATE_JOURNAL, seq + 1);
+    } else {
+        AXL_DBG(1, "Appending to journal %s failed, writing state file instead",
+            journal
+        );
+        axl_write_state_snapshot(state_file, file_list);
+    }
+
+#ifdef HAVE_PTHREADS
+    pthread_mutex_unlock(&axl_state_file_lock);
+#endif
+
+    axl_free(&journal);
+    axl_free(&buf);
+}
+
 /* given an id, lookup and return the file list and transfer type,
  * returns AXL_FAILURE if info could not be found */
 static int axl_get_info(int id, kvtree** list, axl_xfer_t* type, axl_xfer_state_t* state)
@@ -274,6 +580,104 @@ int AXL_Init (void)
         axl_copy_metadata = atoi(val);
     }
 
+    /* copy with copy_file_range() by default, falling back as needed */
+    axl_copy_engine = AXL_COPY_ENGINE_COPY_FILE_RANGE;
+    val = getenv("AXL_COPY_ENGINE");
+    if (val != NULL) {
+        axl_copy_engine = atoi(val);
+    }
+
+    /* bypass the page cache with O_DIRECT when copying, off by default */
+    axl_direct_io = 0;
+    val = getenv("AXL_DIRECT_IO");
+    if (val != NULL) {
+        axl_direct_io = atoi(val);
+    }
+
+    /* copy the largest files first by default */
+    axl_schedule = AXL_SCHEDULE_LARGEST_FIRST;
+    val = getenv("AXL_SCHEDULE");
+    if (val != NULL) {
+        axl_schedule = atoi(val);
+    }
+
+    /* don't compute checksums while copying by default */
+    axl_crc = AXL_CRC_NONE;
+    val = getenv("AXL_CRC");
+    if (val != NULL) {
+        axl_crc = atoi(val);
+    }
+
+    /* don't record manifests by default */
+    axl_manifest_size = 0;
+    val = getenv("AXL_MANIFEST_SIZE");
+    if (val != NULL) {
+        axl_manifest_size = strtoul(val, NULL, 10);
+    }
+
+    /* copy files as they are by default */
+    axl_compress = AXL_COMPRESS_NONE;
+    val = getenv("AXL_COMPRESS");
+    if (val != NULL) {
+        axl_compress = atoi(val);
+    }
+
+    /* copy whole files by default */
+    axl_delta_size = 0;
+    val = getenv("AXL_DELTA_SIZE");
+    if (val != NULL) {
+        axl_delta_size = strtoul(val, NULL, 10);
+    }
+
+    /* copy every file to its own destination by default */
+    axl_pack_size = 0;
+    val = getenv("AXL_PACK_SIZE");
+    if (val != NULL) {
+        axl_pack_size = strtoul(val, NULL, 10);
+    }
+
+    /* sync both ends of each file as it's closed by default */
+    axl_sync_policy = AXL_SYNC_ALL;
+    val = getenv("AXL_SYNC_POLICY");
+    if (val != NULL) {
+        axl_sync_policy = atoi(val);
+    }
+
+    /* let the kernel decide when to write back copied data by default */
+    axl_write_behind_size = 0;
+    val = getenv("AXL_WRITE_BEHIND_SIZE");
+    if (val != NULL) {
+        axl_write_behind_size = strtoul(val, NULL, 10);
+    }
+
+    /* write state files with kvtree_write_file() by default */
+    axl_state_format = AXL_STATE_FORMAT_KVTREE;
+    val = getenv("AXL_STATE_FORMAT");
+    if (val != NULL) {
+        axl_state_format = atoi(val);
+    }
+
+    /* keep up to 256 MiB of copy buffers around for reuse */
+    axl_buf_pool_size = (unsigned long) (256UL * 1024UL * 1024UL);
+    val = getenv("AXL_BUF_POOL_SIZE");
+    if (val != NULL) {
+        axl_buf_pool_size = strtoul(val, NULL, 10);
+    }
+
+    /* pick the checksum kernels for this CPU */
+    if (axl_init_count == 0) {
+        axl_hash_init();
+    }
+
+#ifdef HAVE_PTHREADS
+    /* start the worker pool shared by all pthread transfers on first call */
+    if (axl_init_count == 0) {
+        if (axl_pthread_init() != AXL_SUCCESS) {
+            rc = AXL_FAILURE;
+        }
+    }
+#endif /* HAVE_PTHREADS */
+
     /* keep a reference count to free memory on last AXL_Finalize */
     axl_init_count++;
 
@@ -296,9 +700,20 @@ int AXL_Finalize (void)
     /* decrement reference count and free data structures on last call */
     axl_init_count--;
     if (axl_init_count == 0) {
+#ifdef HAVE_PTHREADS
+        /* stop the workers first, since they record progress in the
+         * kvtrees */
+        if (axl_pthread_finalize() != AXL_SUCCESS) {
+            rc = AXL_FAILURE;
+        }
+#endif /* HAVE_PTHREADS */
+
         /* TODO: are there cases where we also need to delete trees? */
         axl_free(&axl_kvtrees);
         axl_kvtrees_count = 0;
+
+        /* the workers are gone, so every buffer is back in the pool */
+        axl_buf_finalize();
     }
 
     return rc;
@@ -318,6 +733,18 @@ static kvtree* AXL_Config_Set(const kvtree* config)
         AXL_KEY_CONFIG_USE_EXTENSION,
         AXL_KEY_CONFIG_COPY_METADATA,
         AXL_KEY_CONFIG_RANK,
+        AXL_KEY_CONFIG_COPY_ENGINE,
+        AXL_KEY_CONFIG_DIRECT_IO,
+        AXL_KEY_CONFIG_SCHEDULE,
+        AXL_KEY_CONFIG_CRC,
+        AXL_KEY_CONFIG_MANIFEST_SIZE,
+        AXL_KEY_CONFIG_COMPRESS,
+        AXL_KEY_CONFIG_DELTA_SIZE,
+        AXL_KEY_CONFIG_PACK_SIZE,
+        AXL_KEY_CONFIG_SYNC_POLICY,
+        AXL_KEY_CONFIG_WRITE_BEHIND_SIZE,
+        AXL_KEY_CONFIG_STATE_FORMAT,
+        AXL_KEY_CONFIG_BUF_POOL_SIZE,
         NULL
     };
     static const char* known_transfer_options[] = {
@@ -325,6 +752,17 @@ static kvtree* AXL_Config_Set(const kvtree* config)
         AXL_KEY_CONFIG_MKDIR,
         AXL_KEY_CONFIG_USE_EXTENSION,
         AXL_KEY_CONFIG_COPY_METADATA,
+        AXL_KEY_CONFIG_COPY_ENGINE,
+        AXL_KEY_CONFIG_DIRECT_IO,
+        AXL_KEY_CONFIG_SCHEDULE,
+        AXL_KEY_CONFIG_CRC,
+        AXL_KEY_CONFIG_MANIFEST_SIZE,
+        AXL_KEY_CONFIG_COMPRESS,
+        AXL_KEY_CONFIG_DELTA_SIZE,
+        AXL_KEY_CONFIG_PACK_SIZE,
+        AXL_KEY_CONFIG_SYNC_POLICY,
+        AXL_KEY_CONFIG_WRITE_BEHIND_SIZE,
+        AXL_KEY_CONFIG_STATE_FORMAT,
         NULL
     };
 
@@ -348,6 +786,42 @@ static kvtree* AXL_Config_Set(const kvtree* config)
     kvtree_util_get_int(config,
         AXL_KEY_CONFIG_RANK, &axl_rank);
 
+    kvtree_util_get_int(config,
+        AXL_KEY_CONFIG_COPY_ENGINE, &axl_copy_engine);
+
+    kvtree_util_get_int(config,
+        AXL_KEY_CONFIG_DIRECT_IO, &axl_direct_io);
+
+    kvtree_util_get_int(config,
+        AXL_KEY_CONFIG_SCHEDULE, &axl_schedule);
+
+    kvtree_util_get_int(config,
+        AXL_KEY_CONFIG_CRC, &axl_crc);
+
+    kvtree_util_get_bytecount(config,
+        AXL_KEY_CONFIG_MANIFEST_SIZE, &axl_manifest_size);
+
+    kvtree_util_get_int(config,
+        AXL_KEY_CONFIG_COMPRESS, &axl_compress);
+
+    kvtree_util_get_bytecount(config,
+        AXL_KEY_CONFIG_DELTA_SIZE, &axl_delta_size);
+
+    kvtree_util_get_bytecount(config,
+        AXL_KEY_CONFIG_PACK_SIZE, &axl_pack_size);
+
+    kvtree_util_get_int(config,
+        AXL_KEY_CONFIG_SYNC_POLICY, &axl_sync_policy);
+
+    kvtree_util_get_bytecount(config,
+        AXL_KEY_CONFIG_WRITE_BEHIND_SIZE, &axl_write_behind_size);
+
+    kvtree_util_get_int(config,
+        AXL_KEY_CONFIG_STATE_FORMAT, &axl_state_format);
+
+    kvtree_util_get_bytecount(config,
+        AXL_KEY_CONFIG_BUF_POOL_SIZE, &axl_buf_pool_size);
+
     /* check for local options inside an "id" subkey */
     kvtree* ids = kvtree_get(config, "id");
     if (ids != NULL) {
@@ -476,6 +950,17 @@ static kvtree* AXL_Config_Get()
         AXL_KEY_CONFIG_MKDIR,
         AXL_KEY_CONFIG_USE_EXTENSION,
         AXL_KEY_CONFIG_COPY_METADATA,
+        AXL_KEY_CONFIG_COPY_ENGINE,
+        AXL_KEY_CONFIG_DIRECT_IO,
+        AXL_KEY_CONFIG_SCHEDULE,
+        AXL_KEY_CONFIG_CRC,
+        AXL_KEY_CONFIG_MANIFEST_SIZE,
+        AXL_KEY_CONFIG_COMPRESS,
+        AXL_KEY_CONFIG_DELTA_SIZE,
+        AXL_KEY_CONFIG_PACK_SIZE,
+        AXL_KEY_CONFIG_SYNC_POLICY,
+        AXL_KEY_CONFIG_WRITE_BEHIND_SIZE,
+        AXL_KEY_CONFIG_STATE_FORMAT,
         NULL
     };
 
@@ -500,6 +985,42 @@ static kvtree* AXL_Config_Get()
     success &= kvtree_util_set_int(config,
         AXL_KEY_CONFIG_RANK, axl_rank) == KVTREE_SUCCESS;
 
+    success &= kvtree_util_set_int(config,
+        AXL_KEY_CONFIG_COPY_ENGINE, axl_copy_engine) == KVTREE_SUCCESS;
+
+    success &= kvtree_util_set_int(config,
+        AXL_KEY_CONFIG_DIRECT_IO, axl_direct_io) == KVTREE_SUCCESS;
+
+    success &= kvtree_util_set_int(config,
+        AXL_KEY_CONFIG_SCHEDULE, axl_schedule) == KVTREE_SUCCESS;
+
+    success &= kvtree_util_set_int(config,
+        AXL_KEY_CONFIG_CRC, axl_crc) == KVTREE_SUCCESS;
+
+    success &= kvtree_util_set_bytecount(config,
+        AXL_KEY_CONFIG_MANIFEST_SIZE, axl_manifest_size) == KVTREE_SUCCESS;
+
+    success &= kvtree_util_set_int(config,
+        AXL_KEY_CONFIG_COMPRESS, axl_compress) == KVTREE_SUCCESS;
+
+    success &= kvtree_util_set_bytecount(config,
+        AXL_KEY_CONFIG_DELTA_SIZE, axl_delta_size) == KVTREE_SUCCESS;
+
+    success &= kvtree_util_set_bytecount(config,
+        AXL_KEY_CONFIG_PACK_SIZE, axl_pack_size) == KVTREE_SUCCESS;
+
+    success &= kvtree_util_set_int(config,
+        AXL_KEY_CONFIG_SYNC_POLICY, axl_sync_policy) == KVTREE_SUCCESS;
+
+    success &= kvtree_util_set_bytecount(config,
+        AXL_KEY_CONFIG_WRITE_BEHIND_SIZE, axl_write_behind_size) == KVTREE_SUCCESS;
+
+    success &= kvtree_util_set_int(config,
+        AXL_KEY_CONFIG_STATE_FORMAT, axl_state_format) == KVTREE_SUCCESS;
+
+    success &= kvtree_util_set_bytecount(config,
+        AXL_KEY_CONFIG_BUF_POOL_SIZE, axl_buf_pool_size) == KVTREE_SUCCESS;
+
     /* per transfer options */
     int id;
     for (id = 0; id < axl_kvtrees_count; id++) {
@@ -639,6 +1160,39 @@ int AXL_Create(axl_xfer_t xtype, const char* name, const char* state_file)
 
         kvtree_util_set_int(file_list,
             AXL_KEY_CONFIG_COPY_METADATA, axl_copy_metadata);
+
+        kvtree_util_set_int(file_list,
+            AXL_KEY_CONFIG_COPY_ENGINE, axl_copy_engine);
+
+        kvtree_util_set_int(file_list,
+            AXL_KEY_CONFIG_DIRECT_IO, axl_direct_io);
+
+        kvtree_util_set_int(file_list,
+            AXL_KEY_CONFIG_SCHEDULE, axl_schedule);
+
+        kvtree_util_set_int(file_list,
+            AXL_KEY_CONFIG_CRC, axl_crc);
+
+        kvtree_util_set_bytecount(file_list,
+            AXL_KEY_CONFIG_MANIFEST_SIZE, axl_manifest_size);
+
+        kvtree_util_set_int(file_list,
+            AXL_KEY_CONFIG_COMPRESS, axl_compress);
+
+        kvtree_util_set_bytecount(file_list,
+            AXL_KEY_CONFIG_DELTA_SIZE, axl_delta_size);
+
+        kvtree_util_set_bytecount(file_list,
+            AXL_KEY_CONFIG_PACK_SIZE, axl_pack_size);
+
+        kvtree_util_set_int(file_list,
+            AXL_KEY_CONFIG_SYNC_POLICY, axl_sync_policy);
+
+        kvtree_util_set_bytecount(file_list,
+            AXL_KEY_CONFIG_WRITE_BEHIND_SIZE, axl_write_behind_size);
+
+        kvtree_util_set_int(file_list,
+            AXL_KEY_CONFIG_STATE_FORMAT, axl_state_format);
     }
 
     /* create a structure based on transfer type */
@@ -657,6 +1211,14 @@ int AXL_Create(axl_xfer_t xtype, const char* name, const char* state_file)
         break;
 #endif /* HAVE_PTHREADS */
 
+    case AXL_XFER_URING:
+#ifndef HAVE_LIBURING
+        /* User is requesting an io_uring transfer, but we didn't build with liburing */
+        AXL_ERR("io_uring requested but not enabled during build");
+        rc = AXL_FAILURE;
+#endif /* HAVE_LIBURING */
+        break;
+
     case AXL_XFER_ASYNC_BBAPI:
 #ifdef HAVE_BBAPI
         /* Load the BB library on the very first call to
@@ -738,28 +1300,16 @@ static char* axl_add_extension(const char* path, const char* extra)
     return tmp;
 }
 
-/* Add a file to an existing transfer handle.  No directories.
- *
- * If the file's destination path doesn't exist, then automatically create the
- * needed directories. */
-static int __AXL_Add (int id, const char* src, const char* dest)
+/* Insert a file into the file list of a transfer handle that the caller has
+ * already looked up and checked is in the CREATED state.  If statbuf is not
+ * NULL, it is the caller's lstat() of src, and we record its metadata now so
+ * AXL_Dispatch() doesn't have to stat the file again.  Does not update the
+ * state file. */
+static int axl_add_file(int id, kvtree* file_list, axl_xfer_t xtype,
+    const char* src, const char* dest, const struct stat* statbuf)
 {
     int rc = AXL_SUCCESS;
 
-    kvtree* file_list = NULL;
-    axl_xfer_t xtype = AXL_XFER_NULL;
-    axl_xfer_state_t xstate = AXL_XFER_STATE_NULL;
-    if (axl_get_info(id, &file_list, &xtype, &xstate) != AXL_SUCCESS) {
-        AXL_ERR("Could not find transfer info for UID %d", id);
-        return AXL_FAILURE;
-    }
-
-    /* check that handle is in correct state to add files */
-    if (xstate != AXL_XFER_STATE_CREATED) {
-        AXL_ERR("Invalid state to add files for UID %d", id);
-        return AXL_FAILURE;
-    }
-
     /* add record for this file
      * UID
      *   id
@@ -800,6 +1350,10 @@ static int __AXL_Add (int id, const char* src, const char* dest)
 
     kvtree_util_set_int(src_hash, AXL_KEY_STATUS, AXL_STATUS_SOURCE);
 
+    if (statbuf) {
+        axl_meta_encode_stat(statbuf, src_hash);
+    }
+
     /* add file to transfer data structure, depending on its type */
     switch (xtype) {
     case AXL_XFER_SYNC:
@@ -810,6 +1364,11 @@ static int __AXL_Add (int id, const char* src, const char* dest)
         break;
 #endif /* HAVE_PTHREADS */
 
+#ifdef HAVE_LIBURING
+    case AXL_XFER_URING:
+        break;
+#endif /* HAVE_LIBURING */
+
 #ifdef HAVE_BBAPI
     case AXL_XFER_ASYNC_BBAPI:
         /* Special case:
@@ -832,114 +1391,188 @@ static int __AXL_Add (int id, const char* src, const char* dest)
         break;
     }
 
-    /* write data to file if we have one */
-    axl_write_state_file(id);
-
     return rc;
 }
 
-/* Add a file or directory to the transfer handle.  If the src is a
- * directory, recursively add all the files and directories in that
- * directory. */
-int AXL_Add (int id, const char* src, const char* dest)
+/* Add every file under the directory src, at any depth, to the transfer
+ * handle, at the same path under dest, so that copying a directory over an
+ * earlier copy of it updates the files in place.  Does not update the state
+ * file. */
+static int axl_add_dir(int id, kvtree* file_list, axl_xfer_t xtype,
+    const char* src, const char* dest)
 {
-    int rc = AXL_SUCCESS;
+    struct axl_scan_file* files = NULL;
+    size_t count = 0;
+    int rc = axl_scan_dir(src, dest, &files, &count);
 
-    char* new_dest = calloc(PATH_MAX, 1);
-    if (! new_dest) {
-        return AXL_FAILURE;
+    size_t i;
+    for (i = 0; i < count && rc == AXL_SUCCESS; i++) {
+        rc = axl_add_file(id, file_list, xtype, files[i].src, files[i].dst, NULL);
     }
 
-    char* new_src = calloc(PATH_MAX, 1);
-    if (! new_src) {
-        free(new_dest);
+    axl_scan_free(files, count);
+    return rc;
+}
+
+/* Add a file or directory to the transfer handle.  If the src is a
+ * directory, recursively add all the files in that directory.  A dest that
+ * is an existing directory gets src copied into it, like cp does.
+ *
+ * If the file's destination path doesn't exist, then automatically create the
+ * needed directories. */
+static int axl_add_path(int id, const char* src, const char* dest)
+{
+    kvtree* file_list = NULL;
+    axl_xfer_t xtype = AXL_XFER_NULL;
+    axl_xfer_state_t xstate = AXL_XFER_STATE_NULL;
+    if (axl_get_info(id, &file_list, &xtype, &xstate) != AXL_SUCCESS) {
+        AXL_ERR("Could not find transfer info for UID %d", id);
         return AXL_FAILURE;
     }
 
-    char* final_dest = calloc(PATH_MAX, 1);
-    if (! final_dest) {
-        free(new_dest);
-        free(new_src);
+    /* check that handle is in correct state to add files */
+    if (xstate != AXL_XFER_STATE_CREATED) {
+        AXL_ERR("Invalid state to add files for UID %d", id);
         return AXL_FAILURE;
     }
 
-    char* src_copy  = strdup(src);
-    char* dest_copy = strdup(dest);
-
     unsigned int src_path_type  = path_type(src);
     unsigned int dest_path_type = path_type(dest);
 
-    char* src_basename = basename(src_copy);
+    /* They passed a dest directory, so append the source's name to it.
+     *
+     * Before:
+     * src          dest
+     * /tmp/file1   /tmp/mydir
+     *
+     * After:
+     * /tmp/file1   /tmp/mydir/file1 */
+    char* new_dest = NULL;
+    if (dest_path_type == PATH_DIR) {
+        char* src_copy = strdup(src);
+        if (src_copy) {
+            asprintf(&new_dest, "%s/%s", dest, basename(src_copy));
+            axl_free(&src_copy);
+        }
+        if (! new_dest) {
+            return AXL_FAILURE;
+        }
+        dest = new_dest;
+    }
 
-    DIR *dir;
-    struct dirent *de;
+    int rc;
     switch (src_path_type) {
     case PATH_FILE:
-        if (dest_path_type == PATH_DIR) {
-            /* They passed a source file, with dest directory.  Append the
-             * filename to dest.
-             *
-             * Before:
-             * src          dest
-             * /tmp/file1   /tmp/mydir
-             *
-             * After:
-             * /tmp/file1   /tmp/mydir/file1 */
-
-            snprintf(new_dest, PATH_MAX, "%s/%s", dest, src_basename);
-            rc = __AXL_Add(id, src, new_dest);
-        } else {
-            /* The destination is a filename */
-            rc = __AXL_Add(id, src, dest);
-        }
+        rc = axl_add_file(id, file_list, xtype, src, dest, NULL);
+
+        /* record the file in the state file if we have one */
+        axl_write_state_record(id, src, NULL, NULL);
         break;
+
     case PATH_DIR:
-        /* Add the directory itself first... */
         if (dest_path_type == PATH_FILE) {
             /* We can't copy a directory onto a file */
             rc = AXL_FAILURE;
             break;
-       } else if (dest_path_type == PATH_DIR) {
-            snprintf(new_dest, PATH_MAX, "%s/%s", dest, src_basename);
-        } else {
-            /* Our destination doesn't exist */
-            snprintf(new_dest, PATH_MAX, "%s", dest);
         }
 
-        /* Traverse all files/dirs in the directory. */
-        dir = opendir(src);
-        if (! dir) {
+        rc = axl_add_dir(id, file_list, xtype, src, dest);
+
+        /* write the directory's files to the state file at once */
+        axl_write_state_file(id);
+        break;
+
+    default:
+        rc = AXL_FAILURE;
+        break;
+    }
+
+    axl_free(&new_dest);
+    return rc;
+}
+
+int AXL_Add (int id, const char* src, const char* dest)
+{
+    return axl_add_path(id, src, dest);
+}
+
+int AXL_Add_list (int id, int num, const char** src, const char** dest,
+    const struct stat* statbufs)
+{
+    kvtree* file_list = NULL;
+    axl_xfer_t xtype = AXL_XFER_NULL;
+    axl_xfer_state_t xstate = AXL_XFER_STATE_NULL;
+    if (axl_get_info(id, &file_list, &xtype, &xstate) != AXL_SUCCESS) {
+        AXL_ERR("Could not find transfer info for UID %d", id);
+        return AXL_FAILURE;
+    }
+
+    /* check that handle is in correct state to add files */
+    if (xstate != AXL_XFER_STATE_CREATED) {
+        AXL_ERR("Invalid state to add files for UID %d", id);
+        return AXL_FAILURE;
+    }
+
+    /* Check the whole list before we add any of it, classifying each
+     * source the way AXL_Add() does.  A caller's lstat() of a symbolic
+     * link doesn't say what it points to, so we stat() those ourselves. */
+    unsigned int* types = (unsigned int*) malloc(
+        (num > 0 ? num : 1) * sizeof(unsigned int));
+    if (! types) {
+        return AXL_FAILURE;
+    }
+    int rc = AXL_SUCCESS;
+    int i;
+    for (i = 0; i < num && rc == AXL_SUCCESS; i++) {
+        if (src[i] == NULL || dest[i] == NULL) {
+            AXL_ERR("Missing source or destination for file %d of %d", i, num);
             rc = AXL_FAILURE;
             break;
         }
 
-        while ((de = readdir(dir)) != NULL) {
-            /* Skip '.' and '..' directories */
-            if ((strcmp(de->d_name, ".") == 0) || (strcmp(de->d_name, "..") == 0)) {
-                continue;
-            }
+        if (statbufs && S_ISREG(statbufs[i].st_mode)) {
+            types[i] = PATH_FILE;
+        } else if (statbufs && S_ISDIR(statbufs[i].st_mode)) {
+            types[i] = PATH_DIR;
+        } else {
+            types[i] = path_type(src[i]);
+        }
 
-            snprintf(new_src, PATH_MAX, "%s/%s", src, de->d_name);
-            snprintf(final_dest, PATH_MAX, "%s/%s", new_dest, de->d_name);
+        if (types[i] == PATH_DIR && path_type(dest[i]) == PATH_FILE) {
+            /* We can't copy a directory onto a file */
+            AXL_ERR("Can't copy directory `%s' onto file `%s'", src[i], dest[i]);
+            rc = AXL_FAILURE;
+        } else if (types[i] == PATH_UNKNOWN) {
+            AXL_ERR("Can't add `%s': not a file or directory", src[i]);
+            rc = AXL_FAILURE;
+        }
+    }
 
-            rc = AXL_Add(id, new_src, final_dest);
-            if (rc != AXL_SUCCESS) {
-                rc = AXL_FAILURE;
-                break;
+    /* Insert the list.  This only fails if a directory can't be scanned or
+     * the transfer type won't take a file, and then the files before it
+     * stay in the handle, as they would with one AXL_Add() per file. */
+    for (i = 0; i < num && rc == AXL_SUCCESS; i++) {
+        if (types[i] == PATH_FILE) {
+            /* the common case: one file to an exact destination path, with
+             * the caller's lstat() recorded as AXL_Dispatch() would record
+             * its own */
+            const struct stat* statbuf = NULL;
+            if (statbufs && S_ISREG(statbufs[i].st_mode)) {
+                statbuf = &statbufs[i];
             }
+            rc = axl_add_file(id, file_list, xtype, src[i], dest[i], statbuf);
+        } else {
+            /* copy the directory to dest, updating the files in any earlier
+             * copy of it in place */
+            rc = axl_add_dir(id, file_list, xtype, src[i], dest[i]);
         }
-        break;
-
-    default:
-        rc = AXL_FAILURE;
-        break;
     }
+    axl_free(&types);
 
-    free(dest_copy);
-    free(src_copy);
-    free(final_dest);
-    free(new_src);
-    free(new_dest);
+    /* write the whole list to the state file at once, if we added any */
+    if (i > 0) {
+        axl_write_state_file(id);
+    }
 
     return rc;
 }
@@ -956,6 +1589,11 @@ static int axl_save_metadata(int id)
         /* Get the kvtree for the file */
         kvtree* src_kvtree = kvtree_elem_hash(elem);
 
+        /* AXL_Add_list() already recorded it from the caller's lstat() */
+        if (kvtree_get(src_kvtree, "MODE")) {
+            continue;
+        }
+
         /* stat() the file and record metadata to the file's kvtree */
         int rc = axl_meta_encode(src, src_kvtree);
         if (rc != AXL_SUCCESS) {
@@ -971,6 +1609,13 @@ static int axl_save_metadata(int id)
  * TODO: Make this multithreaded */
 static int axl_check_file_sizes(int id)
 {
+    /* Compressing or decompressing changes the size of every file */
+    int compress = AXL_COMPRESS_NONE;
+    kvtree_util_get_int(axl_kvtrees[id], AXL_KEY_CONFIG_COMPRESS, &compress);
+    if (compress != AXL_COMPRESS_NONE) {
+        return AXL_SUCCESS;
+    }
+
     /* For each source file ... */
     char* dst;
     kvtree_elem* elem = NULL;
@@ -978,6 +1623,11 @@ static int axl_check_file_sizes(int id)
         /* Get the kvtree for the file */
         kvtree* src_kvtree = kvtree_elem_hash(elem);
 
+        /* packed files have no destination file of their own */
+        if (axl_pack_is_packed(src_kvtree)) {
+            continue;
+        }
+
         int rc = axl_check_file_size(dst, src_kvtree);
         if (rc != AXL_SUCCESS) {
             return rc;
@@ -986,11 +1636,157 @@ static int axl_check_file_sizes(int id)
     return AXL_SUCCESS;
 }
 
+/* Give each file an empty manifest if the transfer records them.  When
+ * resuming, keep the blocks recorded so far. */
+static void axl_init_manifests(int id, int resume)
+{
+    kvtree* file_list = axl_kvtrees[id];
+
+    unsigned long manifest_size = 0;
+    kvtree_util_get_bytecount(file_list,
+        AXL_KEY_CONFIG_MANIFEST_SIZE, &manifest_size);
+    if (manifest_size == 0) {
+        return;
+    }
+
+    kvtree_elem* elem = NULL;
+    while ((elem = axl_get_next_path(id, elem, NULL, NULL))) {
+        kvtree* elem_hash = kvtree_elem_hash(elem);
+        if (! resume || kvtree_get(elem_hash, AXL_KEY_FILE_MANIFEST) == NULL) {
+            kvtree_set(elem_hash, AXL_KEY_FILE_MANIFEST, kvtree_new());
+        }
+    }
+}
+
+/* Decide which files to pack into a container in their destination
+ * directory, and get ready to pack them.  A resumed transfer packs them all
+ * again, since the containers are only complete once their index is
+ * written at the end of the transfer. */
+static int axl_init_packs(int id, axl_xfer_t xtype, int resume)
+{
+    kvtree* file_list = axl_kvtrees[id];
+
+    unsigned long pack_size = 0;
+    kvtree_util_get_bytecount(file_list, AXL_KEY_CONFIG_PACK_SIZE, &pack_size);
+
+    /* Packing doesn't mix with copying to temporary names, compressing, or
+     * updating destination files in place, and only the transfers that copy
+     * files themselves can do it */
+    int use_extension = axl_use_extension;
+    int compress = AXL_COMPRESS_NONE;
+    unsigned long delta_size = 0;
+    kvtree_util_get_int(file_list, AXL_KEY_CONFIG_USE_EXTENSION, &use_extension);
+    kvtree_util_get_int(file_list, AXL_KEY_CONFIG_COMPRESS, &compress);
+    kvtree_util_get_bytecount(file_list, AXL_KEY_CONFIG_DELTA_SIZE, &delta_size);
+    if (use_extension || compress != AXL_COMPRESS_NONE || delta_size > 0 ||
+        (xtype != AXL_XFER_SYNC && xtype != AXL_XFER_PTHREAD &&
+         xtype != AXL_XFER_URING))
+    {
+        pack_size = 0;
+    }
+
+    int packing = 0;
+    kvtree_elem* elem = NULL;
+    while ((elem = axl_get_next_path(id, elem, NULL, NULL))) {
+        kvtree* elem_hash = kvtree_elem_hash(elem);
+
+        unsigned long size = 0;
+        int packed = (pack_size > 0 &&
+            kvtree_util_get_unsigned_long(elem_hash, "SIZE", &size) == KVTREE_SUCCESS &&
+            size < pack_size);
+        if (packed) {
+            kvtree_util_set_int(elem_hash, AXL_KEY_FILE_PACK, 1);
+            if (resume) {
+                kvtree_util_set_int(elem_hash, AXL_KEY_FILE_STATUS, AXL_STATUS_SOURCE);
+            }
+            packing = 1;
+        } else {
+            kvtree_unset(elem_hash, AXL_KEY_FILE_PACK);
+        }
+    }
+
+    if (packing) {
+        int sync = axl_sync_policy;
+        kvtree_util_get_int(file_list, AXL_KEY_CONFIG_SYNC_POLICY, &sync);
+        return axl_pack_begin(id, sync);
+    }
+    return AXL_SUCCESS;
+}
+
+/* With the AXL_SYNC_DEFER policy, the files were closed without syncing
+ * them.  Sync each filesystem that a destination directory is on once, so
+ * that the transfer is on disk by the time AXL_Wait() returns.  Packed
+ * files are in a container in their destination directory. */
+static int axl_sync_deferred(int id)
+{
+    int sync = axl_sync_policy;
+    kvtree_util_get_int(axl_kvtrees[id], AXL_KEY_CONFIG_SYNC_POLICY, &sync);
+    if (sync != AXL_SYNC_DEFER) {
+        return AXL_SUCCESS;
+    }
+
+#ifdef HAVE_SYNCFS
+    int rc = AXL_SUCCESS;
+    dev_t* devs = NULL;
+    size_t count = 0;
+
+    char* dst;
+    kvtree_elem* elem = NULL;
+    while ((elem = axl_get_next_path(id, elem, NULL, &dst))) {
+        char* dst_path = strdup(dst);
+        char* dst_dir = dirname(dst_path);
+
+        struct stat statbuf;
+        int fd = open(dst_dir, O_RDONLY);
+        if (fd < 0 || fstat(fd, &statbuf) != 0) {
+            AXL_ERR("Opening %s to sync it: errno=%d %s",
+                dst_dir, errno, strerror(errno)
+            );
+            rc = AXL_FAILURE;
+        } else {
+            size_t i = 0;
+            while (i < count && devs[i] != statbuf.st_dev) {
+                i++;
+            }
+            if (i == count) {
+                dev_t* new_devs = realloc(devs, (count + 1) * sizeof(*devs));
+                if (new_devs) {
+                    devs = new_devs;
+                    devs[count++] = statbuf.st_dev;
+                }
+                if (syncfs(fd) != 0) {
+                    AXL_ERR("Failed to sync the filesystem of %s: errno=%d %s",
+                        dst_dir, errno, strerror(errno)
+                    );
+                    rc = AXL_FAILURE;
+                }
+            }
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        axl_free(&dst_path);
+    }
+
+    free(devs);
+    return rc;
+#else
+    /* without syncfs(), sync every filesystem */
+    sync();
+    return AXL_SUCCESS;
+#endif
+}
+
 /* Set metadata mode bits
  *
  * TODO: Make this multithreaded. */
 static int axl_set_metadata(int id)
 {
+    /* Setting the timestamps invalidates the checksums saved by delta
+     * copies, unless we record the new ones */
+    struct axl_copy_opts opts;
+    axl_copy_opts_load(axl_kvtrees[id], &opts);
+
     /* For each destination file ... */
     char* src;
     char* dst;
@@ -998,10 +1794,19 @@ static int axl_set_metadata(int id)
     while ((elem = axl_get_next_path(id, elem, &src, &dst))) {
         kvtree* src_kvtree = kvtree_elem_hash(elem);
 
+        /* packed files keep their metadata in the container's index */
+        if (axl_pack_is_packed(src_kvtree)) {
+            continue;
+        }
+
         int rc = axl_meta_apply(dst, src_kvtree);
         if (rc != AXL_SUCCESS) {
             return rc;
         }
+
+        if (opts.delta_size > 0) {
+            axl_delta_stamp(dst);
+        }
     }
     return AXL_SUCCESS;
 }
@@ -1094,6 +1899,8 @@ int __AXL_Dispatch (int id, int resume)
     }
 #endif /* HAVE_BBAPI */
 
+    axl_init_manifests(id, resume);
+
     if (!resume) {
         if (axl_save_metadata(id) != 0) {
             AXL_ERR("Couldn't save metadata");
@@ -1102,6 +1909,12 @@ int __AXL_Dispatch (int id, int resume)
         axl_write_state_file(id);
     }
 
+    /* this needs the file sizes saved above */
+    if (axl_init_packs(id, xtype, resume) != AXL_SUCCESS) {
+        AXL_ERR("Couldn't set up packing small files");
+        return AXL_FAILURE;
+    }
+
     /* NOTE FOR XFER INTERFACES
      * each interface should update AXL_KEY_STATUS
      * all well as AXL_KEY_FILE_STATUS for each file */
@@ -1125,6 +1938,16 @@ int __AXL_Dispatch (int id, int resume)
         break;
 #endif /* HAVE_PTHREADS */
 
+#ifdef HAVE_LIBURING
+    case AXL_XFER_URING:
+        if (resume) {
+            rc = axl_uring_resume(id);
+        } else {
+            rc = axl_uring_start(id);
+        }
+        break;
+#endif /* HAVE_LIBURING */
+
 #ifdef HAVE_BBAPI
     case AXL_XFER_ASYNC_BBAPI:
         if (resume) {
@@ -1285,6 +2108,12 @@ int AXL_Test (int id)
         break;
 #endif /* HAVE_PTHREADS */
 
+#ifdef HAVE_LIBURING
+    case AXL_XFER_URING:
+        rc = axl_uring_test(id);
+        break;
+#endif /* HAVE_LIBURING */
+
 #ifdef HAVE_BBAPI
     case AXL_XFER_ASYNC_BBAPI:
         rc = axl_async_test_bbapi(id);
@@ -1355,6 +2184,12 @@ int AXL_Wait (int id)
         break;
 #endif /* HAVE_PTHREADS */
 
+#ifdef HAVE_LIBURING
+    case AXL_XFER_URING:
+        rc = axl_uring_wait(id);
+        break;
+#endif /* HAVE_LIBURING */
+
 #ifdef HAVE_BBAPI
     case AXL_XFER_ASYNC_BBAPI:
         rc = axl_async_wait_bbapi(id);
@@ -1374,8 +2209,20 @@ int AXL_Wait (int id)
     }
 
 end:
+    /* Write the index of each container that small files were packed
+     * into, now that nothing else will be packed */
+    int pack_rc = axl_pack_end(id, rc);
+
+    /* Make sure the files are on disk if their syncs were put off */
+    int sync_rc = axl_sync_deferred(id);
+
     /* Are all our destination files the correct size? */
     rc = axl_check_file_sizes(id);
+    if (pack_rc != AXL_SUCCESS) {
+        rc = pack_rc;
+    } else if (sync_rc != AXL_SUCCESS) {
+        rc = sync_rc;
+    }
 
     /* Set permissions and creation times on files */
     if (rc == AXL_SUCCESS && axl_copy_metadata) {
@@ -1453,6 +2300,12 @@ int AXL_Cancel (int id)
         break;
 #endif /* HAVE_PTHREADS */
 
+#ifdef HAVE_LIBURING
+    case AXL_XFER_URING:
+        rc = axl_uring_cancel(id);
+        break;
+#endif /* HAVE_LIBURING */
+
 #ifdef HAVE_BBAPI
     case AXL_XFER_ASYNC_BBAPI:
         rc = axl_async_cancel_bbapi(id);
@@ -1506,6 +2359,15 @@ int AXL_Free (int id)
     }
 #endif
 
+#ifdef HAVE_LIBURING
+    if (xtype == AXL_XFER_URING) {
+        axl_uring_free(id);
+    }
+#endif
+
+    /* drop the containers of a transfer that never finished */
+    axl_pack_end(id, AXL_FAILURE);
+
     /* write data to file if we have one */
     axl_write_state_file(id);
 
@@ -31,9 +31,85 @@ extern "C" {
 #define AXL_KEY_CONFIG_USE_EXTENSION "USE_EXTENSION"
 #define AXL_KEY_CONFIG_COPY_METADATA "COPY_METADATA"
 #define AXL_KEY_CONFIG_RANK "RANK"
+#define AXL_KEY_CONFIG_COPY_ENGINE "COPY_ENGINE"
+#define AXL_KEY_CONFIG_DIRECT_IO "DIRECT_IO"
+#define AXL_KEY_CONFIG_SCHEDULE "SCHEDULE"
+#define AXL_KEY_CONFIG_CRC "CRC"
+#define AXL_KEY_CONFIG_MANIFEST_SIZE "MANIFEST_SIZE"
+#define AXL_KEY_CONFIG_COMPRESS "COMPRESS"
+#define AXL_KEY_CONFIG_DELTA_SIZE "DELTA_SIZE"
+#define AXL_KEY_CONFIG_PACK_SIZE "PACK_SIZE"
+#define AXL_KEY_CONFIG_SYNC_POLICY "SYNC_POLICY"
+#define AXL_KEY_CONFIG_WRITE_BEHIND_SIZE "WRITE_BEHIND_SIZE"
+#define AXL_KEY_CONFIG_STATE_FORMAT "STATE_FORMAT"
+#define AXL_KEY_CONFIG_BUF_POOL_SIZE "BUF_POOL_SIZE"
+
+/** Values for AXL_KEY_CONFIG_COPY_ENGINE, which selects how the sync and
+ * pthread transfer types move file data.  Each engine falls back to the
+ * next simpler one if the kernel or filesystem does not support it. */
+typedef enum {
+    AXL_COPY_ENGINE_READWRITE = 0,   /* read()/write() through a user-space buffer */
+    AXL_COPY_ENGINE_SPLICE,          /* splice() through a pipe */
+    AXL_COPY_ENGINE_COPY_FILE_RANGE, /* copy_file_range() inside the kernel (default) */
+} axl_copy_engine_t;
+
+/** Values for AXL_KEY_CONFIG_SCHEDULE, which sets the order in which the
+ * pthread transfer type starts copying files, using the file sizes recorded
+ * at dispatch.  Copying the largest files first keeps one big file from
+ * being left to a single thread at the end of the transfer. */
+typedef enum {
+    AXL_SCHEDULE_FIFO = 0,           /* the order files are listed in the transfer */
+    AXL_SCHEDULE_LARGEST_FIRST,      /* largest files first (default) */
+    AXL_SCHEDULE_SMALLEST_FIRST,     /* smallest files first */
+} axl_schedule_t;
+
+/** Values for AXL_KEY_CONFIG_CRC, the checksum computed for each file as it
+ * is copied and recorded with the file in the transfer.  The fastest
+ * implementation the CPU supports is picked at runtime. */
+typedef enum {
+    AXL_CRC_NONE = 0,                /* no checksum (default) */
+    AXL_CRC_CRC32,                   /* CRC32 as computed by zlib's crc32() */
+    AXL_CRC_CRC32C,                  /* CRC32C (Castagnoli), as used by iSCSI and ext4 */
+} axl_crc_t;
+
+/** Values for AXL_KEY_CONFIG_COMPRESS, which lets the sync, pthread, and
+ * io_uring transfer types compress files as they copy them.  Files are
+ * compressed with zlib in independent blocks, followed by an index of the
+ * blocks, so the pthread transfer can compress and restore the blocks of a
+ * large file on several threads at once.  Compressed files are always
+ * copied from the start when a transfer is resumed, and CRC and
+ * MANIFEST_SIZE don't apply to them. */
+typedef enum {
+    AXL_COMPRESS_NONE = 0,           /* copy files as they are (default) */
+    AXL_COMPRESS_DEFLATE,            /* write compressed copies of the files */
+    AXL_COMPRESS_INFLATE,            /* restore the originals from compressed copies */
+} axl_compress_t;
+
+/** Values for AXL_KEY_CONFIG_SYNC_POLICY, which sets when the sync,
+ * pthread, and io_uring transfer types flush the files they copy to disk.
+ * Syncing each file as it's closed makes a worker wait for the disk before
+ * it moves on to the next file.  Deferring the syncs to AXL_Wait() lets the
+ * kernel write the files back in the background, and still has them on disk
+ * by the time AXL_Wait() returns. */
+typedef enum {
+    AXL_SYNC_ALL = 0,                /* fsync() the source and destination of each file (default) */
+    AXL_SYNC_DEST,                   /* fsync() only the destination of each file */
+    AXL_SYNC_DEFER,                  /* syncfs() each destination filesystem once, in AXL_Wait() */
+    AXL_SYNC_NONE,                   /* leave writing the files back to the kernel */
+} axl_sync_t;
+
+/** Values for AXL_KEY_CONFIG_STATE_FORMAT, the format a transfer writes its
+ * state file in.  The binary format has a fixed-size record per file and a
+ * table of the path names, and is memory-mapped when a transfer is resumed
+ * rather than parsed, which matters for transfers of many files.  AXL reads
+ * a state file in either format, whatever this is set to. */
+typedef enum {
+    AXL_STATE_FORMAT_KVTREE = 0,     /* kvtree_write_file() (default) */
+    AXL_STATE_FORMAT_BINARY,         /* AXL's own binary format */
+} axl_state_format_t;
 
 /** Supported AXL transfer methods
- * Note that DW, and BBAPI must be found at compile time */
+ * Note that DW, BBAPI, and io_uring must be found at compile time */
 typedef enum {
     AXL_XFER_NULL = 0,      /* placeholder to represent invalid value */
     AXL_XFER_DEFAULT,       /* Autodetect and use the fastest API for this node
@@ -51,6 +127,7 @@ typedef enum {
                              */
     AXL_XFER_PTHREAD,      /* parallel copy using pthreads */
     AXL_XFER_STATE_FILE,    /* Use the xfer type specified in the state_file. */
+    AXL_XFER_URING,         /* async copy using io_uring (Linux only) */
 } axl_xfer_t;
 
 /*
@@ -58,7 +135,12 @@ typedef enum {
  */
 int AXL_Init (void);
 
-/** Shutdown any vendor services */
+/** Shutdown any vendor services.
+ *
+ * AXL_XFER_PTHREAD transfers that are still running are stopped: each
+ * worker thread finishes the file (or chunk) it is copying, and the rest
+ * are left uncopied, so this blocks for at most that long.  A transfer
+ * stopped this way can be resumed later from its state file. */
 int AXL_Finalize (void);
 
 /*
@@ -75,6 +157,7 @@ int AXL_Create (axl_xfer_t xtype, const char* name, const char* state_file);
 
 /* needs to be above doxygen comment to get association right */
 typedef struct kvtree_struct kvtree;
+struct stat;
 
 /**
  * Get/set AXL configuration values.
@@ -97,9 +180,36 @@ kvtree* AXL_Config(
   const kvtree* config        /** [IN] - kvtree of options */
 );
 
-/** Add a file to an existing transfer handle */
+/**
+ * Add a file or directory to an existing transfer handle.  A destination
+ * that is an existing directory gets source copied into it, like cp does.
+ * A directory is added recursively, each file going to the same relative
+ * path under the destination, so subdirectories that already exist there
+ * are updated in place rather than getting a nested copy.  A directory
+ * holding anything other than files and directories (FIFOs, sockets, broken
+ * links) fails, and adds none of its files.
+ */
 int AXL_Add (int id, const char* source, const char* destination);
 
+/**
+ * Add num files to an existing transfer handle in one call.  destination[i]
+ * is the exact path source[i] is copied to; unlike AXL_Add() it is never
+ * treated as a directory to copy into.  A source that is a directory is
+ * copied recursively to destination[i].
+ *
+ * statbufs is optional.  If it is not NULL, statbufs[i] must hold an lstat()
+ * of source[i] (at least st_mode, st_size, owner and times), and AXL records
+ * it rather than stat'ing the file itself in AXL_Dispatch(), so the file
+ * must not change in between.  Without statbufs, AXL_Dispatch() records
+ * the files as they are then, as it does for AXL_Add().
+ *
+ * Every source is checked before any is added, so a missing file adds
+ * none of the list.  The state file, if there is one, is written once for
+ * the whole list.  Returns AXL_SUCCESS if every file was added.
+ */
+int AXL_Add_list (int id, int num, const char** source,
+    const char** destination, const struct stat* statbufs);
+
 /** Initiate a transfer for all files in handle ID */
 int AXL_Dispatch (int id);
 
@@ -136,6 +246,26 @@ int AXL_Free (int id);
  * useful to clean the plate when restarting */
 int AXL_Stop (void);
 
+/** Name of the container that a transfer with AXL_KEY_CONFIG_PACK_SIZE set
+ * packs small files into, in each of their destination directories */
+#define AXL_PACK_NAME ".axlpack"
+
+/**
+ * Look up a file that a transfer packed into a container instead of
+ * copying it, by the destination path it was added with.  Only the
+ * container's index is read.  Returns AXL_SUCCESS and sets size to the
+ * size of the file if it is in the container.
+ */
+int AXL_Pack_lookup (const char* destination, unsigned long* size);
+
+/**
+ * Extract a file that a transfer packed into a container to path, with the
+ * mode and mtime it was packed with, without reading the other files in
+ * the container.  The data is checked against the CRC32C recorded when it
+ * was packed.  Must be called after AXL_Init().
+ */
+int AXL_Pack_extract (const char* destination, const char* path);
+
 /* enable C++ codes to include this header directly */
 #ifdef __cplusplus
 } /* extern "C" */
@@ -0,0 +1,219 @@
+/* A pool of copy buffers shared by all transfers.
+ *
+ * Copies that go through user space need a FILE_BUF_SIZE buffer, 32 MiB by
+ * default.  Allocating one for every file means an mmap() and munmap() per
+ * file, and faulting in freshly zeroed pages each time.  Instead, buffers
+ * are handed out from this pool and kept for the next copy, up to a total
+ * of axl_buf_pool_size bytes.  Buffers are page aligned, so they can also
+ * be used for O_DIRECT. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "config.h"
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include "axl_internal.h"
+
+/* Buffers of at least this size are rounded up to a multiple of it, and
+ * backed by huge pages if the system has some to spare */
+#define AXL_BUF_HUGE_SIZE (2UL * 1024UL * 1024UL)
+
+unsigned long axl_buf_pool_size;
+
+struct axl_buf
+{
+    /* This struct is on either the free or used list */
+    struct axl_buf* next;
+
+    void* ptr;
+    size_t size;
+
+    /* Set if the buffer counts against axl_buf_pool_size, and goes back on
+     * the free list when it's put back.  Buffers allocated while the pool
+     * is full are unmapped instead. */
+    int pooled;
+};
+
+static struct axl_buf_pool
+{
+#ifdef HAVE_PTHREADS
+    pthread_mutex_t lock;
+#endif
+
+    /* Buffers ready to be handed out, and buffers that are in use */
+    struct axl_buf* free;
+    struct axl_buf* used;
+
+    /* Total bytes of pooled buffers, free or in use */
+    size_t bytes;
+} axl_buf_pool = {
+#ifdef HAVE_PTHREADS
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+#endif
+};
+
+static void axl_buf_lock(void)
+{
+#ifdef HAVE_PTHREADS
+    pthread_mutex_lock(&axl_buf_pool.lock);
+#endif
+}
+
+static void axl_buf_unlock(void)
+{
+#ifdef HAVE_PTHREADS
+    pthread_mutex_unlock(&axl_buf_pool.lock);
+#endif
+}
+
+/* Map size bytes of memory, with huge pages if we can get them, and fault
+ * it in up front.  Returns NULL on failure. */
+static void* axl_buf_map(size_t size)
+{
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_POPULATE
+    flags |= MAP_POPULATE;
+#endif
+
+    void* ptr = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    /* This only works if the admin has reserved huge pages */
+    if (size % AXL_BUF_HUGE_SIZE == 0) {
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+    }
+#endif
+
+    if (ptr == MAP_FAILED) {
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (ptr == MAP_FAILED) {
+            return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        /* Otherwise ask for transparent huge pages */
+        if (size >= AXL_BUF_HUGE_SIZE) {
+            madvise(ptr, size, MADV_HUGEPAGE);
+        }
+#endif
+    }
+
+    return ptr;
+}
+
+/* Unmap a buffer and free its struct */
+static void axl_buf_unmap(struct axl_buf* buf)
+{
+    munmap(buf->ptr, buf->size);
+    free(buf);
+}
+
+void* axl_buf_get(size_t size)
+{
+    if (size >= AXL_BUF_HUGE_SIZE) {
+        size = (size + AXL_BUF_HUGE_SIZE - 1) / AXL_BUF_HUGE_SIZE * AXL_BUF_HUGE_SIZE;
+    }
+
+    axl_buf_lock();
+
+    /* Take the smallest free buffer that's big enough */
+    struct axl_buf** best = NULL;
+    struct axl_buf** link;
+    for (link = &axl_buf_pool.free; *link != NULL; link = &(*link)->next) {
+        if ((*link)->size >= size && (best == NULL || (*link)->size < (*best)->size)) {
+            best = link;
+        }
+    }
+
+    struct axl_buf* buf = NULL;
+    if (best != NULL) {
+        buf = *best;
+        *best = buf->next;
+    } else {
+        /* None fit.  Make room by dropping free buffers, which are all
+         * too small for us anyway. */
+        while (axl_buf_pool.free != NULL &&
+            axl_buf_pool.bytes + size > axl_buf_pool_size)
+        {
+            struct axl_buf* old = axl_buf_pool.free;
+            axl_buf_pool.free = old->next;
+            axl_buf_pool.bytes -= old->size;
+            axl_buf_unmap(old);
+        }
+
+        buf = calloc(1, sizeof(*buf));
+        if (buf != NULL) {
+            buf->size = size;
+            buf->ptr = axl_buf_map(size);
+            if (buf->ptr == NULL) {
+                AXL_ERR("Allocating memory: mmap(%lu) errno=%d %s",
+                    (unsigned long) size, errno, strerror(errno)
+                );
+                axl_free(&buf);
+            }
+        }
+
+        if (buf != NULL && axl_buf_pool.bytes + size <= axl_buf_pool_size) {
+            buf->pooled = 1;
+            axl_buf_pool.bytes += size;
+        }
+    }
+
+    void* ptr = NULL;
+    if (buf != NULL) {
+        buf->next = axl_buf_pool.used;
+        axl_buf_pool.used = buf;
+        ptr = buf->ptr;
+    }
+
+    axl_buf_unlock();
+
+    return ptr;
+}
+
+void axl_buf_put(void* ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    axl_buf_lock();
+
+    struct axl_buf** link = &axl_buf_pool.used;
+    while (*link != NULL && (*link)->ptr != ptr) {
+        link = &(*link)->next;
+    }
+
+    struct axl_buf* buf = *link;
+    if (buf != NULL) {
+        *link = buf->next;
+        if (buf->pooled) {
+            buf->next = axl_buf_pool.free;
+            axl_buf_pool.free = buf;
+        } else {
+            axl_buf_unmap(buf);
+        }
+    } else {
+        AXL_ERR("Returning a buffer that didn't come from the pool");
+    }
+
+    axl_buf_unlock();
+}
+
+void axl_buf_finalize(void)
+{
+    axl_buf_lock();
+
+    while (axl_buf_pool.free != NULL) {
+        struct axl_buf* buf = axl_buf_pool.free;
+        axl_buf_pool.free = buf->next;
+        axl_buf_pool.bytes -= buf->size;
+        axl_buf_unmap(buf);
+    }
+
+    axl_buf_unlock();
+}
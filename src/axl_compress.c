@@ -0,0 +1,572 @@
+/* Compressed copies, for the COMPRESS option.
+ *
+ * A file is compressed in fixed-size blocks, each one a zlib stream of its
+ * own, so that the pthread transfer can compress and restore the blocks of a
+ * large file on several threads at once.  A compressed file is laid out as:
+ *
+ *   header   "AXLZ", format version, block size, size of the original file
+ *   blocks   one zlib stream per block, in whatever order they were written
+ *   index    for each block in order, the offset and length of its stream
+ *            and the CRC32C of its uncompressed data
+ *   trailer  offset of the index, "AXLZ", format version
+ *
+ * All numbers are little-endian.  The index goes at the end since we don't
+ * know where each block lands until it has been compressed.  A reader finds
+ * it through the trailer, and can then restore any block on its own. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "config.h"
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include "axl_internal.h"
+
+#define AXL_Z_MAGIC   "AXLZ"
+#define AXL_Z_VERSION (1)
+
+/* header: magic, version, block size, original size */
+#define AXL_Z_HEADER_SIZE  (4 + 4 + 8 + 8)
+
+/* index entry: offset, length, crc */
+#define AXL_Z_ENTRY_SIZE   (8 + 4 + 4)
+
+/* trailer: index offset, magic, version */
+#define AXL_Z_TRAILER_SIZE (8 + 4 + 4)
+
+struct axl_zwriter
+{
+    char* file;
+    int fd;
+
+    /* whether closing the writer syncs the file */
+    int sync;
+
+#ifdef HAVE_PTHREADS
+    /* protects end */
+    pthread_mutex_t lock;
+#endif
+
+    /* where the next block goes */
+    uint64_t end;
+
+    /* Filled in as blocks are written.  Each thread writes the entries for
+     * its own blocks, so these need no lock. */
+    struct axl_zindex index;
+};
+
+/* Get the block size to compress with, see AXL_COMPRESS_BLOCK_SIZE */
+static uint64_t axl_z_block_size(void)
+{
+    char* env = getenv("AXL_COMPRESS_BLOCK_SIZE");
+    if (env && strtoul(env, 0, 10) > 0) {
+        return strtoul(env, 0, 10);
+    }
+    return AXL_COMPRESS_BLOCK_SIZE;
+}
+
+static int axl_z_canceled(const struct axl_copy_opts* opts)
+{
+    return opts->cancel && *opts->cancel;
+}
+
+/* Create dst_file, write its header, and return a writer for the blocks of
+ * a size-byte file, or NULL on error.  opts->sync says whether closing the
+ * writer syncs the file. */
+struct axl_zwriter* axl_zwriter_open(const char* dst_file, off_t size,
+    const struct axl_copy_opts* opts)
+{
+    struct axl_zwriter* zw = calloc(1, sizeof(*zw));
+    if (! zw) {
+        return NULL;
+    }
+
+    zw->sync = (opts->sync == AXL_SYNC_ALL || opts->sync == AXL_SYNC_DEST);
+    zw->index.block_size = axl_z_block_size();
+    zw->index.size       = (uint64_t) size;
+    zw->index.count      = (zw->index.size + zw->index.block_size - 1) /
+                           zw->index.block_size;
+    if (zw->index.count > 0) {
+        zw->index.blocks = calloc(zw->index.count, sizeof(zw->index.blocks[0]));
+    }
+    zw->file = strdup(dst_file);
+    if ((zw->index.count > 0 && ! zw->index.blocks) || ! zw->file) {
+        free(zw->index.blocks);
+        free(zw->file);
+        free(zw);
+        return NULL;
+    }
+
+    mode_t mode_file = axl_getmode(1, 1, 0);
+    zw->fd = axl_open(dst_file, O_WRONLY | O_CREAT | O_TRUNC, mode_file);
+    if (zw->fd < 0) {
+        AXL_ERR("Opening file for writing: axl_open(%s) errno=%d %s",
+            dst_file, errno, strerror(errno)
+        );
+        free(zw->index.blocks);
+        free(zw->file);
+        free(zw);
+        return NULL;
+    }
+
+#ifdef HAVE_PTHREADS
+    pthread_mutex_init(&zw->lock, NULL);
+#endif
+
+    unsigned char header[AXL_Z_HEADER_SIZE];
+    memcpy(header, AXL_Z_MAGIC, 4);
+    axl_put_le32(header + 4, AXL_Z_VERSION);
+    axl_put_le64(header + 8, zw->index.block_size);
+    axl_put_le64(header + 16, zw->index.size);
+    if (axl_pwrite_all(dst_file, zw->fd, header, sizeof(header), 0) != AXL_SUCCESS) {
+        axl_zwriter_close(zw, AXL_FAILURE);
+        return NULL;
+    }
+    zw->end = sizeof(header);
+
+    return zw;
+}
+
+/* block size the writer compresses with */
+off_t axl_zwriter_block_size(const struct axl_zwriter* zw)
+{
+    return (off_t) zw->index.block_size;
+}
+
+/* Reserve length bytes at the end of the file, and return their offset */
+static uint64_t axl_zwriter_reserve(struct axl_zwriter* zw, uint64_t length)
+{
+#ifdef HAVE_PTHREADS
+    pthread_mutex_lock(&zw->lock);
+#endif
+    uint64_t offset = zw->end;
+    zw->end += length;
+#ifdef HAVE_PTHREADS
+    pthread_mutex_unlock(&zw->lock);
+#endif
+    return offset;
+}
+
+/* Compress the blocks in the length bytes at offset in src_file into zw */
+int axl_compress_range(
+    const char* src_file,
+    struct axl_zwriter* zw,
+    const struct axl_copy_opts* opts,
+    off_t offset,
+    off_t length)
+{
+    const struct axl_zindex* zi = &zw->index;
+    uint64_t first = (uint64_t) offset / zi->block_size;
+    uint64_t last  = ((uint64_t) (offset + length) + zi->block_size - 1) /
+                     zi->block_size;
+    if (last > zi->count) {
+        last = zi->count;
+    }
+    if (first >= last) {
+        return AXL_SUCCESS;
+    }
+
+    int src_fd = axl_open(src_file, O_RDONLY);
+    if (src_fd < 0) {
+        AXL_ERR("Opening file to compress: axl_open(%s) errno=%d %s",
+            src_file, errno, strerror(errno)
+        );
+        return AXL_FAILURE;
+    }
+
+#if !defined(__APPLE__)
+    posix_fadvise(src_fd, (off_t) (first * zi->block_size),
+        (off_t) ((last - first) * zi->block_size), POSIX_FADV_SEQUENTIAL);
+#endif
+
+    uLong bound = compressBound((uLong) zi->block_size);
+    unsigned char* in  = (unsigned char*) axl_buf_get(zi->block_size);
+    unsigned char* out = (unsigned char*) axl_buf_get(bound);
+    if (! in || ! out) {
+        AXL_ERR("Allocating buffers to compress %s", src_file);
+        axl_buf_put(in);
+        axl_buf_put(out);
+        close(src_fd);
+        return AXL_FAILURE;
+    }
+
+    int rc = AXL_SUCCESS;
+    uint64_t i;
+    for (i = first; i < last; i++) {
+        if (axl_z_canceled(opts)) {
+            rc = AXL_FAILURE;
+            break;
+        }
+
+        uint64_t start = i * zi->block_size;
+        size_t n = (size_t) AXL_MIN(zi->block_size, zi->size - start);
+        if (axl_pread_all(src_file, src_fd, in, n, (off_t) start) != AXL_SUCCESS) {
+            rc = AXL_FAILURE;
+            break;
+        }
+
+        uLongf out_len = bound;
+        int zrc = compress2(out, &out_len, in, (uLong) n, Z_BEST_SPEED);
+        if (zrc != Z_OK) {
+            AXL_ERR("Compressing block %lu of %s: zlib error %d",
+                (unsigned long) i, src_file, zrc
+            );
+            rc = AXL_FAILURE;
+            break;
+        }
+
+        uint64_t at = axl_zwriter_reserve(zw, out_len);
+        if (axl_pwrite_all(zw->file, zw->fd, out, out_len, (off_t) at) != AXL_SUCCESS) {
+            rc = AXL_FAILURE;
+            break;
+        }
+
+        struct axl_zblock* b = &zi->blocks[i];
+        b->offset = at;
+        b->length = (uint32_t) out_len;
+        b->crc    = axl_hash(AXL_CRC_CRC32C, 0, in, n);
+    }
+
+    axl_buf_put(in);
+    axl_buf_put(out);
+    close(src_fd);
+
+    return rc;
+}
+
+/* Once every block is written, write the index, sync and close the file,
+ * and free zw */
+int axl_zwriter_close(struct axl_zwriter* zw, int rc)
+{
+    const struct axl_zindex* zi = &zw->index;
+
+    if (rc == AXL_SUCCESS) {
+        size_t len = zi->count * AXL_Z_ENTRY_SIZE + AXL_Z_TRAILER_SIZE;
+        unsigned char* buf = malloc(len);
+        if (buf) {
+            unsigned char* p = buf;
+            uint64_t i;
+            for (i = 0; i < zi->count; i++) {
+                axl_put_le64(p, zi->blocks[i].offset);
+                axl_put_le32(p + 8, zi->blocks[i].length);
+                axl_put_le32(p + 12, zi->blocks[i].crc);
+                p += AXL_Z_ENTRY_SIZE;
+            }
+            axl_put_le64(p, zw->end);
+            memcpy(p + 8, AXL_Z_MAGIC, 4);
+            axl_put_le32(p + 12, AXL_Z_VERSION);
+
+            rc = axl_pwrite_all(zw->file, zw->fd, buf, len, (off_t) zw->end);
+            free(buf);
+        } else {
+            AXL_ERR("Allocating index for %s", zw->file);
+            rc = AXL_FAILURE;
+        }
+
+        if (zw->sync) {
+            if (axl_close(zw->file, zw->fd) != AXL_SUCCESS) {
+                rc = AXL_FAILURE;
+            }
+        } else if (close(zw->fd) != 0) {
+            AXL_ERR("Closing file %s: errno=%d %s", zw->file, errno, strerror(errno));
+            rc = AXL_FAILURE;
+        }
+    } else {
+        close(zw->fd);
+    }
+
+#ifdef HAVE_PTHREADS
+    pthread_mutex_destroy(&zw->lock);
+#endif
+    free(zw->index.blocks);
+    free(zw->file);
+    free(zw);
+
+    return rc;
+}
+
+/* read the index of compressed file src_file, returns NULL on error */
+struct axl_zindex* axl_zindex_read(const char* src_file)
+{
+    int fd = axl_open(src_file, O_RDONLY);
+    if (fd < 0) {
+        AXL_ERR("Opening compressed file: axl_open(%s) errno=%d %s",
+            src_file, errno, strerror(errno)
+        );
+        return NULL;
+    }
+
+    struct axl_zindex* zi = calloc(1, sizeof(*zi));
+    unsigned char* buf = NULL;
+    unsigned char header[AXL_Z_HEADER_SIZE];
+    unsigned char trailer[AXL_Z_TRAILER_SIZE];
+    struct stat statbuf;
+    if (! zi || fstat(fd, &statbuf) != 0 ||
+        (uint64_t) statbuf.st_size < AXL_Z_HEADER_SIZE + AXL_Z_TRAILER_SIZE ||
+        axl_pread_all(src_file, fd, header, sizeof(header), 0) != AXL_SUCCESS ||
+        axl_pread_all(src_file, fd, trailer, sizeof(trailer),
+            statbuf.st_size - AXL_Z_TRAILER_SIZE) != AXL_SUCCESS)
+    {
+        goto fail;
+    }
+
+    uint64_t file_size = (uint64_t) statbuf.st_size;
+    uint64_t index_offset = axl_get_le64(trailer);
+    zi->block_size = axl_get_le64(header + 8);
+    zi->size       = axl_get_le64(header + 16);
+    if (memcmp(header, AXL_Z_MAGIC, 4) != 0 ||
+        memcmp(trailer + 8, AXL_Z_MAGIC, 4) != 0 ||
+        axl_get_le32(header + 4) != AXL_Z_VERSION ||
+        axl_get_le32(trailer + 12) != AXL_Z_VERSION ||
+        zi->block_size == 0)
+    {
+        AXL_ERR("%s is not a compressed AXL file", src_file);
+        goto fail;
+    }
+
+    zi->count = (zi->size + zi->block_size - 1) / zi->block_size;
+    if (index_offset < AXL_Z_HEADER_SIZE || index_offset > file_size ||
+        zi->count > file_size / AXL_Z_ENTRY_SIZE ||
+        file_size - index_offset != zi->count * AXL_Z_ENTRY_SIZE + AXL_Z_TRAILER_SIZE)
+    {
+        AXL_ERR("Compressed file %s has a bad index", src_file);
+        goto fail;
+    }
+
+    if (zi->count > 0) {
+        size_t len = zi->count * AXL_Z_ENTRY_SIZE;
+        buf = malloc(len);
+        zi->blocks = calloc(zi->count, sizeof(zi->blocks[0]));
+        if (! buf || ! zi->blocks ||
+            axl_pread_all(src_file, fd, buf, len, (off_t) index_offset) != AXL_SUCCESS)
+        {
+            goto fail;
+        }
+
+        uint64_t i;
+        for (i = 0; i < zi->count; i++) {
+            const unsigned char* p = buf + i * AXL_Z_ENTRY_SIZE;
+            struct axl_zblock* b = &zi->blocks[i];
+            b->offset = axl_get_le64(p);
+            b->length = axl_get_le32(p + 8);
+            b->crc    = axl_get_le32(p + 12);
+            if (b->offset < AXL_Z_HEADER_SIZE || b->offset > index_offset ||
+                b->length > index_offset - b->offset)
+            {
+                AXL_ERR("Compressed file %s has a bad index entry for block %lu",
+                    src_file, (unsigned long) i
+                );
+                goto fail;
+            }
+        }
+    }
+
+    free(buf);
+    close(fd);
+    return zi;
+
+fail:
+    free(buf);
+    axl_zindex_free(zi);
+    close(fd);
+    return NULL;
+}
+
+/* free an index from axl_zindex_read() */
+void axl_zindex_free(struct axl_zindex* zi)
+{
+    if (zi) {
+        free(zi->blocks);
+        free(zi);
+    }
+}
+
+/* Restore blocks first to last (not included) from src_fd to dst_fd */
+static int axl_decompress_blocks(
+    const char* src_file, int src_fd,
+    const char* dst_file, int dst_fd,
+    const struct axl_zindex* zi,
+    const struct axl_copy_opts* opts,
+    uint64_t first,
+    uint64_t last)
+{
+    if (first >= last) {
+        return AXL_SUCCESS;
+    }
+
+    uint32_t max_len = 0;
+    uint64_t i;
+    for (i = first; i < last; i++) {
+        if (zi->blocks[i].length > max_len) {
+            max_len = zi->blocks[i].length;
+        }
+    }
+
+    unsigned char* in  = (unsigned char*) axl_buf_get(max_len > 0 ? max_len : 1);
+    unsigned char* out = (unsigned char*) axl_buf_get(zi->block_size);
+    if (! in || ! out) {
+        AXL_ERR("Allocating buffers to decompress %s", src_file);
+        axl_buf_put(in);
+        axl_buf_put(out);
+        return AXL_FAILURE;
+    }
+
+    int rc = AXL_SUCCESS;
+    for (i = first; i < last; i++) {
+        if (axl_z_canceled(opts)) {
+            rc = AXL_FAILURE;
+            break;
+        }
+
+        const struct axl_zblock* b = &zi->blocks[i];
+        if (axl_pread_all(src_file, src_fd, in, b->length, (off_t) b->offset) != AXL_SUCCESS) {
+            rc = AXL_FAILURE;
+            break;
+        }
+
+        uint64_t start = i * zi->block_size;
+        uLongf n = (uLongf) AXL_MIN(zi->block_size, zi->size - start);
+        uLongf out_len = (uLongf) zi->block_size;
+        int zrc = uncompress(out, &out_len, in, b->length);
+        if (zrc != Z_OK || out_len != n ||
+            axl_hash(AXL_CRC_CRC32C, 0, out, out_len) != b->crc)
+        {
+            AXL_ERR("Block %lu of %s is corrupt: zlib rc %d, length %lu, expected %lu",
+                (unsigned long) i, src_file, zrc,
+                (unsigned long) out_len, (unsigned long) n
+            );
+            rc = AXL_FAILURE;
+            break;
+        }
+
+        if (axl_pwrite_all(dst_file, dst_fd, out, out_len, (off_t) start) != AXL_SUCCESS) {
+            rc = AXL_FAILURE;
+            break;
+        }
+    }
+
+    axl_buf_put(in);
+    axl_buf_put(out);
+
+    return rc;
+}
+
+/* Restore the length bytes at offset of the original of src_file to the
+ * same offset in dst_file */
+int axl_decompress_range(
+    const char* src_file,
+    const char* dst_file,
+    const struct axl_zindex* zi,
+    const struct axl_copy_opts* opts,
+    off_t offset,
+    off_t length)
+{
+    uint64_t first = (uint64_t) offset / zi->block_size;
+    uint64_t last  = ((uint64_t) (offset + length) + zi->block_size - 1) /
+                     zi->block_size;
+    if (last > zi->count) {
+        last = zi->count;
+    }
+
+    int src_fd = axl_open(src_file, O_RDONLY);
+    if (src_fd < 0) {
+        AXL_ERR("Opening file to decompress: axl_open(%s) errno=%d %s",
+            src_file, errno, strerror(errno)
+        );
+        return AXL_FAILURE;
+    }
+
+    int dst_fd = axl_open(dst_file, O_WRONLY);
+    if (dst_fd < 0) {
+        AXL_ERR("Opening file for writing: axl_open(%s) errno=%d %s",
+            dst_file, errno, strerror(errno)
+        );
+        close(src_fd);
+        return AXL_FAILURE;
+    }
+
+    int rc = axl_decompress_blocks(src_file, src_fd, dst_file, dst_fd,
+        zi, opts, first, last);
+
+    close(src_fd);
+    if (close(dst_fd) != 0) {
+        AXL_ERR("Closing file %s: errno=%d %s", dst_file, errno, strerror(errno));
+        rc = AXL_FAILURE;
+    }
+
+    return rc;
+}
+
+/* compress src_file to dst_file on one thread */
+int axl_compress_file(const char* src_file, const char* dst_file,
+    const struct axl_copy_opts* opts)
+{
+    struct stat statbuf;
+    if (stat(src_file, &statbuf) != 0) {
+        AXL_ERR("Failed to stat %s: errno=%d %s", src_file, errno, strerror(errno));
+        return AXL_FAILURE;
+    }
+
+    struct axl_zwriter* zw = axl_zwriter_open(dst_file, statbuf.st_size, opts);
+    if (! zw) {
+        return AXL_FAILURE;
+    }
+
+    int rc = axl_compress_range(src_file, zw, opts, 0, statbuf.st_size);
+    rc = axl_zwriter_close(zw, rc);
+
+    /* a partly compressed file is no use, since we can't resume it */
+    if (rc != AXL_SUCCESS) {
+        axl_file_unlink(dst_file);
+    }
+
+    return rc;
+}
+
+/* restore src_file, a compressed file, to dst_file on one thread */
+int axl_decompress_file(const char* src_file, const char* dst_file,
+    const struct axl_copy_opts* opts)
+{
+    struct axl_zindex* zi = axl_zindex_read(src_file);
+    if (! zi) {
+        return AXL_FAILURE;
+    }
+
+    int rc = AXL_FAILURE;
+    int src_fd = axl_open(src_file, O_RDONLY);
+    if (src_fd >= 0) {
+        mode_t mode_file = axl_getmode(1, 1, 0);
+        int dst_fd = axl_open(dst_file, O_WRONLY | O_CREAT | O_TRUNC, mode_file);
+        if (dst_fd >= 0) {
+            rc = axl_decompress_blocks(src_file, src_fd, dst_file, dst_fd,
+                zi, opts, 0, zi->count);
+            if (axl_copy_close(dst_file, dst_fd, opts, 1) != AXL_SUCCESS) {
+                rc = AXL_FAILURE;
+            }
+            if (rc != AXL_SUCCESS) {
+                axl_file_unlink(dst_file);
+            }
+        } else {
+            AXL_ERR("Opening file for writing: axl_open(%s) errno=%d %s",
+                dst_file, errno, strerror(errno)
+            );
+        }
+        close(src_fd);
+    } else {
+        AXL_ERR("Opening file to decompress: axl_open(%s) errno=%d %s",
+            src_file, errno, strerror(errno)
+        );
+    }
+
+    axl_zindex_free(zi);
+
+    return rc;
+}
@@ -0,0 +1,328 @@
+/* Delta copies, for the DELTA_SIZE option.
+ *
+ * Applications often write each checkpoint over the files of the last one,
+ * with much of the data unchanged.  A delta copy updates an existing
+ * destination file in place: it reads the source in blocks, and writes only
+ * the blocks whose checksums differ from the ones saved for the destination
+ * by the last delta copy.  The checksums are kept next to the destination,
+ * in a file with the same name plus AXL_DELTA_SUFFIX, laid out as:
+ *
+ *   header   "AXLD", format version, block size, size and mtime of the
+ *            destination when the checksums were saved
+ *   sums     for each block, its CRC32C and its CRC32
+ *
+ * All numbers are little-endian.  Two different checksums make it very
+ * unlikely that a changed block is taken for an unchanged one.  If the
+ * destination's size or mtime no longer match the header, someone else
+ * has written to it, so the checksums aren't used and every block is
+ * written. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "axl_internal.h"
+
+#define AXL_DELTA_SUFFIX  ".axlsum"
+#define AXL_DELTA_MAGIC   "AXLD"
+#define AXL_DELTA_VERSION (1)
+
+/* header: magic, version, block size, size, mtime secs, mtime nsecs */
+#define AXL_DELTA_HEADER_SIZE (4 + 4 + 8 + 8 + 8 + 8)
+
+/* per block: crc32c, crc32 */
+#define AXL_DELTA_SUM_SIZE (4 + 4)
+
+/* The checksums of a file's blocks */
+struct axl_delta_sums {
+    uint64_t block_size;
+    uint64_t size;
+    uint64_t count;
+    unsigned char* sums;   /* count entries of AXL_DELTA_SUM_SIZE bytes */
+};
+
+static char* axl_delta_sums_file(const char* dst_file)
+{
+    char* file = NULL;
+    if (asprintf(&file, "%s%s", dst_file, AXL_DELTA_SUFFIX) < 0) {
+        return NULL;
+    }
+    return file;
+}
+
+static void axl_delta_header(unsigned char* header, uint64_t block_size,
+    const struct stat* sb)
+{
+    memcpy(header, AXL_DELTA_MAGIC, 4);
+    axl_put_le32(header + 4, AXL_DELTA_VERSION);
+    axl_put_le64(header + 8, block_size);
+    axl_put_le64(header + 16, (uint64_t) sb->st_size);
+#if defined(__APPLE__)
+    axl_put_le64(header + 24, (uint64_t) sb->st_mtimespec.tv_sec);
+    axl_put_le64(header + 32, (uint64_t) sb->st_mtimespec.tv_nsec);
+#else
+    axl_put_le64(header + 24, (uint64_t) sb->st_mtim.tv_sec);
+    axl_put_le64(header + 32, (uint64_t) sb->st_mtim.tv_nsec);
+#endif
+}
+
+/* Load the checksums saved for the destination open as dst_fd, if they
+ * were computed with block_size and the destination hasn't changed since.
+ * Otherwise, or on error, leave old empty. */
+static void axl_delta_load(const char* sums_file, int dst_fd,
+    uint64_t block_size, struct axl_delta_sums* old)
+{
+    memset(old, 0, sizeof(*old));
+
+    struct stat dst_sb;
+    if (fstat(dst_fd, &dst_sb) != 0) {
+        return;
+    }
+
+    int fd = open(sums_file, O_RDONLY);
+    if (fd < 0) {
+        /* the destination was never delta copied */
+        return;
+    }
+
+    unsigned char header[AXL_DELTA_HEADER_SIZE];
+    unsigned char expect[AXL_DELTA_HEADER_SIZE];
+    axl_delta_header(expect, block_size, &dst_sb);
+
+    struct stat sb;
+    uint64_t count = ((uint64_t) dst_sb.st_size + block_size - 1) / block_size;
+    if (fstat(fd, &sb) != 0 ||
+        (uint64_t) sb.st_size != AXL_DELTA_HEADER_SIZE + count * AXL_DELTA_SUM_SIZE ||
+        axl_pread_all(sums_file, fd, header, sizeof(header), 0) != AXL_SUCCESS ||
+        memcmp(header, expect, sizeof(header)) != 0)
+    {
+        AXL_DBG(2, "Checksums in %s are out of date, writing the whole file",
+            sums_file);
+        close(fd);
+        return;
+    }
+
+    unsigned char* sums = NULL;
+    if (count > 0) {
+        sums = malloc(count * AXL_DELTA_SUM_SIZE);
+        if (! sums || axl_pread_all(sums_file, fd, sums,
+            count * AXL_DELTA_SUM_SIZE, AXL_DELTA_HEADER_SIZE) != AXL_SUCCESS)
+        {
+            free(sums);
+            close(fd);
+            return;
+        }
+    }
+    close(fd);
+
+    old->block_size = block_size;
+    old->size       = (uint64_t) dst_sb.st_size;
+    old->count      = count;
+    old->sums       = sums;
+}
+
+/* Save the checksums of the destination open as dst_fd, which has been
+ * synced */
+static int axl_delta_save(const char* sums_file, int dst_fd,
+    const struct axl_delta_sums* sums)
+{
+    struct stat dst_sb;
+    if (fstat(dst_fd, &dst_sb) != 0) {
+        AXL_ERR("Failed to stat destination for %s: errno=%d %s",
+            sums_file, errno, strerror(errno)
+        );
+        return AXL_FAILURE;
+    }
+
+    mode_t mode_file = axl_getmode(1, 1, 0);
+    int fd = axl_open(sums_file, O_WRONLY | O_CREAT | O_TRUNC, mode_file);
+    if (fd < 0) {
+        AXL_ERR("Opening file for writing: axl_open(%s) errno=%d %s",
+            sums_file, errno, strerror(errno)
+        );
+        return AXL_FAILURE;
+    }
+
+    unsigned char header[AXL_DELTA_HEADER_SIZE];
+    axl_delta_header(header, sums->block_size, &dst_sb);
+
+    int rc = axl_pwrite_all(sums_file, fd, header, sizeof(header), 0);
+    if (rc == AXL_SUCCESS && sums->count > 0) {
+        rc = axl_pwrite_all(sums_file, fd, sums->sums,
+            sums->count * AXL_DELTA_SUM_SIZE, AXL_DELTA_HEADER_SIZE);
+    }
+    if (axl_close(sums_file, fd) != AXL_SUCCESS) {
+        rc = AXL_FAILURE;
+    }
+    if (rc != AXL_SUCCESS) {
+        axl_file_unlink(sums_file);
+    }
+    return rc;
+}
+
+/* Copy src_file over dst_file, writing only the blocks that changed since
+ * the last delta copy to dst_file */
+int axl_delta_copy(const char* src_file, const char* dst_file,
+    const struct axl_copy_opts* opts)
+{
+    uint64_t block_size = opts->delta_size;
+
+    char* sums_file = axl_delta_sums_file(dst_file);
+    if (! sums_file) {
+        return AXL_FAILURE;
+    }
+
+    int src_fd = axl_open(src_file, O_RDONLY);
+    if (src_fd < 0) {
+        AXL_ERR("Opening file to copy: axl_open(%s) errno=%d %s",
+            src_file, errno, strerror(errno)
+        );
+        free(sums_file);
+        return AXL_FAILURE;
+    }
+
+    mode_t mode_file = axl_getmode(1, 1, 0);
+    int dst_fd = axl_open(dst_file, O_WRONLY | O_CREAT, mode_file);
+    if (dst_fd < 0) {
+        AXL_ERR("Opening file for writing: axl_open(%s) errno=%d %s",
+            dst_file, errno, strerror(errno)
+        );
+        close(src_fd);
+        free(sums_file);
+        return AXL_FAILURE;
+    }
+
+    /* Load the old checksums, then remove them, since they no longer
+     * describe the destination once we start writing to it */
+    struct axl_delta_sums old;
+    axl_delta_load(sums_file, dst_fd, block_size, &old);
+    unlink(sums_file);
+
+    struct stat src_sb;
+    struct axl_delta_sums sums = { .block_size = block_size };
+    unsigned char* buf = NULL;
+    int rc = AXL_FAILURE;
+    if (fstat(src_fd, &src_sb) != 0) {
+        AXL_ERR("Failed to stat %s: errno=%d %s", src_file, errno, strerror(errno));
+        goto out;
+    }
+    sums.size  = (uint64_t) src_sb.st_size;
+    sums.count = (sums.size + block_size - 1) / block_size;
+    if (sums.count > 0) {
+        sums.sums = malloc(sums.count * AXL_DELTA_SUM_SIZE);
+    }
+    buf = (unsigned char*) axl_buf_get(block_size);
+    if ((sums.count > 0 && ! sums.sums) || ! buf) {
+        AXL_ERR("Allocating buffers to copy %s", src_file);
+        goto out;
+    }
+
+#if !defined(__APPLE__)
+    /* we read the source once, front to back */
+    posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    uint64_t written = 0;
+    uint64_t i;
+    for (i = 0; i < sums.count; i++) {
+        if (opts->cancel && *opts->cancel) {
+            goto out;
+        }
+
+        uint64_t start = i * block_size;
+        size_t n = (size_t) AXL_MIN(block_size, sums.size - start);
+        if (axl_pread_all(src_file, src_fd, buf, n, (off_t) start) != AXL_SUCCESS) {
+            goto out;
+        }
+
+        unsigned char* sum = sums.sums + i * AXL_DELTA_SUM_SIZE;
+        axl_put_le32(sum, axl_hash(AXL_CRC_CRC32C, 0, buf, n));
+        axl_put_le32(sum + 4, axl_hash(AXL_CRC_CRC32, 0, buf, n));
+
+        /* the old block must be the same length, as well as match */
+        if (i < old.count && AXL_MIN(block_size, old.size - start) == n &&
+            memcmp(sum, old.sums + i * AXL_DELTA_SUM_SIZE, AXL_DELTA_SUM_SIZE) == 0)
+        {
+            continue;
+        }
+
+        if (axl_pwrite_all(dst_file, dst_fd, buf, n, (off_t) start) != AXL_SUCCESS) {
+            goto out;
+        }
+        written++;
+    }
+
+    /* drop anything past the end of the source */
+    struct stat dst_sb;
+    if (fstat(dst_fd, &dst_sb) != 0 ||
+        ((uint64_t) dst_sb.st_size != sums.size &&
+         ftruncate(dst_fd, (off_t) sums.size) != 0))
+    {
+        AXL_ERR("Failed to truncate %s: errno=%d %s", dst_file, errno, strerror(errno));
+        goto out;
+    }
+
+    /* sync the data unless the policy leaves that to AXL_Wait() or to the
+     * kernel */
+    if ((opts->sync == AXL_SYNC_ALL || opts->sync == AXL_SYNC_DEST) &&
+        fsync(dst_fd) != 0)
+    {
+        AXL_ERR("Failed to fsync %s: errno=%d %s", dst_file, errno, strerror(errno));
+        goto out;
+    }
+
+    AXL_DBG(2, "Delta copy of %s to %s wrote %lu of %lu blocks",
+        src_file, dst_file, (unsigned long) written, (unsigned long) sums.count);
+
+    /* The copy succeeded even if we can't save the checksums, the next
+     * delta copy will just write the whole file */
+    axl_delta_save(sums_file, dst_fd, &sums);
+    rc = AXL_SUCCESS;
+
+out:
+    axl_buf_put(buf);
+    free(sums.sums);
+    free(old.sums);
+    close(src_fd);
+    if (close(dst_fd) != 0) {
+        AXL_ERR("Closing file %s: errno=%d %s", dst_file, errno, strerror(errno));
+        rc = AXL_FAILURE;
+    }
+    free(sums_file);
+
+    return rc;
+}
+
+/* Record dst_file's current timestamp in its saved checksums */
+int axl_delta_stamp(const char* dst_file)
+{
+    char* sums_file = axl_delta_sums_file(dst_file);
+    if (! sums_file) {
+        return AXL_FAILURE;
+    }
+
+    int rc = AXL_FAILURE;
+    struct stat dst_sb;
+    unsigned char header[AXL_DELTA_HEADER_SIZE];
+    int fd = open(sums_file, O_RDWR);
+    if (fd >= 0) {
+        if (stat(dst_file, &dst_sb) == 0 &&
+            axl_pread_all(sums_file, fd, header, sizeof(header), 0) == AXL_SUCCESS &&
+            memcmp(header, AXL_DELTA_MAGIC, 4) == 0 &&
+            axl_get_le64(header + 16) == (uint64_t) dst_sb.st_size)
+        {
+            axl_delta_header(header, axl_get_le64(header + 8), &dst_sb);
+            rc = axl_pwrite_all(sums_file, fd, header, sizeof(header), 0);
+        }
+        if (axl_close(sums_file, fd) != AXL_SUCCESS) {
+            rc = AXL_FAILURE;
+        }
+    }
+
+    free(sums_file);
+    return rc;
+}
@@ -0,0 +1,286 @@
+/* Checksum kernels used to compute file CRCs while copying.
+ *
+ * There is a portable kernel for each algorithm, plus kernels that use
+ * x86 instructions where the CPU has them: carry-less multiplication
+ * (PCLMULQDQ) to fold CRC32 16 bytes at a time, and SSE4.2's crc32
+ * instruction for CRC32C.  axl_hash_init() checks the CPU once and picks
+ * the fastest usable kernel for each algorithm.
+ *
+ * All kernels follow zlib's convention: start with a crc of 0, and pass
+ * the value returned for one buffer in with the next. */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <zlib.h>
+
+#include "config.h"
+#include "axl_internal.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define AXL_HASH_X86 1
+#include <immintrin.h>
+#endif
+
+/* zlib takes a uInt length, so feed it large buffers in pieces */
+#define AXL_HASH_ZLIB_MAX (1UL << 30)
+
+static uint32_t axl_hash_crc32_zlib(uint32_t crc, const unsigned char* buf, size_t len)
+{
+    while (len > 0) {
+        size_t n = AXL_MIN(len, AXL_HASH_ZLIB_MAX);
+        crc = (uint32_t) crc32(crc, buf, (uInt) n);
+        buf += n;
+        len -= n;
+    }
+    return crc;
+}
+
+/* Slice-by-8 tables for CRC32C (Castagnoli, reflected polynomial
+ * 0x82F63B78), filled in by axl_hash_init() */
+static uint32_t axl_crc32c_table[8][256];
+
+static void axl_crc32c_table_init(void)
+{
+    int i, j;
+    for (i = 0; i < 256; i++) {
+        uint32_t crc = (uint32_t) i;
+        for (j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? 0x82F63B78 : 0);
+        }
+        axl_crc32c_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++) {
+        for (j = 1; j < 8; j++) {
+            uint32_t prev = axl_crc32c_table[j - 1][i];
+            axl_crc32c_table[j][i] = (prev >> 8) ^ axl_crc32c_table[0][prev & 0xff];
+        }
+    }
+}
+
+static uint32_t axl_hash_crc32c_sw(uint32_t crc, const unsigned char* buf, size_t len)
+{
+    crc = ~crc;
+
+    while (len > 0 && ((uintptr_t) buf & 7) != 0) {
+        crc = (crc >> 8) ^ axl_crc32c_table[0][(crc ^ *buf++) & 0xff];
+        len--;
+    }
+
+    while (len >= 8) {
+        /* the tables assume little-endian loads */
+        uint32_t lo = crc ^ ((uint32_t) buf[0] | (uint32_t) buf[1] << 8 |
+                             (uint32_t) buf[2] << 16 | (uint32_t) buf[3] << 24);
+        uint32_t hi = (uint32_t) buf[4] | (uint32_t) buf[5] << 8 |
+                      (uint32_t) buf[6] << 16 | (uint32_t) buf[7] << 24;
+        crc = axl_crc32c_table[7][lo & 0xff] ^
+              axl_crc32c_table[6][(lo >> 8) & 0xff] ^
+              axl_crc32c_table[5][(lo >> 16) & 0xff] ^
+              axl_crc32c_table[4][lo >> 24] ^
+              axl_crc32c_table[3][hi & 0xff] ^
+              axl_crc32c_table[2][(hi >> 8) & 0xff] ^
+              axl_crc32c_table[1][(hi >> 16) & 0xff] ^
+              axl_crc32c_table[0][hi >> 24];
+        buf += 8;
+        len -= 8;
+    }
+
+    while (len > 0) {
+        crc = (crc >> 8) ^ axl_crc32c_table[0][(crc ^ *buf++) & 0xff];
+        len--;
+    }
+
+    return ~crc;
+}
+
+#ifdef AXL_HASH_X86
+__attribute__((target("sse4.2")))
+static uint32_t axl_hash_crc32c_sse42(uint32_t crc, const unsigned char* buf, size_t len)
+{
+    uint64_t c = ~crc;
+
+    while (len > 0 && ((uintptr_t) buf & 7) != 0) {
+        c = _mm_crc32_u8((uint32_t) c, *buf++);
+        len--;
+    }
+
+    /* the crc32 instruction has a latency of 3 cycles, unroll so the
+     * loads don't add to it */
+    while (len >= 32) {
+        c = _mm_crc32_u64(c, *(const uint64_t*) (buf + 0));
+        c = _mm_crc32_u64(c, *(const uint64_t*) (buf + 8));
+        c = _mm_crc32_u64(c, *(const uint64_t*) (buf + 16));
+        c = _mm_crc32_u64(c, *(const uint64_t*) (buf + 24));
+        buf += 32;
+        len -= 32;
+    }
+    while (len >= 8) {
+        c = _mm_crc32_u64(c, *(const uint64_t*) buf);
+        buf += 8;
+        len -= 8;
+    }
+
+    while (len > 0) {
+        c = _mm_crc32_u8((uint32_t) c, *buf++);
+        len--;
+    }
+
+    return ~(uint32_t) c;
+}
+
+/* Folding constants for the CRC32 polynomial, from Intel's "Fast CRC
+ * Computation for Generic Polynomials Using PCLMULQDQ Instruction" */
+static const uint64_t axl_crc32_k1k2[2] __attribute__((aligned(16))) = { 0x0154442bd4, 0x01c6e41596 };
+static const uint64_t axl_crc32_k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0, 0x00ccaa009e };
+static const uint64_t axl_crc32_k5k0[2] __attribute__((aligned(16))) = { 0x0163cd6124, 0x0000000000 };
+static const uint64_t axl_crc32_poly[2] __attribute__((aligned(16))) = { 0x01db710641, 0x01f7011641 };
+
+/* Fold len bytes into the inverted crc, len must be a multiple of 16 and
+ * at least 64 */
+__attribute__((target("sse4.1,pclmul")))
+static uint32_t axl_crc32_fold(uint32_t crc, const unsigned char* buf, size_t len)
+{
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+    __m128i y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i*) (buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*) (buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*) (buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*) (buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int) crc));
+
+    x0 = _mm_load_si128((const __m128i*) axl_crc32_k1k2);
+    buf += 64;
+    len -= 64;
+
+    /* fold 512 bits at a time */
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+        y5 = _mm_loadu_si128((const __m128i*) (buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i*) (buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i*) (buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i*) (buf + 0x30));
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+        buf += 64;
+        len -= 64;
+    }
+
+    /* fold the four lanes into one */
+    x0 = _mm_load_si128((const __m128i*) axl_crc32_k3k4);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    /* then the remaining 128 bit blocks */
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i*) buf);
+
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+        buf += 16;
+        len -= 16;
+    }
+
+    /* fold 128 bits down to 64 */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x0 = _mm_loadl_epi64((const __m128i*) axl_crc32_k5k0);
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* and Barrett reduce to 32 */
+    x0 = _mm_load_si128((const __m128i*) axl_crc32_poly);
+
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return (uint32_t) _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t axl_hash_crc32_pclmul(uint32_t crc, const unsigned char* buf, size_t len)
+{
+    if (len >= 64) {
+        size_t n = len & ~(size_t) 15;
+        crc = ~axl_crc32_fold(~crc, buf, n);
+        buf += n;
+        len -= n;
+    }
+    return axl_hash_crc32_zlib(crc, buf, len);
+}
+#endif /* AXL_HASH_X86 */
+
+struct axl_hash_kernel axl_hash_kernels[] = {
+#ifdef AXL_HASH_X86
+    { "crc32-pclmul", AXL_CRC_CRC32,  axl_hash_crc32_pclmul, 0 },
+    { "crc32c-sse42", AXL_CRC_CRC32C, axl_hash_crc32c_sse42, 0 },
+#endif
+    { "crc32-zlib",   AXL_CRC_CRC32,  axl_hash_crc32_zlib,   1 },
+    { "crc32c-sw",    AXL_CRC_CRC32C, axl_hash_crc32c_sw,    1 },
+    { NULL,           AXL_CRC_NONE,   NULL,                  0 },
+};
+
+/* the kernel we use for each algorithm, indexed by axl_crc_t */
+static axl_hash_fn axl_hash_best[AXL_CRC_CRC32C + 1];
+
+void axl_hash_init(void)
+{
+    axl_crc32c_table_init();
+
+#ifdef AXL_HASH_X86
+    __builtin_cpu_init();
+    axl_hash_kernels[0].usable = __builtin_cpu_supports("pclmul") &&
+                                 __builtin_cpu_supports("sse4.1");
+    axl_hash_kernels[1].usable = __builtin_cpu_supports("sse4.2") != 0;
+#endif
+
+    /* the kernels are listed fastest first */
+    int i;
+    for (i = AXL_CRC_NONE; i <= AXL_CRC_CRC32C; i++) {
+        axl_hash_best[i] = NULL;
+    }
+    struct axl_hash_kernel* k;
+    for (k = axl_hash_kernels; k->name != NULL; k++) {
+        if (k->usable && axl_hash_best[k->algo] == NULL) {
+            axl_hash_best[k->algo] = k->fn;
+            AXL_DBG(2, "Using %s checksum kernel", k->name);
+        }
+    }
+}
+
+uint32_t axl_hash(int algo, uint32_t crc, const void* buf, size_t len)
+{
+    return axl_hash_best[algo](crc, (const unsigned char*) buf, len);
+}
@@ -6,6 +6,8 @@
 
 #include <zlib.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <sys/stat.h>
 #include "axl.h"
 
 #include "kvtree.h"
@@ -14,6 +16,8 @@
 #define AXL_SUCCESS (0)
 #define AXL_FAILURE (-1)
 
+#define AXL_MIN(a,b) (a < b ? a : b)
+
 /* unless otherwise indicated all global variables defined in this file must
  * only be accessed by the main thread */
 
@@ -44,6 +48,47 @@ extern int axl_make_directories;
 /* global rank of calling process, used for BBAPI */
 extern int axl_rank;
 
+/* default engine used by axl_file_copy() to move file data,
+ * one of the axl_copy_engine_t values */
+extern int axl_copy_engine;
+
+/* whether axl_file_copy() should bypass the page cache with O_DIRECT */
+extern int axl_direct_io;
+
+/* order in which the pthread transfer copies files,
+ * one of the axl_schedule_t values */
+extern int axl_schedule;
+
+/* checksum axl_file_copy() computes for each file it copies,
+ * one of the axl_crc_t values */
+extern int axl_crc;
+
+/* size of the blocks whose checksums axl_file_copy() records in each file's
+ * manifest, 0 for no manifest */
+extern unsigned long axl_manifest_size;
+
+/* whether axl_file_copy() compresses or decompresses the files it copies,
+ * one of the axl_compress_t values */
+extern int axl_compress;
+
+/* size of the blocks axl_file_copy() compares to update an existing
+ * destination file in place, 0 to copy whole files */
+extern unsigned long axl_delta_size;
+
+/* files smaller than this are packed into a container in their destination
+ * directory instead of being copied, 0 to copy every file */
+extern unsigned long axl_pack_size;
+
+/* when files copied are synced to disk, one of the axl_sync_t values */
+extern int axl_sync_policy;
+
+/* bytes of copied data a file may leave dirty in the page cache before
+ * the copy writes it back, 0 to leave writeback to the kernel */
+extern unsigned long axl_write_behind_size;
+
+/* format of the state file, one of the axl_state_format_t values */
+extern int axl_state_format;
+
 /* "KEYS" */
 #define AXL_KEY_UNAME         ("NAME")
 #define AXL_KEY_XFER_TYPE     ("TYPE")
@@ -53,7 +98,11 @@ extern int axl_rank;
 #define AXL_KEY_FILE_DEST     ("DEST")
 #define AXL_KEY_FILE_STATUS   ("STATUS")
 #define AXL_KEY_FILE_CRC      ("CRC")
+#define AXL_KEY_FILE_MANIFEST ("MANIFEST")
+#define AXL_KEY_FILE_PACK     ("PACK")
+#define AXL_KEY_FILE_CHUNKS   ("CHUNKS")
 #define AXL_KEY_STATE_FILE    ("STATE_FILE")
+#define AXL_KEY_STATE_JOURNAL ("JOURNAL")
 
 /* TRANSFER STATUS */
 #define AXL_STATUS_SOURCE (1)
@@ -85,6 +134,13 @@ void axl_abort(int rc, const char* fmt, ...);
 /* Write the state file for an id */
 void axl_write_state_file(int id);
 
+/* Record the element of src in the file list of id, or just its key
+ * subtree if key is set, or just the subkey subtree of that if subkey is
+ * also set, in the journal of the state file, which is much cheaper than
+ * writing the whole state file after every change */
+void axl_write_state_record(int id, const char* src, const char* key,
+    const char* subkey);
+
 /*
 =========================================
 axl_io.c functions
@@ -127,20 +183,341 @@ ssize_t axl_read_attempt(const char* file, int fd, void* buf, unsigned long size
 /* make a good attempt to write to file (retries, if necessary, return error if fail) */
 ssize_t axl_write_attempt(const char* file, int fd, const void* buf, unsigned long size);
 
-/* copy a file from src to dst */
+/* pread() all of count bytes at offset, retrying short reads.  Fails on an
+ * error, or if the file ends first. */
+int axl_pread_all(const char* file, int fd, void* buf, size_t count, off_t offset);
+
+/* pwrite() all of count bytes at offset, retrying short writes */
+int axl_pwrite_all(const char* file, int fd, const void* buf, size_t count, off_t offset);
+
+/* number of bytes after which transfers pause, set by AXL_DEBUG_PAUSE_AFTER
+ * for tests, returns ULONG_MAX if not set */
+unsigned long axl_debug_pause_after(void);
+
+/* per-transfer options that control how axl_file_copy() moves data */
+struct axl_copy_opts {
+    /* size of the user-space buffer for read()/write() copies */
+    unsigned long buf_size;
+
+    /* preferred engine, one of the axl_copy_engine_t values */
+    int engine;
+
+    /* whether to try O_DIRECT before the engine */
+    int direct;
+
+    /* checksum to compute on the data as it's copied, one of the axl_crc_t
+     * values.  This means copying through a user-space buffer rather than
+     * with the engine. */
+    int crc;
+
+    /* if set, the copy stops early once this becomes nonzero */
+    const volatile int* cancel;
+
+    /* if set, axl_file_copy_range() calls this before each step with the
+     * offset it has copied up to and the number of bytes it wants to copy
+     * next.  It returns how many of those bytes the copy may take, or 0 once
+     * the range is done, which lets another thread take over the end of a
+     * range that is copying slowly. */
+    off_t (*claim)(void* arg, off_t offset, off_t want);
+    void* claim_arg;
+
+    /* if nonzero, each step claims at most this many bytes, so the rest of
+     * the range stays free for another thread to take over */
+    off_t claim_step;
+
+    /* If manifest is set, axl_file_copy() records the CRC32C of each
+     * manifest_size block of the file in it as the block is synced to disk,
+     * by calling manifest_update() so that the caller can save the state
+     * file.  When resuming, it checks the last recorded blocks against the
+     * destination and continues after the last one that matches.  Like crc,
+     * this means copying through a user-space buffer. */
+    unsigned long manifest_size;
+    kvtree* manifest;
+    void (*manifest_update)(void* arg, kvtree* manifest,
+        unsigned long block, const uint32_t* crc);
+    void* manifest_arg;
+
+    /* whether to compress or decompress the file, one of the axl_compress_t
+     * values.  Compressed copies ignore crc and manifest_size. */
+    int compress;
+
+    /* If set, an existing destination file is updated in place by writing
+     * only the delta_size blocks whose checksums differ from the ones saved
+     * by the last copy, see axl_delta.c.  Ignored when compressing, and
+     * like compress, this ignores crc and manifest_size. */
+    unsigned long delta_size;
+
+    /* when to sync the files, one of the axl_sync_t values.  Manifest
+     * blocks are synced as they're recorded regardless. */
+    int sync;
+
+    /* If set, axl_file_copy() and axl_file_copy_range() write back the
+     * destination as they go, so that no more than about this many bytes
+     * of it are dirty in the page cache at once */
+    unsigned long write_behind;
+};
+
+/* fill in copy options from the values recorded in a transfer's kvtree */
+int axl_copy_opts_load(const kvtree* file_list, struct axl_copy_opts* opts);
+
+/* close fd, which a copy read from, or wrote to if dst is set, first
+ * syncing it if opts->sync asks for that */
+int axl_copy_close(const char* file, int fd, const struct axl_copy_opts* opts, int dst);
+
+/* copy a file from src to dst, and if opts->crc is set, store the file's
+ * checksum in crc */
 int axl_file_copy(
     const char* src_file,
     const char* dst_file,
-    unsigned long buf_size,
-    int resume
+    const struct axl_copy_opts* opts,
+    int resume,
+    uLong* crc
 );
 
+/* create file of size bytes (truncating it unless resume is set) so that
+ * byte ranges can be written to it in any order, and unless the source has
+ * holes to keep (sparse is set), reserve the blocks for it */
+int axl_file_preallocate(const char* file, off_t size, int resume, int sparse);
+
+/* returns 1 if the file has holes worth skipping when copying it */
+int axl_stat_sparse(const struct stat* sb);
+
+/* reserve blocks for fd, which is writing file, from offset up to size
+ * without changing its size, and return the end of the reservation */
+off_t axl_file_reserve(const char* file, int fd, off_t offset, off_t size);
+
+/* copy length bytes at offset in src_file to the same offset in dst_file,
+ * which must already exist, without syncing dst_file.  If opts->claim is
+ * set, the range may end early at the offset it returns 0 for. */
+int axl_file_copy_range(
+    const char* src_file,
+    const char* dst_file,
+    const struct axl_copy_opts* opts,
+    off_t offset,
+    off_t length
+);
+
+/* record crc as the checksum of the given block in a file's manifest, or if
+ * crc is NULL, forget that block and every block after it */
+void axl_manifest_update(kvtree* manifest, unsigned long block, const uint32_t* crc);
+
+/* axl_manifest_update() the manifest of src in the file list of id, and
+ * record just that change in the journal of its state file */
+void axl_manifest_record(int id, const char* src, kvtree* manifest,
+    unsigned long block, const uint32_t* crc);
+
 /* opens, reads, and computes the crc32 value for the given filename */
 int axl_crc32(const char* filename, uLong* crc);
 
 /* given a filename, return number of bytes in file */
 unsigned long axl_file_size(const char* file);
 
+/*
+=========================================
+axl_hash.c functions
+========================================
+*/
+
+/* a checksum kernel, takes and returns crc values like zlib's crc32() */
+typedef uint32_t (*axl_hash_fn)(uint32_t crc, const unsigned char* buf, size_t len);
+
+struct axl_hash_kernel {
+    const char* name;
+    int algo;     /* one of the axl_crc_t values */
+    axl_hash_fn fn;
+    int usable;   /* set by axl_hash_init() if this CPU can run it */
+};
+
+/* every kernel we have, fastest first, terminated by a NULL name */
+extern struct axl_hash_kernel axl_hash_kernels[];
+
+/* check which kernels this CPU can run and pick the fastest ones,
+ * must be called before axl_hash() */
+void axl_hash_init(void);
+
+/* update crc, which starts at 0, with len bytes of buf using the
+ * fastest kernel for algo (AXL_CRC_CRC32 or AXL_CRC_CRC32C) */
+uint32_t axl_hash(int algo, uint32_t crc, const void* buf, size_t len);
+
+/*
+=========================================
+axl_compress.c functions
+========================================
+*/
+
+/* Size of the blocks files are compressed in, unless overridden by the
+ * AXL_COMPRESS_BLOCK_SIZE environment variable */
+#define AXL_COMPRESS_BLOCK_SIZE (1024UL * 1024UL)
+
+/* One block of a compressed file */
+struct axl_zblock {
+    uint64_t offset;   /* where its zlib stream starts in the compressed file */
+    uint32_t length;   /* length of its zlib stream */
+    uint32_t crc;      /* CRC32C of its uncompressed data */
+};
+
+/* The index of a compressed file */
+struct axl_zindex {
+    uint64_t block_size;       /* size of each block, except maybe the last */
+    uint64_t size;             /* size of the original file */
+    uint64_t count;            /* number of blocks */
+    struct axl_zblock* blocks;
+};
+
+/* A compressed file whose blocks are being written */
+struct axl_zwriter;
+
+/* Create dst_file, write its header, and return a writer for the blocks of
+ * a size-byte file, or NULL on error.  opts->sync says whether closing the
+ * writer syncs the file. */
+struct axl_zwriter* axl_zwriter_open(const char* dst_file, off_t size,
+    const struct axl_copy_opts* opts);
+
+/* block size the writer compresses with */
+off_t axl_zwriter_block_size(const struct axl_zwriter* zw);
+
+/* Compress the blocks in the length bytes at offset in src_file into zw.
+ * offset must be on a block boundary, and length must be a multiple of the
+ * block size or run to the end of the file.  Threads may compress different
+ * ranges into the same writer at once. */
+int axl_compress_range(
+    const char* src_file,
+    struct axl_zwriter* zw,
+    const struct axl_copy_opts* opts,
+    off_t offset,
+    off_t length
+);
+
+/* Once every block is written, write the index, sync and close the file, and
+ * free zw.  If rc isn't AXL_SUCCESS, only close the file and free zw.
+ * Returns AXL_SUCCESS if the file is complete. */
+int axl_zwriter_close(struct axl_zwriter* zw, int rc);
+
+/* read the index of compressed file src_file, returns NULL on error */
+struct axl_zindex* axl_zindex_read(const char* src_file);
+
+/* free an index from axl_zindex_read() */
+void axl_zindex_free(struct axl_zindex* zi);
+
+/* Restore the length bytes at offset of the original of compressed file
+ * src_file, described by zi, to the same offset in dst_file, which must
+ * already exist, without syncing dst_file.  offset and length are aligned
+ * as for axl_compress_range(). */
+int axl_decompress_range(
+    const char* src_file,
+    const char* dst_file,
+    const struct axl_zindex* zi,
+    const struct axl_copy_opts* opts,
+    off_t offset,
+    off_t length
+);
+
+/* compress or decompress src_file to dst_file, as axl_file_copy() does
+ * when opts->compress is set */
+int axl_compress_file(const char* src_file, const char* dst_file,
+    const struct axl_copy_opts* opts);
+int axl_decompress_file(const char* src_file, const char* dst_file,
+    const struct axl_copy_opts* opts);
+
+/*
+=========================================
+axl_delta.c functions
+========================================
+*/
+
+/* Copy src_file over dst_file, writing only the blocks that changed since
+ * the last delta copy to dst_file, as axl_file_copy() does when
+ * opts->delta_size is set */
+int axl_delta_copy(const char* src_file, const char* dst_file,
+    const struct axl_copy_opts* opts);
+
+/* Record dst_file's current timestamp in its saved checksums, after its
+ * metadata has been set, so that the next delta copy can still use them */
+int axl_delta_stamp(const char* dst_file);
+
+/*
+=========================================
+axl_pack.c functions
+========================================
+*/
+
+/* Whether the file described by elem_hash in a transfer is packed into a
+ * container rather than copied, see axl_init_packs() */
+int axl_pack_is_packed(const kvtree* elem_hash);
+
+/* Get ready to pack files for transfer id, sync is one of the axl_sync_t
+ * values */
+int axl_pack_begin(int id, int sync);
+
+/* Append src_file to the container for dst_file, as part of transfer id.
+ * If opts->crc is set, also store src_file's checksum in crc, like
+ * axl_file_copy() does.  Safe to call from any thread. */
+int axl_pack_file(int id, const char* src_file, const char* dst_file,
+    const struct axl_copy_opts* opts, uLong* crc);
+
+/* Finish the containers of transfer id once no more files will be packed
+ * into them.  If rc is AXL_SUCCESS, write their indexes, otherwise just
+ * remove them.  Returns AXL_SUCCESS if every container is complete, and
+ * does nothing if the transfer isn't packing files. */
+int axl_pack_end(int id, int rc);
+
+/*
+=========================================
+axl_buf.c functions
+========================================
+*/
+
+/* total bytes of copy buffers the pool keeps around for reuse,
+ * 0 to allocate a new buffer for every copy */
+extern unsigned long axl_buf_pool_size;
+
+/* Get a page-aligned buffer of at least size bytes from the pool, or NULL
+ * if we're out of memory.  Safe to call from any thread. */
+void* axl_buf_get(size_t size);
+
+/* Return a buffer from axl_buf_get() to the pool */
+void axl_buf_put(void* buf);
+
+/* Free the buffers the pool is holding on to */
+void axl_buf_finalize(void);
+
+/*
+=========================================
+axl_state.c functions
+========================================
+*/
+
+/* Read state_file, in either state file format, into file_list */
+int axl_state_read_file(const char* state_file, kvtree* file_list);
+
+/* Write file_list to state_file in format, one of the axl_state_format_t
+ * values */
+int axl_state_write_file(const char* state_file, const kvtree* file_list,
+    int format);
+
+/*
+=========================================
+axl_scan.c functions
+========================================
+*/
+
+/* a file found by axl_scan_dir(), and the path it's copied to */
+struct axl_scan_file {
+    char* src;
+    char* dst;
+};
+
+/* List every file under the directory src, at any depth, each with the
+ * path it has under dest, reading subdirectories on several threads.
+ * Returns a list of count files that the caller frees with
+ * axl_scan_free(), or AXL_FAILURE if anything under src can't be read or
+ * isn't a file or directory. */
+int axl_scan_dir(const char* src, const char* dest,
+    struct axl_scan_file** files, size_t* count);
+
+/* Free a list of files from axl_scan_dir() */
+void axl_scan_free(struct axl_scan_file* files, size_t count);
+
 /*
 =========================================
 axl_util.c functions
@@ -184,10 +561,21 @@ int asprintf(char** strp, const char* fmt, ...);
  * and timestamps, record them in provided kvtree */
 int axl_meta_encode(const char* file, kvtree* meta);
 
+/* same as axl_meta_encode, for a file the caller has already stat'd */
+void axl_meta_encode_stat(const struct stat* statbuf, kvtree* meta);
+
 /* copy metadata settings recorded in provided kvtree to specified file */
 int axl_meta_apply(const char* file, const kvtree* meta);
 
 /* Check if a file is the size we expect it to be */
 int axl_check_file_size(const char* file, const kvtree* meta);
 
+/* Store v at p as 4 or 8 little-endian bytes, for on-disk formats */
+void axl_put_le32(unsigned char* p, uint32_t v);
+void axl_put_le64(unsigned char* p, uint64_t v);
+
+/* Load 4 or 8 little-endian bytes from p */
+uint32_t axl_get_le32(const unsigned char* p);
+uint64_t axl_get_le64(const unsigned char* p);
+
 #endif /* AXL_INTERNAL_H */
@@ -1,3 +1,8 @@
+/* copy_file_range and splice */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 /* CRC and uLong */
 #include <zlib.h>
 
@@ -24,6 +29,18 @@
 
 #include <stdio.h>
 
+#include "config.h"
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+/* FICLONE and FICLONERANGE */
+#ifdef HAVE_FICLONE
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
 #include "axl_internal.h"
 
 /* Configurations */
@@ -300,6 +317,52 @@ ssize_t axl_write_attempt(const char* file, int fd, const void* buf, unsigned lo
     return n;
 }
 
+/* pread() all of count bytes at offset, retrying short reads.  Fails on an
+ * error, or if the file ends first. */
+int axl_pread_all(const char* file, int fd, void* buf, size_t count, off_t offset)
+{
+    char* p = (char*) buf;
+    while (count > 0) {
+        ssize_t n = pread(fd, p, count, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            AXL_ERR("Reading %s at offset %lu: errno=%d %s",
+                file, (unsigned long) offset, n < 0 ? errno : 0,
+                n < 0 ? strerror(errno) : "unexpected end of file"
+            );
+            return AXL_FAILURE;
+        }
+        p      += n;
+        count  -= (size_t) n;
+        offset += n;
+    }
+    return AXL_SUCCESS;
+}
+
+/* pwrite() all of count bytes at offset, retrying short writes */
+int axl_pwrite_all(const char* file, int fd, const void* buf, size_t count, off_t offset)
+{
+    const char* p = (const char*) buf;
+    while (count > 0) {
+        ssize_t n = pwrite(fd, p, count, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            AXL_ERR("Writing %s at offset %lu: errno=%d %s",
+                file, (unsigned long) offset, errno, strerror(errno)
+            );
+            return AXL_FAILURE;
+        }
+        p      += n;
+        count  -= (size_t) n;
+        offset += n;
+    }
+    return AXL_SUCCESS;
+}
+
 /* fsync and close file */
 int axl_close(const char* file, int fd)
 {
@@ -323,6 +386,25 @@ int axl_close(const char* file, int fd)
     return AXL_SUCCESS;
 }
 
+/* close fd, which a copy read from, or wrote to if dst is set, first
+ * syncing it if opts->sync asks for that */
+int axl_copy_close(const char* file, int fd, const struct axl_copy_opts* opts, int dst)
+{
+    int sync = dst ? (opts->sync == AXL_SYNC_ALL || opts->sync == AXL_SYNC_DEST) :
+                     (opts->sync == AXL_SYNC_ALL);
+    if (sync) {
+        return axl_close(file, fd);
+    }
+
+    if (close(fd) != 0) {
+        AXL_ERR("Closing file descriptor %d for file %s: errno=%d %s",
+            fd, file, errno, strerror(errno)
+        );
+        return AXL_FAILURE;
+    }
+    return AXL_SUCCESS;
+}
+
 static void axl_stat_get_atimes(const struct stat* sb, uint64_t* secs, uint64_t* nsecs)
 {
     *secs = (uint64_t) sb->st_atime;
@@ -380,29 +462,33 @@ static void axl_stat_get_ctimes (const struct stat* sb, uint64_t* secs, uint64_t
 #endif
 }
 
+void axl_meta_encode_stat(const struct stat* statbuf, kvtree* meta)
+{
+    kvtree_util_set_unsigned_long(meta, "MODE", (unsigned long) statbuf->st_mode);
+    kvtree_util_set_unsigned_long(meta, "UID",  (unsigned long) statbuf->st_uid);
+    kvtree_util_set_unsigned_long(meta, "GID",  (unsigned long) statbuf->st_gid);
+    kvtree_util_set_unsigned_long(meta, "SIZE", (unsigned long) statbuf->st_size);
+
+    uint64_t secs, nsecs;
+    axl_stat_get_atimes(statbuf, &secs, &nsecs);
+    kvtree_util_set_unsigned_long(meta, "ATIME_SECS",  (unsigned long) secs);
+    kvtree_util_set_unsigned_long(meta, "ATIME_NSECS", (unsigned long) nsecs);
+
+    axl_stat_get_ctimes(statbuf, &secs, &nsecs);
+    kvtree_util_set_unsigned_long(meta, "CTIME_SECS",  (unsigned long) secs);
+    kvtree_util_set_unsigned_long(meta, "CTIME_NSECS", (unsigned long) nsecs);
+
+    axl_stat_get_mtimes(statbuf, &secs, &nsecs);
+    kvtree_util_set_unsigned_long(meta, "MTIME_SECS",  (unsigned long) secs);
+    kvtree_util_set_unsigned_long(meta, "MTIME_NSECS", (unsigned long) nsecs);
+}
+
 int axl_meta_encode(const char* file, kvtree* meta)
 {
     struct stat statbuf;
     int rc = lstat(file, &statbuf);
     if (rc == 0) {
-        kvtree_util_set_unsigned_long(meta, "MODE", (unsigned long) statbuf.st_mode);
-        kvtree_util_set_unsigned_long(meta, "UID",  (unsigned long) statbuf.st_uid);
-        kvtree_util_set_unsigned_long(meta, "GID",  (unsigned long) statbuf.st_gid);
-        kvtree_util_set_unsigned_long(meta, "SIZE", (unsigned long) statbuf.st_size);
-  
-        uint64_t secs, nsecs;
-        axl_stat_get_atimes(&statbuf, &secs, &nsecs);
-        kvtree_util_set_unsigned_long(meta, "ATIME_SECS",  (unsigned long) secs);
-        kvtree_util_set_unsigned_long(meta, "ATIME_NSECS", (unsigned long) nsecs);
-  
-        axl_stat_get_ctimes(&statbuf, &secs, &nsecs);
-        kvtree_util_set_unsigned_long(meta, "CTIME_SECS",  (unsigned long) secs);
-        kvtree_util_set_unsigned_long(meta, "CTIME_NSECS", (unsigned long) nsecs);
-  
-        axl_stat_get_mtimes(&statbuf, &secs, &nsecs);
-        kvtree_util_set_unsigned_long(meta, "MTIME_SECS",  (unsigned long) secs);
-        kvtree_util_set_unsigned_long(meta, "MTIME_NSECS", (unsigned long) nsecs);
-  
+        axl_meta_encode_stat(&statbuf, meta);
         return AXL_SUCCESS;
     }
     return AXL_FAILURE;
@@ -531,7 +617,7 @@ int axl_meta_apply(const char* file, const kvtree* meta)
  *
  * If the var is not set, return ULONG_MAX.
  */
-static unsigned long axl_debug_pause_after(void)
+unsigned long axl_debug_pause_after(void)
 {
     char* env = getenv("AXL_DEBUG_PAUSE_AFTER");
     if (! env) {
@@ -540,97 +626,256 @@ static unsigned long axl_debug_pause_after(void)
     return strtoul(env, 0, 10);
 }
 
-/* TODO: could perhaps use O_DIRECT here as an optimization */
-/* TODO: could apply compression/decompression here */
-/* copy src_file (full path) to dest_path and return new full path in dest_file */
-int axl_file_copy(
-    const char* src_file,
-    const char* dst_file,
-    unsigned long buf_size,
-    int resume)
+/* Return code used by the copy engines below to indicate that the kernel
+ * or filesystem does not support the engine, and that the caller should
+ * continue the copy with the next simpler engine. */
+#define AXL_COPY_FALLBACK (1)
+
+/* Return code used by the copy engines below to indicate that the caller
+ * canceled the copy.  The partial destination file is kept for resuming. */
+#define AXL_COPY_CANCELED (2)
+
+/* Tracks the bytes copied by one call of axl_file_copy() or
+ * axl_file_copy_range() */
+struct axl_copy_progress {
+    unsigned long total;
+    unsigned long pause_after;
+    const volatile int* cancel;
+
+    /* set if we're computing the crc or manifest below, both of which
+     * cover the first hash_end bytes of the file */
+    int hashing;
+    off_t hash_end;
+
+    /* running checksum of the file, unless crc_algo is AXL_CRC_NONE */
+    int crc_algo;
+    uLong crc;
+
+    /* if manifest is set, the CRC32C of the manifest block ending past
+     * hash_end, which we record once the block is complete */
+    const struct axl_copy_opts* opts;
+    kvtree* manifest;
+    int dst_fd;
+    uint32_t block_crc;
+    int block_open;
+
+    /* If wb_fd is set, the destination is written back in windows of
+     * wb_window bytes as the copy goes, see axl_copy_write_behind().
+     * wb_end is the offset the copy has written up to, writeback has been
+     * started on everything before wb_started, and everything before
+     * wb_dropped has been written and dropped from the page cache. */
+    int wb_fd;
+    off_t wb_window;
+    off_t wb_end;
+    off_t wb_started;
+    off_t wb_dropped;
+};
+
+static void axl_copy_progress_init(struct axl_copy_progress* progress,
+    const struct axl_copy_opts* opts)
 {
-    /* check that we got something for a source file */
-    if (src_file == NULL || strcmp(src_file, "") == 0) {
-        AXL_ERR("Invalid source file");
-        return AXL_FAILURE;
+    progress->total       = 0;
+    progress->pause_after = axl_debug_pause_after();
+    progress->cancel      = opts->cancel;
+    progress->hashing     = 0;
+    progress->hash_end    = 0;
+    progress->crc_algo    = AXL_CRC_NONE;
+    progress->crc         = 0;
+    progress->opts        = opts;
+    progress->manifest    = opts->manifest_size > 0 ? opts->manifest : NULL;
+    progress->dst_fd      = -1;
+    progress->block_crc   = 0;
+    progress->block_open  = 0;
+    progress->wb_fd       = -1;
+    progress->wb_window   = 0;
+    progress->wb_end      = 0;
+    progress->wb_started  = 0;
+    progress->wb_dropped  = 0;
+}
+
+/* Have axl_copy_progress() write back fd from offset onwards as the copy
+ * writes it, keeping at most opts->write_behind bytes of it dirty */
+static void axl_copy_write_behind_init(struct axl_copy_progress* progress,
+    int fd, off_t offset)
+{
+#ifdef HAVE_SYNC_FILE_RANGE
+    if (progress->opts->write_behind == 0) {
+        return;
     }
 
-    /* check that we got something for a destination file */
-    if (dst_file == NULL || strcmp(dst_file, "") == 0) {
-        AXL_ERR("Invalid destination file");
-        return AXL_FAILURE;
+    /* We keep one window filling while the one before it is written back,
+     * so each is half the limit.  Whole pages, since the kernel only drops
+     * whole pages from the cache. */
+    long page = sysconf(_SC_PAGESIZE);
+    if (page <= 0) {
+        page = 4096;
+    }
+    off_t window = (off_t) (progress->opts->write_behind / 2);
+    window -= window % page;
+    if (window < page) {
+        window = page;
     }
 
-    int rc = AXL_SUCCESS;
+    progress->wb_fd      = fd;
+    progress->wb_window  = window;
+    progress->wb_end     = offset;
+    progress->wb_started = offset;
+    progress->wb_dropped = offset;
+#endif
+}
 
-    /* open src_file for reading */
-    int src_fd = axl_open(src_file, O_RDONLY);
-    if (src_fd < 0) {
-        AXL_ERR("Opening file to copy: axl_open(%s) errno=%d %s",
-            src_file, errno, strerror(errno)
-        );
-        return AXL_FAILURE;
-    }
+#ifdef HAVE_SYNC_FILE_RANGE
+/* Start writeback on each window the copy has finished writing, then wait
+ * for the window before it and drop that from the page cache.  This keeps
+ * the dirty pages of the copy to about two windows, rather than leaving
+ * the kernel to throttle whoever dirties memory next, which is usually the
+ * application.  The pages have to be clean before POSIX_FADV_DONTNEED can
+ * drop them, hence waiting on the window first. */
+static void axl_copy_write_behind(struct axl_copy_progress* progress)
+{
+    int fd = progress->wb_fd;
+    off_t window = progress->wb_window;
+    while (1) {
+        off_t boundary = (progress->wb_started / window + 1) * window;
+        if (progress->wb_end < boundary) {
+            break;
+        }
 
-    mode_t mode_file = axl_getmode(1, 1, 0);
+        off_t prev = progress->wb_dropped;
+        off_t start = progress->wb_started;
+        if (sync_file_range(fd, start, boundary - start,
+                SYNC_FILE_RANGE_WRITE) != 0 ||
+            (start > prev && sync_file_range(fd, prev, start - prev,
+                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                SYNC_FILE_RANGE_WAIT_AFTER) != 0))
+        {
+            /* Not every filesystem supports this, and any write error
+             * shows up again when the file is synced, so just stop */
+            AXL_DBG(2, "sync_file_range() failed, disabling write-behind errno=%d %s",
+                errno, strerror(errno)
+            );
+            progress->wb_fd = -1;
+            return;
+        }
+        if (start > prev) {
+            posix_fadvise(fd, prev, start - prev, POSIX_FADV_DONTNEED);
+        }
 
-    int flags;
-    if (resume) {
-        flags = O_WRONLY | O_CREAT | O_APPEND;
-    } else {
-        flags = O_WRONLY | O_CREAT | O_TRUNC;
+        progress->wb_dropped = start;
+        progress->wb_started = boundary;
     }
+}
+#endif
 
-    /* open dest_file for writing */
-    int dst_fd = axl_open(dst_file, flags, mode_file);
-    if (dst_fd < 0) {
-        AXL_ERR("Opening file for writing: axl_open(%s) errno=%d %s",
-            dst_file, errno, strerror(errno)
-        );
-        axl_close(src_file, src_fd);
+/* Sync the data copied so far and record the checksum of the manifest block
+ * that ends at hash_end */
+static int axl_copy_manifest_block(struct axl_copy_progress* progress)
+{
+    const struct axl_copy_opts* opts = progress->opts;
+
+    /* make sure the block is on disk before we say it is */
+    if (fdatasync(progress->dst_fd) != 0) {
+        AXL_ERR("fdatasync() failed errno=%d %s", errno, strerror(errno));
         return AXL_FAILURE;
     }
 
-#if !defined(__APPLE__)
-    /* TODO:
-       posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED | POSIX_FADV_SEQUENTIAL)
-       that tells the kernel that you don't ever need the pages
-       from the file again, and it won't bother keeping them in the page cache.
-    */
-    posix_fadvise(src_fd, 0, 0, POSIX_FADV_DONTNEED | POSIX_FADV_SEQUENTIAL);
-    posix_fadvise(dst_fd, 0, 0, POSIX_FADV_DONTNEED | POSIX_FADV_SEQUENTIAL);
-#endif
+    unsigned long block = (unsigned long) ((progress->hash_end - 1) / opts->manifest_size);
+    opts->manifest_update(opts->manifest_arg, progress->manifest, block,
+        &progress->block_crc);
+    progress->block_crc  = 0;
+    progress->block_open = 0;
 
-    /* allocate buffer to read in file chunks */
-    char* buf = (char*) malloc(buf_size);
-    if (buf == NULL) {
-        AXL_ERR("Allocating memory: malloc(%lu) errno=%d %s",
-            buf_size, errno, strerror(errno)
-        );
-        axl_close(dst_file, dst_fd);
-        axl_close(src_file, src_fd);
-        return AXL_FAILURE;
+    return AXL_SUCCESS;
+}
+
+/* Add n bytes of file data starting at offset to the running CRC and the
+ * manifest.  Bytes before hash_end have already been counted, which happens
+ * when O_DIRECT backs up to a block boundary. */
+static int axl_copy_hash(struct axl_copy_progress* progress,
+    const char* buf, off_t offset, size_t n)
+{
+    if (! progress->hashing || offset > progress->hash_end) {
+        return AXL_SUCCESS;
     }
 
-    /* Resume the transfer to our destination file where we left off */
-    if (resume) {
-        /* Seek to the end of our destination file, while recording offset */
-        off_t start_offset = lseek(dst_fd, 0, SEEK_END);
+    size_t skip = (size_t) (progress->hash_end - offset);
+    if (skip >= n) {
+        return AXL_SUCCESS;
+    }
+    buf += skip;
+    n -= skip;
 
-        /* Set the src file position to the start_offset of dst file */
-        if (lseek(src_fd, start_offset, SEEK_SET) != start_offset) {
-            AXL_ERR("Couldn't seek src file errno=%d %s",
-                errno, strerror(errno)
-            );
-            axl_free(buf);
-            axl_close(dst_file, dst_fd);
-            axl_close(src_file, src_fd);
+    if (progress->crc_algo != AXL_CRC_NONE) {
+        progress->crc = axl_hash(progress->crc_algo, (uint32_t) progress->crc,
+            buf, n);
+    }
+
+    if (! progress->manifest) {
+        progress->hash_end += n;
+        return AXL_SUCCESS;
+    }
+
+    /* split the data at block boundaries */
+    off_t block_size = (off_t) progress->opts->manifest_size;
+    while (n > 0) {
+        size_t take = (size_t) AXL_MIN((off_t) n,
+            block_size - progress->hash_end % block_size);
+        progress->block_crc = axl_hash(AXL_CRC_CRC32C, progress->block_crc,
+            buf, take);
+        progress->block_open = 1;
+        progress->hash_end += take;
+        buf += take;
+        n -= take;
+
+        if (progress->hash_end % block_size == 0 &&
+            axl_copy_manifest_block(progress) != AXL_SUCCESS)
+        {
             return AXL_FAILURE;
         }
     }
 
-    unsigned long total_copied = 0;
-    unsigned long pause_after = axl_debug_pause_after();
+    return AXL_SUCCESS;
+}
+
+/* Count bytes copied so far and possibly pause our transfer for unit tests.
+ * Every engine calls this right after each write to the destination
+ * succeeds, with the bytes that write covered, so the total and any pause
+ * don't depend on which engine copied the file.  Returns AXL_COPY_CANCELED
+ * if the copy should stop. */
+static int axl_copy_progress(struct axl_copy_progress* progress, unsigned long n)
+{
+    const volatile int* cancel = progress->cancel;
+    progress->total += n;
+#ifdef HAVE_SYNC_FILE_RANGE
+    if (progress->wb_fd >= 0) {
+        progress->wb_end += (off_t) n;
+        axl_copy_write_behind(progress);
+    }
+#endif
+    while (progress->pause_after != ULONG_MAX &&
+           progress->total >= progress->pause_after &&
+           ! (cancel && *cancel));
+    if (cancel && *cancel) {
+        return AXL_COPY_CANCELED;
+    }
+    return AXL_SUCCESS;
+}
+
+/* Copy src_fd to dst_fd starting at their current file offsets using
+ * read()/write() through a user-space buffer of buf_size bytes */
+static int axl_copy_readwrite(
+    const char* src_file, int src_fd,
+    const char* dst_file, int dst_fd,
+    unsigned long buf_size,
+    struct axl_copy_progress* progress)
+{
+    int rc = AXL_SUCCESS;
+
+    /* get buffer to read in file chunks */
+    char* buf = (char*) axl_buf_get(buf_size);
+    if (buf == NULL) {
+        return AXL_FAILURE;
+    }
 
     /* write chunks */
     int copying = 1;
@@ -648,6 +893,14 @@ int axl_file_copy(
                 /* write had a problem, stop copying and return an error */
                 copying = 0;
                 rc = AXL_FAILURE;
+            } else if (axl_copy_hash(progress, buf, progress->hash_end,
+                nwrite) != AXL_SUCCESS)
+            {
+                copying = 0;
+                rc = AXL_FAILURE;
+            } else if (axl_copy_progress(progress, nwrite) != AXL_SUCCESS) {
+                copying = 0;
+                rc = AXL_COPY_CANCELED;
             }
         }
 
@@ -662,27 +915,1483 @@ int axl_file_copy(
             copying = 0;
             rc = AXL_FAILURE;
         }
+    }
 
-        /* Possibly pause our transfer for unit tests */
-        total_copied += nread;
-        while (pause_after != ULONG_MAX && total_copied >= pause_after);
+    /* hand buffer back to the pool */
+    axl_buf_put(buf);
+
+    return rc;
+}
+
+#ifdef HAVE_SPLICE
+/* Copy src_fd to dst_fd starting at their current file offsets by splicing
+ * pages through a pipe, which avoids copying data into user space.
+ *
+ * Returns AXL_COPY_FALLBACK if either file does not support splice().
+ * EINVAL means that only before we've moved any data, after that it's an
+ * error like any other. */
+static int axl_copy_splice(
+    const char* src_file, int src_fd,
+    const char* dst_file, int dst_fd,
+    unsigned long buf_size,
+    struct axl_copy_progress* progress)
+{
+    int pipefd[2];
+    if (pipe(pipefd) != 0) {
+        AXL_DBG(1, "Creating pipe for splice failed errno=%d %s",
+            errno, strerror(errno)
+        );
+        return AXL_COPY_FALLBACK;
     }
 
-    /* free buffer */
-    axl_free(&buf);
+    /* ask for a pipe as large as our buffer size, the kernel may limit us
+     * to something smaller so use whatever size we actually got */
+    size_t chunk = 64 * 1024;
+    int pipe_size = fcntl(pipefd[1], F_SETPIPE_SZ, (int) AXL_MIN(buf_size, INT_MAX));
+    if (pipe_size < 0) {
+        pipe_size = fcntl(pipefd[1], F_GETPIPE_SZ);
+    }
+    if (pipe_size > 0) {
+        chunk = (size_t) pipe_size;
+    }
 
-    /* close source and destination files */
-    if (axl_close(dst_file, dst_fd) != AXL_SUCCESS) {
-        rc = AXL_FAILURE;
+    int rc = AXL_SUCCESS;
+    unsigned long copied = 0;
+    while (1) {
+        /* move a chunk of the source file into the pipe */
+        ssize_t nin = splice(src_fd, NULL, pipefd[1], NULL, chunk,
+            SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (nin == 0) {
+            /* EOF */
+            break;
+        } else if (nin < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            if (errno == EOPNOTSUPP || errno == ENOSYS ||
+                (errno == EINVAL && copied == 0))
+            {
+                rc = AXL_COPY_FALLBACK;
+            } else {
+                AXL_ERR("Splicing from file %s errno=%d %s",
+                    src_file, errno, strerror(errno)
+                );
+                rc = AXL_FAILURE;
+            }
+            break;
+        }
+
+        /* drain the pipe into the destination file */
+        ssize_t left = nin;
+        while (left > 0) {
+            ssize_t nout = splice(pipefd[0], NULL, dst_fd, NULL, left,
+                SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (nout > 0) {
+                left -= nout;
+                if (axl_copy_progress(progress, nout) != AXL_SUCCESS) {
+                    rc = AXL_COPY_CANCELED;
+                    break;
+                }
+            } else if (nout < 0 && (errno == EINTR || errno == EAGAIN)) {
+                continue;
+            } else {
+                break;
+            }
+        }
+
+        if (rc == AXL_COPY_CANCELED) {
+            break;
+        }
+
+        if (left > 0) {
+            /* The destination refused the splice.  The source offset has
+             * already moved past the bytes stuck in our pipe, so drain them
+             * through a buffer before falling back. */
+            if (errno == EOPNOTSUPP || errno == ENOSYS ||
+                (errno == EINVAL && copied == 0 && left == nin))
+            {
+                char buf[4096];
+                rc = AXL_COPY_FALLBACK;
+                while (left > 0) {
+                    ssize_t n = axl_read_attempt(src_file, pipefd[0], buf,
+                        AXL_MIN(left, sizeof(buf)));
+                    if (n <= 0 || axl_write_attempt(dst_file, dst_fd, buf, n) != n ||
+                        axl_copy_hash(progress, buf, progress->hash_end, n) != AXL_SUCCESS)
+                    {
+                        rc = AXL_FAILURE;
+                        break;
+                    }
+                    left -= n;
+                    if (axl_copy_progress(progress, n) != AXL_SUCCESS) {
+                        rc = AXL_COPY_CANCELED;
+                        break;
+                    }
+                }
+            } else {
+                AXL_ERR("Splicing to file %s errno=%d %s",
+                    dst_file, errno, strerror(errno)
+                );
+                rc = AXL_FAILURE;
+            }
+            break;
+        }
+
+        copied += nin;
     }
-    if (axl_close(src_file, src_fd) != AXL_SUCCESS) {
-        rc = AXL_FAILURE;
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+
+    return rc;
+}
+#endif /* HAVE_SPLICE */
+
+#ifdef HAVE_COPY_FILE_RANGE
+/* Copy src_fd to dst_fd starting at their current file offsets with
+ * copy_file_range(), which lets the kernel (or a remote file server) move
+ * the data without it ever passing through user space.
+ *
+ * Returns AXL_COPY_FALLBACK if the kernel can't copy between these files,
+ * for example because they are on different filesystems.  Some kernels say
+ * so with EINVAL, which we only take to mean that before anything has been
+ * copied; other errors, EBADF included, are bugs to report, not hide. */
+static int axl_copy_file_range(
+    const char* src_file, int src_fd,
+    const char* dst_file, int dst_fd,
+    unsigned long buf_size,
+    struct axl_copy_progress* progress)
+{
+    /* Some filesystems report EOF early through copy_file_range(),
+     * so remember the size of the source to detect that. */
+    struct stat statbuf;
+    if (fstat(src_fd, &statbuf) != 0) {
+        return AXL_COPY_FALLBACK;
     }
 
-    if (rc != AXL_SUCCESS) {
-        /* unlink the file if the copy failed */
-        axl_file_unlink(dst_file);
+    unsigned long copied = 0;
+    while (1) {
+        /* copy in buf_size pieces to keep pausing and progress granular */
+        ssize_t n = copy_file_range(src_fd, NULL, dst_fd, NULL, buf_size, 0);
+        if (n > 0) {
+            copied += (unsigned long) n;
+            if (axl_copy_progress(progress, n) != AXL_SUCCESS) {
+                return AXL_COPY_CANCELED;
+            }
+        } else if (n == 0) {
+            off_t pos = lseek(src_fd, 0, SEEK_CUR);
+            if (pos >= 0 && pos < statbuf.st_size) {
+                /* short copy, let a different engine finish the job */
+                return AXL_COPY_FALLBACK;
+            }
+            return AXL_SUCCESS;
+        } else {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            if (errno == EXDEV || errno == EOPNOTSUPP || errno == ENOSYS ||
+                (errno == EINVAL && copied == 0))
+            {
+                AXL_DBG(2, "copy_file_range(%s, %s) not supported errno=%d %s",
+                    src_file, dst_file, errno, strerror(errno)
+                );
+                return AXL_COPY_FALLBACK;
+            }
+            AXL_ERR("Copying file %s to %s with copy_file_range errno=%d %s",
+                src_file, dst_file, errno, strerror(errno)
+            );
+            return AXL_FAILURE;
+        }
+    }
+}
+#endif /* HAVE_COPY_FILE_RANGE */
+
+#ifdef O_DIRECT
+/* Alignment of buffers, file offsets, and lengths for O_DIRECT I/O.
+ * 4KiB satisfies the logical block size of nearly every device. */
+#define AXL_DIRECT_ALIGN (4096)
+
+/* One of the two buffers that axl_copy_direct() alternates between */
+struct axl_direct_buf {
+    char* data;
+    off_t offset; /* file offset of data[0] */
+    ssize_t len;  /* bytes read, less than a full block at EOF, -1 on error */
+    int full;     /* set while holding data that has not been written yet */
+};
+
+/* State shared between axl_copy_direct() and its reader thread */
+struct axl_direct_pipe {
+    const char* src_file;
+    int src_fd;
+    size_t block;  /* bytes per read, a multiple of AXL_DIRECT_ALIGN */
+    off_t next;    /* offset of the next read */
+    int err;       /* errno of a failed read */
+    struct axl_direct_buf bufs[2];
+#ifdef HAVE_PTHREADS
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int stop;      /* set to ask the reader to quit early */
+#endif
+};
+
+/* turn O_DIRECT on or off for an open file descriptor */
+static int axl_direct_set(int fd, int enable)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0) {
+        return -1;
+    }
+    if (enable) {
+        flags |= O_DIRECT;
+    } else {
+        flags &= ~O_DIRECT;
+    }
+    return fcntl(fd, F_SETFL, flags);
+}
+
+/* read the next block of the source file into buf */
+static void axl_direct_fill(struct axl_direct_pipe* p, struct axl_direct_buf* buf)
+{
+    size_t got = 0;
+    buf->offset = p->next;
+    while (got < p->block) {
+        ssize_t n = pread(p->src_fd, buf->data + got, p->block - got, buf->offset + got);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            p->err = errno;
+            buf->len = -1;
+            return;
+        }
+        if (n == 0) {
+            break;
+        }
+        got += n;
+
+        /* an unaligned count means we just read the tail of the file */
+        if (got % AXL_DIRECT_ALIGN != 0) {
+            break;
+        }
+    }
+    buf->len = got;
+    p->next += got;
+}
+
+/* write size bytes from buf to fd at offset, retrying short writes */
+static ssize_t axl_direct_pwrite(int fd, const char* buf, size_t size, off_t offset)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pwrite(fd, buf + done, size - done, offset + done);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            errno = EIO;
+            return -1;
+        }
+        done += n;
+    }
+    return done;
+}
+
+#ifdef HAVE_PTHREADS
+/* Reads blocks into the two buffers in turn, staying one block ahead of
+ * the writer.  Stops after a short read, which is either EOF or an error. */
+static void* axl_direct_reader(void* arg)
+{
+    struct axl_direct_pipe* p = (struct axl_direct_pipe*) arg;
+    int i = 0;
+    while (1) {
+        struct axl_direct_buf* buf = &p->bufs[i];
+
+        /* wait for the writer to finish with this buffer */
+        pthread_mutex_lock(&p->lock);
+        while (buf->full && ! p->stop) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        int stop = p->stop;
+        pthread_mutex_unlock(&p->lock);
+        if (stop) {
+            break;
+        }
+
+        axl_direct_fill(p, buf);
+
+        pthread_mutex_lock(&p->lock);
+        buf->full = 1;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+
+        if (buf->len < (ssize_t) p->block) {
+            break;
+        }
+        i ^= 1;
+    }
+    return NULL;
+}
+#endif /* HAVE_PTHREADS */
+
+/* Copy src_fd to dst_fd starting at their current file offsets with O_DIRECT
+ * on both files, so that neither file's data lands in the page cache.  With
+ * pthreads, a reader thread fills one aligned buffer while we write out the
+ * other.  The unaligned tail of the file is written without O_DIRECT.
+ *
+ * Returns AXL_COPY_FALLBACK if either filesystem rejects O_DIRECT, with both
+ * file offsets set to the end of the data written so far. */
+static int axl_copy_direct(
+    const char* src_file, int src_fd,
+    const char* dst_file, int dst_fd,
+    unsigned long buf_size,
+    struct axl_copy_progress* progress)
+{
+    /* O_DIRECT needs aligned offsets, so back up to the start of the block
+     * when resuming.  Rewriting those few bytes is harmless. */
+    off_t start = lseek(src_fd, 0, SEEK_CUR);
+    if (start < 0) {
+        return AXL_COPY_FALLBACK;
+    }
+    start -= start % AXL_DIRECT_ALIGN;
+
+    if (axl_direct_set(src_fd, 1) != 0 || axl_direct_set(dst_fd, 1) != 0) {
+        AXL_DBG(2, "O_DIRECT not supported for %s or %s errno=%d %s",
+            src_file, dst_file, errno, strerror(errno)
+        );
+        axl_direct_set(src_fd, 0);
+        axl_direct_set(dst_fd, 0);
+        return AXL_COPY_FALLBACK;
+    }
+
+    struct axl_direct_pipe p;
+    memset(&p, 0, sizeof(p));
+    p.src_file = src_file;
+    p.src_fd   = src_fd;
+    p.block    = ((buf_size + AXL_DIRECT_ALIGN - 1) / AXL_DIRECT_ALIGN) * AXL_DIRECT_ALIGN;
+    if (p.block == 0) {
+        p.block = AXL_DIRECT_ALIGN;
+    }
+    p.next     = start;
+
+    int rc = AXL_SUCCESS;
+    int i;
+    for (i = 0; i < 2; i++) {
+        /* pool buffers are page aligned, which is enough for O_DIRECT */
+        p.bufs[i].data = axl_buf_get(p.block);
+        if (p.bufs[i].data == NULL) {
+            rc = AXL_FAILURE;
+        }
+    }
+
+    int threaded = 0;
+#ifdef HAVE_PTHREADS
+    pthread_t reader;
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.cond, NULL);
+    if (rc == AXL_SUCCESS && pthread_create(&reader, NULL, &axl_direct_reader, &p) == 0) {
+        threaded = 1;
+    }
+#endif
+
+    /* end of the data we've written out */
+    off_t committed = start;
+
+    i = 0;
+    while (rc == AXL_SUCCESS) {
+        struct axl_direct_buf* buf = &p.bufs[i];
+
+        /* wait for the reader to fill this buffer, or fill it ourselves */
+#ifdef HAVE_PTHREADS
+        if (threaded) {
+            pthread_mutex_lock(&p.lock);
+            while (! buf->full) {
+                pthread_cond_wait(&p.cond, &p.lock);
+            }
+            pthread_mutex_unlock(&p.lock);
+        }
+#endif
+        if (! threaded) {
+            axl_direct_fill(&p, buf);
+        }
+
+        if (buf->len < 0) {
+            if (p.err == EINVAL) {
+                rc = AXL_COPY_FALLBACK;
+            } else {
+                AXL_ERR("Error reading file %s errno=%d %s",
+                    src_file, p.err, strerror(p.err)
+                );
+                rc = AXL_FAILURE;
+            }
+            break;
+        }
+
+        /* write out the aligned part of the block with O_DIRECT */
+        size_t len = (size_t) buf->len;
+        size_t aligned = len - len % AXL_DIRECT_ALIGN;
+        if (aligned > 0 &&
+            axl_direct_pwrite(dst_fd, buf->data, aligned, buf->offset) < 0)
+        {
+            if (errno == EINVAL) {
+                rc = AXL_COPY_FALLBACK;
+            } else {
+                AXL_ERR("Error writing file %s errno=%d %s",
+                    dst_file, errno, strerror(errno)
+                );
+                rc = AXL_FAILURE;
+            }
+            break;
+        }
+
+        /* and the tail of the file through the page cache */
+        if (aligned < len) {
+            if (axl_direct_set(dst_fd, 0) != 0 ||
+                axl_direct_pwrite(dst_fd, buf->data + aligned, len - aligned,
+                    buf->offset + aligned) < 0)
+            {
+                AXL_ERR("Error writing file %s errno=%d %s",
+                    dst_file, errno, strerror(errno)
+                );
+                rc = AXL_FAILURE;
+                break;
+            }
+        }
+
+        committed = buf->offset + len;
+        if (axl_copy_hash(progress, buf->data, buf->offset, len) != AXL_SUCCESS) {
+            rc = AXL_FAILURE;
+            break;
+        }
+
+        /* a short block means we're at the end of the file */
+        int last = (len < p.block);
+        if (axl_copy_progress(progress, (unsigned long) len) != AXL_SUCCESS) {
+            rc = AXL_COPY_CANCELED;
+            last = 1;
+        }
+
+#ifdef HAVE_PTHREADS
+        if (threaded) {
+            pthread_mutex_lock(&p.lock);
+            buf->full = 0;
+            pthread_cond_broadcast(&p.cond);
+            pthread_mutex_unlock(&p.lock);
+        }
+#endif
+
+        if (last) {
+            break;
+        }
+        i ^= 1;
+    }
+
+#ifdef HAVE_PTHREADS
+    if (threaded) {
+        pthread_mutex_lock(&p.lock);
+        p.stop = 1;
+        pthread_cond_broadcast(&p.cond);
+        pthread_mutex_unlock(&p.lock);
+        pthread_join(reader, NULL);
+    }
+    pthread_cond_destroy(&p.cond);
+    pthread_mutex_destroy(&p.lock);
+#endif
+
+    for (i = 0; i < 2; i++) {
+        axl_buf_put(p.bufs[i].data);
+    }
+
+    /* go back to normal I/O, leaving both files positioned after the data
+     * we've written so that a fallback engine can pick up from there */
+    axl_direct_set(src_fd, 0);
+    axl_direct_set(dst_fd, 0);
+    if (rc == AXL_COPY_FALLBACK) {
+        AXL_DBG(2, "O_DIRECT copy of %s to %s not supported, continuing at offset %lu",
+            src_file, dst_file, (unsigned long) committed
+        );
+        if (lseek(src_fd, committed, SEEK_SET) != committed ||
+            lseek(dst_fd, committed, SEEK_SET) != committed)
+        {
+            rc = AXL_FAILURE;
+        }
+    }
+
+    return rc;
+}
+#endif /* O_DIRECT */
+
+#ifdef HAVE_FICLONE
+/* Filesystems we've found can't clone files, so that we don't keep asking
+ * them.  There are only ever a few, the oldest is forgotten if not. */
+#define AXL_CLONE_NODEVS (16)
+static dev_t axl_clone_nodevs[AXL_CLONE_NODEVS];
+static unsigned int axl_clone_nodevs_count = 0;
+#ifdef HAVE_PTHREADS
+static pthread_mutex_t axl_clone_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Returns 1 if dev is in axl_clone_nodevs, call with axl_clone_lock held */
+static int axl_clone_nodev(dev_t dev)
+{
+    unsigned int i;
+    unsigned int n = AXL_MIN(axl_clone_nodevs_count, AXL_CLONE_NODEVS);
+    for (i = 0; i < n; i++) {
+        if (axl_clone_nodevs[i] == dev) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Returns 1 if dev may be able to clone files */
+static int axl_clone_may_work(dev_t dev)
+{
+#ifdef HAVE_PTHREADS
+    pthread_mutex_lock(&axl_clone_lock);
+#endif
+    int may = ! axl_clone_nodev(dev);
+#ifdef HAVE_PTHREADS
+    pthread_mutex_unlock(&axl_clone_lock);
+#endif
+    return may;
+}
+
+/* Check whether cloning a file failed because dev can't clone files at
+ * all, and if so, remember that */
+static void axl_clone_failed(dev_t dev, const char* src_file, const char* dst_file)
+{
+    AXL_DBG(2, "Cloning %s to %s failed errno=%d %s",
+        src_file, dst_file, errno, strerror(errno)
+    );
+    if (errno != EOPNOTSUPP && errno != ENOTTY && errno != EXDEV &&
+        errno != ENOSYS)
+    {
+        /* something about this file, such as a range the filesystem can't
+         * clone, so try the next one */
+        return;
+    }
+#ifdef HAVE_PTHREADS
+    pthread_mutex_lock(&axl_clone_lock);
+#endif
+    if (! axl_clone_nodev(dev)) {
+        axl_clone_nodevs[axl_clone_nodevs_count % AXL_CLONE_NODEVS] = dev;
+        axl_clone_nodevs_count++;
+    }
+#ifdef HAVE_PTHREADS
+    pthread_mutex_unlock(&axl_clone_lock);
+#endif
+}
+
+/* Share the blocks of length bytes at offset in src_fd with the same range
+ * of dst_fd, or all of src_fd if length is 0, if both are on a filesystem
+ * that can clone files, like XFS or btrfs.  This takes the same time no
+ * matter how much data there is.
+ *
+ * Returns AXL_COPY_FALLBACK if the files can't be cloned. */
+static int axl_copy_clone(
+    const char* src_file, int src_fd,
+    const char* dst_file, int dst_fd,
+    off_t offset, off_t length)
+{
+    struct stat src_stat, dst_stat;
+    if (fstat(src_fd, &src_stat) != 0 || fstat(dst_fd, &dst_stat) != 0 ||
+        src_stat.st_dev != dst_stat.st_dev ||
+        ! axl_clone_may_work(src_stat.st_dev))
+    {
+        return AXL_COPY_FALLBACK;
+    }
+
+    int ret;
+    if (length == 0) {
+        ret = ioctl(dst_fd, FICLONE, src_fd);
+    } else {
+        struct file_clone_range range;
+        range.src_fd      = src_fd;
+        range.src_offset  = (uint64_t) offset;
+        range.src_length  = (uint64_t) length;
+        range.dest_offset = (uint64_t) offset;
+        ret = ioctl(dst_fd, FICLONERANGE, &range);
+    }
+    if (ret != 0) {
+        axl_clone_failed(src_stat.st_dev, src_file, dst_file);
+        return AXL_COPY_FALLBACK;
+    }
+
+    return AXL_SUCCESS;
+}
+#endif /* HAVE_FICLONE */
+
+/* Returns 1 if the file has fewer blocks allocated than its size needs,
+ * meaning it has holes that are worth skipping when copying it */
+int axl_stat_sparse(const struct stat* sb)
+{
+#ifdef SEEK_DATA
+    return ((off_t) sb->st_blocks * 512 < sb->st_size);
+#else
+    return 0;
+#endif
+}
+
+#ifdef SEEK_DATA
+/* Copy src_fd to dst_fd starting at their current file offsets, reading
+ * and writing only the data extents of the source that lseek(SEEK_DATA)
+ * and lseek(SEEK_HOLE) find, so the holes stay holes in the destination.
+ * The destination is then extended to the size of the source.
+ *
+ * Returns AXL_COPY_FALLBACK if the filesystem can't find the holes. */
+static int axl_copy_sparse(
+    const char* src_file, int src_fd,
+    const char* dst_file, int dst_fd,
+    unsigned long buf_size,
+    struct axl_copy_progress* progress)
+{
+    struct stat statbuf;
+    off_t pos = lseek(src_fd, 0, SEEK_CUR);
+    if (pos < 0 || fstat(src_fd, &statbuf) != 0) {
+        return AXL_COPY_FALLBACK;
+    }
+    off_t size = statbuf.st_size;
+
+    char* buf = (char*) axl_buf_get(buf_size);
+    if (buf == NULL) {
+        return AXL_FAILURE;
+    }
+
+    int rc = AXL_SUCCESS;
+    while (rc == AXL_SUCCESS && pos < size) {
+        /* find the next extent of data, there's none past the last hole */
+        off_t data = lseek(src_fd, pos, SEEK_DATA);
+        off_t hole = size;
+        if (data < 0 && errno == ENXIO) {
+            data = size;
+        } else if (data >= 0) {
+            hole = lseek(src_fd, data, SEEK_HOLE);
+        }
+        if (data < 0 || hole < 0) {
+            AXL_DBG(2, "Finding holes in %s failed errno=%d %s",
+                src_file, errno, strerror(errno)
+            );
+            rc = AXL_COPY_FALLBACK;
+            break;
+        }
+        hole = AXL_MIN(hole, size);
+        data = AXL_MIN(data, size);
+
+        /* The hole reads as zeros, which the crc and manifest cover too,
+         * but there's nothing to write */
+        while (rc == AXL_SUCCESS && pos < data) {
+            size_t n = (size_t) AXL_MIN((off_t) buf_size, data - pos);
+            if (progress->hashing) {
+                memset(buf, 0, n);
+                if (axl_copy_hash(progress, buf, pos, n) != AXL_SUCCESS) {
+                    rc = AXL_FAILURE;
+                    break;
+                }
+            }
+            pos += n;
+            if (axl_copy_progress(progress, n) != AXL_SUCCESS) {
+                rc = AXL_COPY_CANCELED;
+            }
+        }
+
+        /* copy the data extent */
+        while (rc == AXL_SUCCESS && pos < hole) {
+            size_t want = (size_t) AXL_MIN((off_t) buf_size, hole - pos);
+            if (axl_pread_all(src_file, src_fd, buf, want, pos) != AXL_SUCCESS ||
+                axl_pwrite_all(dst_file, dst_fd, buf, want, pos) != AXL_SUCCESS ||
+                axl_copy_hash(progress, buf, pos, want) != AXL_SUCCESS)
+            {
+                rc = AXL_FAILURE;
+                break;
+            }
+            pos += want;
+            if (axl_copy_progress(progress, want) != AXL_SUCCESS) {
+                rc = AXL_COPY_CANCELED;
+            }
+        }
+    }
+
+    axl_buf_put(buf);
+
+    /* extend the destination over a trailing hole, and leave both offsets
+     * where we stopped, so another engine or a resume picks up from there */
+    if (rc == AXL_SUCCESS && ftruncate(dst_fd, size) != 0) {
+        AXL_ERR("ftruncate(%s, %lu) failed errno=%d %s",
+            dst_file, (unsigned long) size, errno, strerror(errno)
+        );
+        rc = AXL_FAILURE;
+    }
+    if (lseek(src_fd, pos, SEEK_SET) != pos ||
+        lseek(dst_fd, pos, SEEK_SET) != pos)
+    {
+        rc = AXL_FAILURE;
+    }
+
+    return rc;
+}
+#endif /* SEEK_DATA */
+
+/* fill in copy options from the values recorded in a transfer's kvtree */
+int axl_copy_opts_load(const kvtree* file_list, struct axl_copy_opts* opts)
+{
+    int rc = AXL_SUCCESS;
+
+    if (kvtree_util_get_bytecount(file_list,
+        AXL_KEY_CONFIG_FILE_BUF_SIZE, &opts->buf_size) != KVTREE_SUCCESS)
+    {
+        AXL_ERR("Missing %s option", AXL_KEY_CONFIG_FILE_BUF_SIZE);
+        rc = AXL_FAILURE;
+    }
+
+    /* state files written by older versions don't record an engine */
+    opts->engine = axl_copy_engine;
+    kvtree_util_get_int(file_list, AXL_KEY_CONFIG_COPY_ENGINE, &opts->engine);
+
+    opts->direct = axl_direct_io;
+    kvtree_util_get_int(file_list, AXL_KEY_CONFIG_DIRECT_IO, &opts->direct);
+
+    opts->crc = AXL_CRC_NONE;
+    kvtree_util_get_int(file_list, AXL_KEY_CONFIG_CRC, &opts->crc);
+    if (opts->crc != AXL_CRC_NONE && opts->crc != AXL_CRC_CRC32C) {
+        opts->crc = AXL_CRC_CRC32;
+    }
+
+    opts->manifest_size = 0;
+    kvtree_util_get_bytecount(file_list, AXL_KEY_CONFIG_MANIFEST_SIZE,
+        &opts->manifest_size);
+
+    /* compressed and delta copies carry a CRC32C for each block of their
+     * own */
+    opts->compress = AXL_COMPRESS_NONE;
+    kvtree_util_get_int(file_list, AXL_KEY_CONFIG_COMPRESS, &opts->compress);
+    opts->delta_size = 0;
+    kvtree_util_get_bytecount(file_list, AXL_KEY_CONFIG_DELTA_SIZE,
+        &opts->delta_size);
+    int use_extension = axl_use_extension;
+    kvtree_util_get_int(file_list, AXL_KEY_CONFIG_USE_EXTENSION, &use_extension);
+    if (opts->compress != AXL_COMPRESS_NONE || use_extension) {
+        /* there's nothing to update when copying to a temporary name */
+        opts->delta_size = 0;
+    }
+    if (opts->compress != AXL_COMPRESS_NONE || opts->delta_size > 0) {
+        opts->crc = AXL_CRC_NONE;
+        opts->manifest_size = 0;
+    }
+
+    opts->sync = axl_sync_policy;
+    kvtree_util_get_int(file_list, AXL_KEY_CONFIG_SYNC_POLICY, &opts->sync);
+
+    opts->write_behind = axl_write_behind_size;
+    kvtree_util_get_bytecount(file_list, AXL_KEY_CONFIG_WRITE_BEHIND_SIZE,
+        &opts->write_behind);
+
+    /* callers that support canceling a copy set this themselves */
+    opts->cancel = NULL;
+    opts->claim = NULL;
+    opts->claim_arg = NULL;
+    opts->claim_step = 0;
+
+    /* as do callers that keep a manifest for each file */
+    opts->manifest = NULL;
+    opts->manifest_update = NULL;
+    opts->manifest_arg = NULL;
+
+    return rc;
+}
+
+/* record crc as the checksum of the given block in a file's manifest, or if
+ * crc is NULL, forget that block and every block after it */
+void axl_manifest_update(kvtree* manifest, unsigned long block, const uint32_t* crc)
+{
+    char key[32];
+
+    if (crc) {
+        snprintf(key, sizeof(key), "%lu", block);
+        kvtree_util_set_crc32(manifest, key, (uLong) *crc);
+        return;
+    }
+
+    /* blocks are recorded in order, so the ones after it are all there */
+    unsigned long blocks = (unsigned long) kvtree_size(manifest);
+    for (; block < blocks; block++) {
+        snprintf(key, sizeof(key), "%lu", block);
+        kvtree_unset(manifest, key);
+    }
+}
+
+/* axl_manifest_update() the manifest of src in the file list of id, and
+ * record the change in the journal of its state file: just the one block
+ * if it's recorded, or the whole manifest if blocks were forgotten, so
+ * recording each block of a file costs the same however many there are */
+void axl_manifest_record(int id, const char* src, kvtree* manifest,
+    unsigned long block, const uint32_t* crc)
+{
+    axl_manifest_update(manifest, block, crc);
+    if (crc) {
+        char key[32];
+        snprintf(key, sizeof(key), "%lu", block);
+        axl_write_state_record(id, src, AXL_KEY_FILE_MANIFEST, key);
+    } else {
+        axl_write_state_record(id, src, AXL_KEY_FILE_MANIFEST, NULL);
+    }
+}
+
+/* Update crc with algo over length bytes of fd starting at offset, reading
+ * through buf */
+static int axl_hash_range(const char* file, int fd, char* buf,
+    unsigned long buf_size, int algo, off_t offset, off_t length, uLong* crc)
+{
+    uint32_t c = (uint32_t) *crc;
+    while (length > 0) {
+        size_t want = (size_t) AXL_MIN((off_t) buf_size, length);
+        ssize_t n = pread(fd, buf, want, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            AXL_ERR("Error reading file %s to compute crc errno=%d %s",
+                file, errno, strerror(errno)
+            );
+            return AXL_FAILURE;
+        }
+        c = axl_hash(algo, c, buf, (size_t) n);
+        offset += n;
+        length -= n;
+    }
+    *crc = c;
+    return AXL_SUCCESS;
+}
+
+/* Start the running CRC of a resumed copy with the length bytes that are
+ * already in the destination */
+static int axl_copy_crc_resume(struct axl_copy_progress* progress,
+    const char* dst_file, int dst_fd, off_t length, unsigned long buf_size)
+{
+    char* buf = (char*) axl_buf_get(buf_size);
+    if (buf == NULL) {
+        return AXL_FAILURE;
+    }
+
+    int rc = axl_hash_range(dst_file, dst_fd, buf, buf_size,
+        progress->crc_algo, 0, length, &progress->crc);
+
+    axl_buf_put(buf);
+
+    return rc;
+}
+
+/* Check the blocks recorded in a resumed copy's manifest against the
+ * destination, last block first, and set verified to the end of the last
+ * one that matches.  The blocks after it are dropped from the manifest.
+ * Blocks are synced before they're recorded, so normally only the last
+ * block is read, and it only fails to match if the destination changed
+ * since. */
+static int axl_copy_manifest_resume(struct axl_copy_progress* progress,
+    const char* dst_file, int dst_fd, off_t src_size, off_t dst_size,
+    unsigned long buf_size, off_t* verified)
+{
+    const struct axl_copy_opts* opts = progress->opts;
+    off_t block_size = (off_t) opts->manifest_size;
+
+    *verified = 0;
+
+    char* buf = (char*) axl_buf_get(buf_size);
+    if (buf == NULL) {
+        return AXL_FAILURE;
+    }
+
+    int rc = AXL_SUCCESS;
+    unsigned long blocks = (unsigned long) kvtree_size(progress->manifest);
+    unsigned long block;
+    for (block = blocks; block > 0; block--) {
+        /* the last block of the file may be short */
+        off_t offset = (off_t) (block - 1) * block_size;
+        off_t length = AXL_MIN(block_size, src_size - offset);
+
+        char key[32];
+        snprintf(key, sizeof(key), "%lu", block - 1);
+        uLong expect;
+        if (length <= 0 || offset + length > dst_size ||
+            kvtree_util_get_crc32(progress->manifest, key, &expect) != KVTREE_SUCCESS)
+        {
+            continue;
+        }
+
+        uLong crc = 0;
+        rc = axl_hash_range(dst_file, dst_fd, buf, buf_size, AXL_CRC_CRC32C,
+            offset, length, &crc);
+        if (rc != AXL_SUCCESS) {
+            break;
+        }
+        if (crc == expect) {
+            *verified = offset + length;
+            break;
+        }
+
+        AXL_DBG(1, "Block %lu of %s doesn't match its manifest, crc32c 0x%lx != 0x%lx",
+            block - 1, dst_file, (unsigned long) crc, (unsigned long) expect
+        );
+    }
+
+    axl_buf_put(buf);
+
+    if (rc == AXL_SUCCESS && block < blocks) {
+        opts->manifest_update(opts->manifest_arg, progress->manifest, block, NULL);
+    }
+
+    return rc;
+}
+
+/* copy src_file (full path) to dest_path and return new full path in dest_file */
+int axl_file_copy(
+    const char* src_file,
+    const char* dst_file,
+    const struct axl_copy_opts* opts,
+    int resume,
+    uLong* crc)
+{
+    /* check that we got something for a source file */
+    if (src_file == NULL || strcmp(src_file, "") == 0) {
+        AXL_ERR("Invalid source file");
+        return AXL_FAILURE;
+    }
+
+    /* check that we got something for a destination file */
+    if (dst_file == NULL || strcmp(dst_file, "") == 0) {
+        AXL_ERR("Invalid destination file");
+        return AXL_FAILURE;
+    }
+
+    /* Compressed files have a format of their own, see axl_compress.c.
+     * They can't be resumed, so they're always copied from the start. */
+    if (opts->compress == AXL_COMPRESS_DEFLATE) {
+        return axl_compress_file(src_file, dst_file, opts);
+    } else if (opts->compress == AXL_COMPRESS_INFLATE) {
+        return axl_decompress_file(src_file, dst_file, opts);
+    }
+
+    /* Delta copies write into the existing destination, so appending to it
+     * when resuming would be wrong.  A delta copy that was interrupted
+     * simply starts over. */
+    if (opts->delta_size > 0) {
+        return axl_delta_copy(src_file, dst_file, opts);
+    }
+
+    int rc = AXL_SUCCESS;
+
+    /* open src_file for reading */
+    int src_fd = axl_open(src_file, O_RDONLY);
+    if (src_fd < 0) {
+        AXL_ERR("Opening file to copy: axl_open(%s) errno=%d %s",
+            src_file, errno, strerror(errno)
+        );
+        return AXL_FAILURE;
+    }
+
+    mode_t mode_file = axl_getmode(1, 1, 0);
+
+    /* When resuming, we seek to the end of the destination rather than
+     * opening it with O_APPEND, since neither copy_file_range() nor splice()
+     * accept a destination opened in append mode. */
+    int flags;
+    if (resume) {
+        flags = O_WRONLY | O_CREAT;
+    } else {
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+    }
+
+    /* we read back what's already been copied to start the crc or check
+     * the manifest */
+    if (resume && (opts->crc || (opts->manifest && opts->manifest_size > 0))) {
+        flags = (flags & ~O_WRONLY) | O_RDWR;
+    }
+
+    /* open dest_file for writing */
+    int dst_fd = axl_open(dst_file, flags, mode_file);
+    if (dst_fd < 0) {
+        AXL_ERR("Opening file for writing: axl_open(%s) errno=%d %s",
+            dst_file, errno, strerror(errno)
+        );
+        axl_close(src_file, src_fd);
+        return AXL_FAILURE;
+    }
+
+#if !defined(__APPLE__)
+    /* we read the source once, front to back */
+    posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    struct axl_copy_progress progress;
+    axl_copy_progress_init(&progress, opts);
+    progress.dst_fd = dst_fd;
+
+    /* Resume the transfer to our destination file where we left off */
+    if (resume) {
+        /* Seek to the end of our destination file, while recording offset */
+        off_t start_offset = lseek(dst_fd, 0, SEEK_END);
+
+        /* With a manifest, we continue after the last block we can verify
+         * instead, and drop whatever follows it, since that may be a torn
+         * or stale write */
+        if (progress.manifest) {
+            struct stat statbuf;
+            off_t verified = 0;
+            if (fstat(src_fd, &statbuf) != 0 ||
+                axl_copy_manifest_resume(&progress, dst_file, dst_fd,
+                    statbuf.st_size, start_offset, opts->buf_size,
+                    &verified) != AXL_SUCCESS ||
+                ftruncate(dst_fd, verified) != 0 ||
+                lseek(dst_fd, verified, SEEK_SET) != verified)
+            {
+                AXL_ERR("Couldn't resume %s from its manifest errno=%d %s",
+                    dst_file, errno, strerror(errno)
+                );
+                axl_close(dst_file, dst_fd);
+                axl_close(src_file, src_fd);
+                return AXL_FAILURE;
+            }
+            if (verified != start_offset) {
+                AXL_DBG(1, "Resuming %s at verified offset %lu rather than %lu",
+                    dst_file, (unsigned long) verified,
+                    (unsigned long) start_offset
+                );
+            }
+            start_offset = verified;
+        }
+
+        /* Set the src file position to the start_offset of dst file */
+        if (lseek(src_fd, start_offset, SEEK_SET) != start_offset) {
+            AXL_ERR("Couldn't seek src file errno=%d %s",
+                errno, strerror(errno)
+            );
+            axl_close(dst_file, dst_fd);
+            axl_close(src_file, src_fd);
+            return AXL_FAILURE;
+        }
+    }
+
+    /* Try the requested engine first.  Each engine picks up from the current
+     * file offsets, so if one gives up partway through, the next one simply
+     * continues where it left off. */
+    int engine = opts->engine;
+    rc = AXL_COPY_FALLBACK;
+
+    /* The crc and manifest are computed on the data as it passes through
+     * our buffers, so only the sparse copy, O_DIRECT and read/write will
+     * do */
+    if (opts->crc || progress.manifest) {
+        progress.hashing  = 1;
+        progress.crc_algo = opts->crc;
+        engine = AXL_COPY_ENGINE_READWRITE;
+
+        off_t start_offset = lseek(dst_fd, 0, SEEK_CUR);
+        if (start_offset > 0 && opts->crc) {
+            rc = axl_copy_crc_resume(&progress, dst_file, dst_fd,
+                start_offset, opts->buf_size);
+            if (rc == AXL_SUCCESS) {
+                rc = AXL_COPY_FALLBACK;
+            }
+        }
+        progress.hash_end = start_offset;
+    }
+
+    off_t reserved = 0;
+    int sparse = 0;
+    struct stat src_stat;
+    off_t dst_offset = lseek(dst_fd, 0, SEEK_CUR);
+    int have_stat = (fstat(src_fd, &src_stat) == 0);
+
+#ifdef HAVE_FICLONE
+    /* Share the source's blocks rather than copying them if the filesystem
+     * can, when we're starting from scratch and don't need to see the data */
+    if (rc == AXL_COPY_FALLBACK && have_stat && dst_offset == 0 &&
+        ! progress.hashing)
+    {
+        rc = axl_copy_clone(src_file, src_fd, dst_file, dst_fd, 0, 0);
+        if (rc == AXL_SUCCESS &&
+            axl_copy_progress(&progress, (unsigned long) src_stat.st_size) != AXL_SUCCESS)
+        {
+            rc = AXL_COPY_CANCELED;
+        }
+    }
+#endif
+
+    /* reserve the rest of the destination up front, unless the source has
+     * holes that we'd like to keep */
+    if (rc == AXL_COPY_FALLBACK && have_stat) {
+        sparse = axl_stat_sparse(&src_stat);
+        if (! sparse) {
+            reserved = axl_file_reserve(dst_file, dst_fd, dst_offset,
+                src_stat.st_size);
+        }
+    }
+
+    axl_copy_write_behind_init(&progress, dst_fd, dst_offset);
+
+#ifdef SEEK_DATA
+    /* The engines below would read and write every byte of the holes, and
+     * allocate all of them in the destination */
+    if (rc == AXL_COPY_FALLBACK && sparse) {
+        rc = axl_copy_sparse(src_file, src_fd, dst_file, dst_fd,
+            opts->buf_size, &progress);
+    }
+#endif
+
+#ifdef O_DIRECT
+    /* bypass the page cache entirely if asked to */
+    if (rc == AXL_COPY_FALLBACK && opts->direct) {
+        rc = axl_copy_direct(src_file, src_fd, dst_file, dst_fd,
+            opts->buf_size, &progress);
+    }
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+    if (rc == AXL_COPY_FALLBACK && engine >= AXL_COPY_ENGINE_COPY_FILE_RANGE) {
+        rc = axl_copy_file_range(src_file, src_fd, dst_file, dst_fd,
+            opts->buf_size, &progress);
+    }
+#endif
+
+#ifdef HAVE_SPLICE
+    if (rc == AXL_COPY_FALLBACK && engine >= AXL_COPY_ENGINE_SPLICE) {
+        rc = axl_copy_splice(src_file, src_fd, dst_file, dst_fd,
+            opts->buf_size, &progress);
+    }
+#endif
+
+    if (rc == AXL_COPY_FALLBACK) {
+        rc = axl_copy_readwrite(src_file, src_fd, dst_file, dst_fd,
+            opts->buf_size, &progress);
+    }
+
+    /* record the last block of the manifest, if the file ends partway
+     * through one */
+    if (rc == AXL_SUCCESS && progress.block_open) {
+        rc = axl_copy_manifest_block(&progress);
+    }
+
+    /* Free any blocks we reserved past the end, in case the source shrank
+     * while we copied it.  A canceled copy keeps them for its resume. */
+    struct stat dst_stat;
+    if (rc == AXL_SUCCESS && fstat(dst_fd, &dst_stat) == 0 &&
+        dst_stat.st_size < reserved && ftruncate(dst_fd, dst_stat.st_size) != 0)
+    {
+        AXL_DBG(2, "ftruncate(%s, %lu) failed errno=%d %s",
+            dst_file, (unsigned long) dst_stat.st_size, errno, strerror(errno)
+        );
+    }
+
+#if !defined(__APPLE__)
+    /* We won't read the source again, so drop its pages from the page cache
+     * now.  Hinting this before the copy has no effect, since the pages
+     * aren't there to drop until we've read them. */
+    posix_fadvise(src_fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+
+    /* close source and destination files */
+    if (axl_copy_close(dst_file, dst_fd, opts, 1) != AXL_SUCCESS) {
+        rc = AXL_FAILURE;
+    }
+    if (axl_copy_close(src_file, src_fd, opts, 0) != AXL_SUCCESS) {
+        rc = AXL_FAILURE;
+    }
+
+    if (rc == AXL_COPY_CANCELED) {
+        /* keep what we've copied so far, so the transfer can be resumed */
+        AXL_DBG(2, "Copy of %s to %s canceled", src_file, dst_file);
+        rc = AXL_FAILURE;
+    } else if (rc != AXL_SUCCESS) {
+        /* unlink the file if the copy failed */
+        axl_file_unlink(dst_file);
+    } else if (opts->crc) {
+        AXL_DBG(2, "Copied %s to %s, %s 0x%lx", src_file, dst_file,
+            opts->crc == AXL_CRC_CRC32C ? "crc32c" : "crc32",
+            (unsigned long) progress.crc
+        );
+        *crc = progress.crc;
+    }
+
+    return rc;
+}
+
+/* reserve blocks for fd, which is writing file, from offset up to size
+ * without changing its size, and return the end of the reservation */
+off_t axl_file_reserve(const char* file, int fd, off_t offset, off_t size)
+{
+#ifdef HAVE_FALLOCATE
+    /* Letting the file grow one write at a time fragments it, and more so
+     * when several writers append to files at once.  FALLOC_FL_KEEP_SIZE
+     * leaves the size at what has actually been written, which is what a
+     * resumed copy goes by.  Not all filesystems support this, which is
+     * fine. */
+    if (size > offset) {
+        if (fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, size - offset) == 0) {
+            return size;
+        }
+        AXL_DBG(2, "fallocate(%s, %lu, %lu) failed errno=%d %s",
+            file, (unsigned long) offset, (unsigned long) (size - offset),
+            errno, strerror(errno)
+        );
+    }
+#endif
+    return offset;
+}
+
+/* create file of size bytes (truncating it unless resume is set) so that
+ * byte ranges can be written to it in any order, and unless the source has
+ * holes to keep (sparse is set), reserve the blocks for it */
+int axl_file_preallocate(const char* file, off_t size, int resume, int sparse)
+{
+    int flags = O_WRONLY | O_CREAT;
+    if (! resume) {
+        flags |= O_TRUNC;
+    }
+
+    int fd = axl_open(file, flags, axl_getmode(1, 1, 0));
+    if (fd < 0) {
+        AXL_ERR("Opening file for writing: axl_open(%s) errno=%d %s",
+            file, errno, strerror(errno)
+        );
+        return AXL_FAILURE;
+    }
+
+    int rc = AXL_SUCCESS;
+
+#ifdef HAVE_FALLOCATE
+    /* Reserve the blocks up front so the filesystem can lay the file out
+     * contiguously.  Not all filesystems support this, which is fine. */
+    if (! sparse && size > 0 && fallocate(fd, 0, 0, size) != 0) {
+        AXL_DBG(2, "fallocate(%s, %lu) failed errno=%d %s",
+            file, (unsigned long) size, errno, strerror(errno)
+        );
+    }
+#endif
+
+    /* set the final size, in case fallocate isn't available */
+    if (ftruncate(fd, size) != 0) {
+        AXL_ERR("ftruncate(%s, %lu) failed errno=%d %s",
+            file, (unsigned long) size, errno, strerror(errno)
+        );
+        rc = AXL_FAILURE;
+    }
+
+    if (close(fd) != 0) {
+        AXL_ERR("Closing file %s errno=%d %s",
+            file, errno, strerror(errno)
+        );
+        rc = AXL_FAILURE;
+    }
+
+    return rc;
+}
+
+/* Number of bytes axl_file_copy_range() should copy next at offset + done,
+ * 0 once the range is done */
+static off_t axl_copy_range_step(const struct axl_copy_opts* opts,
+    off_t offset, off_t done, off_t length)
+{
+    off_t want = AXL_MIN(length - done, (off_t) opts->buf_size);
+    if (opts->claim_step > 0) {
+        want = AXL_MIN(want, opts->claim_step);
+    }
+    if (want > 0 && opts->claim) {
+        want = opts->claim(opts->claim_arg, offset + done, want);
+    }
+    return want;
+}
+
+/* copy length bytes at offset in src_file to the same offset in dst_file,
+ * which must already exist, without syncing dst_file */
+int axl_file_copy_range(
+    const char* src_file,
+    const char* dst_file,
+    const struct axl_copy_opts* opts,
+    off_t offset,
+    off_t length)
+{
+    int src_fd = axl_open(src_file, O_RDONLY);
+    if (src_fd < 0) {
+        AXL_ERR("Opening file to copy: axl_open(%s) errno=%d %s",
+            src_file, errno, strerror(errno)
+        );
+        return AXL_FAILURE;
+    }
+
+    int dst_fd = axl_open(dst_file, O_WRONLY);
+    if (dst_fd < 0) {
+        AXL_ERR("Opening file for writing: axl_open(%s) errno=%d %s",
+            dst_file, errno, strerror(errno)
+        );
+        close(src_fd);
+        return AXL_FAILURE;
+    }
+
+    int rc = AXL_SUCCESS;
+    off_t done = 0;
+    off_t step;
+    struct axl_copy_progress progress;
+    axl_copy_progress_init(&progress, opts);
+
+    /* skip the holes of a sparse source, axl_file_preallocate() left them
+     * as holes in the destination */
+    struct stat statbuf;
+    int sparse = (fstat(src_fd, &statbuf) == 0 && axl_stat_sparse(&statbuf));
+
+#ifdef HAVE_FICLONE
+    /* Share the source's blocks for the whole range if the filesystem can,
+     * and if the range ends at a block boundary or the end of the file.
+     * Claim the range only once the clone has worked, so that where it
+     * fails, idle threads can still split what we go on to copy.  A thread
+     * that split off the end of the range in the meantime copies the same
+     * bytes over what we cloned, which is wasted but harmless. */
+    if (axl_copy_clone(src_file, src_fd, dst_file, dst_fd, offset, length) ==
+        AXL_SUCCESS)
+    {
+        off_t claimed = length;
+        if (opts->claim) {
+            claimed = opts->claim(opts->claim_arg, offset, length);
+        }
+        done = claimed;
+        if (axl_copy_progress(&progress, (unsigned long) claimed) != AXL_SUCCESS) {
+            rc = AXL_FAILURE;
+        }
+    }
+#endif
+
+    axl_copy_write_behind_init(&progress, dst_fd, offset + done);
+
+#ifdef HAVE_COPY_FILE_RANGE
+    /* Let the kernel copy the range if it can.  We pass explicit offsets, so
+     * several threads can copy ranges of the same file at once.  If it can't
+     * copy between these files, we finish the range with pread/pwrite below,
+     * as axl_copy_file_range() does. */
+    if (rc == AXL_SUCCESS && opts->engine >= AXL_COPY_ENGINE_COPY_FILE_RANGE &&
+        ! sparse)
+    {
+        while ((step = axl_copy_range_step(opts, offset, done, length)) > 0) {
+            loff_t in  = offset + done;
+            loff_t out = offset + done;
+            ssize_t n = copy_file_range(src_fd, &in, dst_fd, &out, step, 0);
+            if (n > 0) {
+                done += n;
+                if (axl_copy_progress(&progress, n) != AXL_SUCCESS) {
+                    rc = AXL_FAILURE;
+                    break;
+                }
+            } else if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+                continue;
+            } else if (n < 0 && errno != EXDEV && errno != EOPNOTSUPP &&
+                errno != ENOSYS && (errno != EINVAL || done > 0))
+            {
+                AXL_ERR("Copying file %s to %s with copy_file_range errno=%d %s",
+                    src_file, dst_file, errno, strerror(errno)
+                );
+                rc = AXL_FAILURE;
+                break;
+            } else {
+                break;
+            }
+        }
+    }
+#endif
+
+    step = 0;
+    if (rc == AXL_SUCCESS) {
+        step = axl_copy_range_step(opts, offset, done, length);
+    }
+
+    char* buf = NULL;
+    if (step > 0) {
+        buf = (char*) axl_buf_get(opts->buf_size);
+        if (buf == NULL) {
+            rc = AXL_FAILURE;
+        }
+    }
+
+    while (rc == AXL_SUCCESS && step > 0) {
+#ifdef SEEK_DATA
+        /* stop the step at the next boundary between data and a hole, and
+         * if it starts in a hole, there's nothing to read or write */
+        if (sparse) {
+            off_t pos  = offset + done;
+            off_t data = lseek(src_fd, pos, SEEK_DATA);
+            off_t hole = -1;
+            if (data == pos) {
+                hole = lseek(src_fd, pos, SEEK_HOLE);
+            }
+            if (data < 0 && errno == ENXIO) {
+                data = pos + step;
+            }
+            if (data > pos) {
+                step = AXL_MIN(data - pos, step);
+                done += step;
+                if (axl_copy_progress(&progress, step) != AXL_SUCCESS) {
+                    rc = AXL_FAILURE;
+                    break;
+                }
+                step = axl_copy_range_step(opts, offset, done, length);
+                continue;
+            }
+            if (hole > pos) {
+                step = AXL_MIN(hole - pos, step);
+            }
+        }
+#endif
+
+        ssize_t nread = pread(src_fd, buf, (size_t) step, offset + done);
+        if (nread < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            AXL_ERR("Error reading file %s errno=%d %s",
+                src_file, errno, strerror(errno)
+            );
+            rc = AXL_FAILURE;
+            break;
+        } else if (nread == 0) {
+            AXL_ERR("Unexpected end of file %s at offset %lu",
+                src_file, (unsigned long) (offset + done)
+            );
+            rc = AXL_FAILURE;
+            break;
+        }
+
+        ssize_t nwrite = 0;
+        while (nwrite < nread) {
+            ssize_t n = pwrite(dst_fd, buf + nwrite, nread - nwrite,
+                offset + done + nwrite);
+            if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+                continue;
+            } else if (n <= 0) {
+                AXL_ERR("Error writing file %s errno=%d %s",
+                    dst_file, errno, strerror(errno)
+                );
+                rc = AXL_FAILURE;
+                break;
+            }
+            nwrite += n;
+        }
+
+        done += nread;
+        if (rc == AXL_SUCCESS && axl_copy_progress(&progress, nread) != AXL_SUCCESS) {
+            rc = AXL_FAILURE;
+        }
+        if (rc == AXL_SUCCESS) {
+            step = axl_copy_range_step(opts, offset, done, length);
+        }
+    }
+
+    axl_buf_put(buf);
+
+    if (close(dst_fd) != 0) {
+        AXL_ERR("Closing file %s errno=%d %s",
+            dst_file, errno, strerror(errno)
+        );
+        rc = AXL_FAILURE;
     }
+    close(src_fd);
 
     return rc;
 }
@@ -714,7 +2423,7 @@ int axl_crc32(const char* filename, uLong* crc)
     do {
         nread = axl_read(filename, fd, buf, buffer_size);
         if (nread > 0) {
-            *crc = crc32(*crc, (const Bytef*) buf, (uInt) nread);
+            *crc = axl_hash(AXL_CRC_CRC32, (uint32_t) *crc, buf, (size_t) nread);
         }
     } while (nread == buffer_size);
 
@@ -1,6 +1,8 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <libgen.h>
+#include <sys/stat.h>
 
 #include "axl.h"
 #include "axl_mpi.h"
@@ -117,20 +119,81 @@ int AXL_Add_comm (
   const char** dst, /**< [IN]  - list of destination paths of length num */
   MPI_Comm comm)    /**< [IN]  - communicator used for coordination and flow control */
 {
-    /* assume we'll succeed */
+    /* As when this called AXL_Add() for each file, an entry that can't be
+     * added fails only itself: the rest of the list is still added, and
+     * every rank returns AXL_FAILURE.  AXL_Add_list() takes all of a list
+     * or none of it, so check each entry here, and add the files that pass
+     * in one list.  Directories are added one at a time, since one with
+     * something in it that can't be copied fails when it's scanned. */
     int rc = AXL_SUCCESS;
+    int count = 0;
+    const char** file_srcs = (const char**) calloc(num > 0 ? num : 1, sizeof(char*));
+    const char** file_dsts = (const char**) calloc(num > 0 ? num : 1, sizeof(char*));
+    char** new_dsts = (char**) calloc(num > 0 ? num : 1, sizeof(char*));
+    if (file_srcs == NULL || file_dsts == NULL || new_dsts == NULL) {
+        axl_free2(&file_srcs);
+        axl_free2(&file_dsts);
+        axl_free2(&new_dsts);
+        num = 0;
+        rc = AXL_FAILURE;
+    }
 
-    /* add files to transfer list */
     int i;
     for (i = 0; i < num; i++) {
-      const char* src_file  = src[i];
-      const char* dest_file = dst[i];
-      if (AXL_Add(id, src_file, dest_file) != AXL_SUCCESS) {
-        /* remember that we failed to add a file */
+        struct stat src_st, dst_st;
+        if (src[i] == NULL || dst[i] == NULL || stat(src[i], &src_st) != 0 ||
+            (! S_ISREG(src_st.st_mode) && ! S_ISDIR(src_st.st_mode)))
+        {
+            /* remember that we failed to add a file */
+            rc = AXL_FAILURE;
+            continue;
+        }
+
+        /* A destination that is an existing directory gets the source
+         * copied into it, as AXL_Add() does, so resolve those to the path
+         * in it */
+        const char* dst_path = dst[i];
+        if (stat(dst[i], &dst_st) == 0 && S_ISDIR(dst_st.st_mode)) {
+            char* src_copy = strdup(src[i]);
+            if (src_copy) {
+                size_t len = strlen(dst[i]) + strlen(src_copy) + 2;
+                new_dsts[i] = (char*) malloc(len);
+                if (new_dsts[i]) {
+                    snprintf(new_dsts[i], len, "%s/%s", dst[i], basename(src_copy));
+                }
+                axl_free2(&src_copy);
+            }
+            if (new_dsts[i] == NULL) {
+                rc = AXL_FAILURE;
+                continue;
+            }
+            dst_path = new_dsts[i];
+        }
+
+        if (S_ISDIR(src_st.st_mode)) {
+            if (AXL_Add_list(id, 1, &src[i], &dst_path, NULL) != AXL_SUCCESS) {
+                rc = AXL_FAILURE;
+            }
+            continue;
+        }
+
+        file_srcs[count] = src[i];
+        file_dsts[count] = dst_path;
+        count++;
+    }
+
+    /* add the files to the transfer list */
+    if (count > 0 && AXL_Add_list(id, count, file_srcs, file_dsts, NULL) != AXL_SUCCESS) {
         rc = AXL_FAILURE;
-      }
     }
 
+    for (i = 0; i < num; i++) {
+        axl_free2(&new_dsts[i]);
+    }
+    axl_free2(&new_dsts);
+    axl_free2(&file_dsts);
+    axl_free2(&file_srcs);
+
     /* return same value on all ranks */
     if (! axl_alltrue(rc == AXL_SUCCESS, comm)) {
         /* someone failed, so everyone fails */
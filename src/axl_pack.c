@@ -0,0 +1,635 @@
+/* Small-file packing, for the PACK_SIZE option.
+ *
+ * Creating a file on a parallel filesystem costs a round trip to its
+ * metadata server, which for small files takes longer than writing the
+ * data.  With PACK_SIZE set, files smaller than that are appended to a
+ * container in their destination directory, named AXL_PACK_NAME, instead of
+ * being copied to a file of their own.  A container is laid out as:
+ *
+ *   header   "AXLP", format version
+ *   data     the contents of each member, in whatever order they were packed
+ *   index    for each member in order of name, the offset and size of its
+ *            data, its CRC32C, mode, and mtime, and the length and bytes of
+ *            its name
+ *   trailer  offset of the index, number of members, "AXLP", format version
+ *
+ * All numbers are little-endian.  A member's name is the basename of its
+ * destination, so a reader can find a member from the destination path
+ * alone, by reading the trailer and the index, and then read just that
+ * member's data. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "config.h"
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include "axl_internal.h"
+
+#define AXL_PACK_MAGIC   "AXLP"
+#define AXL_PACK_VERSION (1)
+
+/* header: magic, version */
+#define AXL_PACK_HEADER_SIZE  (4 + 4)
+
+/* index entry: offset, size, crc, mode, mtime secs, mtime nsecs, name
+ * length, followed by the name */
+#define AXL_PACK_ENTRY_SIZE   (8 + 8 + 4 + 4 + 8 + 4 + 4)
+
+/* trailer: index offset, member count, magic, version */
+#define AXL_PACK_TRAILER_SIZE (8 + 8 + 4 + 4)
+
+/* One file in a container */
+struct axl_pack_member {
+    char* name;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t crc;
+    uint32_t mode;
+    uint64_t mtime_sec;
+    uint32_t mtime_nsec;
+};
+
+/* A container being written */
+struct axl_pack_container {
+    char* file;
+    int fd;
+
+    /* where the next member's data goes */
+    uint64_t end;
+
+    struct axl_pack_member* members;
+    uint64_t count;
+    uint64_t capacity;
+
+    struct axl_pack_container* next;
+};
+
+/* The containers of one transfer */
+struct axl_packer {
+    int id;
+
+    /* whether finishing a container syncs it */
+    int sync;
+
+    struct axl_pack_container* containers;
+    struct axl_packer* next;
+};
+
+/* Transfers that are packing files.  The pthread transfer packs files from
+ * several threads at once, so the lock protects the list, the containers,
+ * and their members.  The data itself is written outside of the lock. */
+static struct axl_packer* axl_packers = NULL;
+
+#ifdef HAVE_PTHREADS
+static pthread_mutex_t axl_packers_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void axl_packers_acquire(void)
+{
+#ifdef HAVE_PTHREADS
+    pthread_mutex_lock(&axl_packers_lock);
+#endif
+}
+
+static void axl_packers_release(void)
+{
+#ifdef HAVE_PTHREADS
+    pthread_mutex_unlock(&axl_packers_lock);
+#endif
+}
+
+/* Return the path of the container for dst_file, or NULL on error */
+static char* axl_pack_container_file(const char* dst_file, char** name)
+{
+    char* dst_copy = strdup(dst_file);
+    char* dst_copy2 = strdup(dst_file);
+    char* file = NULL;
+    if (dst_copy && dst_copy2) {
+        if (asprintf(&file, "%s/%s", dirname(dst_copy), AXL_PACK_NAME) < 0) {
+            file = NULL;
+        }
+        if (file && name) {
+            *name = strdup(basename(dst_copy2));
+            if (! *name) {
+                free(file);
+                file = NULL;
+            }
+        }
+    }
+    free(dst_copy);
+    free(dst_copy2);
+    return file;
+}
+
+/* Whether the file described by elem_hash in a transfer is packed */
+int axl_pack_is_packed(const kvtree* elem_hash)
+{
+    int packed = 0;
+    kvtree_util_get_int(elem_hash, AXL_KEY_FILE_PACK, &packed);
+    return packed;
+}
+
+/* Get ready to pack files for transfer id, sync is one of the axl_sync_t
+ * values */
+int axl_pack_begin(int id, int sync)
+{
+    /* a transfer that was canceled and resumed starts its containers over */
+    axl_pack_end(id, AXL_FAILURE);
+
+    struct axl_packer* packer = calloc(1, sizeof(*packer));
+    if (! packer) {
+        AXL_ERR("Allocating packer for UID %d", id);
+        return AXL_FAILURE;
+    }
+    packer->id   = id;
+    packer->sync = (sync == AXL_SYNC_ALL || sync == AXL_SYNC_DEST);
+
+    axl_packers_acquire();
+    packer->next = axl_packers;
+    axl_packers = packer;
+    axl_packers_release();
+
+    return AXL_SUCCESS;
+}
+
+/* Find the container in the directory of container_file, creating it if
+ * this is the first member for that directory.  Must hold the lock. */
+static struct axl_pack_container* axl_pack_container_get(
+    struct axl_packer* packer, const char* container_file)
+{
+    struct axl_pack_container* c;
+    for (c = packer->containers; c; c = c->next) {
+        if (strcmp(c->file, container_file) == 0) {
+            return c;
+        }
+    }
+
+    c = calloc(1, sizeof(*c));
+    if (! c || ! (c->file = strdup(container_file))) {
+        free(c);
+        return NULL;
+    }
+
+    mode_t mode_file = axl_getmode(1, 1, 0);
+    c->fd = axl_open(c->file, O_WRONLY | O_CREAT | O_TRUNC, mode_file);
+    if (c->fd < 0) {
+        AXL_ERR("Opening file for writing: axl_open(%s) errno=%d %s",
+            c->file, errno, strerror(errno)
+        );
+        free(c->file);
+        free(c);
+        return NULL;
+    }
+
+    unsigned char header[AXL_PACK_HEADER_SIZE];
+    memcpy(header, AXL_PACK_MAGIC, 4);
+    axl_put_le32(header + 4, AXL_PACK_VERSION);
+    if (axl_pwrite_all(c->file, c->fd, header, sizeof(header), 0) != AXL_SUCCESS) {
+        close(c->fd);
+        axl_file_unlink(c->file);
+        free(c->file);
+        free(c);
+        return NULL;
+    }
+    c->end = AXL_PACK_HEADER_SIZE;
+
+    c->next = packer->containers;
+    packer->containers = c;
+    return c;
+}
+
+/* Append src_file to the container for dst_file, as part of transfer id.
+ * If opts->crc is set, also store src_file's checksum in crc, like
+ * axl_file_copy() does.  Safe to call from any thread. */
+int axl_pack_file(int id, const char* src_file, const char* dst_file,
+    const struct axl_copy_opts* opts, uLong* crc)
+{
+    char* name = NULL;
+    char* container_file = axl_pack_container_file(dst_file, &name);
+    if (! container_file) {
+        return AXL_FAILURE;
+    }
+
+    int src_fd = axl_open(src_file, O_RDONLY);
+    if (src_fd < 0) {
+        AXL_ERR("Opening file to copy: axl_open(%s) errno=%d %s",
+            src_file, errno, strerror(errno)
+        );
+        free(container_file);
+        free(name);
+        return AXL_FAILURE;
+    }
+
+    int rc = AXL_FAILURE;
+    unsigned char* buf = NULL;
+    struct axl_pack_member m = { .name = name };
+    struct stat sb;
+    if (fstat(src_fd, &sb) != 0) {
+        AXL_ERR("Failed to stat %s: errno=%d %s", src_file, errno, strerror(errno));
+        goto out;
+    }
+    m.size = (uint64_t) sb.st_size;
+    m.mode = (uint32_t) sb.st_mode;
+#if defined(__APPLE__)
+    m.mtime_sec  = (uint64_t) sb.st_mtimespec.tv_sec;
+    m.mtime_nsec = (uint32_t) sb.st_mtimespec.tv_nsec;
+#else
+    m.mtime_sec  = (uint64_t) sb.st_mtim.tv_sec;
+    m.mtime_nsec = (uint32_t) sb.st_mtim.tv_nsec;
+#endif
+
+    size_t buf_size = (size_t) AXL_MIN((uint64_t) opts->buf_size, m.size);
+    if (buf_size > 0) {
+        buf = (unsigned char*) axl_buf_get(buf_size);
+        if (! buf) {
+            AXL_ERR("Allocating buffer to pack %s", src_file);
+            goto out;
+        }
+    }
+
+    /* Reserve room for the data, which we then write without the lock */
+    axl_packers_acquire();
+    struct axl_packer* packer = axl_packers;
+    while (packer && packer->id != id) {
+        packer = packer->next;
+    }
+    struct axl_pack_container* c = NULL;
+    if (packer) {
+        c = axl_pack_container_get(packer, container_file);
+    }
+    if (c) {
+        m.offset = c->end;
+        c->end += m.size;
+    }
+    axl_packers_release();
+    if (! c) {
+        AXL_ERR("No container to pack %s into for UID %d", src_file, id);
+        goto out;
+    }
+
+    uint32_t crc32c = 0;
+    uint32_t file_crc = 0;
+    uint64_t done = 0;
+    while (done < m.size) {
+        if (opts->cancel && *opts->cancel) {
+            goto out;
+        }
+        size_t n = (size_t) AXL_MIN((uint64_t) buf_size, m.size - done);
+        if (axl_pread_all(src_file, src_fd, buf, n, (off_t) done) != AXL_SUCCESS ||
+            axl_pwrite_all(c->file, c->fd, buf, n, (off_t) (m.offset + done)) != AXL_SUCCESS)
+        {
+            goto out;
+        }
+        crc32c = axl_hash(AXL_CRC_CRC32C, crc32c, buf, n);
+        if (opts->crc == AXL_CRC_CRC32C) {
+            file_crc = crc32c;
+        } else if (opts->crc) {
+            file_crc = axl_hash(opts->crc, file_crc, buf, n);
+        }
+        done += n;
+    }
+    m.crc = crc32c;
+
+    /* The member only goes in the index once its data is written */
+    axl_packers_acquire();
+    if (c->count == c->capacity) {
+        uint64_t capacity = c->capacity ? c->capacity * 2 : 64;
+        struct axl_pack_member* members =
+            realloc(c->members, capacity * sizeof(*members));
+        if (members) {
+            c->members  = members;
+            c->capacity = capacity;
+        }
+    }
+    if (c->count < c->capacity) {
+        c->members[c->count++] = m;
+        m.name = NULL;
+        rc = AXL_SUCCESS;
+    }
+    axl_packers_release();
+
+    if (rc == AXL_SUCCESS && crc) {
+        *crc = (uLong) file_crc;
+    }
+
+out:
+    axl_buf_put(buf);
+    close(src_fd);
+    free(container_file);
+    free(m.name);
+    return rc;
+}
+
+static int axl_pack_member_cmp(const void* a, const void* b)
+{
+    return strcmp(((const struct axl_pack_member*) a)->name,
+                  ((const struct axl_pack_member*) b)->name);
+}
+
+/* Write the index and trailer of c, and close it, syncing it first if
+ * sync is set */
+static int axl_pack_container_finish(struct axl_pack_container* c, int sync)
+{
+    qsort(c->members, c->count, sizeof(c->members[0]), axl_pack_member_cmp);
+
+    size_t len = AXL_PACK_TRAILER_SIZE;
+    uint64_t i;
+    for (i = 0; i < c->count; i++) {
+        len += AXL_PACK_ENTRY_SIZE + strlen(c->members[i].name);
+    }
+
+    unsigned char* buf = malloc(len);
+    if (! buf) {
+        AXL_ERR("Allocating index for %s", c->file);
+        close(c->fd);
+        return AXL_FAILURE;
+    }
+
+    unsigned char* p = buf;
+    for (i = 0; i < c->count; i++) {
+        const struct axl_pack_member* m = &c->members[i];
+        uint32_t name_len = (uint32_t) strlen(m->name);
+        axl_put_le64(p,      m->offset);
+        axl_put_le64(p + 8,  m->size);
+        axl_put_le32(p + 16, m->crc);
+        axl_put_le32(p + 20, m->mode);
+        axl_put_le64(p + 24, m->mtime_sec);
+        axl_put_le32(p + 32, m->mtime_nsec);
+        axl_put_le32(p + 36, name_len);
+        memcpy(p + AXL_PACK_ENTRY_SIZE, m->name, name_len);
+        p += AXL_PACK_ENTRY_SIZE + name_len;
+    }
+    axl_put_le64(p,      c->end);
+    axl_put_le64(p + 8,  c->count);
+    memcpy(p + 16, AXL_PACK_MAGIC, 4);
+    axl_put_le32(p + 20, AXL_PACK_VERSION);
+
+    int rc = axl_pwrite_all(c->file, c->fd, buf, len, (off_t) c->end);
+    free(buf);
+
+    /* the members' data was written without syncing */
+    if (sync) {
+        if (axl_close(c->file, c->fd) != AXL_SUCCESS) {
+            rc = AXL_FAILURE;
+        }
+    } else if (close(c->fd) != 0) {
+        AXL_ERR("Closing file %s: errno=%d %s", c->file, errno, strerror(errno));
+        rc = AXL_FAILURE;
+    }
+    return rc;
+}
+
+/* Finish the containers of transfer id once no more files will be packed
+ * into them.  If rc is AXL_SUCCESS, write their indexes, otherwise just
+ * remove them.  Returns AXL_SUCCESS if every container is complete, and
+ * does nothing if the transfer isn't packing files. */
+int axl_pack_end(int id, int rc)
+{
+    axl_packers_acquire();
+    struct axl_packer** prev = &axl_packers;
+    while (*prev && (*prev)->id != id) {
+        prev = &(*prev)->next;
+    }
+    struct axl_packer* packer = *prev;
+    if (packer) {
+        *prev = packer->next;
+    }
+    axl_packers_release();
+
+    if (! packer) {
+        return AXL_SUCCESS;
+    }
+
+    int ret = AXL_SUCCESS;
+    while (packer->containers) {
+        struct axl_pack_container* c = packer->containers;
+        packer->containers = c->next;
+
+        if (rc == AXL_SUCCESS) {
+            if (axl_pack_container_finish(c, packer->sync) != AXL_SUCCESS) {
+                ret = AXL_FAILURE;
+            }
+        } else {
+            close(c->fd);
+            axl_file_unlink(c->file);
+        }
+
+        uint64_t i;
+        for (i = 0; i < c->count; i++) {
+            free(c->members[i].name);
+        }
+        free(c->members);
+        free(c->file);
+        free(c);
+    }
+    free(packer);
+
+    return (rc == AXL_SUCCESS) ? ret : rc;
+}
+
+/* Open the container for dst_file and find the member for it in the
+ * index.  On success, returns the container's fd and fills in m, whose
+ * name the caller must free. */
+static int axl_pack_find(const char* dst_file, char** container_file,
+    struct axl_pack_member* m)
+{
+    char* name = NULL;
+    char* file = axl_pack_container_file(dst_file, &name);
+    if (! file) {
+        return -1;
+    }
+
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        AXL_DBG(1, "No container %s for %s", file, dst_file);
+        free(file);
+        free(name);
+        return -1;
+    }
+
+    unsigned char* buf = NULL;
+    unsigned char trailer[AXL_PACK_TRAILER_SIZE];
+    struct stat sb;
+    if (fstat(fd, &sb) != 0 ||
+        (uint64_t) sb.st_size < AXL_PACK_HEADER_SIZE + AXL_PACK_TRAILER_SIZE ||
+        axl_pread_all(file, fd, trailer, sizeof(trailer),
+            sb.st_size - AXL_PACK_TRAILER_SIZE) != AXL_SUCCESS)
+    {
+        goto fail;
+    }
+
+    uint64_t file_size    = (uint64_t) sb.st_size;
+    uint64_t index_offset = axl_get_le64(trailer);
+    uint64_t count        = axl_get_le64(trailer + 8);
+    if (memcmp(trailer + 16, AXL_PACK_MAGIC, 4) != 0 ||
+        axl_get_le32(trailer + 20) != AXL_PACK_VERSION ||
+        index_offset < AXL_PACK_HEADER_SIZE ||
+        index_offset > file_size - AXL_PACK_TRAILER_SIZE)
+    {
+        AXL_ERR("%s is not a complete AXL container", file);
+        goto fail;
+    }
+
+    size_t len = (size_t) (file_size - AXL_PACK_TRAILER_SIZE - index_offset);
+    buf = malloc(len ? len : 1);
+    if (! buf || axl_pread_all(file, fd, buf, len, (off_t) index_offset) != AXL_SUCCESS) {
+        goto fail;
+    }
+
+    /* the entries are sorted by name, so we can stop once we pass it */
+    size_t name_len = strlen(name);
+    const unsigned char* p = buf;
+    const unsigned char* end = buf + len;
+    uint64_t i;
+    for (i = 0; i < count; i++) {
+        if ((size_t) (end - p) < AXL_PACK_ENTRY_SIZE) {
+            break;
+        }
+        uint32_t entry_len = axl_get_le32(p + 36);
+        if ((size_t) (end - p) - AXL_PACK_ENTRY_SIZE < entry_len) {
+            break;
+        }
+
+        const char* entry_name = (const char*) p + AXL_PACK_ENTRY_SIZE;
+        size_t n = AXL_MIN((size_t) entry_len, name_len);
+        int cmp = memcmp(entry_name, name, n);
+        if (cmp == 0) {
+            cmp = (entry_len > name_len) - (entry_len < name_len);
+        }
+        if (cmp > 0) {
+            break;
+        }
+        if (cmp == 0) {
+            m->offset     = axl_get_le64(p);
+            m->size       = axl_get_le64(p + 8);
+            m->crc        = axl_get_le32(p + 16);
+            m->mode       = axl_get_le32(p + 20);
+            m->mtime_sec  = axl_get_le64(p + 24);
+            m->mtime_nsec = axl_get_le32(p + 32);
+            if (m->offset < AXL_PACK_HEADER_SIZE || m->offset > index_offset ||
+                m->size > index_offset - m->offset)
+            {
+                AXL_ERR("Container %s has a bad index entry for %s", file, name);
+                goto fail;
+            }
+            m->name = name;
+            free(buf);
+            *container_file = file;
+            return fd;
+        }
+        p += AXL_PACK_ENTRY_SIZE + entry_len;
+    }
+    AXL_DBG(1, "%s is not in container %s", name, file);
+
+fail:
+    free(buf);
+    close(fd);
+    free(file);
+    free(name);
+    return -1;
+}
+
+/* Look up a file that was packed rather than copied to destination */
+int AXL_Pack_lookup(const char* destination, unsigned long* size)
+{
+    char* file = NULL;
+    struct axl_pack_member m;
+    int fd = axl_pack_find(destination, &file, &m);
+    if (fd < 0) {
+        return AXL_FAILURE;
+    }
+    close(fd);
+    free(file);
+    free(m.name);
+
+    if (size) {
+        *size = (unsigned long) m.size;
+    }
+    return AXL_SUCCESS;
+}
+
+/* Extract a file that was packed rather than copied to destination */
+int AXL_Pack_extract(const char* destination, const char* path)
+{
+    char* file = NULL;
+    struct axl_pack_member m;
+    int fd = axl_pack_find(destination, &file, &m);
+    if (fd < 0) {
+        AXL_ERR("Could not find %s in a container", destination);
+        return AXL_FAILURE;
+    }
+
+    int rc = AXL_FAILURE;
+    unsigned char* buf = NULL;
+    mode_t mode_file = axl_getmode(1, 1, 0);
+    int dst_fd = axl_open(path, O_WRONLY | O_CREAT | O_TRUNC, mode_file);
+    if (dst_fd < 0) {
+        AXL_ERR("Opening file for writing: axl_open(%s) errno=%d %s",
+            path, errno, strerror(errno)
+        );
+        goto out;
+    }
+
+    size_t buf_size = (size_t) AXL_MIN((uint64_t) axl_file_buf_size, m.size);
+    if (buf_size > 0 && ! (buf = (unsigned char*) axl_buf_get(buf_size))) {
+        AXL_ERR("Allocating buffer to extract %s", path);
+        goto out;
+    }
+
+    uint32_t crc = 0;
+    uint64_t done = 0;
+    while (done < m.size) {
+        size_t n = (size_t) AXL_MIN((uint64_t) buf_size, m.size - done);
+        if (axl_pread_all(file, fd, buf, n, (off_t) (m.offset + done)) != AXL_SUCCESS ||
+            axl_pwrite_all(path, dst_fd, buf, n, (off_t) done) != AXL_SUCCESS)
+        {
+            goto out;
+        }
+        crc = axl_hash(AXL_CRC_CRC32C, crc, buf, n);
+        done += n;
+    }
+    if (crc != m.crc) {
+        AXL_ERR("%s in container %s is corrupt", m.name, file);
+        goto out;
+    }
+
+    /* give the file the mode and mtime it was packed with */
+    struct timespec times[2] = {
+        { .tv_sec = 0, .tv_nsec = UTIME_OMIT },
+        { .tv_sec = (time_t) m.mtime_sec, .tv_nsec = (long) m.mtime_nsec },
+    };
+    if (fchmod(dst_fd, (mode_t) (m.mode & 07777)) != 0 ||
+        futimens(dst_fd, times) != 0)
+    {
+        AXL_ERR("Setting mode and mtime of %s: errno=%d %s",
+            path, errno, strerror(errno)
+        );
+        goto out;
+    }
+    rc = AXL_SUCCESS;
+
+out:
+    if (dst_fd >= 0) {
+        if (axl_close(path, dst_fd) != AXL_SUCCESS) {
+            rc = AXL_FAILURE;
+        }
+        if (rc != AXL_SUCCESS) {
+            axl_file_unlink(path);
+        }
+    }
+    axl_buf_put(buf);
+    close(fd);
+    free(file);
+    free(m.name);
+    return rc;
+}
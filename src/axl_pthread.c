@@ -1,7 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <signal.h>
 #include <assert.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "axl_internal.h"
 #include "kvtree_util.h"
 #include "axl_pthread.h"
@@ -14,23 +22,92 @@
 #include <sys/sysinfo.h>
 #endif
 
-#define AXL_MIN(a,b) (a < b ? a : b)
-
-/*  We default our number of threads to the lesser of:
+/*  The worker pool has the lesser of these number of threads:
  *
- *  - The number of CPU threads
- *  - MAX_THREADS
- *  - The number of files being transferred */
+ *  - The number of CPU threads (or AXL_PTHREAD_THREADS, if set)
+ *  - MAX_THREADS */
 
 /* We don't see much scaling past 16 threads */
 #define MAX_THREADS 16
 
-struct axl_work
+/* Files at least twice this size are split into chunks of this size, which
+ * are copied by several threads at once.  This can be overridden with the
+ * AXL_PTHREAD_CHUNK_SIZE environment variable, where 0 disables splitting. */
+#define AXL_PTHREAD_CHUNK_SIZE (64UL * 1024UL * 1024UL)
+
+/* If set, a thread that runs out of work takes over the second half of the
+ * uncopied part of a chunk another thread is still copying, as long as
+ * that leaves each thread at least this much to copy, and files at least
+ * twice this size are copied as chunks (of up to AXL_PTHREAD_CHUNK_SIZE)
+ * so they can be split this way.  It's off unless the
+ * AXL_PTHREAD_SPLIT_SIZE environment variable sets it. */
+#define AXL_PTHREAD_SPLIT_SIZE (0)
+
+/* Split points are rounded up to a multiple of this */
+#define AXL_PTHREAD_SPLIT_ALIGN (4096)
+
+/* How often AXL_Wait() and AXL_Cancel() check whether the workers are done */
+#define AXL_PTHREAD_WAIT_USLEEP (1000)
+
+/* A file that has been split into chunks */
+struct axl_chunked_file
 {
-    struct axl_work* next;
+    /* This struct is in a linked list, so we can free it */
+    struct axl_chunked_file* next;
+
+    /* Number of chunks the file was split into, and how many of those
+     * are finished.  Splitting a running chunk adds one. */
+    atomic_uint chunks;
+    atomic_uint chunks_done;
+
+    /* Set if any chunk failed */
+    atomic_int error;
+
+    /* When compressing, the compressed file the chunks write their blocks
+     * to, which the last chunk finishes.  When decompressing, the index of
+     * the compressed source file. */
+    struct axl_zwriter* zw;
+    struct axl_zindex* zi;
+};
 
+struct axl_work
+{
     /* The file element in the kvtree */
     kvtree_elem* elem;
+
+    /* If this is a chunk of a larger file, the file it belongs to and the
+     * byte range to copy.  file is NULL when copying the whole file, in
+     * which case length is the file's size, used only for scheduling. */
+    struct axl_chunked_file* file;
+    off_t offset;
+    off_t length;
+};
+
+/* A chunk that a pool thread is copying.  Threads that run out of work
+ * split off the end of the range for themselves. */
+struct axl_inflight
+{
+    /* The transfer's split_lock, which protects the fields below */
+    pthread_mutex_t* lock;
+
+    /* The item being copied, NULL if the thread isn't copying a chunk */
+    struct axl_work* work;
+
+    /* The copy has claimed the bytes before claimed, and stops at end */
+    off_t claimed;
+    off_t end;
+};
+
+/* A Chase-Lev work-stealing deque over a fixed set of work items.  All of a
+ * transfer's items are dealt out to the deques before the transfer is handed
+ * to the pool, so nothing is pushed afterwards.  The pool thread that owns
+ * a deque pops items from the bottom, and any other thread can steal from
+ * the top. */
+struct axl_deque
+{
+    atomic_long top;
+    atomic_long bottom;
+    struct axl_work** items;
 };
 
 struct axl_pthread_data
@@ -44,28 +121,85 @@ struct axl_pthread_data
     /* If resume = 1, try to resume old transfers */
     int resume;
 
-    /* Number of threads */
-    unsigned int threads;
-
     /* This struct is in a linked list */
     struct axl_pthread_data* next;
 
-    /* Lock to protect workqueue */
+    /* Our work items, in one array */
+    struct axl_work* work;
+    size_t count;
+    size_t capacity;
+
+    /* The work items, dealt out across one deque per pool thread */
+    struct axl_work** slots;
+    struct axl_deque* deques;
+    unsigned int ndeques;
+
+    /* Tracks count of work items still to be completed.  It starts at the
+     * number of items queued, and a worker decrements it when it completes
+     * an item.  The main thread tests whether this count has reached 0 to
+     * know that all work is done. */
+    atomic_ulong remain;
+
+    /* Files we've split into chunks */
+    struct axl_chunked_file* chunked;
+
+    /* The chunks being copied, one slot per pool thread, so idle threads
+     * can split them */
+    struct axl_inflight* inflight;
+    pthread_mutex_t split_lock;
+    off_t split_size;
+
+    /* Number of workers taking items from our deques.  We can't free the
+     * deques until this drops to 0. */
+    atomic_uint active;
+
+    /* The fields below are protected by the pool lock */
+
+    /* Set while we're on the pool's list of transfers with queued work */
+    int queued;
+    struct axl_pthread_data* next_job;
+
+    /* Set by AXL_Cancel().  Copies in progress poll this to stop early,
+     * so it is read without the lock. */
+    volatile int canceled;
+
+    /* Held by workers while they update the file_list kvtree, since they
+     * save the state file as they record manifest blocks */
+    pthread_mutex_t state_lock;
+};
+
+/* The worker pool shared by all pthread transfers.  The threads are started
+ * in AXL_Init() and stopped in AXL_Finalize(), so dispatching a transfer
+ * only queues its work.  Transfers that overlap share the same threads,
+ * which caps the number of copies running on the node at once. */
+static struct axl_pthread_pool
+{
+    /* Lock to protect the pool, along with the job list fields of every
+     * axl_pthread_data */
     pthread_mutex_t lock;
 
-    /* Our workqueue */
-    struct axl_work* head;
-    struct axl_work* tail;
+    /* Workers wait on this for work to be queued */
+    pthread_cond_t work;
 
-    /* Tracks count of work items still to be completed.
-     * The main thread increments this with each item it adds to the queue.
-     * Each thread decrements this counter when it completes an item.
-     * After starting the threads, the main thread tests whether
-     * this count has reached 0 to know that all work is done. */
-    unsigned int remain;
+    /* Transfers that have queued work.  An idle worker joins the first
+     * transfer and moves it to the back, so transfers share the pool. */
+    struct axl_pthread_data* head;
+    struct axl_pthread_data* tail;
+
+    /* Number of transfers on the list, read without the lock by workers
+     * checking whether they should move on to another transfer */
+    atomic_uint jobs;
 
-    /* Array of our thread IDs */
+    /* Our worker threads */
     pthread_t* tid;
+    unsigned int threads;
+
+    /* Set by AXL_Finalize() to stop the workers, read without the lock by
+     * workers checking whether to take another item */
+    atomic_int shutdown;
+} axl_pthread_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
 };
 
 /* This is a linked list that is used to lookup which axl_pthread_data is
@@ -109,6 +243,8 @@ unsigned int axl_get_nprocs(void)
     return cpu_threads;
 }
 
+static void axl_pthread_free_pdata(struct axl_pthread_data* pdata);
+
 /* Get the pthread data for a given AXL ID */
 struct axl_pthread_data* axl_pthread_data_lookup(int id)
 {
@@ -179,149 +315,913 @@ void axl_pthread_data_remove(int id)
     pthread_mutex_unlock(&axl_all_pthread_data.lock);
 }
 
-/* The actual pthread function */
-static void* axl_pthread_func(void* arg)
+/* Get the chunk size for splitting large files, see AXL_PTHREAD_CHUNK_SIZE */
+static unsigned long axl_pthread_chunk_size(void)
 {
-    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+    char* env = getenv("AXL_PTHREAD_CHUNK_SIZE");
+    if (! env) {
+        return AXL_PTHREAD_CHUNK_SIZE;
+    }
+    return strtoul(env, 0, 10);
+}
 
-    struct axl_pthread_data* pdata = arg;
-    while (1) {
-        pthread_mutex_lock(&pdata->lock);
+/* Get the smallest piece to split off a running chunk, see
+ * AXL_PTHREAD_SPLIT_SIZE */
+static unsigned long axl_pthread_split_size(void)
+{
+    char* env = getenv("AXL_PTHREAD_SPLIT_SIZE");
+    if (! env) {
+        return AXL_PTHREAD_SPLIT_SIZE;
+    }
+    return strtoul(env, 0, 10);
+}
 
-        /* Get a file to transfer */
-        struct axl_work* work = pdata->head;
-        if (! work) {
-            /* No more work to do */
-            pthread_mutex_unlock(&pdata->lock);
-            break;
+/* Count a finished chunk of a file.  The thread that finishes the last
+ * chunk syncs the file.  Returns AXL_SUCCESS once the last chunk is done
+ * and the whole file was copied, AXL_FAILURE if the file failed, or 1 if
+ * other chunks are still outstanding. */
+static int axl_pthread_chunk_done(struct axl_pthread_data* pdata,
+    struct axl_work* work, const char* dst, const struct axl_copy_opts* opts,
+    int rc)
+{
+    struct axl_chunked_file* file = work->file;
+
+    if (rc != AXL_SUCCESS) {
+        atomic_store(&file->error, 1);
+    }
+    if (atomic_fetch_add(&file->chunks_done, 1) + 1 < atomic_load(&file->chunks)) {
+        return 1;
+    }
+
+    if (file->zw) {
+        /* Every block is in, so write the index, which syncs the file */
+        rc = axl_zwriter_close(file->zw,
+            atomic_load(&file->error) ? AXL_FAILURE : AXL_SUCCESS);
+        file->zw = NULL;
+        if (rc != AXL_SUCCESS) {
+            atomic_store(&file->error, 1);
         } else {
-            /* Take our work out of the queue */
-            pdata->head = pdata->head->next;
-            pthread_mutex_unlock(&pdata->lock);
+            return AXL_SUCCESS;
         }
+    }
 
-        /* Get kvtree for this file */
-        kvtree_elem* elem = work->elem;
-        kvtree* elem_hash = kvtree_elem_hash(elem);
+    if (atomic_load(&file->error)) {
+        /* unlink the file if the copy failed, but keep it if we were
+         * canceled so that the transfer can be resumed */
+        if (! pdata->canceled) {
+            axl_file_unlink(dst);
+        }
+        return AXL_FAILURE;
+    }
 
-        /* Get source file name */
-        char* src = kvtree_elem_key(elem);
+    /* The chunks were written without syncing, sync the file once here
+     * if the policy asks for it */
+    if (opts->sync != AXL_SYNC_ALL && opts->sync != AXL_SYNC_DEST) {
+        return AXL_SUCCESS;
+    }
+    int fd = axl_open(dst, O_WRONLY);
+    if (fd < 0) {
+        AXL_ERR("Opening file for sync: axl_open(%s) errno=%d %s",
+            dst, errno, strerror(errno)
+        );
+        return AXL_FAILURE;
+    }
+    return axl_close(dst, fd);
+}
 
-        /* Lookup destination filename */
-        char* dst = NULL;
-        kvtree_util_get_str(elem_hash, AXL_KEY_FILE_DEST, &dst);
+/* Append a transfer to the pool's list of transfers with queued work.
+ * We assume the pool lock is already held. */
+static void axl_pthread_job_enqueue(struct axl_pthread_data* pdata)
+{
+    atomic_fetch_add(&axl_pthread_pool.jobs, 1);
+    pdata->queued   = 1;
+    pdata->next_job = NULL;
+    if (! axl_pthread_pool.head) {
+        axl_pthread_pool.head = pdata;
+    } else {
+        axl_pthread_pool.tail->next_job = pdata;
+    }
+    axl_pthread_pool.tail = pdata;
+}
+
+/* Remove a transfer from the pool's list of transfers with queued work.
+ * We assume the pool lock is already held. */
+static void axl_pthread_job_dequeue(struct axl_pthread_data* pdata)
+{
+    struct axl_pthread_data* prev = NULL;
+    struct axl_pthread_data* job = axl_pthread_pool.head;
+    while (job) {
+        if (job == pdata) {
+            if (prev) {
+                prev->next_job = job->next_job;
+            } else {
+                axl_pthread_pool.head = job->next_job;
+            }
+            if (axl_pthread_pool.tail == job) {
+                axl_pthread_pool.tail = prev;
+            }
+            atomic_fetch_sub(&axl_pthread_pool.jobs, 1);
+            break;
+        }
+        prev = job;
+        job = job->next_job;
+    }
+    pdata->queued   = 0;
+    pdata->next_job = NULL;
+}
+
+/* Pop an item from the bottom of a deque we own, NULL if it's empty */
+static struct axl_work* axl_deque_pop(struct axl_deque* q)
+{
+    long b = atomic_load_explicit(&q->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&q->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&q->top, memory_order_relaxed);
+
+    if (t > b) {
+        /* empty */
+        atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    struct axl_work* work = q->items[b];
+    if (t == b) {
+        /* This is the last item, so we race the thieves for it */
+        if (! atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1,
+            memory_order_seq_cst, memory_order_relaxed))
+        {
+            work = NULL;
+        }
+        atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+    }
+    return work;
+}
+
+/* Steal an item from the top of another thread's deque, NULL if it's empty */
+static struct axl_work* axl_deque_steal(struct axl_deque* q)
+{
+    long t = atomic_load_explicit(&q->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&q->bottom, memory_order_acquire);
+
+    while (t < b) {
+        struct axl_work* work = q->items[t];
+        if (atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1,
+            memory_order_seq_cst, memory_order_relaxed))
+        {
+            return work;
+        }
+
+        /* Someone else took item t, and t now holds the new top */
+        atomic_thread_fence(memory_order_seq_cst);
+        b = atomic_load_explicit(&q->bottom, memory_order_acquire);
+    }
+    return NULL;
+}
+
+/* Take the next work item for pool thread self: first from its own deque,
+ * then from the others.  Since nothing is pushed once the transfer starts,
+ * NULL means every item has been taken. */
+static struct axl_work* axl_pthread_take(struct axl_pthread_data* pdata, unsigned int self)
+{
+    struct axl_work* work = NULL;
+    if (self < pdata->ndeques) {
+        work = axl_deque_pop(&pdata->deques[self]);
+    }
+
+    unsigned int i;
+    for (i = 1; work == NULL && i <= pdata->ndeques; i++) {
+        work = axl_deque_steal(&pdata->deques[(self + i) % pdata->ndeques]);
+    }
+    return work;
+}
+
+/* The axl_copy_opts claim function for chunks, lets axl_file_copy_range()
+ * copy up to the end of its range, which may have been moved by a split */
+static off_t axl_pthread_claim(void* arg, off_t offset, off_t want)
+{
+    struct axl_inflight* inflight = (struct axl_inflight*) arg;
+
+    pthread_mutex_lock(inflight->lock);
+    off_t n = AXL_MIN(want, inflight->end - offset);
+    if (n < 0) {
+        n = 0;
+    }
+    if (offset + n > inflight->claimed) {
+        inflight->claimed = offset + n;
+    }
+    pthread_mutex_unlock(inflight->lock);
+
+    return n;
+}
+
+/* Look for the running chunk with the most left to copy, and if it's worth
+ * splitting, take the second half of what's left of it into piece.  Returns
+ * piece, or NULL if no chunk is worth splitting. */
+static struct axl_work* axl_pthread_split(struct axl_pthread_data* pdata,
+    struct axl_work* piece)
+{
+    if (pdata->split_size == 0 || pdata->canceled) {
+        return NULL;
+    }
+
+    struct axl_work* work = NULL;
+
+    pthread_mutex_lock(&pdata->split_lock);
+
+    struct axl_inflight* slowest = NULL;
+    unsigned int i;
+    for (i = 0; i < pdata->ndeques; i++) {
+        struct axl_inflight* inflight = &pdata->inflight[i];
+        if (inflight->work && (! slowest ||
+            inflight->end - inflight->claimed > slowest->end - slowest->claimed))
+        {
+            slowest = inflight;
+        }
+    }
+
+    if (slowest && slowest->end - slowest->claimed >= 2 * pdata->split_size) {
+        off_t left = slowest->end - slowest->claimed;
+        off_t split = slowest->claimed + left / 2;
+        split = (split + AXL_PTHREAD_SPLIT_ALIGN - 1) /
+            AXL_PTHREAD_SPLIT_ALIGN * AXL_PTHREAD_SPLIT_ALIGN;
+        if (split < slowest->end) {
+            *piece = *slowest->work;
+            piece->offset = split;
+            piece->length = slowest->end - split;
+            slowest->end = split;
+
+            AXL_DBG(2, "Splitting %s at offset %lu",
+                kvtree_elem_key(piece->elem), (unsigned long) split);
+
+            /* The file now has one more chunk, and the transfer one more
+             * item.  The chunk we split can't finish before we count these,
+             * since it still has bytes left to copy. */
+            atomic_fetch_add(&piece->file->chunks, 1);
+            atomic_fetch_add(&pdata->remain, 1);
+            work = piece;
+        }
+    }
+
+    pthread_mutex_unlock(&pdata->split_lock);
+
+    return work;
+}
+
+/* The file whose manifest axl_pthread_manifest_update() records */
+struct axl_pthread_manifest_arg {
+    struct axl_pthread_data* pdata;
+    const char* src;
+};
+
+/* The axl_copy_opts manifest_update function, records a block of a file
+ * and saves it in the state file so the copy can be resumed from there */
+static void axl_pthread_manifest_update(void* arg, kvtree* manifest,
+    unsigned long block, const uint32_t* crc)
+{
+    struct axl_pthread_manifest_arg* m = (struct axl_pthread_manifest_arg*) arg;
+    struct axl_pthread_data* pdata = m->pdata;
+
+    pthread_mutex_lock(&pdata->state_lock);
+    axl_manifest_record(pdata->id, m->src, manifest, block, crc);
+    pthread_mutex_unlock(&pdata->state_lock);
+}
+
+/* Record that a chunk of a file, up to end, is in its destination, so a
+ * resumed transfer can skip it.  This is only worth doing if there's a
+ * state file to resume from.  Like manifest blocks, the chunk is synced
+ * first, whatever the sync policy. */
+static int axl_pthread_chunk_record(struct axl_pthread_data* pdata,
+    struct axl_work* work, const char* src, const char* dst, off_t end)
+{
+    char* state_file = NULL;
+    if (kvtree_util_get_str(pdata->file_list, AXL_KEY_STATE_FILE,
+        &state_file) != KVTREE_SUCCESS)
+    {
+        return AXL_SUCCESS;
+    }
+
+    int fd = axl_open(dst, O_WRONLY);
+    if (fd < 0) {
+        AXL_ERR("Opening file for sync: axl_open(%s) errno=%d %s",
+            dst, errno, strerror(errno)
+        );
+        return AXL_FAILURE;
+    }
+    int rc = AXL_SUCCESS;
+    if (fdatasync(fd) != 0) {
+        AXL_ERR("fdatasync(%s) failed errno=%d %s",
+            dst, errno, strerror(errno)
+        );
+        rc = AXL_FAILURE;
+    }
+    close(fd);
+    if (rc != AXL_SUCCESS) {
+        return rc;
+    }
 
-        const kvtree* file_list = pdata->file_list;
+    char key[32];
+    snprintf(key, sizeof(key), "%lu", (unsigned long) work->offset);
 
-        unsigned long file_buf_size;
-        int success = kvtree_util_get_bytecount(file_list,
-            AXL_KEY_CONFIG_FILE_BUF_SIZE, &file_buf_size);
-        assert(success == KVTREE_SUCCESS);
+    pthread_mutex_lock(&pdata->state_lock);
+    kvtree* elem_hash = kvtree_elem_hash(work->elem);
+    kvtree* chunks = kvtree_get(elem_hash, AXL_KEY_FILE_CHUNKS);
+    if (! chunks) {
+        chunks = kvtree_set(elem_hash, AXL_KEY_FILE_CHUNKS, kvtree_new());
+    }
+    kvtree_util_set_bytecount(chunks, key, (unsigned long) end);
+    axl_write_state_record(pdata->id, src, AXL_KEY_FILE_CHUNKS, key);
+    pthread_mutex_unlock(&pdata->state_lock);
+
+    return AXL_SUCCESS;
+}
 
-        /* Copy the file from soruce to destination */
-        int rc = axl_file_copy(src, dst, file_buf_size, pdata->resume);
+/* Copy one work item and record the outcome in the file's kvtree */
+static void axl_pthread_copy(struct axl_pthread_data* pdata, struct axl_work* work,
+    unsigned int self)
+{
+    /* Get kvtree for this file */
+    kvtree_elem* elem = work->elem;
+    kvtree* elem_hash = kvtree_elem_hash(elem);
+
+    /* Get source file name */
+    char* src = kvtree_elem_key(elem);
+
+    /* Lookup destination filename */
+    char* dst = NULL;
+    kvtree_util_get_str(elem_hash, AXL_KEY_FILE_DEST, &dst);
+
+    const kvtree* file_list = pdata->file_list;
+
+    struct axl_copy_opts opts;
+    int success = axl_copy_opts_load(file_list, &opts);
+    assert(success == AXL_SUCCESS);
+
+    /* let AXL_Cancel() interrupt the copy */
+    opts.cancel = &pdata->canceled;
+
+    int rc;
+    if (work->file) {
+        /* Copy our chunk of the file, letting idle threads split it */
+        struct axl_inflight* inflight = &pdata->inflight[self];
+        pthread_mutex_lock(&pdata->split_lock);
+        inflight->work    = work;
+        inflight->claimed = work->offset;
+        inflight->end     = work->offset + work->length;
+        pthread_mutex_unlock(&pdata->split_lock);
+
+        opts.claim      = axl_pthread_claim;
+        opts.claim_arg  = inflight;
+        opts.claim_step = pdata->split_size;
+
+        if (work->file->zw) {
+            rc = axl_compress_range(src, work->file->zw, &opts,
+                work->offset, work->length);
+        } else if (work->file->zi) {
+            rc = axl_decompress_range(src, dst, work->file->zi, &opts,
+                work->offset, work->length);
+        } else {
+            rc = axl_file_copy_range(src, dst, &opts, work->offset, work->length);
+        }
+
+        pthread_mutex_lock(&pdata->split_lock);
+        off_t end = inflight->end;
+        inflight->work = NULL;
+        pthread_mutex_unlock(&pdata->split_lock);
+
+        AXL_DBG(2, "%s: Read and copied %s to %s offset %lu length %lu, rc %d",
+            __func__, src, dst, (unsigned long) work->offset,
+            (unsigned long) (end - work->offset), rc);
+
+        if (rc == AXL_SUCCESS && end > work->offset &&
+            ! work->file->zw && ! work->file->zi)
+        {
+            rc = axl_pthread_chunk_record(pdata, work, src, dst, end);
+        }
+
+        rc = axl_pthread_chunk_done(pdata, work, dst, &opts, rc);
+    } else {
+        struct axl_pthread_manifest_arg manifest_arg = { pdata, src };
+        opts.manifest        = kvtree_get(elem_hash, AXL_KEY_FILE_MANIFEST);
+        opts.manifest_update = axl_pthread_manifest_update;
+        opts.manifest_arg    = &manifest_arg;
+
+        /* Copy the file from soruce to destination, or pack it if it's
+         * small */
+        uLong crc;
+        if (axl_pack_is_packed(elem_hash)) {
+            rc = axl_pack_file(pdata->id, src, dst, &opts, &crc);
+        } else {
+            /* a destination preallocated for chunks can't be resumed from
+             * its end */
+            int resume = pdata->resume &&
+                ! kvtree_get(elem_hash, AXL_KEY_FILE_CHUNKS);
+            rc = axl_file_copy(src, dst, &opts, resume, &crc);
+        }
         AXL_DBG(2, "%s: Read and copied %s to %s, rc %d",
             __func__, src, dst, rc);
+        if (rc == AXL_SUCCESS && opts.crc) {
+            pthread_mutex_lock(&pdata->state_lock);
+            kvtree_util_set_crc32(elem_hash, AXL_KEY_FILE_CRC, crc);
+            pthread_mutex_unlock(&pdata->state_lock);
+        }
+    }
 
-        /* Record the success/failure of the individual file transfer */
-        if (rc == AXL_SUCCESS) {
-            kvtree_util_set_int(elem_hash, AXL_KEY_FILE_STATUS, AXL_STATUS_DEST);
-        } else {
-            kvtree_util_set_int(elem_hash, AXL_KEY_FILE_STATUS, AXL_STATUS_ERROR);
+    /* Record the success/failure of the individual file transfer, once all
+     * of its chunks are done.  A copy cut short by AXL_Cancel() leaves the
+     * file's status alone. */
+    pthread_mutex_lock(&pdata->state_lock);
+    if (rc == AXL_SUCCESS) {
+        kvtree_util_set_int(elem_hash, AXL_KEY_FILE_STATUS, AXL_STATUS_DEST);
+    } else if (rc == AXL_FAILURE && ! pdata->canceled) {
+        kvtree_util_set_int(elem_hash, AXL_KEY_FILE_STATUS, AXL_STATUS_ERROR);
+    }
+    pthread_mutex_unlock(&pdata->state_lock);
+}
+
+/* The worker thread function, arg is the thread's index in the pool */
+static void* axl_pthread_func(void* arg)
+{
+    unsigned int self = (unsigned int) (uintptr_t) arg;
+
+    pthread_mutex_lock(&axl_pthread_pool.lock);
+    while (1) {
+        /* Wait for a transfer to have work for us */
+        while (! atomic_load(&axl_pthread_pool.shutdown) && ! axl_pthread_pool.head) {
+            pthread_cond_wait(&axl_pthread_pool.work, &axl_pthread_pool.lock);
         }
+        if (atomic_load(&axl_pthread_pool.shutdown)) {
+            break;
+        }
+
+        /* Join the first transfer, and move it to the back of the list so
+         * the next idle worker starts on another transfer */
+        struct axl_pthread_data* pdata = axl_pthread_pool.head;
+        axl_pthread_job_dequeue(pdata);
+        axl_pthread_job_enqueue(pdata);
+        atomic_fetch_add(&pdata->active, 1);
+        pthread_mutex_unlock(&axl_pthread_pool.lock);
+
+        /* Copy items until they're all taken, or until another transfer is
+         * waiting for workers.  Once the items are all taken, help out by
+         * splitting chunks that other threads are still copying. */
+        int drained = 0;
+        while (! pdata->canceled && ! atomic_load(&axl_pthread_pool.shutdown)) {
+            struct axl_work piece;
+            struct axl_work* work = axl_pthread_take(pdata, self);
+            if (! work) {
+                work = axl_pthread_split(pdata, &piece);
+            }
+            if (! work) {
+                drained = 1;
+                break;
+            }
 
-        free(work);
+            axl_pthread_copy(pdata, work, self);
 
-        /* record that one more work item is done (though perhaps with an error) */
-        pthread_mutex_lock(&pdata->lock);
-        pdata->remain -= 1;
-        pthread_mutex_unlock(&pdata->lock);
+            /* record that one more work item is done (though perhaps with an error) */
+            atomic_fetch_sub(&pdata->remain, 1);
+
+            if (atomic_load_explicit(&axl_pthread_pool.jobs, memory_order_relaxed) > 1) {
+                break;
+            }
+        }
+
+        pthread_mutex_lock(&axl_pthread_pool.lock);
+        if (drained && pdata->queued) {
+            /* Every item has been taken, so there's nothing here for
+             * anyone else */
+            axl_pthread_job_dequeue(pdata);
+        }
+        atomic_fetch_sub(&pdata->active, 1);
+    }
+    pthread_mutex_unlock(&axl_pthread_pool.lock);
+
+    return NULL;
+}
+
+/* Start the worker pool, called from AXL_Init() */
+int axl_pthread_init(void)
+{
+    unsigned int threads = AXL_MIN(axl_get_nprocs(), MAX_THREADS);
+
+    /* Let tests and users pick the number of threads */
+    char* env = getenv("AXL_PTHREAD_THREADS");
+    if (env && atoi(env) > 0) {
+        threads = AXL_MIN((unsigned int) atoi(env), MAX_THREADS);
+    }
+
+    axl_pthread_pool.tid = calloc(threads, sizeof(axl_pthread_pool.tid[0]));
+    if (! axl_pthread_pool.tid) {
+        return AXL_FAILURE;
+    }
+
+    atomic_store(&axl_pthread_pool.shutdown, 0);
+    axl_pthread_pool.threads = 0;
+
+    /* The workers inherit our signal mask.  Block all signals while we
+     * create them so that signals sent to the process are handled by the
+     * application's threads.  A handler that calls AXL_Cancel() on a worker
+     * would wait forever for the copy it interrupted. */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    unsigned int i;
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&axl_pthread_pool.tid[i], NULL, &axl_pthread_func,
+            (void*) (uintptr_t) i) != 0)
+        {
+            break;
+        }
+        axl_pthread_pool.threads++;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    /* we can make do with fewer threads, but not with none */
+    if (axl_pthread_pool.threads == 0) {
+        AXL_ERR("Couldn't spawn any worker threads");
+        axl_free(&axl_pthread_pool.tid);
+        return AXL_FAILURE;
     }
 
     return AXL_SUCCESS;
 }
 
-static struct axl_pthread_data* axl_pthread_create_thread_data(unsigned int threads)
+/* Stop the worker pool, called from AXL_Finalize().  Workers finish the
+ * item they are copying, but don't start any more, so this waits for at
+ * most one item per worker.  Items left in a queue are never copied. */
+int axl_pthread_finalize(void)
+{
+    pthread_mutex_lock(&axl_pthread_pool.lock);
+    atomic_store(&axl_pthread_pool.shutdown, 1);
+    pthread_cond_broadcast(&axl_pthread_pool.work);
+    pthread_mutex_unlock(&axl_pthread_pool.lock);
+
+    int rc = AXL_SUCCESS;
+    unsigned int i;
+    for (i = 0; i < axl_pthread_pool.threads; i++) {
+        if (pthread_join(axl_pthread_pool.tid[i], NULL) != 0) {
+            rc = AXL_FAILURE;
+        }
+    }
+
+    axl_free(&axl_pthread_pool.tid);
+    axl_pthread_pool.threads = 0;
+    axl_pthread_pool.head    = NULL;
+    axl_pthread_pool.tail    = NULL;
+    atomic_store(&axl_pthread_pool.jobs, 0);
+
+    /* The transfers still running will never finish now.  Forget them, or
+     * a transfer resumed after the next AXL_Init() with the same id would
+     * find one of them and wait for its items forever. */
+    pthread_mutex_lock(&axl_all_pthread_data.lock);
+    struct axl_pthread_data* pdata = axl_all_pthread_data.head;
+    axl_all_pthread_data.head = NULL;
+    axl_all_pthread_data.tail = NULL;
+    while (pdata) {
+        struct axl_pthread_data* next = pdata->next;
+        axl_pthread_free_pdata(pdata);
+        pdata = next;
+    }
+    pthread_mutex_unlock(&axl_all_pthread_data.lock);
+
+    return rc;
+}
+
+static struct axl_pthread_data* axl_pthread_create_thread_data(size_t capacity)
 {
     struct axl_pthread_data* pdata = calloc(1, sizeof(*pdata));
     if (! pdata) {
         return NULL;
     }
 
-    if (pthread_mutex_init(&pdata->lock, NULL) != 0) {
-        free(pdata);
-        return NULL;
+    /* Size the work array for one item per file.  It only grows if we
+     * split files into chunks. */
+    if (capacity > 0) {
+        pdata->work = malloc(capacity * sizeof(pdata->work[0]));
+        if (! pdata->work) {
+            free(pdata);
+            return NULL;
+        }
     }
+    pdata->count    = 0;
+    pdata->capacity = capacity;
 
-    pdata->tid = calloc(threads, sizeof(pdata->tid[0]));
-    if (! pdata->tid) {
-        free(pdata);
-        return NULL;
-    }
+    atomic_init(&pdata->remain, 0);
+    atomic_init(&pdata->active, 0);
 
-    pdata->threads = threads;
-    pdata->head    = NULL;
-    pdata->tail    = NULL;
-    pdata->remain  = 0;
+    pthread_mutex_init(&pdata->split_lock, NULL);
+    pthread_mutex_init(&pdata->state_lock, NULL);
 
     return pdata;
 }
 
-/* Free up our axl_pthread_data.  We assume no one is competing for the lock. */
+/* Free up our axl_pthread_data.  We assume no worker is still using it. */
 static void axl_pthread_free_pdata(struct axl_pthread_data* pdata)
 {
-    /* Free our workqueue item first (if any).  If our transfer completed
-     * successfully, all workqueue entries would have already been freed. */
-    struct axl_work* work = pdata->head;
-    while (pdata->head) {
-        work = pdata->head->next;
-        free(pdata->head);
-        pdata->head = work;
+    while (pdata->chunked) {
+        struct axl_chunked_file* file = pdata->chunked->next;
+
+        /* a canceled transfer may leave a compressed file unfinished */
+        if (pdata->chunked->zw) {
+            axl_zwriter_close(pdata->chunked->zw, AXL_FAILURE);
+        }
+        axl_zindex_free(pdata->chunked->zi);
+        free(pdata->chunked);
+        pdata->chunked = file;
     }
 
-    free(pdata->tid);
+    pthread_mutex_destroy(&pdata->split_lock);
+    pthread_mutex_destroy(&pdata->state_lock);
+
+    free(pdata->work);
+    free(pdata->slots);
+    free(pdata->deques);
+    free(pdata->inflight);
     free(pdata);
 }
 
-/* Add a file to our workqueue.  We assume the lock is already held */
-static int axl_pthread_add_work(struct axl_pthread_data* pdata, kvtree_elem* elem)
+/* Add a file, or a chunk of a file if file is set, to our work array */
+static int axl_pthread_add_work(struct axl_pthread_data* pdata, kvtree_elem* elem,
+    struct axl_chunked_file* file, off_t offset, off_t length)
+{
+    if (pdata->count == pdata->capacity) {
+        size_t capacity = pdata->capacity ? pdata->capacity * 2 : 64;
+        struct axl_work* work = realloc(pdata->work, capacity * sizeof(*work));
+        if (! work) {
+            return AXL_FAILURE;
+        }
+        pdata->work     = work;
+        pdata->capacity = capacity;
+    }
+
+    struct axl_work* work = &pdata->work[pdata->count];
+    work->elem   = elem;
+    work->file   = file;
+    work->offset = offset;
+    work->length = length;
+
+    pdata->count++;
+
+    return AXL_SUCCESS;
+}
+
+/* qsort() comparison functions for the SCHEDULE policies */
+static int axl_work_cmp_largest(const void* a, const void* b)
 {
-    struct axl_work* work = calloc(1, sizeof(*work));
-    if (! work) {
+    off_t la = ((const struct axl_work*) a)->length;
+    off_t lb = ((const struct axl_work*) b)->length;
+    return (la < lb) - (la > lb);
+}
+
+static int axl_work_cmp_smallest(const void* a, const void* b)
+{
+    return axl_work_cmp_largest(b, a);
+}
+
+/* Sort our work items into the order given by the transfer's SCHEDULE */
+static void axl_pthread_schedule_work(struct axl_pthread_data* pdata)
+{
+    int schedule = AXL_SCHEDULE_LARGEST_FIRST;
+    kvtree_util_get_int(pdata->file_list, AXL_KEY_CONFIG_SCHEDULE, &schedule);
+
+    switch (schedule) {
+    case AXL_SCHEDULE_LARGEST_FIRST:
+        qsort(pdata->work, pdata->count, sizeof(pdata->work[0]),
+            axl_work_cmp_largest);
+        break;
+    case AXL_SCHEDULE_SMALLEST_FIRST:
+        qsort(pdata->work, pdata->count, sizeof(pdata->work[0]),
+            axl_work_cmp_smallest);
+        break;
+    case AXL_SCHEDULE_FIFO:
+        break;
+    default:
+        AXL_ERR("Unknown schedule %d, copying files in order", schedule);
+        break;
+    }
+}
+
+/* Deal our work items out round-robin to one deque per pool thread, so
+ * neighbouring items (like the chunks of a file) start on different threads.
+ * Owners pop from the bottom of their deque, so each deque is filled from
+ * the bottom up: its owner copies its items in scheduled order, and thieves
+ * take the items scheduled last. */
+static int axl_pthread_deal_work(struct axl_pthread_data* pdata, unsigned int threads)
+{
+    pdata->slots    = malloc(pdata->count * sizeof(pdata->slots[0]));
+    pdata->deques   = calloc(threads, sizeof(pdata->deques[0]));
+    pdata->inflight = calloc(threads, sizeof(pdata->inflight[0]));
+    if (! pdata->slots || ! pdata->deques || ! pdata->inflight) {
         return AXL_FAILURE;
     }
+    pdata->ndeques = threads;
 
-    work->elem = elem;
+    unsigned int t;
+    for (t = 0; t < threads; t++) {
+        pdata->inflight[t].lock = &pdata->split_lock;
+    }
 
-    if (! pdata->head) {
-         /* First time we inserted into the workqueue */
-        pdata->head = work;
-        pdata->tail = work;
-    } else {
-        /* Insert it at the end of the list */
-        pdata->tail->next = work;
-        pdata->tail = work;
+    struct axl_work** slot = pdata->slots;
+    unsigned int d;
+    for (d = 0; d < threads; d++) {
+        struct axl_deque* q = &pdata->deques[d];
+        q->items = slot;
+
+        size_t n = 0;
+        if (d < pdata->count) {
+            n = (pdata->count - d + threads - 1) / threads;
+        }
+
+        size_t i, j;
+        for (i = d, j = n; i < pdata->count; i += threads) {
+            q->items[--j] = &pdata->work[i];
+        }
+        slot += n;
+
+        atomic_init(&q->top, 0);
+        atomic_init(&q->bottom, (long) n);
     }
 
-    /* Increment our count of items to be completed */
-    pdata->remain += 1;
+    atomic_init(&pdata->remain, pdata->count);
 
     return AXL_SUCCESS;
 }
 
-/* Create and wakeup all our threads to start transferring the files in
- * the workqueue. */
-static int axl_pthread_run(struct axl_pthread_data* pdata)
+/* Wait until every work item is done and no worker is looking at our
+ * deques.  We poll rather than wait on a condition variable, since
+ * AXL_Cancel() may be called from a signal handler that interrupted
+ * AXL_Wait() (axl_cp does this), and condition variables can't be
+ * waited on reentrantly. */
+static void axl_pthread_wait_idle(struct axl_pthread_data* pdata)
 {
-    int i;
-    for (i = 0; i < pdata->threads; i++) {
-        int rc = pthread_create(&pdata->tid[i], NULL, &axl_pthread_func, pdata);
-        if (rc != 0) {
+    while (atomic_load(&pdata->remain) > 0 || atomic_load(&pdata->active) > 0) {
+        usleep(AXL_PTHREAD_WAIT_USLEEP);
+    }
+}
+
+/* Decide whether to copy a file as chunks, and if so, get it ready and
+ * return its axl_chunked_file, setting size to the number of bytes to copy
+ * and block to the size chunks must be a multiple of.  Returns NULL to copy
+ * the file whole. */
+static struct axl_chunked_file* axl_pthread_chunk_file(int id,
+    kvtree* elem_hash, const char* src, const char* dst,
+    const struct axl_copy_opts* opts, int resume,
+    unsigned long chunk_size, unsigned long split_size, off_t* size, off_t* block)
+{
+    /* When decompressing, we chunk the original file */
+    struct axl_zindex* zi = NULL;
+    struct stat statbuf;
+    int sparse = 0;
+    if (opts->compress == AXL_COMPRESS_INFLATE) {
+        zi = axl_zindex_read(src);
+        if (! zi) {
+            /* axl_file_copy() will report the error */
+            return NULL;
+        }
+        *size  = (off_t) zi->size;
+        *block = (off_t) zi->block_size;
+    } else if (stat(src, &statbuf) == 0) {
+        *size  = statbuf.st_size;
+        *block = 1;
+        sparse = axl_stat_sparse(&statbuf);
+    } else {
+        return NULL;
+    }
+
+    if (! ((chunk_size > 0 && *size / 2 >= chunk_size) ||
+           (split_size > 0 && *size / 2 >= split_size)))
+    {
+        axl_zindex_free(zi);
+        return NULL;
+    }
+
+    struct axl_chunked_file* file = calloc(1, sizeof(*file));
+    if (! file) {
+        axl_zindex_free(zi);
+        return NULL;
+    }
+
+    if (opts->compress == AXL_COMPRESS_DEFLATE) {
+        file->zw = axl_zwriter_open(dst, *size, opts);
+        if (file->zw) {
+            *block = axl_zwriter_block_size(file->zw);
+            return file;
+        }
+        axl_zindex_free(zi);
+        free(file);
+        return NULL;
+    }
+
+    /* Once we preallocate the destination, its size no longer says how
+     * much of it is copied, so note in the state file that it's being
+     * copied as chunks first.  If it's resumed as a whole file, it has to
+     * be copied from the start. */
+    if (! kvtree_get(elem_hash, AXL_KEY_FILE_CHUNKS)) {
+        kvtree_set(elem_hash, AXL_KEY_FILE_CHUNKS, kvtree_new());
+        axl_write_state_record(id, src, AXL_KEY_FILE_CHUNKS, NULL);
+    }
+
+    if (axl_file_preallocate(dst, *size, resume, sparse) == AXL_SUCCESS) {
+        file->zi = zi;
+        return file;
+    }
+
+    axl_zindex_free(zi);
+    free(file);
+    return NULL;
+}
+
+/* Compare the byte ranges of a chunked file that are already copied, by
+ * offset */
+static int axl_pthread_range_cmp(const void* a, const void* b)
+{
+    const off_t* x = (const off_t*) a;
+    const off_t* y = (const off_t*) b;
+    return (x[0] > y[0]) - (x[0] < y[0]);
+}
+
+/* Queue the chunks of a file, pieces of size bytes in piece sized chunks.
+ * If resume is set, skip the ranges that AXL_KEY_FILE_CHUNKS records as
+ * copied.  We always queue at least one chunk, even an empty one, since
+ * it's the last chunk to finish that records the file as done. */
+static int axl_pthread_add_chunks(struct axl_pthread_data* pdata,
+    kvtree_elem* elem, struct axl_chunked_file* file, off_t size, off_t piece,
+    int resume)
+{
+    kvtree* elem_hash = kvtree_elem_hash(elem);
+
+    /* the copied ranges, as offset and end pairs, sorted by offset */
+    kvtree* chunks = resume ? kvtree_get(elem_hash, AXL_KEY_FILE_CHUNKS) : NULL;
+    size_t count = 0;
+    off_t* ranges = NULL;
+    if (chunks && kvtree_size(chunks) > 0) {
+        ranges = malloc(2 * (size_t) kvtree_size(chunks) * sizeof(*ranges));
+        if (! ranges) {
             return AXL_FAILURE;
         }
+        kvtree_elem* e;
+        for (e = kvtree_elem_first(chunks); e; e = kvtree_elem_next(e)) {
+            unsigned long end;
+            if (kvtree_util_get_bytecount(chunks, kvtree_elem_key(e), &end) ==
+                KVTREE_SUCCESS)
+            {
+                ranges[2 * count]     = (off_t) strtoul(kvtree_elem_key(e), NULL, 10);
+                ranges[2 * count + 1] = (off_t) end;
+                count++;
+            }
+        }
+        qsort(ranges, count, 2 * sizeof(*ranges), axl_pthread_range_cmp);
     }
 
-    return AXL_SUCCESS;
+    int rc = AXL_SUCCESS;
+    off_t skipped = 0;
+    size_t next = 0;
+    off_t offset;
+    for (offset = 0; rc == AXL_SUCCESS && offset < size; offset += piece) {
+        off_t piece_end = AXL_MIN(offset + piece, size);
+
+        /* queue the gaps between the copied ranges in this piece */
+        off_t pos = offset;
+        while (rc == AXL_SUCCESS && pos < piece_end) {
+            while (next < count && ranges[2 * next + 1] <= pos) {
+                next++;
+            }
+            off_t gap_end = piece_end;
+            if (next < count && ranges[2 * next] <= pos) {
+                /* pos is in a copied range, skip to its end */
+                off_t end = AXL_MIN(ranges[2 * next + 1], piece_end);
+                skipped += end - pos;
+                pos = end;
+                continue;
+            }
+            if (next < count && ranges[2 * next] < gap_end) {
+                gap_end = ranges[2 * next];
+            }
+            rc = axl_pthread_add_work(pdata, elem, file, pos, gap_end - pos);
+            if (rc == AXL_SUCCESS) {
+                file->chunks++;
+            }
+            pos = gap_end;
+        }
+    }
+
+    if (rc == AXL_SUCCESS && file->chunks == 0) {
+        rc = axl_pthread_add_work(pdata, elem, file, size, 0);
+        if (rc == AXL_SUCCESS) {
+            file->chunks++;
+        }
+    }
+
+    if (skipped > 0) {
+        AXL_DBG(2, "Resuming %s, skipping %lu bytes already copied",
+            kvtree_elem_key(elem), (unsigned long) skipped);
+    }
+
+    free(ranges);
+    return rc;
 }
 
 /* Start a tranfer.  If resume = 1, attempt to resume the old transfer (start
@@ -337,22 +1237,45 @@ static int __axl_pthread_start (int id, int resume)
     /* mark dataset as in progress */
     kvtree_util_set_int(file_list, AXL_KEY_STATUS, AXL_STATUS_INPROG);
 
-    /* Get number of files being transferred */
     kvtree* files = kvtree_get(file_list, AXL_KEY_FILES);
-    unsigned int file_count = kvtree_size(files);
-
-    /* Get number of hardware threads */
-    unsigned int cpu_threads = axl_get_nprocs();
 
-    unsigned int threads = AXL_MIN(cpu_threads, AXL_MIN(file_count, MAX_THREADS));
+    if (axl_pthread_pool.threads == 0) {
+        AXL_ERR("No worker threads, was AXL_Init() called?");
+        kvtree_util_set_int(file_list, AXL_KEY_STATUS, AXL_STATUS_ERROR);
+        return AXL_FAILURE;
+    }
 
-    /* Create the data structure for our threads */
-    struct axl_pthread_data* pdata = axl_pthread_create_thread_data(threads);
+    /* Create the job descriptor for this transfer */
+    struct axl_pthread_data* pdata = axl_pthread_create_thread_data(kvtree_size(files));
     if (! pdata) {
         return AXL_FAILURE;
     }
     pdata->resume = resume;
 
+    unsigned long chunk_size = axl_pthread_chunk_size();
+    unsigned long split_size = axl_pthread_split_size();
+
+    /* A file's crc and manifest are computed front to back by a single
+     * thread, as are delta copies, which save their checksums at the end.
+     * Compressed files are split into chunks of whole blocks, and since the
+     * blocks are written as they're compressed, running chunks can't be
+     * split. */
+    struct axl_copy_opts opts;
+    axl_copy_opts_load(file_list, &opts);
+    if (opts.crc || opts.manifest_size > 0 || opts.delta_size > 0) {
+        chunk_size = 0;
+        split_size = 0;
+    } else if (opts.compress != AXL_COMPRESS_NONE) {
+        split_size = 0;
+    }
+
+    /* Chunks are copied with pread/pwrite, not O_DIRECT */
+    if (opts.direct) {
+        chunk_size = 0;
+        split_size = 0;
+    }
+    pdata->split_size = (off_t) split_size;
+
     axl_pthread_data_add(id, pdata);
 
     kvtree_elem* elem = NULL;
@@ -370,7 +1293,41 @@ static int __axl_pthread_start (int id, int resume)
             continue;
         }
 
-        rc = axl_pthread_add_work(pdata, elem);
+        /* chunks recorded by an earlier transfer to this destination */
+        if (! resume) {
+            kvtree_unset(elem_hash, AXL_KEY_FILE_CHUNKS);
+        }
+
+        /* Split large files into chunks, and copy files big enough for idle
+         * threads to split as chunks too.  The chunks finish in any order, so
+         * the size of a partly copied destination file says nothing about
+         * which chunks are done.  When resuming, we copy the parts that
+         * aren't recorded as done in the file's AXL_KEY_FILE_CHUNKS. */
+        char* src = kvtree_elem_key(elem);
+        char* dst = NULL;
+        kvtree_util_get_str(elem_hash, AXL_KEY_FILE_DEST, &dst);
+        struct axl_chunked_file* file = NULL;
+        off_t size = 0;
+        off_t block = 1;
+        if ((chunk_size > 0 || split_size > 0) && ! axl_pack_is_packed(elem_hash)) {
+            file = axl_pthread_chunk_file(id, elem_hash, src, dst, &opts,
+                resume, chunk_size, split_size, &size, &block);
+        }
+
+        if (file) {
+            file->next = pdata->chunked;
+            pdata->chunked = file;
+
+            off_t piece = chunk_size > 0 ? (off_t) chunk_size : size;
+            piece = (piece + block - 1) / block * block;
+            rc = axl_pthread_add_chunks(pdata, elem, file, size, piece,
+                resume && ! file->zw && ! file->zi);
+        } else {
+            /* Use the size recorded at dispatch to schedule the file */
+            unsigned long size = 0;
+            kvtree_util_get_unsigned_long(elem_hash, "SIZE", &size);
+            rc = axl_pthread_add_work(pdata, elem, NULL, 0, (off_t) size);
+        }
         if (rc != AXL_SUCCESS) {
             printf("something bad happened\n");
             /* Something bad happened.  Break here instead of returning so
@@ -379,13 +1336,21 @@ static int __axl_pthread_start (int id, int resume)
         }
     }
 
-    /* At this point, all our files are queued in the workqueue.  Start the
-     * transfers. */
-    rc = axl_pthread_run(pdata);
-    if (rc == AXL_SUCCESS) {
-        kvtree_util_set_int(file_list, AXL_KEY_STATUS, AXL_STATUS_INPROG);
-    } else {
-        AXL_ERR("Couldn't spawn all threads");
+    if (rc == AXL_SUCCESS && pdata->count > 0) {
+        axl_pthread_schedule_work(pdata);
+        rc = axl_pthread_deal_work(pdata, axl_pthread_pool.threads);
+    }
+
+    /* At this point, all our files are queued in the deques.  Hand the
+     * transfer to the worker pool. */
+    if (rc == AXL_SUCCESS && pdata->count > 0) {
+        pthread_mutex_lock(&axl_pthread_pool.lock);
+        axl_pthread_job_enqueue(pdata);
+        pthread_cond_broadcast(&axl_pthread_pool.work);
+        pthread_mutex_unlock(&axl_pthread_pool.lock);
+    }
+
+    if (rc != AXL_SUCCESS) {
         kvtree_util_set_int(file_list, AXL_KEY_STATUS, AXL_STATUS_ERROR);
     }
 
@@ -411,20 +1376,16 @@ int axl_pthread_test (int id)
     assert(pdata);
 
     /* check whether all work items have been completed */
-    pthread_mutex_lock(&pdata->lock);
-    if (pdata->remain > 0) {
+    if (atomic_load(&pdata->remain) > 0) {
         /* There is still work outstanding */
         rc = AXL_FAILURE;
     }
-    pthread_mutex_unlock(&pdata->lock);
 
     return rc;
 }
 
 int axl_pthread_wait (int id)
 {
-    int rc = AXL_SUCCESS;
-
     struct axl_pthread_data* pdata = axl_pthread_data_lookup(id);
     if (! pdata) {
         /* Did they call AXL_Cancel() and then AXL_Wait()? */
@@ -435,37 +1396,13 @@ int axl_pthread_wait (int id)
     /* get pointer to file list for this dataset */
     kvtree* file_list = pdata->file_list;
 
-    /* All our threads are now started.  Wait for them to finish */
-    int i;
-    for (i = 0; i < pdata->threads; i++) {
-        void* rc_ptr = NULL;
-        int tmp_rc = pthread_join(pdata->tid[i], &rc_ptr);
-        if (tmp_rc != 0) {
-            AXL_ERR("pthread_join(%d) failed (%d)", i, rc);
-            return AXL_FAILURE;
-        }
-
-        /* Check the rc that the thread actually reported.  The thread
-         * returns a void * that we encode our rc value in.  If the
-         * thread was canceled, that totally valid and fine. */
-        if (rc_ptr != PTHREAD_CANCELED) {
-            tmp_rc = (int) ((unsigned long) rc_ptr);
-            if (tmp_rc) {
-                AXL_ERR("pthread join rc_ptr was set as %d", rc);
-                rc = AXL_FAILURE;
-            }
-        }
-    }
-
-    if (rc != AXL_SUCCESS) {
-        AXL_ERR("Couldn't join all threads");
-        return AXL_FAILURE;
-    }
+    /* Wait for the workers to finish all of our items */
+    axl_pthread_wait_idle(pdata);
 
     axl_pthread_data_remove(id);
     axl_pthread_free_pdata(pdata);
 
-    /* All threads are now successfully finished */
+    /* All items are now finished */
     kvtree_util_set_int(file_list, AXL_KEY_STATUS, AXL_STATUS_DEST);
 
     return axl_sync_wait(id);
@@ -473,36 +1410,29 @@ int axl_pthread_wait (int id)
 
 int axl_pthread_cancel (int id)
 {
-    int rc = AXL_SUCCESS;
-
     /* get pointer to pthread struct for this dataset */
     struct axl_pthread_data* pdata = axl_pthread_data_lookup(id);
     assert(pdata);
 
-    int i;
-    for (i = 0; i < pdata->threads; i++) {
-        /* send the thread a cancellation request */
-        int tmp_rc = pthread_cancel(pdata->tid[i]);
-        if (tmp_rc) {
-            AXL_ERR("pthread_cancel failed, rc %d");
-            rc = AXL_FAILURE;
-            break;
-        }
+    /* ask copies in progress to stop, and keep idle workers from joining */
+    pthread_mutex_lock(&axl_pthread_pool.lock);
+    pdata->canceled = 1;
+    if (pdata->queued) {
+        axl_pthread_job_dequeue(pdata);
+    }
+    pthread_mutex_unlock(&axl_pthread_pool.lock);
 
-        /* wait for the thread to actually exit */
-        void* rc_ptr;
-        pthread_join(pdata->tid[i], &rc_ptr);
-        if (rc_ptr != 0 && rc_ptr != PTHREAD_CANCELED) {
-            AXL_ERR("pthread_join failed, rc_ptr %p", rc_ptr);
-            rc = AXL_FAILURE;
+    /* steal the items that haven't started yet and drop them */
+    if (pdata->count > 0) {
+        while (axl_pthread_take(pdata, pdata->ndeques)) {
+            atomic_fetch_sub(&pdata->remain, 1);
         }
     }
 
-    if (rc != AXL_SUCCESS) {
-        AXL_ERR("Bad return code from canceling a thread");
-    }
+    /* and wait for the copies in progress to notice */
+    axl_pthread_wait_idle(pdata);
 
-    return rc;
+    return AXL_SUCCESS;
 }
 
 void axl_pthread_free (int id)
@@ -512,6 +1442,7 @@ void axl_pthread_free (int id)
      * and we should free it. */
     struct axl_pthread_data* pdata = axl_pthread_data_lookup(id);
     if (pdata) {
+        axl_pthread_wait_idle(pdata);
         axl_pthread_data_remove(id);
         axl_pthread_free_pdata(pdata);
     }
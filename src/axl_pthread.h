@@ -7,6 +7,8 @@
 
 /** \name pthread */
 ///@{
+int axl_pthread_init(void);
+int axl_pthread_finalize(void);
 int axl_pthread_start(int id);
 int axl_pthread_resume(int id);
 int axl_pthread_test(int id);
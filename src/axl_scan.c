@@ -0,0 +1,370 @@
+/* Recursive directory scans, for adding a directory to a transfer.
+ *
+ * On a parallel filesystem, listing a directory and stat'ing what's in it
+ * each cost a round trip to a metadata server, so adding a directory of
+ * many files one readdir() at a time takes far longer than copying them.
+ * A scan reads the type of each entry from d_type, and only stats the
+ * entries whose type that doesn't give (links, and filesystems that don't
+ * fill it in), with fstatat() relative to the directory being read.  The
+ * subdirectories it finds go on a stack that a set of threads share, and a
+ * thread is started whenever a subdirectory is pushed and no thread is
+ * waiting for one, up to AXL_SCAN_THREADS, so a flat directory is read
+ * without starting any.  The files found are returned to the caller in one
+ * list, in no particular order. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "config.h"
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#include <signal.h>
+#endif
+
+#include "axl_internal.h"
+
+/* most threads a scan reads directories with, counting the caller */
+#define AXL_SCAN_THREADS (16)
+
+/* a directory waiting to be read */
+struct axl_scan_dir {
+    struct axl_scan_dir* next;
+    char* src;
+    char* dst;
+};
+
+struct axl_scan {
+#ifdef HAVE_PTHREADS
+    pthread_mutex_t lock;
+
+    /* threads wait on this for a directory to be pushed, or for the scan
+     * to finish */
+    pthread_cond_t cond;
+
+    /* threads we started, and how many of them are waiting */
+    pthread_t tid[AXL_SCAN_THREADS];
+    unsigned int threads;
+    unsigned int waiting;
+#endif
+
+    /* directories waiting to be read, and the number being read */
+    struct axl_scan_dir* dirs;
+    unsigned int busy;
+
+    /* set if reading any directory failed */
+    int error;
+
+    /* the files found so far */
+    struct axl_scan_file* files;
+    size_t count;
+    size_t capacity;
+};
+
+static void axl_scan_lock(struct axl_scan* scan)
+{
+#ifdef HAVE_PTHREADS
+    pthread_mutex_lock(&scan->lock);
+#endif
+}
+
+static void axl_scan_unlock(struct axl_scan* scan)
+{
+#ifdef HAVE_PTHREADS
+    pthread_mutex_unlock(&scan->lock);
+#endif
+}
+
+static void* axl_scan_thread(void* arg);
+
+/* Push a directory to be read, with the scan locked */
+static int axl_scan_push(struct axl_scan* scan, char* src, char* dst)
+{
+    struct axl_scan_dir* dir = malloc(sizeof(*dir));
+    if (! dir) {
+        return AXL_FAILURE;
+    }
+    dir->src  = src;
+    dir->dst  = dst;
+    dir->next = scan->dirs;
+    scan->dirs = dir;
+
+#ifdef HAVE_PTHREADS
+    if (scan->waiting > 0) {
+        pthread_cond_signal(&scan->cond);
+    } else if (scan->threads < AXL_SCAN_THREADS - 1 && ! scan->error) {
+        /* Block signals in the new thread, as the pthread transfer's
+         * workers do, so they're handled by the application's threads */
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        if (pthread_create(&scan->tid[scan->threads], NULL,
+            &axl_scan_thread, scan) == 0)
+        {
+            scan->threads++;
+        }
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+#endif
+
+    return AXL_SUCCESS;
+}
+
+/* Join a and b with a slash, in a new string the caller frees */
+static char* axl_scan_join(const char* a, const char* b)
+{
+    size_t a_len = strlen(a);
+    size_t b_len = strlen(b);
+    char* path = malloc(a_len + 1 + b_len + 1);
+    if (path) {
+        memcpy(path, a, a_len);
+        path[a_len] = '/';
+        memcpy(path + a_len + 1, b, b_len + 1);
+    }
+    return path;
+}
+
+/* Read the directory dir, push its subdirectories, and add its files to
+ * the scan's list */
+static int axl_scan_read(struct axl_scan* scan, const struct axl_scan_dir* dir)
+{
+    int fd = open(dir->src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        AXL_ERR("Reading directory: open(%s) errno=%d %s",
+            dir->src, errno, strerror(errno)
+        );
+        return AXL_FAILURE;
+    }
+
+    DIR* d = fdopendir(fd);
+    if (! d) {
+        AXL_ERR("Reading directory: fdopendir(%s) errno=%d %s",
+            dir->src, errno, strerror(errno)
+        );
+        close(fd);
+        return AXL_FAILURE;
+    }
+
+    /* collect this directory's files before taking the lock to add them */
+    struct axl_scan_file* files = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+
+    int rc = AXL_SUCCESS;
+    struct dirent* de;
+    while (rc == AXL_SUCCESS && (de = readdir(d)) != NULL) {
+        /* Skip '.' and '..' directories */
+        const char* name = de->d_name;
+        if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0)) {
+            continue;
+        }
+
+        /* like stat(), we follow links to find what they point to */
+        int type = DT_UNKNOWN;
+#ifdef _DIRENT_HAVE_D_TYPE
+        type = de->d_type;
+#endif
+        if (type == DT_UNKNOWN || type == DT_LNK) {
+            struct stat statbuf;
+            if (fstatat(fd, name, &statbuf, 0) != 0) {
+                AXL_ERR("stat(%s/%s) failed: errno=%d %s",
+                    dir->src, name, errno, strerror(errno)
+                );
+                rc = AXL_FAILURE;
+                break;
+            }
+            if (S_ISREG(statbuf.st_mode)) {
+                type = DT_REG;
+            } else if (S_ISDIR(statbuf.st_mode)) {
+                type = DT_DIR;
+            }
+        }
+        if (type != DT_REG && type != DT_DIR) {
+            AXL_ERR("Can't add `%s/%s': not a file or directory", dir->src, name);
+            rc = AXL_FAILURE;
+            break;
+        }
+
+        char* src = axl_scan_join(dir->src, name);
+        char* dst = axl_scan_join(dir->dst, name);
+        if (! src || ! dst) {
+            axl_free(&src);
+            axl_free(&dst);
+            rc = AXL_FAILURE;
+            break;
+        }
+
+        if (type == DT_DIR) {
+            axl_scan_lock(scan);
+            rc = axl_scan_push(scan, src, dst);
+            axl_scan_unlock(scan);
+            if (rc != AXL_SUCCESS) {
+                axl_free(&src);
+                axl_free(&dst);
+            }
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            struct axl_scan_file* tmp = realloc(files, capacity * sizeof(*files));
+            if (! tmp) {
+                axl_free(&src);
+                axl_free(&dst);
+                rc = AXL_FAILURE;
+                break;
+            }
+            files = tmp;
+        }
+        files[count].src = src;
+        files[count].dst = dst;
+        count++;
+    }
+    closedir(d);
+
+    axl_scan_lock(scan);
+    if (rc == AXL_SUCCESS && scan->count + count > scan->capacity) {
+        size_t new_capacity = scan->capacity ? scan->capacity : 64;
+        while (new_capacity < scan->count + count) {
+            new_capacity *= 2;
+        }
+        struct axl_scan_file* tmp = realloc(scan->files,
+            new_capacity * sizeof(*tmp));
+        if (tmp) {
+            scan->files    = tmp;
+            scan->capacity = new_capacity;
+        } else {
+            rc = AXL_FAILURE;
+        }
+    }
+    if (rc == AXL_SUCCESS && count > 0) {
+        memcpy(scan->files + scan->count, files, count * sizeof(*files));
+        scan->count += count;
+        count = 0;
+    }
+    axl_scan_unlock(scan);
+
+    axl_scan_free(files, count);
+    return rc;
+}
+
+/* Read directories until there are none left and none being read, which
+ * the caller and the threads we start all do */
+static void* axl_scan_thread(void* arg)
+{
+    struct axl_scan* scan = (struct axl_scan*) arg;
+
+    axl_scan_lock(scan);
+    while (1) {
+        if (scan->dirs && ! scan->error) {
+            struct axl_scan_dir* dir = scan->dirs;
+            scan->dirs = dir->next;
+            scan->busy++;
+            axl_scan_unlock(scan);
+
+            int rc = axl_scan_read(scan, dir);
+            axl_free(&dir->src);
+            axl_free(&dir->dst);
+            axl_free(&dir);
+
+            axl_scan_lock(scan);
+            scan->busy--;
+            if (rc != AXL_SUCCESS) {
+                scan->error = 1;
+            }
+            continue;
+        }
+
+        /* if nobody is reading a directory, nothing more can be pushed */
+        if (scan->busy == 0) {
+            break;
+        }
+
+#ifdef HAVE_PTHREADS
+        scan->waiting++;
+        pthread_cond_wait(&scan->cond, &scan->lock);
+        scan->waiting--;
+#endif
+    }
+
+#ifdef HAVE_PTHREADS
+    /* wake the others so they see we're done */
+    pthread_cond_broadcast(&scan->cond);
+#endif
+    axl_scan_unlock(scan);
+
+    return NULL;
+}
+
+int axl_scan_dir(const char* src, const char* dest,
+    struct axl_scan_file** files, size_t* count)
+{
+    *files = NULL;
+    *count = 0;
+
+    struct axl_scan scan;
+    memset(&scan, 0, sizeof(scan));
+#ifdef HAVE_PTHREADS
+    pthread_mutex_init(&scan.lock, NULL);
+    pthread_cond_init(&scan.cond, NULL);
+#endif
+
+    /* start with src, which we read in this thread */
+    struct axl_scan_dir* root = calloc(1, sizeof(*root));
+    if (root) {
+        root->src = strdup(src);
+        root->dst = strdup(dest);
+        scan.dirs = root;
+    }
+    if (! root || ! root->src || ! root->dst) {
+        scan.error = 1;
+    }
+
+    /* the caller reads directories too, and once it's done, so is every
+     * thread, and nothing else can be started */
+    axl_scan_thread(&scan);
+
+#ifdef HAVE_PTHREADS
+    unsigned int i;
+    for (i = 0; i < scan.threads; i++) {
+        pthread_join(scan.tid[i], NULL);
+    }
+    pthread_cond_destroy(&scan.cond);
+    pthread_mutex_destroy(&scan.lock);
+#endif
+
+    /* directories left over after a failure */
+    while (scan.dirs) {
+        struct axl_scan_dir* dir = scan.dirs;
+        scan.dirs = dir->next;
+        axl_free(&dir->src);
+        axl_free(&dir->dst);
+        axl_free(&dir);
+    }
+
+    if (scan.error) {
+        axl_scan_free(scan.files, scan.count);
+        return AXL_FAILURE;
+    }
+
+    *files = scan.files;
+    *count = scan.count;
+    return AXL_SUCCESS;
+}
+
+void axl_scan_free(struct axl_scan_file* files, size_t count)
+{
+    size_t i;
+    for (i = 0; i < count; i++) {
+        axl_free(&files[i].src);
+        axl_free(&files[i].dst);
+    }
+    free(files);
+}
@@ -0,0 +1,644 @@
+/* State files in AXL's binary format, for the STATE_FORMAT option.
+ *
+ * kvtree_read_file() parses a state file and allocates every node of it
+ * before a transfer can be resumed, which for a transfer of hundreds of
+ * thousands of files is a noticeable part of a restart.  The binary format
+ * keeps what every file has, its source and destination, status, and
+ * metadata, in a fixed-size record, so a reader memory-maps the file and
+ * walks the records in place.  Resuming still needs a kvtree of the files,
+ * since every transfer engine works on one, but it is built straight from
+ * the records, and a file whose record says it's done doesn't get its
+ * manifest or chunks.  A binary state file is laid out as:
+ *
+ *   header   "AXLS", format version, CRC32C of everything after the header,
+ *            record size, number of files, and the offset and length of
+ *            each section below
+ *   records  for each file, the offsets of its source and destination in
+ *            the strings, its status, its metadata, and the offset and
+ *            length of anything else recorded about it in the extras
+ *   strings  the source and destination paths, each ending in a NUL
+ *   extras   the handle's own values, then the rest of each file's values,
+ *            each one a key ending in a NUL, the length of its subtree, and
+ *            the subtree packed with kvtree_pack()
+ *
+ * All numbers are little-endian.  Most files have nothing in the extras,
+ * so reading them back is just copying out their records.  The file is
+ * written under a temporary name, synced, and renamed over the old one,
+ * and then its directory is synced, so a crash while writing it leaves
+ * the previous state file whole. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "config.h"
+
+#include "axl_internal.h"
+
+#define AXL_STATE_MAGIC   "AXLS"
+#define AXL_STATE_VERSION (1)
+
+/* header: magic, version, crc, record size, number of files, offset of the
+ * records, offset and length of the strings, offset and length of the
+ * extras, length of the handle's values at the start of the extras */
+#define AXL_STATE_HEADER_SIZE (4 + 4 + 4 + 4 + 8 * 7)
+
+/* record: source, destination, status, flags, extras offset and length,
+ * the ten metadata fields of axl_state_meta_keys */
+#define AXL_STATE_RECORD_SIZE (8 + 8 + 4 + 4 + 8 + 8 + 8 * 10)
+
+/* record flags, for the values a file may not have */
+#define AXL_STATE_HAS_DEST   (1)
+#define AXL_STATE_HAS_STATUS (2)
+#define AXL_STATE_HAS_META   (4)
+
+/* the metadata axl_meta_encode() records about a file, which a record
+ * holds in this order when it has AXL_STATE_HAS_META */
+#define AXL_STATE_META_FIELDS (10)
+static const char* axl_state_meta_keys[AXL_STATE_META_FIELDS] = {
+    "MODE", "UID", "GID", "SIZE",
+    "ATIME_SECS", "ATIME_NSECS",
+    "CTIME_SECS", "CTIME_NSECS",
+    "MTIME_SECS", "MTIME_NSECS",
+};
+
+/* Read the metadata fields of hash into meta, returns AXL_FAILURE unless
+ * all of them are there */
+static int axl_state_meta_get(const kvtree* hash, uint64_t* meta)
+{
+    int i;
+    for (i = 0; i < AXL_STATE_META_FIELDS; i++) {
+        unsigned long val;
+        if (kvtree_util_get_unsigned_long(hash, axl_state_meta_keys[i],
+            &val) != KVTREE_SUCCESS)
+        {
+            return AXL_FAILURE;
+        }
+        meta[i] = (uint64_t) val;
+    }
+    return AXL_SUCCESS;
+}
+
+/* Returns 1 if key is one of the metadata fields */
+static int axl_state_meta_is_key(const char* key)
+{
+    int i;
+    for (i = 0; i < AXL_STATE_META_FIELDS; i++) {
+        if (strcmp(key, axl_state_meta_keys[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* a section of the file being written */
+struct axl_state_buf {
+    unsigned char* data;
+    size_t len;
+    size_t cap;
+};
+
+/* Make room for len more bytes at the end of b, and return where they go,
+ * or NULL if we're out of memory */
+static unsigned char* axl_state_buf_add(struct axl_state_buf* b, size_t len)
+{
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < b->len + len) {
+            cap *= 2;
+        }
+        unsigned char* data = realloc(b->data, cap);
+        if (! data) {
+            return NULL;
+        }
+        b->data = data;
+        b->cap  = cap;
+    }
+    unsigned char* p = b->data + b->len;
+    b->len += len;
+    return p;
+}
+
+/* Append str with its NUL to the strings, and return its offset */
+static uint64_t axl_state_put_string(struct axl_state_buf* b, const char* str)
+{
+    size_t len = strlen(str) + 1;
+    uint64_t offset = (uint64_t) b->len;
+    unsigned char* p = axl_state_buf_add(b, len);
+    if (! p) {
+        return UINT64_MAX;
+    }
+    memcpy(p, str, len);
+    return offset;
+}
+
+/* Append key and its subtree hash to the extras */
+static int axl_state_put_extra(struct axl_state_buf* b, const char* key,
+    const kvtree* hash)
+{
+    size_t key_len = strlen(key) + 1;
+    size_t len = kvtree_pack_size(hash);
+    unsigned char* p = axl_state_buf_add(b, key_len + 8 + len);
+    if (! p) {
+        return AXL_FAILURE;
+    }
+    memcpy(p, key, key_len);
+    axl_put_le64(p + key_len, (uint64_t) len);
+    kvtree_pack((char*) (p + key_len + 8), hash);
+    return AXL_SUCCESS;
+}
+
+/* Return 1 for the keys of a file that only record how far its copy got */
+static int axl_state_progress_key(const char* key)
+{
+    return (strcmp(key, AXL_KEY_FILE_MANIFEST) == 0 ||
+            strcmp(key, AXL_KEY_FILE_CHUNKS) == 0);
+}
+
+/* Read the len bytes of extras at p into hash, except for the keys skip
+ * returns 1 for, if it's set */
+static int axl_state_get_extras(const unsigned char* p, uint64_t len, kvtree* hash,
+    int (*skip)(const char* key))
+{
+    uint64_t pos = 0;
+    while (pos < len) {
+        const char* key = (const char*) (p + pos);
+        if (memchr(key, '\0', (size_t) (len - pos)) == NULL) {
+            return AXL_FAILURE;
+        }
+        pos += strlen(key) + 1;
+
+        if (len - pos < 8) {
+            return AXL_FAILURE;
+        }
+        uint64_t size = axl_get_le64(p + pos);
+        pos += 8;
+        if (size > len - pos) {
+            return AXL_FAILURE;
+        }
+
+        if (! skip || ! skip(key)) {
+            kvtree_unset(hash, key);
+            kvtree* sub = kvtree_set(hash, key, kvtree_new());
+            kvtree_unpack((const char*) (p + pos), sub);
+        }
+        pos += size;
+    }
+    return AXL_SUCCESS;
+}
+
+/* Add the record for the file elem to the records, strings and extras */
+static int axl_state_put_file(const kvtree_elem* elem,
+    struct axl_state_buf* records, struct axl_state_buf* strings,
+    struct axl_state_buf* extras)
+{
+    const char* src = kvtree_elem_key(elem);
+    const kvtree* hash = kvtree_elem_hash(elem);
+
+    uint32_t flags = 0;
+    uint64_t src_offset = axl_state_put_string(strings, src);
+    uint64_t dst_offset = 0;
+    char* dst = NULL;
+    if (kvtree_util_get_str(hash, AXL_KEY_FILE_DEST, &dst) == KVTREE_SUCCESS) {
+        dst_offset = axl_state_put_string(strings, dst);
+        flags |= AXL_STATE_HAS_DEST;
+    }
+    if (src_offset == UINT64_MAX || dst_offset == UINT64_MAX) {
+        return AXL_FAILURE;
+    }
+
+    int status = 0;
+    if (kvtree_util_get_int(hash, AXL_KEY_FILE_STATUS, &status) == KVTREE_SUCCESS) {
+        flags |= AXL_STATE_HAS_STATUS;
+    }
+
+    uint64_t meta[AXL_STATE_META_FIELDS];
+    if (axl_state_meta_get(hash, meta) == AXL_SUCCESS) {
+        flags |= AXL_STATE_HAS_META;
+    } else {
+        /* a partial set goes in the extras with everything else */
+        memset(meta, 0, sizeof(meta));
+    }
+
+    /* everything else goes in the extras */
+    uint64_t extras_offset = (uint64_t) extras->len;
+    const kvtree_elem* e;
+    for (e = kvtree_elem_first(hash); e; e = kvtree_elem_next(e)) {
+        const char* key = kvtree_elem_key(e);
+        if ((strcmp(key, AXL_KEY_FILE_DEST) == 0 && (flags & AXL_STATE_HAS_DEST)) ||
+            (strcmp(key, AXL_KEY_FILE_STATUS) == 0 && (flags & AXL_STATE_HAS_STATUS)) ||
+            (axl_state_meta_is_key(key) && (flags & AXL_STATE_HAS_META)))
+        {
+            continue;
+        }
+        if (axl_state_put_extra(extras, key, kvtree_elem_hash(e)) != AXL_SUCCESS) {
+            return AXL_FAILURE;
+        }
+    }
+    uint64_t extras_len = (uint64_t) extras->len - extras_offset;
+
+    unsigned char* p = axl_state_buf_add(records, AXL_STATE_RECORD_SIZE);
+    if (! p) {
+        return AXL_FAILURE;
+    }
+    axl_put_le64(p,      src_offset);
+    axl_put_le64(p + 8,  dst_offset);
+    axl_put_le32(p + 16, (uint32_t) status);
+    axl_put_le32(p + 20, flags);
+    axl_put_le64(p + 24, extras_offset);
+    axl_put_le64(p + 32, extras_len);
+    int i;
+    for (i = 0; i < AXL_STATE_META_FIELDS; i++) {
+        axl_put_le64(p + 40 + 8 * i, meta[i]);
+    }
+
+    return AXL_SUCCESS;
+}
+
+/* A binary state file mapped into memory, with its header checked */
+struct axl_state_map {
+    void* map;
+    size_t size;
+    uint64_t nfiles;
+    const unsigned char* records;
+    const unsigned char* strings;
+    uint64_t strings_len;
+    const unsigned char* extras;
+    uint64_t extras_len;
+    uint64_t handle_len;
+};
+
+/* One file's record, read in place: src and dst point into the map */
+struct axl_state_record {
+    const char* src;
+    const char* dst;
+    int status;
+    uint32_t flags;
+    uint64_t meta[AXL_STATE_META_FIELDS];
+    const unsigned char* extras;
+    uint64_t extras_len;
+};
+
+/* Map the binary state file state_file, which is size bytes and open on
+ * fd, and check its header and CRC */
+static int axl_state_map_open(const char* state_file, int fd, size_t size,
+    struct axl_state_map* m)
+{
+    void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        AXL_ERR("mmap(%s) failed: errno=%d %s",
+            state_file, errno, strerror(errno)
+        );
+        return AXL_FAILURE;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    const unsigned char* p = (const unsigned char*) map;
+    uint32_t version      = axl_get_le32(p + 4);
+    uint32_t crc          = axl_get_le32(p + 8);
+    uint32_t record_size  = axl_get_le32(p + 12);
+    uint64_t nfiles       = axl_get_le64(p + 16);
+    uint64_t records      = axl_get_le64(p + 24);
+    uint64_t strings      = axl_get_le64(p + 32);
+    uint64_t strings_len  = axl_get_le64(p + 40);
+    uint64_t extras       = axl_get_le64(p + 48);
+    uint64_t extras_len   = axl_get_le64(p + 56);
+    uint64_t handle_len   = axl_get_le64(p + 64);
+
+    int rc = AXL_SUCCESS;
+    if (version != AXL_STATE_VERSION || record_size != AXL_STATE_RECORD_SIZE) {
+        AXL_ERR("State file %s is format version %u, expected %u",
+            state_file, version, AXL_STATE_VERSION
+        );
+        rc = AXL_FAILURE;
+    } else if (records != AXL_STATE_HEADER_SIZE ||
+        nfiles > (size - records) / AXL_STATE_RECORD_SIZE ||
+        strings != records + nfiles * AXL_STATE_RECORD_SIZE ||
+        strings_len > size - strings ||
+        (strings_len > 0 && p[strings + strings_len - 1] != '\0') ||
+        extras != strings + strings_len ||
+        extras_len != size - extras ||
+        handle_len > extras_len)
+    {
+        AXL_ERR("State file %s is truncated or corrupt", state_file);
+        rc = AXL_FAILURE;
+    } else if (axl_hash(AXL_CRC_CRC32C, 0, p + AXL_STATE_HEADER_SIZE,
+        size - AXL_STATE_HEADER_SIZE) != crc)
+    {
+        AXL_ERR("State file %s has a bad CRC", state_file);
+        rc = AXL_FAILURE;
+    }
+
+    if (rc != AXL_SUCCESS) {
+        munmap(map, size);
+        return rc;
+    }
+
+    m->map         = map;
+    m->size        = size;
+    m->nfiles      = nfiles;
+    m->records     = p + records;
+    m->strings     = p + strings;
+    m->strings_len = strings_len;
+    m->extras      = p + extras;
+    m->extras_len  = extras_len;
+    m->handle_len  = handle_len;
+    return AXL_SUCCESS;
+}
+
+static void axl_state_map_close(struct axl_state_map* m)
+{
+    munmap(m->map, m->size);
+    m->map = NULL;
+}
+
+/* Read record i of m into r, without copying anything out of the map */
+static int axl_state_map_record(const struct axl_state_map* m, uint64_t i,
+    struct axl_state_record* r)
+{
+    const unsigned char* p = m->records + i * AXL_STATE_RECORD_SIZE;
+    uint64_t src_offset    = axl_get_le64(p);
+    uint64_t dst_offset    = axl_get_le64(p + 8);
+    uint64_t extras_offset = axl_get_le64(p + 24);
+    r->status              = (int) axl_get_le32(p + 16);
+    r->flags               = axl_get_le32(p + 20);
+    r->extras_len          = axl_get_le64(p + 32);
+
+    /* the strings end in a NUL, so any offset inside them is a string */
+    if (src_offset >= m->strings_len ||
+        ((r->flags & AXL_STATE_HAS_DEST) && dst_offset >= m->strings_len) ||
+        extras_offset > m->extras_len ||
+        r->extras_len > m->extras_len - extras_offset)
+    {
+        return AXL_FAILURE;
+    }
+
+    r->src = (const char*) (m->strings + src_offset);
+    r->dst = NULL;
+    if (r->flags & AXL_STATE_HAS_DEST) {
+        r->dst = (const char*) (m->strings + dst_offset);
+    }
+    r->extras = m->extras + extras_offset;
+
+    int j;
+    for (j = 0; j < AXL_STATE_META_FIELDS; j++) {
+        r->meta[j] = axl_get_le64(p + 40 + 8 * j);
+    }
+    return AXL_SUCCESS;
+}
+
+/* Add the file in record r to files.  A file the record says is in its
+ * destination is never copied again, so how far its copy got, in its
+ * manifest and chunks, is left in the map. */
+static int axl_state_add_file(const struct axl_state_record* r, kvtree* files)
+{
+    kvtree* hash = kvtree_set(files, r->src, kvtree_new());
+
+    if (r->flags & AXL_STATE_HAS_DEST) {
+        kvtree_util_set_str(hash, AXL_KEY_FILE_DEST, r->dst);
+    }
+
+    int done = 0;
+    if (r->flags & AXL_STATE_HAS_STATUS) {
+        kvtree_util_set_int(hash, AXL_KEY_FILE_STATUS, r->status);
+        done = (r->status == AXL_STATUS_DEST);
+    }
+
+    if (r->flags & AXL_STATE_HAS_META) {
+        int i;
+        for (i = 0; i < AXL_STATE_META_FIELDS; i++) {
+            kvtree_util_set_unsigned_long(hash, axl_state_meta_keys[i],
+                (unsigned long) r->meta[i]);
+        }
+    }
+
+    if (r->extras_len == 0) {
+        return AXL_SUCCESS;
+    }
+    return axl_state_get_extras(r->extras, r->extras_len, hash,
+        done ? axl_state_progress_key : NULL);
+}
+
+/* Read the binary state file state_file, which is size bytes and open on
+ * fd, into file_list.  The records are read in place in the map, and only
+ * what resuming the transfer needs is copied into the kvtree. */
+static int axl_state_read_binary(const char* state_file, int fd, size_t size,
+    kvtree* file_list)
+{
+    struct axl_state_map m;
+    int rc = axl_state_map_open(state_file, fd, size, &m);
+    if (rc != AXL_SUCCESS) {
+        return rc;
+    }
+
+    rc = axl_state_get_extras(m.extras, m.handle_len, file_list, NULL);
+
+    if (rc == AXL_SUCCESS && m.nfiles > 0) {
+        kvtree_unset(file_list, AXL_KEY_FILES);
+        kvtree* files = kvtree_set(file_list, AXL_KEY_FILES, kvtree_new());
+
+        uint64_t i;
+        for (i = 0; i < m.nfiles && rc == AXL_SUCCESS; i++) {
+            struct axl_state_record r;
+            rc = axl_state_map_record(&m, i, &r);
+            if (rc == AXL_SUCCESS) {
+                rc = axl_state_add_file(&r, files);
+            }
+        }
+    }
+    if (rc != AXL_SUCCESS) {
+        AXL_ERR("State file %s is truncated or corrupt", state_file);
+    }
+
+    axl_state_map_close(&m);
+    return rc;
+}
+
+int axl_state_read_file(const char* state_file, kvtree* file_list)
+{
+    int fd = open(state_file, O_RDONLY);
+    if (fd < 0) {
+        AXL_ERR("Opening state file for read: open(%s) errno=%d %s",
+            state_file, errno, strerror(errno)
+        );
+        return AXL_FAILURE;
+    }
+
+    /* a binary state file starts with our magic, anything else is a
+     * kvtree file */
+    struct stat statbuf;
+    char magic[4];
+    if (fstat(fd, &statbuf) == 0 &&
+        statbuf.st_size >= AXL_STATE_HEADER_SIZE &&
+        pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+        memcmp(magic, AXL_STATE_MAGIC, sizeof(magic)) == 0)
+    {
+        int rc = axl_state_read_binary(state_file, fd,
+            (size_t) statbuf.st_size, file_list);
+        close(fd);
+        return rc;
+    }
+    close(fd);
+
+    if (kvtree_read_file(state_file, file_list) != KVTREE_SUCCESS) {
+        return AXL_FAILURE;
+    }
+    return AXL_SUCCESS;
+}
+
+/* fsync the directory that file is in */
+static int axl_state_sync_dir(const char* file)
+{
+    char* file_copy = strdup(file);
+    if (! file_copy) {
+        return AXL_FAILURE;
+    }
+    const char* dir = dirname(file_copy);
+
+    int rc = AXL_SUCCESS;
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0 || fsync(fd) != 0) {
+        AXL_ERR("Syncing directory %s failed: errno=%d %s",
+            dir, errno, strerror(errno)
+        );
+        rc = AXL_FAILURE;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    axl_free(&file_copy);
+    return rc;
+}
+
+/* Write the binary state file for file_list to state_file */
+static int axl_state_write_binary(const char* state_file, const kvtree* file_list)
+{
+    struct axl_state_buf records = {NULL, 0, 0};
+    struct axl_state_buf strings = {NULL, 0, 0};
+    struct axl_state_buf extras  = {NULL, 0, 0};
+    int rc = AXL_SUCCESS;
+
+    /* the handle's own values, then a record for each file */
+    const kvtree* files = NULL;
+    const kvtree_elem* elem;
+    for (elem = kvtree_elem_first(file_list); elem && rc == AXL_SUCCESS;
+        elem = kvtree_elem_next(elem))
+    {
+        const char* key = kvtree_elem_key(elem);
+        if (strcmp(key, AXL_KEY_FILES) == 0) {
+            files = kvtree_elem_hash(elem);
+            continue;
+        }
+        rc = axl_state_put_extra(&extras, key, kvtree_elem_hash(elem));
+    }
+    uint64_t handle_len = (uint64_t) extras.len;
+
+    uint64_t nfiles = 0;
+    for (elem = files ? kvtree_elem_first(files) : NULL; elem && rc == AXL_SUCCESS;
+        elem = kvtree_elem_next(elem))
+    {
+        rc = axl_state_put_file(elem, &records, &strings, &extras);
+        nfiles++;
+    }
+
+    unsigned char header[AXL_STATE_HEADER_SIZE];
+    uint64_t records_offset = AXL_STATE_HEADER_SIZE;
+    uint64_t strings_offset = records_offset + records.len;
+    uint64_t extras_offset  = strings_offset + strings.len;
+    uint32_t crc = axl_hash(AXL_CRC_CRC32C, 0, records.data, records.len);
+    crc = axl_hash(AXL_CRC_CRC32C, crc, strings.data, strings.len);
+    crc = axl_hash(AXL_CRC_CRC32C, crc, extras.data, extras.len);
+    memcpy(header, AXL_STATE_MAGIC, 4);
+    axl_put_le32(header + 4,  AXL_STATE_VERSION);
+    axl_put_le32(header + 8,  crc);
+    axl_put_le32(header + 12, AXL_STATE_RECORD_SIZE);
+    axl_put_le64(header + 16, nfiles);
+    axl_put_le64(header + 24, records_offset);
+    axl_put_le64(header + 32, strings_offset);
+    axl_put_le64(header + 40, (uint64_t) strings.len);
+    axl_put_le64(header + 48, extras_offset);
+    axl_put_le64(header + 56, (uint64_t) extras.len);
+    axl_put_le64(header + 64, handle_len);
+
+    char* tmp = NULL;
+    if (rc == AXL_SUCCESS && asprintf(&tmp, "%s.tmp", state_file) < 0) {
+        tmp = NULL;
+        rc = AXL_FAILURE;
+    }
+    int fd = -1;
+    if (rc == AXL_SUCCESS) {
+        fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, axl_getmode(1, 1, 0));
+        if (fd < 0) {
+            AXL_ERR("Opening state file for write: open(%s) errno=%d %s",
+                tmp, errno, strerror(errno)
+            );
+            rc = AXL_FAILURE;
+        }
+    } else {
+        AXL_ERR("Couldn't build state file %s", state_file);
+    }
+
+    if (rc == AXL_SUCCESS) {
+        if (axl_write_attempt(tmp, fd, header, sizeof(header)) != sizeof(header) ||
+            axl_write_attempt(tmp, fd, records.data, records.len) != (ssize_t) records.len ||
+            axl_write_attempt(tmp, fd, strings.data, strings.len) != (ssize_t) strings.len ||
+            axl_write_attempt(tmp, fd, extras.data, extras.len) != (ssize_t) extras.len)
+        {
+            rc = AXL_FAILURE;
+        }
+
+        /* the new file has to be on disk before it replaces the old one,
+         * or a crash could leave neither */
+        if (rc == AXL_SUCCESS && fsync(fd) != 0) {
+            AXL_ERR("fsync(%s) failed: errno=%d %s",
+                tmp, errno, strerror(errno)
+            );
+            rc = AXL_FAILURE;
+        }
+        if (close(fd) != 0) {
+            rc = AXL_FAILURE;
+        }
+
+        if (rc == AXL_SUCCESS && rename(tmp, state_file) != 0) {
+            AXL_ERR("rename(%s, %s) failed: errno=%d %s",
+                tmp, state_file, errno, strerror(errno)
+            );
+            rc = AXL_FAILURE;
+        }
+        if (rc != AXL_SUCCESS) {
+            unlink(tmp);
+        }
+    }
+
+    /* and so does the rename */
+    if (rc == AXL_SUCCESS) {
+        rc = axl_state_sync_dir(state_file);
+    }
+
+    axl_free(&tmp);
+    free(extras.data);
+    free(strings.data);
+    free(records.data);
+    return rc;
+}
+
+int axl_state_write_file(const char* state_file, const kvtree* file_list,
+    int format)
+{
+    if (format == AXL_STATE_FORMAT_BINARY) {
+        return axl_state_write_binary(state_file, file_list);
+    }
+
+    if (kvtree_write_file(state_file, file_list) != KVTREE_SUCCESS) {
+        return AXL_FAILURE;
+    }
+    return AXL_SUCCESS;
+}
@@ -5,6 +5,22 @@
 
 #include <assert.h>
 
+/* The file whose manifest axl_sync_manifest_update() records */
+struct axl_sync_manifest_arg {
+    int id;
+    const char* source;
+};
+
+/* The axl_copy_opts manifest_update function, arg points to an
+ * axl_sync_manifest_arg.  We record the manifest in the state file after
+ * every block, so a resumed copy knows where it can pick up from. */
+static void axl_sync_manifest_update(void* arg, kvtree* manifest,
+    unsigned long block, const uint32_t* crc)
+{
+    struct axl_sync_manifest_arg* m = (struct axl_sync_manifest_arg*) arg;
+    axl_manifest_record(m->id, m->source, manifest, block, crc);
+}
+
 /* synchonous transfer of files */
 int __axl_sync_start (int id, int resume)
 {
@@ -38,19 +54,31 @@ int __axl_sync_start (int id, int resume)
             continue;
         }
 
-        /* TODO: check bytecount conversion success, do not use global
-         * axl_kvtrees to get file_list */
-        unsigned long file_buf_size;
-        int success = kvtree_util_get_bytecount(file_list,
-            AXL_KEY_CONFIG_FILE_BUF_SIZE, &file_buf_size);
-        assert(success == KVTREE_SUCCESS);
+        /* TODO: do not use global axl_kvtrees to get file_list */
+        struct axl_copy_opts opts;
+        int success = axl_copy_opts_load(file_list, &opts);
+        assert(success == AXL_SUCCESS);
 
         char* destination;
         kvtree_util_get_str(elem_hash, AXL_KEY_FILE_DEST, &destination);
 
-        /* Copy the file */
-        int tmp_rc = axl_file_copy(source, destination, file_buf_size, resume);
+        struct axl_sync_manifest_arg manifest_arg = { id, source };
+        opts.manifest        = kvtree_get(elem_hash, AXL_KEY_FILE_MANIFEST);
+        opts.manifest_update = axl_sync_manifest_update;
+        opts.manifest_arg    = &manifest_arg;
+
+        /* Copy the file, or pack it if it's small */
+        uLong crc;
+        int tmp_rc;
+        if (axl_pack_is_packed(elem_hash)) {
+            tmp_rc = axl_pack_file(id, source, destination, &opts, &crc);
+        } else {
+            tmp_rc = axl_file_copy(source, destination, &opts, resume, &crc);
+        }
         if (tmp_rc == AXL_SUCCESS) {
+            if (opts.crc) {
+                kvtree_util_set_crc32(elem_hash, AXL_KEY_FILE_CRC, crc);
+            }
             kvtree_util_set_int(elem_hash, AXL_KEY_FILE_STATUS, AXL_STATUS_DEST);
         } else {
             kvtree_util_set_int(elem_hash, AXL_KEY_FILE_STATUS, AXL_STATUS_ERROR);
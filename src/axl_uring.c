@@ -0,0 +1,898 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <liburing.h>
+#include "axl_internal.h"
+#include "kvtree_util.h"
+#include "axl_uring.h"
+#include "axl_sync.h"
+
+/* This is the io_uring transfer implementation.  Rather than dedicating a
+ * thread to each file that blocks in read() and write(), a single thread per
+ * transfer drives the opens, reads, writes, fsyncs, and closes of all files
+ * through one io_uring instance, keeping many requests in flight at once. */
+
+/* Max number of requests we keep in flight at once */
+#define AXL_URING_QUEUE_DEPTH (128)
+
+/* Largest single read or write we issue.  Each read/write request owns a
+ * buffer of this size (or FILE_BUF_SIZE if that's smaller), which bounds
+ * our memory use to AXL_URING_QUEUE_DEPTH times this value. */
+#define AXL_URING_MAX_IO_SIZE (512UL * 1024UL)
+
+/* Max number of files we have open at once */
+#define AXL_URING_MAX_OPEN_FILES (64)
+
+/* The next step each file is waiting on.  A step is only issued once all of
+ * the file's outstanding requests for the previous step have completed. */
+enum axl_uring_state {
+    AXL_URING_OPEN_SRC,
+    AXL_URING_OPEN_DST,
+    AXL_URING_COPY,
+    AXL_URING_SYNC,
+    AXL_URING_CLOSE,
+    AXL_URING_DONE,
+};
+
+enum axl_uring_op {
+    AXL_URING_OP_OPEN_SRC,
+    AXL_URING_OP_OPEN_DST,
+    AXL_URING_OP_READ,
+    AXL_URING_OP_WRITE,
+    AXL_URING_OP_FSYNC,
+    AXL_URING_OP_CLOSE,
+};
+
+struct axl_uring_file
+{
+    /* The file's kvtree, used to record its status */
+    kvtree* elem_hash;
+
+    /* Source and destination paths (point into the kvtree) */
+    const char* src;
+    const char* dst;
+
+    int src_fd;
+    int dst_fd;
+
+    /* Size of the source file, and offset of the next read to issue */
+    off_t size;
+    off_t next;
+
+    /* Number of requests in flight for this file */
+    unsigned int pending;
+
+    enum axl_uring_state state;
+
+    /* Set if any request for this file failed */
+    int error;
+
+    /* Set if the file is packed into a container rather than copied */
+    int packed;
+};
+
+struct axl_uring_req
+{
+    enum axl_uring_op op;
+    struct axl_uring_file* file;
+
+    /* data buffer for reads and writes, allocated on first use */
+    char* buf;
+
+    /* file offset of buf[0], number of bytes in this request,
+     * and number of bytes read or written so far */
+    off_t offset;
+    size_t len;
+    size_t done;
+
+    /* open flags for the destination file */
+    int flags;
+
+    /* This struct is in a free list while not in use */
+    struct axl_uring_req* next;
+};
+
+struct axl_uring_data
+{
+    /* AXL ID associated with this data */
+    int id;
+
+    /* AXL transfer options from axl_kvtrees */
+    kvtree* file_list;
+
+    /* If resume = 1, try to resume old transfers */
+    int resume;
+
+    /* This struct is in a linked list */
+    struct axl_uring_data* next;
+
+    /* Files to transfer */
+    struct axl_uring_file* files;
+    unsigned int count;
+
+    /* Our submission thread, and whether it has been joined */
+    pthread_t tid;
+    int joined;
+
+    /* Lock to protect remain and cancel */
+    pthread_mutex_t lock;
+
+    /* Count of files still to be completed.  The submission thread
+     * decrements this as each file finishes. */
+    unsigned int remain;
+
+    /* Set by AXL_Cancel() to ask the submission thread to stop */
+    int cancel;
+
+    /* Set by the submission thread if any file failed */
+    int failed;
+};
+
+/* State of a submission thread's ring */
+struct axl_uring_ring
+{
+    struct io_uring ring;
+
+    /* Request structs that are not in flight */
+    struct axl_uring_req* free_reqs;
+
+    /* Number of requests in flight */
+    unsigned int inflight;
+
+    /* Size of each read and write */
+    size_t io_size;
+
+    /* Whether to fsync each destination before closing it */
+    int fsync;
+};
+
+/* Same as axl_all_pthread_data, see the note in axl_pthread.c on why
+ * this is not stored in the kvtree */
+struct axl_all_uring_data
+{
+    struct axl_uring_data* head;
+    struct axl_uring_data* tail;
+
+    /* Lock to protect this data structure */
+    pthread_mutex_t lock;
+} axl_all_uring_data = {
+    .head = NULL,
+    .tail = NULL,
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+/* Get the uring data for a given AXL ID */
+static struct axl_uring_data* axl_uring_data_lookup(int id)
+{
+    struct axl_uring_data* ret = NULL;
+
+    pthread_mutex_lock(&axl_all_uring_data.lock);
+
+    struct axl_uring_data* udata = axl_all_uring_data.head;
+    while (udata) {
+        if (udata->id == id) {
+            /* Match */
+            ret = udata;
+            break;
+        }
+        udata = udata->next;
+    }
+
+    pthread_mutex_unlock(&axl_all_uring_data.lock);
+
+    return ret;
+}
+
+/* Add our new udata to the list. */
+static void axl_uring_data_add(int id, struct axl_uring_data* udata)
+{
+    udata->id = id;
+    udata->file_list = axl_kvtrees[id];
+
+    pthread_mutex_lock(&axl_all_uring_data.lock);
+
+    if (!axl_all_uring_data.head) {
+        /* First entry */
+        axl_all_uring_data.head = udata;
+        axl_all_uring_data.tail = udata;
+    } else {
+        axl_all_uring_data.tail->next = udata;
+        axl_all_uring_data.tail = udata;
+    }
+
+    pthread_mutex_unlock(&axl_all_uring_data.lock);
+}
+
+static void axl_uring_data_remove(int id)
+{
+    pthread_mutex_lock(&axl_all_uring_data.lock);
+
+    struct axl_uring_data* prev = NULL;
+    struct axl_uring_data* udata = axl_all_uring_data.head;
+    while (udata) {
+        if (udata->id == id) {
+            /* Match, remove it from the list.  The caller is still
+             * responsible for freeing udata. */
+            if (prev) {
+                prev->next = udata->next;
+            }
+            if (axl_all_uring_data.head == udata) {
+                axl_all_uring_data.head = udata->next;
+            }
+            if (axl_all_uring_data.tail == udata) {
+                axl_all_uring_data.tail = prev;
+            }
+            break;
+        }
+        prev = udata;
+        udata = udata->next;
+    }
+
+    pthread_mutex_unlock(&axl_all_uring_data.lock);
+}
+
+static void axl_uring_free_udata(struct axl_uring_data* udata)
+{
+    pthread_mutex_destroy(&udata->lock);
+    free(udata->files);
+    free(udata);
+}
+
+static int axl_uring_canceled(struct axl_uring_data* udata)
+{
+    pthread_mutex_lock(&udata->lock);
+    int cancel = udata->cancel;
+    pthread_mutex_unlock(&udata->lock);
+    return cancel;
+}
+
+/* Record the final status of a file and count it as done */
+static void axl_uring_file_done(struct axl_uring_data* udata,
+    struct axl_uring_file* file, int canceled)
+{
+    if (file->error) {
+        kvtree_util_set_int(file->elem_hash, AXL_KEY_FILE_STATUS, AXL_STATUS_ERROR);
+        udata->failed = 1;
+
+        /* unlink the file if the copy failed, but leave canceled
+         * transfers in place so that they can be resumed */
+        if (! canceled && ! file->packed) {
+            axl_file_unlink(file->dst);
+        }
+    } else if (! canceled) {
+        kvtree_util_set_int(file->elem_hash, AXL_KEY_FILE_STATUS, AXL_STATUS_DEST);
+    }
+    AXL_DBG(2, "%s: Read and copied %s to %s, error %d",
+        __func__, file->src, file->dst, file->error);
+
+    pthread_mutex_lock(&udata->lock);
+    udata->remain -= 1;
+    pthread_mutex_unlock(&udata->lock);
+}
+
+/* Queue a request on the ring, the caller has already filled in req */
+static void axl_uring_queue(struct io_uring* ring, struct axl_uring_req* req)
+{
+    struct axl_uring_file* file = req->file;
+
+    /* we never have more requests than SQ entries, so this can't fail */
+    struct io_uring_sqe* sqe = io_uring_get_sqe(ring);
+
+    switch (req->op) {
+    case AXL_URING_OP_OPEN_SRC:
+        io_uring_prep_openat(sqe, AT_FDCWD, file->src, O_RDONLY, 0);
+        break;
+    case AXL_URING_OP_OPEN_DST:
+        io_uring_prep_openat(sqe, AT_FDCWD, file->dst, req->flags, axl_getmode(1, 1, 0));
+        break;
+    case AXL_URING_OP_READ:
+        io_uring_prep_read(sqe, file->src_fd, req->buf + req->done,
+            req->len - req->done, req->offset + req->done);
+        break;
+    case AXL_URING_OP_WRITE:
+        io_uring_prep_write(sqe, file->dst_fd, req->buf + req->done,
+            req->len - req->done, req->offset + req->done);
+        break;
+    case AXL_URING_OP_FSYNC:
+        io_uring_prep_fsync(sqe, file->dst_fd, 0);
+        break;
+    case AXL_URING_OP_CLOSE:
+        /* the fd to close is stashed in offset */
+        io_uring_prep_close(sqe, (int) req->offset);
+        break;
+    }
+
+    io_uring_sqe_set_data(sqe, req);
+}
+
+/* Handle one completed request.  Returns 1 if req is done with and
+ * may be put back on the free list, 0 if it was requeued. */
+static int axl_uring_complete(
+    struct axl_uring_data* udata,
+    struct io_uring* ring,
+    struct axl_uring_req* req,
+    int res,
+    unsigned long* total_copied,
+    unsigned long pause_after)
+{
+    struct axl_uring_file* file = req->file;
+
+    /* retry anything that was interrupted */
+    if (res == -EINTR || res == -EAGAIN) {
+        axl_uring_queue(ring, req);
+        return 0;
+    }
+
+    switch (req->op) {
+    case AXL_URING_OP_OPEN_SRC: {
+        if (res < 0) {
+            AXL_ERR("Opening file to copy: open(%s) errno=%d %s",
+                file->src, -res, strerror(-res)
+            );
+            file->error = 1;
+            file->state = AXL_URING_DONE;
+            break;
+        }
+        file->src_fd = res;
+
+        struct stat statbuf;
+        if (fstat(file->src_fd, &statbuf) != 0) {
+            AXL_ERR("stat(%s) failed: errno=%d %s",
+                file->src, errno, strerror(errno)
+            );
+            file->error = 1;
+            file->state = AXL_URING_CLOSE;
+            break;
+        }
+        file->size = statbuf.st_size;
+        file->state = AXL_URING_OPEN_DST;
+        break;
+    }
+
+    case AXL_URING_OP_OPEN_DST:
+        if (res < 0) {
+            AXL_ERR("Opening file for writing: open(%s) errno=%d %s",
+                file->dst, -res, strerror(-res)
+            );
+            file->error = 1;
+            file->state = AXL_URING_CLOSE;
+            break;
+        }
+        file->dst_fd = res;
+
+        /* Writes complete in any order, so the end of a destination left by
+         * an interrupted copy may lie past blocks that were never written.
+         * We can't tell how much of it is good, so a resumed file is copied
+         * again from the start; files that finished are still skipped. */
+        file->next = 0;
+
+        /* the ring writes blocks in any order, so reserve the whole file
+         * first to keep it from fragmenting */
+        axl_file_reserve(file->dst, file->dst_fd, 0, file->size);
+        file->state = AXL_URING_COPY;
+        break;
+
+    case AXL_URING_OP_READ:
+        if (res <= 0) {
+            if (res == 0) {
+                AXL_ERR("Unexpected end of file %s at offset %lu",
+                    file->src, (unsigned long) (req->offset + req->done)
+                );
+            } else {
+                AXL_ERR("Error reading file %s errno=%d %s",
+                    file->src, -res, strerror(-res)
+                );
+            }
+            file->error = 1;
+            break;
+        }
+
+        req->done += res;
+        if (req->done < req->len) {
+            /* short read, read the rest of the block */
+            axl_uring_queue(ring, req);
+            return 0;
+        }
+
+        /* got the full block, now write it out */
+        req->op   = AXL_URING_OP_WRITE;
+        req->done = 0;
+        axl_uring_queue(ring, req);
+        return 0;
+
+    case AXL_URING_OP_WRITE:
+        if (res <= 0) {
+            AXL_ERR("Error writing file %s errno=%d %s",
+                file->dst, -res, strerror(-res)
+            );
+            file->error = 1;
+            break;
+        }
+
+        req->done += res;
+        if (req->done < req->len) {
+            /* short write, write the rest of the block */
+            axl_uring_queue(ring, req);
+            return 0;
+        }
+
+        /* Possibly pause our transfer for unit tests */
+        *total_copied += req->len;
+        while (pause_after != ULONG_MAX && *total_copied >= pause_after &&
+               ! axl_uring_canceled(udata));
+        break;
+
+    case AXL_URING_OP_FSYNC:
+        if (res < 0) {
+            /* print warning that fsync failed */
+            AXL_DBG(2, "Failed to fsync file descriptor: %s errno=%d %s",
+                file->dst, -res, strerror(-res)
+            );
+        }
+        file->state = AXL_URING_CLOSE;
+        break;
+
+    case AXL_URING_OP_CLOSE:
+        if (res < 0) {
+            AXL_ERR("Closing file descriptor %d: errno=%d %s",
+                (int) req->offset, -res, strerror(-res)
+            );
+            file->error = 1;
+        }
+        break;
+    }
+
+    file->pending--;
+    return 1;
+}
+
+/* Issue up to limit of the next requests for a file, as long as we have
+ * free request structs.  Returns 1 once the file is completely done. */
+static int axl_uring_advance(
+    struct axl_uring_data* udata,
+    struct axl_uring_ring* r,
+    struct axl_uring_file* file,
+    unsigned int limit,
+    int canceled)
+{
+    while (r->free_reqs && limit > 0) {
+        struct axl_uring_req* req = r->free_reqs;
+        req->file   = file;
+        req->offset = 0;
+        req->len    = 0;
+        req->done   = 0;
+
+        switch (file->state) {
+        case AXL_URING_OPEN_SRC:
+            if (file->pending > 0) {
+                return 0;
+            }
+            req->op = AXL_URING_OP_OPEN_SRC;
+            break;
+
+        case AXL_URING_OPEN_DST:
+            if (file->pending > 0) {
+                return 0;
+            }
+            req->op = AXL_URING_OP_OPEN_DST;
+            req->flags = O_WRONLY | O_CREAT | O_TRUNC;
+            break;
+
+        case AXL_URING_COPY:
+            if (file->error || canceled || file->next >= file->size) {
+                /* no more reads to issue, wait for writes to drain */
+                if (file->pending > 0) {
+                    return 0;
+                }
+                if (file->error || canceled || ! r->fsync) {
+                    file->state = AXL_URING_CLOSE;
+                } else {
+                    file->state = AXL_URING_SYNC;
+                }
+                continue;
+            }
+
+            if (! req->buf) {
+                req->buf = malloc(r->io_size);
+                if (! req->buf) {
+                    AXL_ERR("Allocating memory: malloc(%lu) errno=%d %s",
+                        (unsigned long) r->io_size, errno, strerror(errno)
+                    );
+                    file->error = 1;
+                    continue;
+                }
+            }
+            req->op     = AXL_URING_OP_READ;
+            req->offset = file->next;
+            req->len    = AXL_MIN((off_t) r->io_size, file->size - file->next);
+            file->next += req->len;
+            break;
+
+        case AXL_URING_SYNC:
+            if (file->pending > 0) {
+                return 0;
+            }
+            req->op = AXL_URING_OP_FSYNC;
+            break;
+
+        case AXL_URING_CLOSE:
+            req->op = AXL_URING_OP_CLOSE;
+            if (file->src_fd >= 0) {
+                req->offset  = file->src_fd;
+                file->src_fd = -1;
+            } else if (file->dst_fd >= 0) {
+                req->offset  = file->dst_fd;
+                file->dst_fd = -1;
+            } else if (file->pending > 0) {
+                /* wait for our closes to complete */
+                return 0;
+            } else {
+                file->state = AXL_URING_DONE;
+                continue;
+            }
+            break;
+
+        case AXL_URING_DONE:
+            return 1;
+        }
+
+        /* take the request off the free list and queue it */
+        r->free_reqs = req->next;
+        r->inflight++;
+        file->pending++;
+        limit--;
+        axl_uring_queue(&r->ring, req);
+    }
+
+    return (file->state == AXL_URING_DONE && file->pending == 0);
+}
+
+/* Pack the small files into their containers, which the ring leaves to us */
+static void axl_uring_pack_files(struct axl_uring_data* udata,
+    const struct axl_copy_opts* opts)
+{
+    unsigned int i;
+    for (i = 0; i < udata->count && ! axl_uring_canceled(udata); i++) {
+        struct axl_uring_file* file = &udata->files[i];
+        if (! file->packed) {
+            continue;
+        }
+        uLong crc;
+        if (axl_pack_file(udata->id, file->src, file->dst, opts, &crc) != AXL_SUCCESS) {
+            file->error = 1;
+        } else if (opts->crc) {
+            kvtree_util_set_crc32(file->elem_hash, AXL_KEY_FILE_CRC, crc);
+        }
+        axl_uring_file_done(udata, file, 0);
+    }
+}
+
+/* Copy files one at a time with axl_file_copy(), used when the kernel
+ * does not let us set up a ring, or the transfer wants each file's crc */
+static void axl_uring_copy_fallback(struct axl_uring_data* udata,
+    const struct axl_copy_opts* opts)
+{
+    unsigned int i;
+    for (i = 0; i < udata->count && ! axl_uring_canceled(udata); i++) {
+        struct axl_uring_file* file = &udata->files[i];
+        if (file->packed) {
+            continue;
+        }
+        uLong crc;
+        if (axl_file_copy(file->src, file->dst, opts, udata->resume, &crc) != AXL_SUCCESS) {
+            file->error = 1;
+        } else if (opts->crc) {
+            kvtree_util_set_crc32(file->elem_hash, AXL_KEY_FILE_CRC, crc);
+        }
+        axl_uring_file_done(udata, file, 0);
+    }
+}
+
+/* The submission thread */
+static void* axl_uring_func(void* arg)
+{
+    struct axl_uring_data* udata = arg;
+
+    struct axl_copy_opts opts;
+    if (axl_copy_opts_load(udata->file_list, &opts) != AXL_SUCCESS) {
+        udata->failed = 1;
+        return AXL_SUCCESS;
+    }
+
+    axl_uring_pack_files(udata, &opts);
+
+    /* The ring finishes a file's blocks in any order, so it can't compute
+     * a crc on the way through, and it only does plain copies of whole
+     * files */
+    if (opts.crc || opts.compress != AXL_COMPRESS_NONE || opts.delta_size > 0) {
+        axl_uring_copy_fallback(udata, &opts);
+        return AXL_SUCCESS;
+    }
+
+    struct axl_uring_ring r = {
+        .free_reqs = NULL,
+        .inflight  = 0,
+        .io_size   = AXL_MIN(opts.buf_size, AXL_URING_MAX_IO_SIZE),
+        .fsync     = (opts.sync == AXL_SYNC_ALL || opts.sync == AXL_SYNC_DEST),
+    };
+    int ret = io_uring_queue_init(AXL_URING_QUEUE_DEPTH, &r.ring, 0);
+    if (ret < 0) {
+        AXL_DBG(1, "io_uring_queue_init failed errno=%d %s, copying synchronously",
+            -ret, strerror(-ret)
+        );
+        axl_uring_copy_fallback(udata, &opts);
+        return AXL_SUCCESS;
+    }
+
+    /* Allocate our pool of requests, the ring never holds more than this */
+    struct axl_uring_req* reqs = calloc(AXL_URING_QUEUE_DEPTH, sizeof(*reqs));
+    if (! reqs) {
+        io_uring_queue_exit(&r.ring);
+        axl_uring_copy_fallback(udata, &opts);
+        return AXL_SUCCESS;
+    }
+    int i;
+    for (i = 0; i < AXL_URING_QUEUE_DEPTH; i++) {
+        reqs[i].next = r.free_reqs;
+        r.free_reqs = &reqs[i];
+    }
+
+    /* Files that we're currently working on */
+    struct axl_uring_file* active[AXL_URING_MAX_OPEN_FILES];
+    unsigned int active_count = 0;
+    unsigned int next_file = 0;
+
+    unsigned long total_copied = 0;
+    unsigned long pause_after = axl_debug_pause_after();
+
+    while (1) {
+        int canceled = axl_uring_canceled(udata);
+
+        /* start on more files if we have room */
+        while (! canceled && next_file < udata->count &&
+               active_count < AXL_URING_MAX_OPEN_FILES)
+        {
+            struct axl_uring_file* file = &udata->files[next_file++];
+            if (! file->packed) {
+                active[active_count++] = file;
+            }
+        }
+
+        /* Issue the next step for each file, retiring those that are done.
+         * We hand out one request per file before filling the rest of the
+         * ring, so that every open file makes progress. */
+        unsigned int j = 0;
+        while (j < active_count) {
+            struct axl_uring_file* file = active[j];
+            if (axl_uring_advance(udata, &r, file, 1, canceled)) {
+                axl_uring_file_done(udata, file, canceled);
+                active[j] = active[--active_count];
+            } else {
+                j++;
+            }
+        }
+        for (j = 0; j < active_count && r.free_reqs; j++) {
+            axl_uring_advance(udata, &r, active[j], UINT_MAX, canceled);
+        }
+
+        if (r.inflight == 0) {
+            /* nothing outstanding, so we're either done or canceled */
+            if (active_count == 0 && (canceled || next_file >= udata->count)) {
+                break;
+            }
+            continue;
+        }
+
+        io_uring_submit(&r.ring);
+
+        /* wait for at least one completion, then reap whatever else is ready */
+        struct io_uring_cqe* cqe;
+        ret = io_uring_wait_cqe(&r.ring, &cqe);
+        if (ret < 0) {
+            AXL_ERR("io_uring_wait_cqe failed errno=%d %s", -ret, strerror(-ret));
+            continue;
+        }
+        do {
+            struct axl_uring_req* req = io_uring_cqe_get_data(cqe);
+            int res = cqe->res;
+            io_uring_cqe_seen(&r.ring, cqe);
+
+            if (axl_uring_complete(udata, &r.ring, req, res,
+                &total_copied, pause_after))
+            {
+                req->next = r.free_reqs;
+                r.free_reqs = req;
+                r.inflight--;
+            }
+        } while (io_uring_peek_cqe(&r.ring, &cqe) == 0);
+    }
+
+    for (i = 0; i < AXL_URING_QUEUE_DEPTH; i++) {
+        free(reqs[i].buf);
+    }
+    free(reqs);
+    io_uring_queue_exit(&r.ring);
+
+    return AXL_SUCCESS;
+}
+
+/* Start a tranfer.  If resume = 1, attempt to resume the old transfer (start
+ * the copy where the old destination file left off). */
+static int __axl_uring_start (int id, int resume)
+{
+    /* get pointer to file list for this dataset */
+    kvtree* file_list = axl_kvtrees[id];
+
+    /* mark dataset as in progress */
+    kvtree_util_set_int(file_list, AXL_KEY_STATUS, AXL_STATUS_INPROG);
+
+    kvtree* files = kvtree_get(file_list, AXL_KEY_FILES);
+    unsigned int file_count = kvtree_size(files);
+
+    struct axl_uring_data* udata = calloc(1, sizeof(*udata));
+    if (! udata) {
+        kvtree_util_set_int(file_list, AXL_KEY_STATUS, AXL_STATUS_ERROR);
+        return AXL_FAILURE;
+    }
+    udata->files = calloc(file_count ? file_count : 1, sizeof(*udata->files));
+    if (! udata->files || pthread_mutex_init(&udata->lock, NULL) != 0) {
+        free(udata->files);
+        free(udata);
+        kvtree_util_set_int(file_list, AXL_KEY_STATUS, AXL_STATUS_ERROR);
+        return AXL_FAILURE;
+    }
+    udata->resume = resume;
+
+    /* build our list of files still to be copied */
+    kvtree_elem* elem = NULL;
+    for (elem = kvtree_elem_first(files);
+         elem != NULL;
+         elem = kvtree_elem_next(elem))
+    {
+        kvtree* elem_hash = kvtree_elem_hash(elem);
+
+        int status;
+        kvtree_util_get_int(elem_hash, AXL_KEY_FILE_STATUS, &status);
+        if (status == AXL_STATUS_DEST) {
+            /* this file was already transfered */
+            continue;
+        }
+
+        char* dst = NULL;
+        kvtree_util_get_str(elem_hash, AXL_KEY_FILE_DEST, &dst);
+
+        struct axl_uring_file* file = &udata->files[udata->count++];
+        file->elem_hash = elem_hash;
+        file->src       = kvtree_elem_key(elem);
+        file->dst       = dst;
+        file->src_fd    = -1;
+        file->dst_fd    = -1;
+        file->state     = AXL_URING_OPEN_SRC;
+        file->packed    = axl_pack_is_packed(elem_hash);
+    }
+    udata->remain = udata->count;
+
+    axl_uring_data_add(id, udata);
+
+    int rc = AXL_SUCCESS;
+    if (pthread_create(&udata->tid, NULL, &axl_uring_func, udata) != 0) {
+        AXL_ERR("Couldn't spawn io_uring submission thread");
+        udata->joined = 1;
+        kvtree_util_set_int(file_list, AXL_KEY_STATUS, AXL_STATUS_ERROR);
+        rc = AXL_FAILURE;
+    }
+
+    return rc;
+}
+
+int axl_uring_start (int id)
+{
+    return __axl_uring_start(id, 0);
+}
+
+int axl_uring_resume (int id)
+{
+    return __axl_uring_start(id, 1);
+}
+
+int axl_uring_test (int id)
+{
+    /* assume all files are done */
+    int rc = AXL_SUCCESS;
+
+    struct axl_uring_data* udata = axl_uring_data_lookup(id);
+    if (! udata) {
+        return rc;
+    }
+
+    /* check whether all files have been completed */
+    pthread_mutex_lock(&udata->lock);
+    if (udata->remain > 0) {
+        /* There is still work outstanding */
+        rc = AXL_FAILURE;
+    }
+    pthread_mutex_unlock(&udata->lock);
+
+    return rc;
+}
+
+int axl_uring_wait (int id)
+{
+    struct axl_uring_data* udata = axl_uring_data_lookup(id);
+    if (! udata) {
+        AXL_ERR("No io_uring data");
+        return AXL_FAILURE;
+    }
+
+    /* get pointer to file list for this dataset */
+    kvtree* file_list = udata->file_list;
+
+    /* wait for the submission thread to finish */
+    if (! udata->joined) {
+        int tmp_rc = pthread_join(udata->tid, NULL);
+        if (tmp_rc != 0) {
+            AXL_ERR("pthread_join failed (%d)", tmp_rc);
+            return AXL_FAILURE;
+        }
+        udata->joined = 1;
+    }
+
+    /* the transfer is incomplete if it failed or was canceled */
+    if (udata->failed || udata->cancel) {
+        kvtree_util_set_int(file_list, AXL_KEY_STATUS, AXL_STATUS_ERROR);
+    } else {
+        kvtree_util_set_int(file_list, AXL_KEY_STATUS, AXL_STATUS_DEST);
+    }
+
+    axl_uring_data_remove(id);
+    axl_uring_free_udata(udata);
+
+    return axl_sync_wait(id);
+}
+
+int axl_uring_cancel (int id)
+{
+    struct axl_uring_data* udata = axl_uring_data_lookup(id);
+    if (! udata) {
+        AXL_ERR("No io_uring data");
+        return AXL_FAILURE;
+    }
+
+    /* ask the submission thread to stop issuing requests */
+    pthread_mutex_lock(&udata->lock);
+    udata->cancel = 1;
+    pthread_mutex_unlock(&udata->lock);
+
+    /* and wait for its in-flight requests to drain */
+    if (! udata->joined) {
+        int tmp_rc = pthread_join(udata->tid, NULL);
+        if (tmp_rc != 0) {
+            AXL_ERR("pthread_join failed (%d)", tmp_rc);
+            return AXL_FAILURE;
+        }
+        udata->joined = 1;
+    }
+
+    return AXL_SUCCESS;
+}
+
+void axl_uring_free (int id)
+{
+    /* udata should have been freed in AXL_Wait(), but maybe they just did
+     * an AXL_Cancel() and then an AXL_Free().  If so, udata will be set
+     * and we should free it. */
+    struct axl_uring_data* udata = axl_uring_data_lookup(id);
+    if (udata) {
+        if (! udata->joined) {
+            pthread_join(udata->tid, NULL);
+        }
+        axl_uring_data_remove(id);
+        axl_uring_free_udata(udata);
+    }
+}
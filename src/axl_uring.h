@@ -0,0 +1,17 @@
+#ifndef AXL_URING_H
+#define AXL_URING_H
+
+/** \file axl_uring.h
+ *  \ingroup axl
+ *  \brief implementation of axl using io_uring */
+
+/** \name uring */
+///@{
+int axl_uring_start(int id);
+int axl_uring_resume(int id);
+int axl_uring_test(int id);
+int axl_uring_wait(int id);
+int axl_uring_cancel(int id);
+void axl_uring_free(int id);
+///@}
+#endif //AXL_URING_H
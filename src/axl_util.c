@@ -133,3 +133,41 @@ kvtree_elem* axl_get_next_path(int id, kvtree_elem* elem, char** src, char** dst
 
     return (elem);
 }
+
+/* Store v at p as 4 or 8 little-endian bytes, for on-disk formats */
+void axl_put_le32(unsigned char* p, uint32_t v)
+{
+    int i;
+    for (i = 0; i < 4; i++) {
+        p[i] = (unsigned char) (v >> (8 * i));
+    }
+}
+
+void axl_put_le64(unsigned char* p, uint64_t v)
+{
+    int i;
+    for (i = 0; i < 8; i++) {
+        p[i] = (unsigned char) (v >> (8 * i));
+    }
+}
+
+/* Load 4 or 8 little-endian bytes from p */
+uint32_t axl_get_le32(const unsigned char* p)
+{
+    uint32_t v = 0;
+    int i;
+    for (i = 3; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+uint64_t axl_get_le64(const unsigned char* p)
+{
+    uint64_t v = 0;
+    int i;
+    for (i = 7; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
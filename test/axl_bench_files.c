@@ -0,0 +1,163 @@
+/*
+ * Benchmark the per-file overhead of a transfer.  Creates a number of
+ * zero-byte files in a scratch directory, copies them to a second directory
+ * with AXL, and reports files/second for AXL_Add() and for the copy itself
+ * (AXL_Dispatch() through AXL_Wait()).
+ *
+ * This is not run by ctest.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "axl.h"
+
+static double
+now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double) tv.tv_sec + (double) tv.tv_usec / 1000000.0;
+}
+
+/* Translate a string like "pthread" to its corresponding axl_xfer_t */
+static axl_xfer_t
+axl_xfer_str_to_xfer(const char *xfer_str)
+{
+    struct {
+        const char *xfer_str;
+        axl_xfer_t xfer;
+    } xfer_strs[] = {
+            {"sync", AXL_XFER_SYNC},
+            {"pthread", AXL_XFER_PTHREAD},
+            {"uring", AXL_XFER_URING},
+            {NULL, AXL_XFER_NULL},  /* must always be last element in array */
+    };
+    int i;
+
+    for (i = 0; xfer_strs[i].xfer_str; i++) {
+        if (strcmp(xfer_strs[i].xfer_str, xfer_str) == 0) {
+            return xfer_strs[i].xfer;
+        }
+    }
+    return AXL_XFER_NULL;
+}
+
+static void
+usage(void)
+{
+    printf("Usage: axl_bench_files [-n count] [-X xfer_type] SCRATCH_DIR\n");
+    printf("\n");
+    printf("Copy count zero-byte files (default 1000000) from SCRATCH_DIR/src\n");
+    printf("to SCRATCH_DIR/dst and report files/second.\n");
+    printf("\n");
+    printf("-n count:       Number of files\n");
+    printf("-X xfer_type:   AXL transfer type: sync pthread uring (default pthread)\n");
+}
+
+int
+main(int argc, char **argv) {
+    int rc;
+    int opt;
+    unsigned long count = 1000000;
+    const char *xfer_str = "pthread";
+    char src[PATH_MAX];
+    char dst[PATH_MAX];
+    char path[PATH_MAX + 32];
+    unsigned long i;
+
+    while ((opt = getopt(argc, argv, "n:X:")) != -1) {
+        switch (opt) {
+            case 'n':
+                count = strtoul(optarg, NULL, 10);
+                break;
+            case 'X':
+                xfer_str = optarg;
+                break;
+            default: /* '?' */
+                usage();
+                exit(1);
+        }
+    }
+
+    if (argc - optind != 1) {
+        usage();
+        exit(1);
+    }
+
+    axl_xfer_t xfer = axl_xfer_str_to_xfer(xfer_str);
+    if (xfer == AXL_XFER_NULL) {
+        printf("Error: Invalid AXL transfer type '%s'\n", xfer_str);
+        usage();
+        exit(1);
+    }
+
+    snprintf(src, sizeof(src), "%s/src", argv[optind]);
+    snprintf(dst, sizeof(dst), "%s/dst", argv[optind]);
+    if (mkdir(src, 0700) != 0 || mkdir(dst, 0700) != 0) {
+        printf("Couldn't create %s and %s, do they already exist?\n", src, dst);
+        exit(1);
+    }
+
+    /* Create our source files */
+    for (i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "%s/%lu", src, i);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0) {
+            printf("Couldn't create %s\n", path);
+            exit(1);
+        }
+        close(fd);
+    }
+
+    rc = AXL_Init();
+    if (rc != AXL_SUCCESS) {
+        printf("AXL_Init() failed (error %d)\n", rc);
+        return rc;
+    }
+
+    int id = AXL_Create(xfer, "axl_bench_files", NULL);
+    if (id == -1) {
+        printf("AXL_Create() failed (error %d)\n", id);
+        return id;
+    }
+
+    double start = now();
+    for (i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "%s/%lu", src, i);
+        rc = AXL_Add(id, path, dst);
+        if (rc != AXL_SUCCESS) {
+            printf("AXL_Add(..., %s, %s) failed (error %d)\n", path, dst, rc);
+            return rc;
+        }
+    }
+    double added = now();
+
+    rc = AXL_Dispatch(id);
+    if (rc != AXL_SUCCESS) {
+        printf("AXL_Dispatch() failed (error %d)\n", rc);
+        return rc;
+    }
+
+    rc = AXL_Wait(id);
+    if (rc != AXL_SUCCESS) {
+        printf("AXL_Wait() failed (error %d)\n", rc);
+        return rc;
+    }
+    double copied = now();
+
+    AXL_Free(id);
+    AXL_Finalize();
+
+    printf("%s: %lu files\n", xfer_str, count);
+    printf("  add:  %.3f secs, %.0f files/sec\n",
+        added - start, (double) count / (added - start));
+    printf("  copy: %.3f secs, %.0f files/sec\n",
+        copied - added, (double) count / (copied - added));
+
+    return 0;
+}
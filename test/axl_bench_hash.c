@@ -0,0 +1,144 @@
+/*
+ * Benchmark the checksum kernels in axl_hash.c against zlib's crc32() on
+ * buffers of 1 MiB to 64 MiB, and check that every kernel the CPU can run
+ * agrees with the portable one for its algorithm.
+ *
+ * Exits nonzero if any kernel gives a different checksum.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/time.h>
+#include <zlib.h>
+#include "axl.h"
+#include "axl_internal.h"
+
+static double
+now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double) tv.tv_sec + (double) tv.tv_usec / 1000000.0;
+}
+
+static void
+usage(void)
+{
+    printf("Usage: axl_bench_hash [-n iterations]\n");
+    printf("\n");
+    printf("Time each checksum kernel on 1, 4, 16, and 64 MiB buffers.\n");
+    printf("\n");
+    printf("-n iterations:  Number of passes over each buffer (default 10)\n");
+}
+
+/* zlib's crc32() as a kernel, for a baseline */
+static uint32_t
+zlib_crc32(uint32_t crc, const unsigned char* buf, size_t len)
+{
+    return (uint32_t) crc32(crc, buf, (uInt) len);
+}
+
+/* Time iterations passes of fn over buf, print GB/s, return the checksum */
+static uint32_t
+bench(const char* name, axl_hash_fn fn, const unsigned char* buf, size_t len,
+    int iterations)
+{
+    uint32_t crc = 0;
+    int i;
+
+    double start = now();
+    for (i = 0; i < iterations; i++) {
+        crc = fn(0, buf, len);
+    }
+    double secs = now() - start;
+
+    printf("  %-14s %8.2f GB/s  0x%08lx\n", name,
+        (double) len * iterations / secs / 1e9, (unsigned long) crc);
+
+    return crc;
+}
+
+int
+main(int argc, char **argv) {
+    int rc = 0;
+    int opt;
+    int iterations = 10;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+            case 'n':
+                iterations = atoi(optarg);
+                break;
+            default: /* '?' */
+                usage();
+                exit(1);
+        }
+    }
+
+    if (AXL_Init() != AXL_SUCCESS) {
+        printf("AXL_Init() failed\n");
+        return 1;
+    }
+
+    /* the standard check values, so the portable kernels are tested too */
+    const char* check = "123456789";
+    if (axl_hash(AXL_CRC_CRC32, 0, check, 9) != 0xCBF43926 ||
+        axl_hash(AXL_CRC_CRC32C, 0, check, 9) != 0xE3069283)
+    {
+        printf("Wrong checksum for \"%s\"\n", check);
+        rc = 1;
+    }
+
+    size_t max = 64UL * 1024UL * 1024UL;
+    unsigned char* buf = malloc(max + 1);
+    if (buf == NULL) {
+        printf("Couldn't allocate %lu bytes\n", (unsigned long) max);
+        return 1;
+    }
+
+    /* Odd offset and length, so the kernels' unaligned head and tail
+     * handling gets checked too */
+    size_t i;
+    srand(1);
+    for (i = 0; i < max + 1; i++) {
+        buf[i] = (unsigned char) rand();
+    }
+
+    size_t len;
+    for (len = 1024UL * 1024UL; len <= max; len *= 4) {
+        printf("%lu MiB:\n", (unsigned long) (len >> 20));
+
+        uint32_t expect[AXL_CRC_CRC32C + 1];
+        expect[AXL_CRC_CRC32] = bench("zlib", zlib_crc32, buf + 1, len - 1, iterations);
+        expect[AXL_CRC_CRC32C] = 0;
+
+        /* the portable kernels come last, use them as the reference */
+        int n = 0;
+        while (axl_hash_kernels[n].name != NULL) {
+            n++;
+        }
+        int k;
+        for (k = n - 1; k >= 0; k--) {
+            struct axl_hash_kernel* kernel = &axl_hash_kernels[k];
+            if (! kernel->usable) {
+                printf("  %-14s not supported by this CPU\n", kernel->name);
+                continue;
+            }
+
+            uint32_t crc = bench(kernel->name, kernel->fn, buf + 1, len - 1, iterations);
+            if (kernel->algo == AXL_CRC_CRC32C && expect[AXL_CRC_CRC32C] == 0) {
+                expect[AXL_CRC_CRC32C] = crc;
+            } else if (crc != expect[kernel->algo]) {
+                printf("  %s gave 0x%08lx, expected 0x%08lx\n", kernel->name,
+                    (unsigned long) crc, (unsigned long) expect[kernel->algo]);
+                rc = 1;
+            }
+        }
+    }
+
+    free(buf);
+    AXL_Finalize();
+
+    return rc;
+}
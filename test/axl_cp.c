@@ -6,6 +6,7 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <signal.h>
+#include <libgen.h>
 #include <stdlib.h>
 #include "axl.h"
 
@@ -35,6 +36,7 @@ axl_xfer_str_to_xfer(const char *xfer_str)
             {"dw", AXL_XFER_ASYNC_DW},
             {"bbapi", AXL_XFER_ASYNC_BBAPI},
             {"pthread", AXL_XFER_PTHREAD},
+            {"uring", AXL_XFER_URING},
             {"state_file", AXL_XFER_STATE_FILE},
             {NULL, AXL_XFER_NULL},  /* must always be last element in array */
     };
@@ -53,15 +55,18 @@ axl_xfer_str_to_xfer(const char *xfer_str)
 static void
 usage(void)
 {
-    printf("Usage: axl_cp [-ap] [-r|-R] [-S state_file [-U]] [-X xfer_type] SOURCE DEST\n");
-    printf("       axl_cp [-ap] [-r|-R] [-S state_file [-U]] [-X xfer_type] SOURCE... DIRECTORY\n");
+    printf("Usage: axl_cp [-alp] [-r|-R] [-S state_file [-U]] [-X xfer_type] SOURCE DEST\n");
+    printf("       axl_cp [-alp] [-r|-R] [-S state_file [-U]] [-X xfer_type] SOURCE... DIRECTORY\n");
+    printf("       axl_cp -x DEST FILE\n");
     printf("\n");
     printf("-a:             Archive mode.  Preserve permissions + times + recursive.  Implies -pr\n");
+    printf("-l:             Add all the sources with one AXL_Add_list() call\n");
     printf("-p:             Preserve permissions + times.\n");
     printf("-r|-R:          Copy directories recursively\n");
     printf("-S state_file:  Reload state from state_file\n");
     printf("-U:             Resume copies to existing destination files if they exist\n");
-    printf("-X xfer_type:   AXL transfer type: default native pthread sync dw bbapi state_file.\n");
+    printf("-X xfer_type:   AXL transfer type: default native pthread uring sync dw bbapi state_file.\n");
+    printf("-x:             Extract DEST, which an earlier copy packed into a container, to FILE\n");
     printf("\n");
 }
 
@@ -97,6 +102,67 @@ void sig_func(int signum)
     exit(AXL_SUCCESS);
 }
 
+/*
+ * Add the sources to the transfer with one AXL_Add_list() call, working out
+ * each exact destination path the way AXL_Add() would, and passing AXL our
+ * lstat() of each source.
+ */
+static int
+add_list(int id, char **src, unsigned int src_count, const char *dest,
+    int recursive)
+{
+    const char **srcs = calloc(src_count, sizeof(*srcs));
+    char **dests = calloc(src_count, sizeof(*dests));
+    struct stat *statbufs = calloc(src_count, sizeof(*statbufs));
+    int dest_is_dir = is_dir(dest);
+    unsigned int i, num = 0;
+    int rc;
+
+    if (!srcs || !dests || !statbufs) {
+        printf("axl_cp: out of memory\n");
+        exit(1);
+    }
+
+    for (i = 0; i < src_count; i++) {
+        if (lstat(src[i], &statbufs[num]) != 0) {
+            printf("axl_cp: cannot stat '%s': %s\n", src[i], strerror(errno));
+            exit(1);
+        }
+        if (!recursive && is_dir(src[i])) {
+            printf("axl_cp: omitting directory '%s'\n", src[i]);
+            continue;
+        }
+
+        srcs[num] = src[i];
+        dests[num] = malloc(PATH_MAX);
+        if (!dests[num]) {
+            printf("axl_cp: out of memory\n");
+            exit(1);
+        }
+        if (dest_is_dir) {
+            char *tmp = strdup(src[i]);
+            snprintf(dests[num], PATH_MAX, "%s/%s", dest, basename(tmp));
+            free(tmp);
+        } else {
+            snprintf(dests[num], PATH_MAX, "%s", dest);
+        }
+        num++;
+    }
+
+    rc = AXL_Add_list(id, num, srcs, (const char **) dests, statbufs);
+    if (rc != AXL_SUCCESS) {
+        printf("AXL_Add_list(..., %u files) failed (error %d)\n", num, rc);
+    }
+
+    for (i = 0; i < num; i++) {
+        free(dests[i]);
+    }
+    free(statbufs);
+    free(dests);
+    free(srcs);
+    return rc;
+}
+
 int
 main(int argc, char **argv) {
     int rc;
@@ -108,7 +174,7 @@ main(int argc, char **argv) {
     axl_xfer_t xfer;
     unsigned int src_count;
     int i;
-    int recursive = 0, resume = 0;
+    int recursive = 0, resume = 0, extract = 0, list = 0;
     struct sigaction action;
 
     memset(&action, 0, sizeof(action));
@@ -117,12 +183,15 @@ main(int argc, char **argv) {
     char *state_file = NULL;
     int preserve = 0;
 
-    while ((opt = getopt(argc, argv, "aprRS:UX:")) != -1) {
+    while ((opt = getopt(argc, argv, "alprRS:UxX:")) != -1) {
         switch (opt) {
             case 'a':
                 preserve = 1;
                 recursive = 1;
                 break;
+            case 'l':
+                list = 1;
+                break;
             case 'p':
                 preserve = 1;
                 break;
@@ -139,6 +208,9 @@ main(int argc, char **argv) {
             case 'X':
                 xfer_str = optarg;
                 break;
+            case 'x':
+                extract = 1;
+                break;
             default: /* '?' */
                 usage();
                 exit(1);
@@ -165,6 +237,27 @@ main(int argc, char **argv) {
         dest = argv[optind + args_left - 1];
     }
 
+    if (extract) {
+        if (args_left != 2) {
+            usage();
+            exit(1);
+        }
+
+        rc = AXL_Init();
+        if (rc != AXL_SUCCESS) {
+            printf("AXL_Init() failed (error %d)\n", rc);
+            return rc;
+        }
+
+        rc = AXL_Pack_extract(src[0], dest);
+        if (rc != AXL_SUCCESS) {
+            printf("AXL_Pack_extract(%s, %s) failed (error %d)\n", src[0], dest, rc);
+            return rc;
+        }
+
+        return AXL_Finalize();
+    }
+
     /*
      * They're doing a copy where the final arg is a destination directory,
      * not a file.
@@ -203,6 +296,11 @@ main(int argc, char **argv) {
 
     if (resume) {
         rc = AXL_Resume(id);
+    } else if (list) {
+        rc = add_list(id, src, src_count, dest, recursive);
+        if (rc == AXL_SUCCESS) {
+            rc = AXL_Dispatch(id);
+        }
     } else {
         /* Starting a new file list */
         for (i = 0; i < src_count; i++) {
@@ -8,13 +8,29 @@
 function usage
 {
 echo "
- Usage: test_axl [-c sec [-k]] [-n num_files] [xfer_type]
+ Usage: test_axl [-c sec [-k]] [-d] [-H] [-l] [-n num_files] [-P] [-R] [-s] [-z] [xfer_type]
 
    -c sec:          Cancel transfer after 'sec' seconds (can be decimal number)
+   -d:              Copy the files, change some of them, and copy them again
+                    over the first copies
+   -H:              Make the files sparse, and check that the copies have no
+                    more blocks allocated than the originals
+   -l:              Add the files with one AXL_Add_list() call
    -n num_files:    Number of files to create (default 50)
    -p bytes:        Pause the transfer after $bytes bytes
+   -P:              Check that small files were packed (AXL_PACK_SIZE must be
+                    set), then extract them to another directory and check
+                    those
+   -R:              Fill the files with random data, 16KiB per file number
+                    rather than 1KiB of zeros, so a block the copy skipped
+                    can't pass for a hole
+   -s:              Add a 64MiB file, and check that a thread split off part
+                    of a file another thread was copying
+                    (AXL_PTHREAD_SPLIT_SIZE must be set)
    -U:              After starting the transfer, kill -9 it, and resume it
-   xfer_type:       sync|pthread|bbapi|dw|state_file (defaults to sync if none specified)
+   -z:              Compress the files, then decompress them to another
+                    directory and check those
+   xfer_type:       sync|pthread|uring|bbapi|dw|state_file (defaults to sync if none specified)
 "
 }
 
@@ -23,7 +39,7 @@ function isnum
 	[[ "$1" =~ ^[0-9.]+$ ]]
 }
 
-while getopts "c:kn:p:U" opt; do
+while getopts "c:dHkln:p:PRsUz" opt; do
 	case "${opt}" in
 	c)
 		sec=${OPTARG}
@@ -33,6 +49,15 @@ while getopts "c:kn:p:U" opt; do
 			exit 1
 		fi
 		;;
+	d)
+		delta=1
+		;;
+	H)
+		sparse=1
+		;;
+	l)
+		list_flag=-l
+		;;
 	n)
 		num_files=${OPTARG}
 		if ! isnum $num_files ; then
@@ -49,10 +74,21 @@ while getopts "c:kn:p:U" opt; do
 			exit
 		fi
 		;;
-
+	P)
+		pack=1
+		;;
+	R)
+		random=1
+		;;
+	s)
+		split=1
+		;;
 	U)
 		resume=1
 		;;
+	z)
+		compress=1
+		;;
 	*)
 		usage
 		exit
@@ -68,6 +104,7 @@ fi
 case $xfer in
 	sync) ;;
 	pthread) ;;
+	uring) ;;
 	bbapi) ;;
 	dw) ;;
 	*)
@@ -78,12 +115,14 @@ esac
 
 src=$(mktemp -d)
 dest=$(mktemp -d)
+restored=$(mktemp -d)
+log=$(mktemp)
 
 trap ctrl_c INT
 
 function cleanup
 {
-	rm -fr "$src" "$dest"
+	rm -fr "$src" "$dest" "$restored" "$log"
 }
 
 function ctrl_c() {
@@ -107,7 +146,72 @@ function create_files {
 	for ((i=0; i < $num; i++)) ; do
 		dirnum=$(($i % $num_dirs))
 		tmp="$src/${dirs[$dirnum]}"
-		dd if=/dev/zero of="$tmp/$i.file" bs=1k count=$i &>/dev/null
+		if [ "$sparse" == "1" ] ; then
+			# a hole with a little data before, in, and after it
+			truncate -s $(($i * 64))k "$tmp/$i.file"
+			for off in 0 $(($i * 32)) $(($i * 64 - 1)) ; do
+				[ $off -ge 0 ] || continue
+				printf "data $i" | dd of="$tmp/$i.file" bs=1k seek=$off conv=notrunc &>/dev/null
+			done
+		elif [ "$random" == "1" ] ; then
+			dd if=/dev/urandom of="$tmp/$i.file" bs=16k count=$i &>/dev/null
+		else
+			dd if=/dev/zero of="$tmp/$i.file" bs=1k count=$i &>/dev/null
+		fi
+	done
+
+	if [ "$split" == "1" ] ; then
+		# one file that takes long enough to copy that idle threads
+		# always find it still copying
+		dd if=/dev/urandom of="$src/big.file" bs=1M count=64 &>/dev/null
+	fi
+}
+
+# Check that no copy has more blocks allocated than its original, which it
+# would if its holes were filled in
+function check_sparse
+{
+	for f in $(cd $src && find . -type f) ; do
+		if [ "$(stat -c %b $dest/$f)" -gt "$(stat -c %b $src/$f)" ] ; then
+			echo "$dest/$f has more blocks than $src/$f"
+			return 1
+		fi
+	done
+}
+
+# Check that some thread split off part of a file to copy, which the
+# AXL_DEBUG=2 output logs
+function check_split
+{
+	if ! grep -q "Splitting" "$log" ; then
+		echo "no file was split"
+		return 1
+	fi
+}
+
+# Overwrite part of one file, replace another with a bigger one, and shrink
+# a third
+function modify_files {
+	printf 'changed' | dd of="$(find $src -name 10.file)" bs=1 seek=5000 conv=notrunc &>/dev/null
+	dd if=/dev/urandom of="$(find $src -name 20.file)" bs=1k count=30 &>/dev/null
+	truncate -s 5000 "$(find $src -name 30.file)"
+}
+
+# Gather the files copied whole and the ones packed into containers into
+# $restored, so we can check them against $src
+function unpack_files
+{
+	if [ -z "$(find $dest -name .axlpack)" ] ; then
+		echo "no files were packed"
+		return 1
+	fi
+	for f in $(cd $src && find . -type f) ; do
+		mkdir -p "$(dirname $restored/$f)"
+		if [ -e "$dest/$f" ] ; then
+			cp "$dest/$f" "$restored/$f"
+		elif ! ./axl_cp -x "$dest/$f" "$restored/$f" ; then
+			return 1
+		fi
 	done
 }
 
@@ -133,6 +237,15 @@ function run_test
 		export AXL_DEBUG_PAUSE_AFTER=$pause_after
 	fi
 
+	if [ "$compress" == "1" ] ; then
+		export AXL_COMPRESS=1
+	fi
+
+	if [ "$split" == "1" ] ; then
+		# log each split, so check_split can look for them
+		export AXL_DEBUG=2
+	fi
+
 	if [ "$resume" == "1" ] ; then
 		# We want to kill the process so it doesn't call AXL_Cancel()
 		sig=SIGKILL
@@ -146,8 +259,8 @@ function run_test
         else
             TIMEOUT_CMD=timeout
         fi
-	$TIMEOUT_CMD --signal=$sig --preserve-status $s ./axl_cp -S /var/tmp/state_file -X $xfer -r $src/* $dest
-
+	$TIMEOUT_CMD --signal=$sig --preserve-status $s ./axl_cp $list_flag -S /var/tmp/state_file -X $xfer -r $src/* $dest > "$log" 2>&1
+	out1="$(cat "$log")"
 
 	oldpid=$!
 	unset AXL_DEBUG_PAUSE_AFTER
@@ -158,6 +271,27 @@ function run_test
 		./axl_cp -S /var/tmp/state_file -U -X state_file -r $src/* $dest
 	fi
 	rc=$?
+	unset AXL_COMPRESS
+	unset AXL_DEBUG
+
+	if [ "$rc" == "0" ] && [ "$compress" == "1" ] ; then
+		# Restore the compressed files, so we can check them against $src
+		rm -f /var/tmp/state_file
+		AXL_COMPRESS=2 ./axl_cp $list_flag -S /var/tmp/state_file -X $xfer -r $dest/* $restored
+		rc=$?
+	fi
+	if [ "$rc" == "0" ] && [ "$pack" == "1" ] ; then
+		unpack_files
+		rc=$?
+	fi
+	if [ "$rc" == "0" ] && [ "$sparse" == "1" ] ; then
+		check_sparse
+		rc=$?
+	fi
+	if [ "$rc" == "0" ] && [ "$split" == "1" ] ; then
+		check_split
+		rc=$?
+	fi
 	if [ "$rc" != "0" ] ; then
 		echo "failed copy, rc=$rc"
 		echo "$out1"
@@ -186,17 +320,29 @@ fi
 # 2. A basic copy where we cancel it partway though to test AXL_Cancel
 #
 # First run our test, and optionally cancel it
+if [ "$delta" == "1" ] ; then
+	if ! run_test $xfer ; then
+		cleanup
+		exit 1
+	fi
+	modify_files
+fi
+if [ "$compress" == "1" ] || [ "$pack" == "1" ] ; then
+	check=$restored
+else
+	check=$dest
+fi
 if ! run_test $xfer $sec $pause_after $resume ; then
 	# Our copy failed for some reason (independent of the cancellation)
 	cleanup
 	exit 1
 else
 	# Files are copied, verify they're all there and correct
-	if ! out2="$(diff -qr $src $dest)" ; then
+	if ! out2="$(diff -qr -x '*.axlsum' $src $check)" ; then
 		# Files aren't all there.  If we canceled the transfer this is
 		# good, since they shouldn't be all there.  Otherwise they
-		# should be there.
-		if [ -n "$sec" ] ; then
+		# should be there, including when we resumed the transfer.
+		if [ -n "$sec" ] && [ "$resume" != "1" ] ; then
 			echo "success"
 		else
 			echo "failed. transfer output was:"
@@ -15,6 +15,18 @@ int old_axl_make_directories;
 int old_axl_use_extension;
 int old_axl_copy_metadata;
 int old_axl_rank;
+int old_axl_copy_engine;
+int old_axl_direct_io;
+int old_axl_schedule;
+int old_axl_crc;
+size_t old_axl_manifest_size;
+int old_axl_compress;
+size_t old_axl_delta_size;
+size_t old_axl_pack_size;
+int old_axl_sync_policy;
+size_t old_axl_write_behind_size;
+int old_axl_state_format;
+size_t old_axl_buf_pool_size;
 
 /* values that options were set to */
 size_t new_axl_file_buf_size;
@@ -23,6 +35,18 @@ int new_axl_make_directories;
 int new_axl_use_extension;
 int new_axl_copy_metadata;
 int new_axl_rank;
+int new_axl_copy_engine;
+int new_axl_direct_io;
+int new_axl_schedule;
+int new_axl_crc;
+size_t new_axl_manifest_size;
+int new_axl_compress;
+size_t new_axl_delta_size;
+size_t new_axl_pack_size;
+int new_axl_sync_policy;
+size_t new_axl_write_behind_size;
+int new_axl_state_format;
+size_t new_axl_buf_pool_size;
 
 /* tests setting global options, error exits if failure are detected */
 void set_global_options(void)
@@ -105,6 +129,108 @@ void set_global_options(void)
         exit(EXIT_FAILURE);
     }
 
+    new_axl_copy_engine = (old_axl_copy_engine == AXL_COPY_ENGINE_READWRITE) ?
+        AXL_COPY_ENGINE_SPLICE : AXL_COPY_ENGINE_READWRITE;
+    rc = kvtree_util_set_int(axl_config_values, AXL_KEY_CONFIG_COPY_ENGINE,
+                             new_axl_copy_engine);
+    if (rc != KVTREE_SUCCESS) {
+        printf("kvtree_util_set_int failed (error %d)\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
+    new_axl_direct_io = !old_axl_direct_io;
+    rc = kvtree_util_set_int(axl_config_values, AXL_KEY_CONFIG_DIRECT_IO,
+                             new_axl_direct_io);
+    if (rc != KVTREE_SUCCESS) {
+        printf("kvtree_util_set_int failed (error %d)\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
+    new_axl_schedule = (old_axl_schedule + 1) % 3;
+    rc = kvtree_util_set_int(axl_config_values, AXL_KEY_CONFIG_SCHEDULE,
+                             new_axl_schedule);
+    if (rc != KVTREE_SUCCESS) {
+        printf("kvtree_util_set_int failed (error %d)\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
+    new_axl_crc = !old_axl_crc;
+    rc = kvtree_util_set_int(axl_config_values, AXL_KEY_CONFIG_CRC,
+                             new_axl_crc);
+    if (rc != KVTREE_SUCCESS) {
+        printf("kvtree_util_set_int failed (error %d)\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
+    new_axl_manifest_size = old_axl_manifest_size + 65536;
+    rc = kvtree_util_set_bytecount(axl_config_values,
+                                   AXL_KEY_CONFIG_MANIFEST_SIZE,
+                                   new_axl_manifest_size);
+    if (rc != KVTREE_SUCCESS) {
+        printf("kvtree_util_set_bytecount failed (error %d)\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
+    new_axl_compress = !old_axl_compress;
+    rc = kvtree_util_set_int(axl_config_values, AXL_KEY_CONFIG_COMPRESS,
+                             new_axl_compress);
+    if (rc != KVTREE_SUCCESS) {
+        printf("kvtree_util_set_int failed (error %d)\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
+    new_axl_delta_size = old_axl_delta_size + 65536;
+    rc = kvtree_util_set_bytecount(axl_config_values,
+                                   AXL_KEY_CONFIG_DELTA_SIZE,
+                                   new_axl_delta_size);
+    if (rc != KVTREE_SUCCESS) {
+        printf("kvtree_util_set_bytecount failed (error %d)\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
+    new_axl_pack_size = old_axl_pack_size + 8192;
+    rc = kvtree_util_set_bytecount(axl_config_values,
+                                   AXL_KEY_CONFIG_PACK_SIZE,
+                                   new_axl_pack_size);
+    if (rc != KVTREE_SUCCESS) {
+        printf("kvtree_util_set_bytecount failed (error %d)\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
+    new_axl_sync_policy = (old_axl_sync_policy + 1) % 4;
+    rc = kvtree_util_set_int(axl_config_values, AXL_KEY_CONFIG_SYNC_POLICY,
+                             new_axl_sync_policy);
+    if (rc != KVTREE_SUCCESS) {
+        printf("kvtree_util_set_int failed (error %d)\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
+    new_axl_write_behind_size = old_axl_write_behind_size + 1048576;
+    rc = kvtree_util_set_bytecount(axl_config_values,
+                                   AXL_KEY_CONFIG_WRITE_BEHIND_SIZE,
+                                   new_axl_write_behind_size);
+    if (rc != KVTREE_SUCCESS) {
+        printf("kvtree_util_set_bytecount failed (error %d)\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
+    new_axl_state_format = AXL_STATE_FORMAT_BINARY;
+    rc = kvtree_util_set_int(axl_config_values, AXL_KEY_CONFIG_STATE_FORMAT,
+                             new_axl_state_format);
+    if (rc != KVTREE_SUCCESS) {
+        printf("kvtree_util_set_int failed (error %d)\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
+    new_axl_buf_pool_size = old_axl_buf_pool_size + 4096;
+    rc = kvtree_util_set_bytecount(axl_config_values,
+                                   AXL_KEY_CONFIG_BUF_POOL_SIZE,
+                                   new_axl_buf_pool_size);
+    if (rc != KVTREE_SUCCESS) {
+        printf("kvtree_util_set_bytecount failed (error %d)\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
     printf("Configuring AXL (second set of options)...\n");
     if (AXL_Config(axl_config_values) == NULL) {
         printf("AXL_Config() failed\n");
@@ -155,6 +281,91 @@ void set_global_options(void)
         exit(EXIT_FAILURE);
     }
 
+    if (axl_copy_engine != new_axl_copy_engine) {
+        printf("AXL_Config() failed to set %s: %d != %d\n",
+               AXL_KEY_CONFIG_COPY_ENGINE, axl_copy_engine,
+               new_axl_copy_engine);
+        exit(EXIT_FAILURE);
+    }
+
+    if (axl_direct_io != new_axl_direct_io) {
+        printf("AXL_Config() failed to set %s: %d != %d\n",
+               AXL_KEY_CONFIG_DIRECT_IO, axl_direct_io,
+               new_axl_direct_io);
+        exit(EXIT_FAILURE);
+    }
+
+    if (axl_schedule != new_axl_schedule) {
+        printf("AXL_Config() failed to set %s: %d != %d\n",
+               AXL_KEY_CONFIG_SCHEDULE, axl_schedule,
+               new_axl_schedule);
+        exit(EXIT_FAILURE);
+    }
+
+    if (axl_crc != new_axl_crc) {
+        printf("AXL_Config() failed to set %s: %d != %d\n",
+               AXL_KEY_CONFIG_CRC, axl_crc,
+               new_axl_crc);
+        exit(EXIT_FAILURE);
+    }
+
+    if (axl_manifest_size != new_axl_manifest_size) {
+        printf("AXL_Config() failed to set %s: %lu != %lu\n",
+               AXL_KEY_CONFIG_MANIFEST_SIZE, (long unsigned)axl_manifest_size,
+               (long unsigned)(new_axl_manifest_size));
+        exit(EXIT_FAILURE);
+    }
+
+    if (axl_compress != new_axl_compress) {
+        printf("AXL_Config() failed to set %s: %d != %d\n",
+               AXL_KEY_CONFIG_COMPRESS, axl_compress,
+               new_axl_compress);
+        exit(EXIT_FAILURE);
+    }
+
+    if (axl_delta_size != new_axl_delta_size) {
+        printf("AXL_Config() failed to set %s: %lu != %lu\n",
+               AXL_KEY_CONFIG_DELTA_SIZE, (long unsigned)axl_delta_size,
+               (long unsigned)(new_axl_delta_size));
+        exit(EXIT_FAILURE);
+    }
+
+    if (axl_pack_size != new_axl_pack_size) {
+        printf("AXL_Config() failed to set %s: %lu != %lu\n",
+               AXL_KEY_CONFIG_PACK_SIZE, (long unsigned)axl_pack_size,
+               (long unsigned)(new_axl_pack_size));
+        exit(EXIT_FAILURE);
+    }
+
+    if (axl_sync_policy != new_axl_sync_policy) {
+        printf("AXL_Config() failed to set %s: %d != %d\n",
+               AXL_KEY_CONFIG_SYNC_POLICY, axl_sync_policy,
+               new_axl_sync_policy);
+        exit(EXIT_FAILURE);
+    }
+
+    if (axl_write_behind_size != new_axl_write_behind_size) {
+        printf("AXL_Config() failed to set %s: %lu != %lu\n",
+               AXL_KEY_CONFIG_WRITE_BEHIND_SIZE,
+               (long unsigned)axl_write_behind_size,
+               (long unsigned)(new_axl_write_behind_size));
+        exit(EXIT_FAILURE);
+    }
+
+    if (axl_state_format != new_axl_state_format) {
+        printf("AXL_Config() failed to set %s: %d != %d\n",
+               AXL_KEY_CONFIG_STATE_FORMAT, axl_state_format,
+               new_axl_state_format);
+        exit(EXIT_FAILURE);
+    }
+
+    if (axl_buf_pool_size != new_axl_buf_pool_size) {
+        printf("AXL_Config() failed to set %s: %lu != %lu\n",
+               AXL_KEY_CONFIG_BUF_POOL_SIZE, (long unsigned)axl_buf_pool_size,
+               (long unsigned)(new_axl_buf_pool_size));
+        exit(EXIT_FAILURE);
+    }
+
     kvtree_delete(&axl_config_values);
 }
 
@@ -212,7 +423,14 @@ void check_known_options(const kvtree* configured_values,
 void check_options(const kvtree* configured_values, int is_global,
                    size_t exp_file_buf_size, int exp_debug,
                    int exp_make_directories, int exp_use_extension, int exp_copy_metadata,
-                   int exp_rank)
+                   int exp_rank, int exp_copy_engine,
+                   int exp_direct_io, int exp_schedule, int exp_crc,
+                   size_t exp_manifest_size, int exp_compress,
+                   size_t exp_delta_size, size_t exp_pack_size,
+                   int exp_sync_policy,
+                   size_t exp_write_behind_size,
+                   int exp_state_format,
+                   size_t exp_buf_pool_size)
 {
     static const char* known_global_options[] = {
         AXL_KEY_CONFIG_FILE_BUF_SIZE,
@@ -221,6 +439,18 @@ void check_options(const kvtree* configured_values, int is_global,
         AXL_KEY_CONFIG_USE_EXTENSION,
         AXL_KEY_CONFIG_COPY_METADATA,
         AXL_KEY_CONFIG_RANK,
+        AXL_KEY_CONFIG_COPY_ENGINE,
+        AXL_KEY_CONFIG_DIRECT_IO,
+        AXL_KEY_CONFIG_SCHEDULE,
+        AXL_KEY_CONFIG_CRC,
+        AXL_KEY_CONFIG_MANIFEST_SIZE,
+        AXL_KEY_CONFIG_COMPRESS,
+        AXL_KEY_CONFIG_DELTA_SIZE,
+        AXL_KEY_CONFIG_PACK_SIZE,
+        AXL_KEY_CONFIG_SYNC_POLICY,
+        AXL_KEY_CONFIG_WRITE_BEHIND_SIZE,
+        AXL_KEY_CONFIG_STATE_FORMAT,
+        AXL_KEY_CONFIG_BUF_POOL_SIZE,
         NULL
     };
     static const char* known_transfer_options[] = {
@@ -228,6 +458,17 @@ void check_options(const kvtree* configured_values, int is_global,
         AXL_KEY_CONFIG_MKDIR,
         AXL_KEY_CONFIG_USE_EXTENSION,
         AXL_KEY_CONFIG_COPY_METADATA,
+        AXL_KEY_CONFIG_COPY_ENGINE,
+        AXL_KEY_CONFIG_DIRECT_IO,
+        AXL_KEY_CONFIG_SCHEDULE,
+        AXL_KEY_CONFIG_CRC,
+        AXL_KEY_CONFIG_MANIFEST_SIZE,
+        AXL_KEY_CONFIG_COMPRESS,
+        AXL_KEY_CONFIG_DELTA_SIZE,
+        AXL_KEY_CONFIG_PACK_SIZE,
+        AXL_KEY_CONFIG_SYNC_POLICY,
+        AXL_KEY_CONFIG_WRITE_BEHIND_SIZE,
+        AXL_KEY_CONFIG_STATE_FORMAT,
         NULL
     };
     const char** known_options = is_global ? known_global_options :
@@ -288,6 +529,21 @@ void check_options(const kvtree* configured_values, int is_global,
                    exp_rank);
             exit(EXIT_FAILURE);
         }
+
+        unsigned long cfg_buf_pool_size;
+        if (kvtree_util_get_bytecount(configured_values,
+          AXL_KEY_CONFIG_BUF_POOL_SIZE, &cfg_buf_pool_size) != KVTREE_SUCCESS)
+        {
+            printf("Could not get %s from AXL_Config\n",
+                   AXL_KEY_CONFIG_BUF_POOL_SIZE);
+            exit(EXIT_FAILURE);
+        }
+        if (cfg_buf_pool_size != exp_buf_pool_size) {
+            printf("AXL_Config returned unexpected value %lu for %s. Expected %lu.\n",
+                   cfg_buf_pool_size, AXL_KEY_CONFIG_BUF_POOL_SIZE,
+                   (unsigned long)exp_buf_pool_size);
+            exit(EXIT_FAILURE);
+        }
     }
 
     int cfg_make_directories;
@@ -335,6 +591,171 @@ void check_options(const kvtree* configured_values, int is_global,
         exit(EXIT_FAILURE);
     }
 
+    int cfg_copy_engine;
+    if (kvtree_util_get_int(configured_values, AXL_KEY_CONFIG_COPY_ENGINE,
+                            &cfg_copy_engine) != KVTREE_SUCCESS)
+    {
+        printf("Could not get %s from AXL_Config\n",
+               AXL_KEY_CONFIG_COPY_ENGINE);
+        exit(EXIT_FAILURE);
+    }
+    if (cfg_copy_engine != exp_copy_engine) {
+        printf("AXL_Config returned unexpected value %d for %s. Expected %d.\n",
+               cfg_copy_engine, AXL_KEY_CONFIG_COPY_ENGINE,
+               exp_copy_engine);
+        exit(EXIT_FAILURE);
+    }
+
+    int cfg_direct_io;
+    if (kvtree_util_get_int(configured_values, AXL_KEY_CONFIG_DIRECT_IO,
+                            &cfg_direct_io) != KVTREE_SUCCESS)
+    {
+        printf("Could not get %s from AXL_Config\n",
+               AXL_KEY_CONFIG_DIRECT_IO);
+        exit(EXIT_FAILURE);
+    }
+    if (cfg_direct_io != exp_direct_io) {
+        printf("AXL_Config returned unexpected value %d for %s. Expected %d.\n",
+               cfg_direct_io, AXL_KEY_CONFIG_DIRECT_IO,
+               exp_direct_io);
+        exit(EXIT_FAILURE);
+    }
+
+    int cfg_schedule;
+    if (kvtree_util_get_int(configured_values, AXL_KEY_CONFIG_SCHEDULE,
+                            &cfg_schedule) != KVTREE_SUCCESS)
+    {
+        printf("Could not get %s from AXL_Config\n",
+               AXL_KEY_CONFIG_SCHEDULE);
+        exit(EXIT_FAILURE);
+    }
+    if (cfg_schedule != exp_schedule) {
+        printf("AXL_Config returned unexpected value %d for %s. Expected %d.\n",
+               cfg_schedule, AXL_KEY_CONFIG_SCHEDULE,
+               exp_schedule);
+        exit(EXIT_FAILURE);
+    }
+
+    int cfg_crc;
+    if (kvtree_util_get_int(configured_values, AXL_KEY_CONFIG_CRC,
+                            &cfg_crc) != KVTREE_SUCCESS)
+    {
+        printf("Could not get %s from AXL_Config\n",
+               AXL_KEY_CONFIG_CRC);
+        exit(EXIT_FAILURE);
+    }
+    if (cfg_crc != exp_crc) {
+        printf("AXL_Config returned unexpected value %d for %s. Expected %d.\n",
+               cfg_crc, AXL_KEY_CONFIG_CRC,
+               exp_crc);
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned long cfg_manifest_size;
+    if (kvtree_util_get_bytecount(configured_values,
+      AXL_KEY_CONFIG_MANIFEST_SIZE, &cfg_manifest_size) != KVTREE_SUCCESS)
+    {
+        printf("Could not get %s from AXL_Config\n",
+               AXL_KEY_CONFIG_MANIFEST_SIZE);
+        exit(EXIT_FAILURE);
+    }
+    if (cfg_manifest_size != exp_manifest_size) {
+        printf("AXL_Config returned unexpected value %lu for %s. Expected %lu.\n",
+               cfg_manifest_size, AXL_KEY_CONFIG_MANIFEST_SIZE,
+               (unsigned long)exp_manifest_size);
+        exit(EXIT_FAILURE);
+    }
+
+    int cfg_compress;
+    if (kvtree_util_get_int(configured_values, AXL_KEY_CONFIG_COMPRESS,
+                            &cfg_compress) != KVTREE_SUCCESS)
+    {
+        printf("Could not get %s from AXL_Config\n",
+               AXL_KEY_CONFIG_COMPRESS);
+        exit(EXIT_FAILURE);
+    }
+    if (cfg_compress != exp_compress) {
+        printf("AXL_Config returned unexpected value %d for %s. Expected %d.\n",
+               cfg_compress, AXL_KEY_CONFIG_COMPRESS,
+               exp_compress);
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned long cfg_delta_size;
+    if (kvtree_util_get_bytecount(configured_values,
+      AXL_KEY_CONFIG_DELTA_SIZE, &cfg_delta_size) != KVTREE_SUCCESS)
+    {
+        printf("Could not get %s from AXL_Config\n",
+               AXL_KEY_CONFIG_DELTA_SIZE);
+        exit(EXIT_FAILURE);
+    }
+    if (cfg_delta_size != exp_delta_size) {
+        printf("AXL_Config returned unexpected value %lu for %s. Expected %lu.\n",
+               cfg_delta_size, AXL_KEY_CONFIG_DELTA_SIZE,
+               (unsigned long)exp_delta_size);
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned long cfg_pack_size;
+    if (kvtree_util_get_bytecount(configured_values,
+      AXL_KEY_CONFIG_PACK_SIZE, &cfg_pack_size) != KVTREE_SUCCESS)
+    {
+        printf("Could not get %s from AXL_Config\n",
+               AXL_KEY_CONFIG_PACK_SIZE);
+        exit(EXIT_FAILURE);
+    }
+    if (cfg_pack_size != exp_pack_size) {
+        printf("AXL_Config returned unexpected value %lu for %s. Expected %lu.\n",
+               cfg_pack_size, AXL_KEY_CONFIG_PACK_SIZE,
+               (unsigned long)exp_pack_size);
+        exit(EXIT_FAILURE);
+    }
+
+    int cfg_sync_policy;
+    if (kvtree_util_get_int(configured_values, AXL_KEY_CONFIG_SYNC_POLICY,
+                            &cfg_sync_policy) != KVTREE_SUCCESS)
+    {
+        printf("Could not get %s from AXL_Config\n",
+               AXL_KEY_CONFIG_SYNC_POLICY);
+        exit(EXIT_FAILURE);
+    }
+    if (cfg_sync_policy != exp_sync_policy) {
+        printf("AXL_Config returned unexpected value %d for %s. Expected %d.\n",
+               cfg_sync_policy, AXL_KEY_CONFIG_SYNC_POLICY,
+               exp_sync_policy);
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned long cfg_write_behind_size;
+    if (kvtree_util_get_bytecount(configured_values,
+      AXL_KEY_CONFIG_WRITE_BEHIND_SIZE, &cfg_write_behind_size) != KVTREE_SUCCESS)
+    {
+        printf("Could not get %s from AXL_Config\n",
+               AXL_KEY_CONFIG_WRITE_BEHIND_SIZE);
+        exit(EXIT_FAILURE);
+    }
+    if (cfg_write_behind_size != exp_write_behind_size) {
+        printf("AXL_Config returned unexpected value %lu for %s. Expected %lu.\n",
+               cfg_write_behind_size, AXL_KEY_CONFIG_WRITE_BEHIND_SIZE,
+               (unsigned long)exp_write_behind_size);
+        exit(EXIT_FAILURE);
+    }
+
+    int cfg_state_format;
+    if (kvtree_util_get_int(configured_values, AXL_KEY_CONFIG_STATE_FORMAT,
+                            &cfg_state_format) != KVTREE_SUCCESS)
+    {
+        printf("Could not get %s from AXL_Config\n",
+               AXL_KEY_CONFIG_STATE_FORMAT);
+        exit(EXIT_FAILURE);
+    }
+    if (cfg_state_format != exp_state_format) {
+        printf("AXL_Config returned unexpected value %d for %s. Expected %d.\n",
+               cfg_state_format, AXL_KEY_CONFIG_STATE_FORMAT,
+               exp_state_format);
+        exit(EXIT_FAILURE);
+    }
+
     check_known_options(configured_values, is_global, known_options);
 }
 
@@ -348,13 +769,25 @@ void get_global_options(void)
 
     check_options(axl_configured_values, 1, new_axl_file_buf_size,
                   new_axl_debug, new_axl_make_directories,
-                  new_axl_use_extension, new_axl_copy_metadata, new_axl_rank);
+                  new_axl_use_extension, new_axl_copy_metadata, new_axl_rank,
+                  new_axl_copy_engine, new_axl_direct_io,
+                  new_axl_schedule, new_axl_crc, new_axl_manifest_size,
+                  new_axl_compress, new_axl_delta_size,
+                  new_axl_pack_size, new_axl_sync_policy,
+                  new_axl_write_behind_size, new_axl_state_format,
+                  new_axl_buf_pool_size);
 
     kvtree_delete(&axl_configured_values);
 }
 
 void set_transfer_options(int id, size_t file_buf_size, int make_directories,
-                          int use_extension, int copy_metadata)
+                          int use_extension, int copy_metadata, int copy_engine,
+                          int direct_io, int schedule, int crc,
+                          size_t manifest_size, int compress,
+                          size_t delta_size, size_t pack_size,
+                          int sync_policy,
+                          size_t write_behind_size,
+                          int state_format)
 {
     int rc;
 
@@ -399,6 +832,87 @@ void set_transfer_options(int id, size_t file_buf_size, int make_directories,
         exit(EXIT_FAILURE);
     }
 
+    rc = kvtree_util_set_int(transfer_config, AXL_KEY_CONFIG_COPY_ENGINE,
+                             copy_engine);
+    if (rc != KVTREE_SUCCESS) {
+        printf("kvtree_util_set_int failed (error %d)\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
+    rc = kvtree_util_set_int(transfer_config, AXL_KEY_CONFIG_DIRECT_IO,
+                             direct_io);
+    if (rc != KVTREE_SUCCESS) {
+        printf("kvtree_util_set_int failed (error %d)\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
+    rc = kvtree_util_set_int(transfer_config, AXL_KEY_CONFIG_SCHEDULE,
+                             schedule);
+    if (rc != KVTREE_SUCCESS) {
+        printf("kvtree_util_set_int failed (error %d)\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
+    rc = kvtree_util_set_int(transfer_config, AXL_KEY_CONFIG_CRC,
+                             crc);
+    if (rc != KVTREE_SUCCESS) {
+        printf("kvtree_util_set_int failed (error %d)\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
+    rc = kvtree_util_set_bytecount(transfer_config,
+                                   AXL_KEY_CONFIG_MANIFEST_SIZE,
+                                   manifest_size);
+    if (rc != KVTREE_SUCCESS) {
+        printf("kvtree_util_set_bytecount failed (error %d)\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
+    rc = kvtree_util_set_int(transfer_config, AXL_KEY_CONFIG_COMPRESS,
+                             compress);
+    if (rc != KVTREE_SUCCESS) {
+        printf("kvtree_util_set_int failed (error %d)\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
+    rc = kvtree_util_set_bytecount(transfer_config,
+                                   AXL_KEY_CONFIG_DELTA_SIZE,
+                                   delta_size);
+    if (rc != KVTREE_SUCCESS) {
+        printf("kvtree_util_set_bytecount failed (error %d)\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
+    rc = kvtree_util_set_bytecount(transfer_config,
+                                   AXL_KEY_CONFIG_PACK_SIZE,
+                                   pack_size);
+    if (rc != KVTREE_SUCCESS) {
+        printf("kvtree_util_set_bytecount failed (error %d)\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
+    rc = kvtree_util_set_int(transfer_config, AXL_KEY_CONFIG_SYNC_POLICY,
+                             sync_policy);
+    if (rc != KVTREE_SUCCESS) {
+        printf("kvtree_util_set_int failed (error %d)\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
+    rc = kvtree_util_set_bytecount(transfer_config,
+                                   AXL_KEY_CONFIG_WRITE_BEHIND_SIZE,
+                                   write_behind_size);
+    if (rc != KVTREE_SUCCESS) {
+        printf("kvtree_util_set_bytecount failed (error %d)\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
+    rc = kvtree_util_set_int(transfer_config, AXL_KEY_CONFIG_STATE_FORMAT,
+                             state_format);
+    if (rc != KVTREE_SUCCESS) {
+        printf("kvtree_util_set_int failed (error %d)\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
     if (AXL_Config(config) == NULL) {
         printf("AXL_Config() failed\n");
         exit(EXIT_FAILURE);
@@ -408,7 +922,13 @@ void set_transfer_options(int id, size_t file_buf_size, int make_directories,
 }
 
 void get_transfer_options(int id, size_t file_buf_size, int make_directories,
-                          int use_extension, int copy_metadata)
+                          int use_extension, int copy_metadata, int copy_engine,
+                          int direct_io, int schedule, int crc,
+                          size_t manifest_size, int compress,
+                          size_t delta_size, size_t pack_size,
+                          int sync_policy,
+                          size_t write_behind_size,
+                          int state_format)
 {
     kvtree* config = AXL_Config(NULL);
     if (config == NULL) {
@@ -424,7 +944,10 @@ void get_transfer_options(int id, size_t file_buf_size, int make_directories,
 
     /* check known option values */
     check_options(transfer_config, 0, file_buf_size, -1, make_directories,
-                  use_extension, copy_metadata, -1);
+                  use_extension, copy_metadata, -1, copy_engine,
+                  direct_io, schedule, crc, manifest_size, compress,
+                  delta_size, pack_size, sync_policy, write_behind_size,
+                  state_format, 0);
 
     kvtree_delete(&config);
 }
@@ -445,6 +968,18 @@ main(void) {
     old_axl_use_extension    = axl_use_extension;
     old_axl_copy_metadata    = axl_copy_metadata;
     old_axl_rank             = axl_rank;
+    old_axl_copy_engine      = axl_copy_engine;
+    old_axl_direct_io        = axl_direct_io;
+    old_axl_schedule         = axl_schedule;
+    old_axl_crc              = axl_crc;
+    old_axl_manifest_size    = axl_manifest_size;
+    old_axl_compress         = axl_compress;
+    old_axl_delta_size       = axl_delta_size;
+    old_axl_pack_size        = axl_pack_size;
+    old_axl_sync_policy      = axl_sync_policy;
+    old_axl_write_behind_size = axl_write_behind_size;
+    old_axl_state_format     = axl_state_format;
+    old_axl_buf_pool_size    = axl_buf_pool_size;
 
     /* must pick up "old" defaults */
     int id1 = AXL_Create(AXL_XFER_DEFAULT, __FILE__, NULL);
@@ -465,19 +1000,39 @@ main(void) {
 
     /* check that global values are used by default */
     get_transfer_options(id1, old_axl_file_buf_size, old_axl_make_directories,
-        old_axl_use_extension, old_axl_copy_metadata);
+        old_axl_use_extension, old_axl_copy_metadata, old_axl_copy_engine,
+        old_axl_direct_io, old_axl_schedule, old_axl_crc,
+        old_axl_manifest_size, old_axl_compress, old_axl_delta_size,
+        old_axl_pack_size, old_axl_sync_policy, old_axl_write_behind_size,
+        old_axl_state_format);
     get_transfer_options(id2, new_axl_file_buf_size, new_axl_make_directories,
-        new_axl_use_extension, new_axl_copy_metadata);
+        new_axl_use_extension, new_axl_copy_metadata, new_axl_copy_engine,
+        new_axl_direct_io, new_axl_schedule, new_axl_crc,
+        new_axl_manifest_size, new_axl_compress, new_axl_delta_size,
+        new_axl_pack_size, new_axl_sync_policy, new_axl_write_behind_size,
+        new_axl_state_format);
 
     /* change values */
     set_transfer_options(id1, new_axl_file_buf_size+1, new_axl_make_directories,
-        new_axl_use_extension, new_axl_copy_metadata);
+        new_axl_use_extension, new_axl_copy_metadata, old_axl_copy_engine,
+        old_axl_direct_io, old_axl_schedule, old_axl_crc,
+        old_axl_manifest_size, old_axl_compress, old_axl_delta_size,
+        old_axl_pack_size, old_axl_sync_policy, old_axl_write_behind_size,
+        old_axl_state_format);
     /* did they change? */
     get_transfer_options(id1, new_axl_file_buf_size+1, new_axl_make_directories,
-        new_axl_use_extension, new_axl_copy_metadata);
+        new_axl_use_extension, new_axl_copy_metadata, old_axl_copy_engine,
+        old_axl_direct_io, old_axl_schedule, old_axl_crc,
+        old_axl_manifest_size, old_axl_compress, old_axl_delta_size,
+        old_axl_pack_size, old_axl_sync_policy, old_axl_write_behind_size,
+        old_axl_state_format);
     /* but only for the one I did change? */
     get_transfer_options(id2, new_axl_file_buf_size, new_axl_make_directories,
-        new_axl_use_extension, new_axl_copy_metadata);
+        new_axl_use_extension, new_axl_copy_metadata, new_axl_copy_engine,
+        new_axl_direct_io, new_axl_schedule, new_axl_crc,
+        new_axl_manifest_size, new_axl_compress, new_axl_delta_size,
+        new_axl_pack_size, new_axl_sync_policy, new_axl_write_behind_size,
+        new_axl_state_format);
 
     rc = AXL_Free(id2);
     if (rc != AXL_SUCCESS) {
@@ -0,0 +1,168 @@
+/*
+ * Call AXL_Finalize() while a pthread transfer is still copying, then
+ * AXL_Init() again and resume the transfer from its state file.  The
+ * resumed transfer gets the same id as the stopped one, and must not wait
+ * for the items the stopped one left behind.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "axl.h"
+
+#define NUM_FILES 64
+#define FILE_SIZE (1024 * 1024)
+
+static char src_dir[] = "test_finalize_XXXXXX";
+static char dest_dir[256];
+static char state_file[256];
+static const char* src[NUM_FILES];
+static const char* dest[NUM_FILES];
+
+static void
+create_files(void)
+{
+    if (mkdtemp(src_dir) == NULL) {
+        perror("mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(dest_dir, sizeof(dest_dir), "%s/dest", src_dir);
+    snprintf(state_file, sizeof(state_file), "%s/state", src_dir);
+    if (mkdir(dest_dir, 0700) != 0) {
+        perror("mkdir");
+        exit(EXIT_FAILURE);
+    }
+
+    char* buf = malloc(FILE_SIZE);
+    int i;
+    for (i = 0; i < NUM_FILES; i++) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/file%d", src_dir, i);
+        src[i] = strdup(path);
+        snprintf(path, sizeof(path), "%s/file%d", dest_dir, i);
+        dest[i] = strdup(path);
+
+        memset(buf, 'a' + i % 26, FILE_SIZE);
+        FILE* fp = fopen(src[i], "w");
+        if (fp == NULL || fwrite(buf, 1, FILE_SIZE, fp) != FILE_SIZE ||
+            fclose(fp) != 0)
+        {
+            printf("Couldn't write %s\n", src[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(buf);
+}
+
+static void
+check_files(void)
+{
+    char* buf1 = malloc(FILE_SIZE);
+    char* buf2 = malloc(FILE_SIZE);
+    int i;
+    for (i = 0; i < NUM_FILES; i++) {
+        FILE* fp1 = fopen(src[i], "r");
+        FILE* fp2 = fopen(dest[i], "r");
+        if (fp1 == NULL || fp2 == NULL ||
+            fread(buf1, 1, FILE_SIZE, fp1) != FILE_SIZE ||
+            fread(buf2, 1, FILE_SIZE + 1, fp2) != FILE_SIZE ||
+            memcmp(buf1, buf2, FILE_SIZE) != 0)
+        {
+            printf("%s doesn't match %s\n", dest[i], src[i]);
+            exit(EXIT_FAILURE);
+        }
+        fclose(fp1);
+        fclose(fp2);
+    }
+    free(buf1);
+    free(buf2);
+}
+
+static void
+remove_files(void)
+{
+    int i;
+    for (i = 0; i < NUM_FILES; i++) {
+        unlink(src[i]);
+        unlink(dest[i]);
+    }
+    unlink(state_file);
+    rmdir(dest_dir);
+    rmdir(src_dir);
+}
+
+int
+main(void) {
+    int rc;
+
+    create_files();
+
+    rc = AXL_Init();
+    if (rc != AXL_SUCCESS) {
+        printf("AXL_Init() failed (error %d)\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
+    int id = AXL_Create(AXL_XFER_PTHREAD, __FILE__, state_file);
+    if (id < 0) {
+        printf("AXL_Create() failed (error %d)\n", id);
+        exit(EXIT_FAILURE);
+    }
+
+    rc = AXL_Add_list(id, NUM_FILES, src, dest, NULL);
+    if (rc != AXL_SUCCESS) {
+        printf("AXL_Add_list() failed (error %d)\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
+    rc = AXL_Dispatch(id);
+    if (rc != AXL_SUCCESS) {
+        printf("AXL_Dispatch() failed (error %d)\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
+    /* stop the transfer with most of its files still queued */
+    AXL_Finalize();
+
+    rc = AXL_Init();
+    if (rc != AXL_SUCCESS) {
+        printf("AXL_Init() failed (error %d)\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
+    int id2 = AXL_Create(AXL_XFER_STATE_FILE, __FILE__, state_file);
+    if (id2 != id) {
+        printf("AXL_Create() returned %d, expected %d\n", id2, id);
+        exit(EXIT_FAILURE);
+    }
+
+    rc = AXL_Resume(id2);
+    if (rc != AXL_SUCCESS) {
+        printf("AXL_Resume() failed (error %d)\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
+    rc = AXL_Wait(id2);
+    if (rc != AXL_SUCCESS) {
+        printf("AXL_Wait() failed (error %d)\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
+    rc = AXL_Free(id2);
+    if (rc != AXL_SUCCESS) {
+        printf("AXL_Free() failed (error %d)\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
+    rc = AXL_Finalize();
+    if (rc != AXL_SUCCESS) {
+        printf("AXL_Finalize() failed (error %d)\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
+    check_files();
+    remove_files();
+
+    return 0;
+}